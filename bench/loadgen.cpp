@@ -0,0 +1,856 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*   loadgen.cpp - HTTP load generator for webserv                            */
+/*                                                                            */
+/*   Starts (or reuses) a webserv instance, drives a weighted mix of          */
+/*   keep-alive GETs, multipart uploads, DELETEs and CGI calls over N         */
+/*   concurrent connections and prints throughput and latency as JSON.       */
+/*   --compare-unix runs the mix over loopback TCP, then over a unix socket  */
+/*   of the same server, and reports both. --compare-engines runs it against */
+/*   a server on each event_engine, with the CPU time the server used.       */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <cstdlib>
+#include <cctype>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+enum OpType { OP_GET, OP_POST, OP_DELETE, OP_CGI, OP_COUNT };
+
+static const char* g_opNames[OP_COUNT] = { "get", "post", "delete", "cgi" };
+
+struct Options
+{
+    std::string serverBinary;
+    std::string config;
+    std::string host;
+    int         port;
+    std::string unixPath;
+    std::string compareUnix;
+    bool        compareEngines;
+    int         connections;
+    int         idle;
+    double      duration;
+    double      warmup;
+    long        maxRequests;
+    int         weights[OP_COUNT];
+    size_t      uploadSize;
+    bool        spawn;
+    std::string output;
+    std::string label;
+    std::vector<std::string> assets;
+
+    Options() : serverBinary("./webserv"), config("Configs/basic.conf"), host("127.0.0.1"), port(8084),
+        compareEngines(false), connections(16), idle(0), duration(10.0), warmup(1.0), maxRequests(0), uploadSize(4096), spawn(true)
+    {
+        weights[OP_GET] = 85;
+        weights[OP_POST] = 6;
+        weights[OP_DELETE] = 6;
+        weights[OP_CGI] = 3;
+    }
+};
+
+struct OpStats
+{
+    std::vector<unsigned long> latencies;
+    unsigned long errors;
+    unsigned long bytes;
+
+    OpStats() : errors(0), bytes(0) {}
+};
+
+struct Connection
+{
+    int           fd;
+    bool          connecting;
+    std::string   out;
+    size_t        sent;
+    std::string   in;
+    OpType        op;
+    unsigned long startUs;
+    std::string   uploaded;
+
+    Connection() : fd(-1), connecting(false), sent(0), op(OP_GET), startUs(0) {}
+};
+
+static unsigned long nowMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<unsigned long>(ts.tv_sec) * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static std::string toString(long value)
+{
+    std::ostringstream oss;
+    oss << value;
+    return oss.str();
+}
+
+static void usage()
+{
+    std::cerr << "usage: loadgen [options]\n"
+              << "  --server PATH       webserv binary to start (default ./webserv)\n"
+              << "  --config FILE       configuration passed to webserv (default Configs/basic.conf)\n"
+              << "  --no-spawn          benchmark an already running server\n"
+              << "  --host ADDR         target address (default 127.0.0.1)\n"
+              << "  --port N            target port (default 8084)\n"
+              << "  --unix PATH         target the unix socket PATH instead of host:port\n"
+              << "  --compare-unix PATH run over host:port, then over the unix socket PATH of the\n"
+              << "                      same server, and report both\n"
+              << "  --compare-engines   run against a server on event_engine poll, then on\n"
+              << "                      io_uring, and report both with the server's CPU time\n"
+              << "  --connections N     concurrent keep-alive connections (default 16)\n"
+              << "  --idle N            hold N more connections open without requests (default 0)\n"
+              << "  --duration SEC      measured run time (default 10)\n"
+              << "  --warmup SEC        unmeasured warm-up time (default 1)\n"
+              << "  --requests N        stop after N measured requests\n"
+              << "  --mix get=W,post=W,delete=W,cgi=W   request weights\n"
+              << "  --upload-size BYTES size of each multipart upload (default 4096)\n"
+              << "  --asset PATH        GET target, repeatable (default: a set of var/www files)\n"
+              << "  --label NAME        free-form label copied into the report\n"
+              << "  --output FILE       write the JSON report to FILE instead of stdout\n";
+}
+
+static bool parseMix(const std::string& spec, Options& options)
+{
+    std::istringstream iss(spec);
+    std::string item;
+
+    for (int i = 0; i < OP_COUNT; ++i)
+        options.weights[i] = 0;
+    while (std::getline(iss, item, ','))
+    {
+        size_t eq = item.find('=');
+        if (eq == std::string::npos)
+            return false;
+        std::string name = item.substr(0, eq);
+        int weight = std::atoi(item.substr(eq + 1).c_str());
+        int op = 0;
+        while (op < OP_COUNT && name != g_opNames[op])
+            ++op;
+        if (op == OP_COUNT || weight < 0)
+            return false;
+        options.weights[op] = weight;
+    }
+    return true;
+}
+
+static bool parseOptions(int argc, char** argv, Options& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--no-spawn")
+            options.spawn = false;
+        else if (arg == "--compare-engines")
+            options.compareEngines = true;
+        else if (arg == "--help" || arg == "-h")
+            return false;
+        else if (!hasValue)
+            return false;
+        else if (arg == "--server")
+            options.serverBinary = argv[++i];
+        else if (arg == "--config")
+            options.config = argv[++i];
+        else if (arg == "--host")
+            options.host = argv[++i];
+        else if (arg == "--port")
+            options.port = std::atoi(argv[++i]);
+        else if (arg == "--unix")
+            options.unixPath = argv[++i];
+        else if (arg == "--compare-unix")
+            options.compareUnix = argv[++i];
+        else if (arg == "--connections")
+            options.connections = std::atoi(argv[++i]);
+        else if (arg == "--idle")
+            options.idle = std::atoi(argv[++i]);
+        else if (arg == "--duration")
+            options.duration = std::atof(argv[++i]);
+        else if (arg == "--warmup")
+            options.warmup = std::atof(argv[++i]);
+        else if (arg == "--requests")
+            options.maxRequests = std::atol(argv[++i]);
+        else if (arg == "--mix")
+        {
+            if (!parseMix(argv[++i], options))
+                return false;
+        }
+        else if (arg == "--upload-size")
+            options.uploadSize = std::strtoul(argv[++i], NULL, 10);
+        else if (arg == "--asset")
+            options.assets.push_back(argv[++i]);
+        else if (arg == "--label")
+            options.label = argv[++i];
+        else if (arg == "--output")
+            options.output = argv[++i];
+        else
+            return false;
+    }
+    if (options.assets.empty())
+    {
+        options.assets.push_back("/");
+        options.assets.push_back("/style.css");
+        options.assets.push_back("/index.html");
+        options.assets.push_back("/intra.html");
+        options.assets.push_back("/Yann.jpg");
+        options.assets.push_back("/login");
+    }
+    if (options.uploadSize < 64)
+        options.uploadSize = 64;
+    if (options.compareEngines && (!options.spawn || !options.compareUnix.empty()))
+        return false;
+    return options.connections > 0 && options.idle >= 0 && options.port > 0;
+}
+
+/* ------------------------------------------------------------------------ */
+/*                              Server process                              */
+/* ------------------------------------------------------------------------ */
+
+static pid_t spawnServer(const Options& options)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0)
+    {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0)
+        {
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            close(devnull);
+        }
+        execl(options.serverBinary.c_str(), options.serverBinary.c_str(), options.config.c_str(), (char*)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+// "unix:<path>", "[<ipv6>]:<port>" or "<ipv4>:<port>".
+static std::string targetName(const Options& options)
+{
+    if (!options.unixPath.empty())
+        return "unix:" + options.unixPath;
+    std::ostringstream name;
+    if (options.host.find(':') != std::string::npos)
+        name << '[' << options.host << "]:" << options.port;
+    else
+        name << options.host << ':' << options.port;
+    return name.str();
+}
+
+static int connectTo(const Options& options, bool blocking)
+{
+    sockaddr_storage address;
+    socklen_t length;
+    std::memset(&address, 0, sizeof(address));
+    if (!options.unixPath.empty())
+    {
+        sockaddr_un& local = reinterpret_cast<sockaddr_un&>(address);
+        if (options.unixPath.size() >= sizeof(local.sun_path))
+            return -1;
+        local.sun_family = AF_UNIX;
+        std::strcpy(local.sun_path, options.unixPath.c_str());
+        length = sizeof(local);
+    }
+    else if (options.host.find(':') != std::string::npos)
+    {
+        sockaddr_in6& inet6 = reinterpret_cast<sockaddr_in6&>(address);
+        inet6.sin6_family = AF_INET6;
+        inet6.sin6_port = htons(options.port);
+        if (inet_pton(AF_INET6, options.host.c_str(), &inet6.sin6_addr) != 1)
+            return -1;
+        length = sizeof(inet6);
+    }
+    else
+    {
+        sockaddr_in& inet = reinterpret_cast<sockaddr_in&>(address);
+        inet.sin_family = AF_INET;
+        inet.sin_port = htons(options.port);
+        inet.sin_addr.s_addr = inet_addr(options.host.c_str());
+        length = sizeof(inet);
+    }
+
+    int fd = socket(address.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    if (address.ss_family != AF_UNIX)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (!blocking)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), length) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool waitForServer(const Options& options, pid_t pid)
+{
+    for (int attempt = 0; attempt < 100; ++attempt)
+    {
+        if (pid > 0 && waitpid(pid, NULL, WNOHANG) == pid)
+            return false;
+        int fd = connectTo(options, true);
+        if (fd >= 0)
+        {
+            close(fd);
+            return true;
+        }
+        usleep(50000);
+    }
+    return false;
+}
+
+// Connections the server has to keep watching while the mix runs.
+static std::vector<int> openIdle(const Options& options)
+{
+    std::vector<int> fds;
+    for (int i = 0; i < options.idle; ++i)
+    {
+        int fd = connectTo(options, true);
+        if (fd < 0)
+            break;
+        fds.push_back(fd);
+    }
+    return fds;
+}
+
+// User plus system time of pid, from /proc, in milliseconds; -1 if unknown.
+static long cpuMillis(pid_t pid)
+{
+    if (pid <= 0)
+        return -1;
+    std::ifstream file(("/proc/" + toString(pid) + "/stat").c_str());
+    std::string line;
+    if (!std::getline(file, line) || line.rfind(')') == std::string::npos)
+        return -1;
+    // Fields counted from 3 (state), after the command name; utime is 14.
+    std::istringstream fields(line.substr(line.rfind(')') + 2));
+    std::string field;
+    unsigned long ticks = 0;
+    for (int i = 3; i <= 15 && fields >> field; ++i)
+    {
+        if (i >= 14)
+            ticks += std::strtoul(field.c_str(), NULL, 10);
+    }
+    return static_cast<long>(ticks * 1000 / sysconf(_SC_CLK_TCK));
+}
+
+// A copy of config that starts with event_engine set, or "" if it cannot
+// be written.
+static std::string engineConfig(const std::string& config, const std::string& engine)
+{
+    std::ifstream in(config.c_str());
+    std::string path = "/tmp/loadgen-" + toString(getpid()) + "-" + engine + ".conf";
+    std::ofstream out(path.c_str());
+    if (!in.is_open() || !out.is_open())
+        return "";
+    out << "event_engine " << engine << ";\n" << in.rdbuf();
+    return out ? path : "";
+}
+
+/* ------------------------------------------------------------------------ */
+/*                             Request building                             */
+/* ------------------------------------------------------------------------ */
+
+class LoadGenerator
+{
+private:
+    const Options&          _options;
+    std::vector<Connection> _connections;
+    std::deque<std::string> _uploaded;
+    OpStats                 _stats[OP_COUNT];
+    std::map<int, unsigned long> _statusCounts;
+    unsigned long           _uploadSeq;
+    unsigned long           _assetSeq;
+    unsigned long           _measured;
+    unsigned long           _reconnects;
+    unsigned long           _measureStart;
+    unsigned long           _measureEnd;
+    int                     _weightTotal;
+    pid_t                   _server;
+    long                    _cpuStart;
+    long                    _cpuEnd;
+
+    OpType pickOp();
+    std::string hostHeader() const;
+    void buildRequest(Connection& conn);
+    bool openConnection(Connection& conn);
+    void closeConnection(Connection& conn);
+    bool onWritable(Connection& conn);
+    bool onReadable(Connection& conn, unsigned long now);
+    bool responseComplete(const std::string& in, int& status) const;
+    void recordError(Connection& conn, unsigned long now);
+
+public:
+    explicit LoadGenerator(const Options& options);
+    // The spawned server, whose CPU time over the measured run is reported.
+    void watchServer(pid_t pid);
+    bool run();
+    void report(std::ostream& out) const;
+};
+
+LoadGenerator::LoadGenerator(const Options& options)
+    : _options(options), _connections(options.connections), _uploadSeq(0), _assetSeq(0), _measured(0),
+      _reconnects(0), _measureStart(0), _measureEnd(0), _weightTotal(0), _server(-1), _cpuStart(-1), _cpuEnd(-1)
+{
+    for (int i = 0; i < OP_COUNT; ++i)
+        _weightTotal += options.weights[i];
+}
+
+void LoadGenerator::watchServer(pid_t pid)
+{
+    _server = pid;
+}
+
+OpType LoadGenerator::pickOp()
+{
+    int roll = _weightTotal > 0 ? std::rand() % _weightTotal : 0;
+    for (int i = 0; i < OP_COUNT; ++i)
+    {
+        if (roll < _options.weights[i])
+            return static_cast<OpType>(i);
+        roll -= _options.weights[i];
+    }
+    return OP_GET;
+}
+
+std::string LoadGenerator::hostHeader() const
+{
+    return _options.unixPath.empty() ? targetName(_options) : "localhost";
+}
+
+void LoadGenerator::buildRequest(Connection& conn)
+{
+    conn.op = pickOp();
+    conn.uploaded.clear();
+    if (conn.op == OP_DELETE && _uploaded.empty())
+        conn.op = _options.weights[OP_POST] > 0 ? OP_POST : OP_GET;
+
+    std::string& out = conn.out;
+    out.clear();
+    conn.sent = 0;
+    conn.in.clear();
+
+    if (conn.op == OP_GET)
+    {
+        const std::string& path = _options.assets[_assetSeq++ % _options.assets.size()];
+        out = "GET " + path + " HTTP/1.1\r\nHost: " + hostHeader() + "\r\nConnection: keep-alive\r\nUser-Agent: webserv-loadgen\r\n\r\n";
+    }
+    else if (conn.op == OP_CGI)
+        out = "GET /cgi-bin/list_files.py HTTP/1.1\r\nHost: " + hostHeader() + "\r\nUser-Agent: webserv-loadgen\r\n\r\n";
+    else if (conn.op == OP_DELETE)
+    {
+        std::string name = _uploaded.front();
+        _uploaded.pop_front();
+        out = "DELETE /" + name + " HTTP/1.1\r\nHost: " + hostHeader() + "\r\nUser-Agent: webserv-loadgen\r\n\r\n";
+    }
+    else
+    {
+        std::string boundary = "----webservLoadgenBoundary";
+        std::string name = "loadgen_" + toString(getpid()) + "_" + toString(_uploadSeq++) + ".txt";
+        std::string body = "--" + boundary + "\r\n"
+            "Content-Disposition: form-data; name=\"file\"; filename=\"" + name + "\"\r\n"
+            "Content-Type: text/plain\r\n\r\n"
+            + std::string(_options.uploadSize, 'x')
+            + "\r\n--" + boundary + "--\r\n";
+        out = "POST /post HTTP/1.1\r\nHost: " + hostHeader() + "\r\nUser-Agent: webserv-loadgen\r\n"
+            "Content-Type: multipart/form-data; boundary=" + boundary + "\r\n"
+            "Content-Length: " + toString(body.size()) + "\r\n\r\n" + body;
+        conn.uploaded = name;
+    }
+    conn.startUs = nowMicros();
+}
+
+bool LoadGenerator::openConnection(Connection& conn)
+{
+    conn.fd = connectTo(_options, false);
+    conn.connecting = conn.fd >= 0;
+    if (conn.fd < 0)
+        return false;
+    buildRequest(conn);
+    return true;
+}
+
+void LoadGenerator::closeConnection(Connection& conn)
+{
+    if (conn.fd >= 0)
+        close(conn.fd);
+    conn.fd = -1;
+}
+
+void LoadGenerator::recordError(Connection& conn, unsigned long now)
+{
+    if (_measureStart && now >= _measureStart && now < _measureEnd)
+        ++_stats[conn.op].errors;
+    closeConnection(conn);
+    ++_reconnects;
+}
+
+bool LoadGenerator::onWritable(Connection& conn)
+{
+    if (conn.connecting)
+    {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+            return false;
+        conn.connecting = false;
+    }
+    ssize_t n = send(conn.fd, conn.out.data() + conn.sent, conn.out.size() - conn.sent, MSG_NOSIGNAL);
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    conn.sent += n;
+    return true;
+}
+
+static std::string lowercase(const std::string& value)
+{
+    std::string lower = value;
+    for (size_t i = 0; i < lower.size(); ++i)
+        lower[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(lower[i])));
+    return lower;
+}
+
+bool LoadGenerator::responseComplete(const std::string& in, int& status) const
+{
+    size_t headerEnd = in.find("\r\n\r\n");
+    if (headerEnd == std::string::npos)
+        return false;
+    status = std::atoi(in.c_str() + 9);
+    std::string head = lowercase(in.substr(0, headerEnd));
+    size_t pos = head.find("\r\ncontent-length:");
+    size_t bodyLength = 0;
+    if (pos != std::string::npos)
+        bodyLength = std::strtoul(head.c_str() + pos + 17, NULL, 10);
+    return in.size() >= headerEnd + 4 + bodyLength;
+}
+
+bool LoadGenerator::onReadable(Connection& conn, unsigned long now)
+{
+    char buffer[65536];
+    ssize_t n = recv(conn.fd, buffer, sizeof(buffer), 0);
+    if (n <= 0)
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    conn.in.append(buffer, n);
+
+    int status = 0;
+    if (!responseComplete(conn.in, status))
+        return true;
+
+    if (now >= _measureStart && now < _measureEnd)
+    {
+        OpStats& stats = _stats[conn.op];
+        stats.latencies.push_back(now - conn.startUs);
+        stats.bytes += conn.in.size();
+        ++_statusCounts[status];
+        if (status >= 500)
+            ++stats.errors;
+        ++_measured;
+    }
+    if (conn.op == OP_POST && status == 201 && !conn.uploaded.empty())
+        _uploaded.push_back(conn.uploaded);
+    buildRequest(conn);
+    return true;
+}
+
+bool LoadGenerator::run()
+{
+    unsigned long start = nowMicros();
+    _measureStart = start + static_cast<unsigned long>(_options.warmup * 1e6);
+    _measureEnd = _measureStart + static_cast<unsigned long>(_options.duration * 1e6);
+
+    for (size_t i = 0; i < _connections.size(); ++i)
+    {
+        if (!openConnection(_connections[i]))
+            return false;
+    }
+
+    std::vector<pollfd> pfds(_connections.size());
+    for (;;)
+    {
+        unsigned long now = nowMicros();
+        if (now >= _measureEnd || (_options.maxRequests > 0 && _measured >= static_cast<unsigned long>(_options.maxRequests)))
+            break;
+        if (_cpuStart < 0 && now >= _measureStart)
+            _cpuStart = cpuMillis(_server);
+
+        for (size_t i = 0; i < _connections.size(); ++i)
+        {
+            Connection& conn = _connections[i];
+            if (conn.fd < 0)
+                openConnection(conn);
+            pfds[i].fd = conn.fd;
+            pfds[i].revents = 0;
+            pfds[i].events = (conn.connecting || conn.sent < conn.out.size()) ? POLLOUT : POLLIN;
+        }
+        if (poll(&pfds[0], pfds.size(), 100) < 0 && errno != EINTR)
+            return false;
+
+        now = nowMicros();
+        for (size_t i = 0; i < _connections.size(); ++i)
+        {
+            Connection& conn = _connections[i];
+            if (conn.fd < 0)
+                continue;
+            bool ok = true;
+            if (pfds[i].revents & (POLLERR | POLLHUP | POLLNVAL) && !(pfds[i].revents & POLLIN))
+                ok = false;
+            else if (pfds[i].revents & POLLOUT)
+                ok = onWritable(conn);
+            else if (pfds[i].revents & POLLIN)
+                ok = onReadable(conn, now);
+            if (ok && now > conn.startUs && now - conn.startUs > 30000000UL)
+                ok = false;
+            if (!ok)
+                recordError(conn, now);
+        }
+    }
+    _measureEnd = std::min(_measureEnd, nowMicros());
+    if (_cpuStart >= 0)
+        _cpuEnd = cpuMillis(_server);
+    for (size_t i = 0; i < _connections.size(); ++i)
+        closeConnection(_connections[i]);
+    return true;
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                  Report                                  */
+/* ------------------------------------------------------------------------ */
+
+static unsigned long percentile(const std::vector<unsigned long>& sorted, double q)
+{
+    if (sorted.empty())
+        return 0;
+    size_t index = static_cast<size_t>(q * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+static void writeLatency(std::ostream& out, std::vector<unsigned long> values)
+{
+    std::sort(values.begin(), values.end());
+    double sum = 0;
+    for (size_t i = 0; i < values.size(); ++i)
+        sum += values[i];
+    out << "{\"count\": " << values.size()
+        << ", \"mean_us\": " << (values.empty() ? 0 : static_cast<unsigned long>(sum / values.size()))
+        << ", \"p50_us\": " << percentile(values, 0.50)
+        << ", \"p99_us\": " << percentile(values, 0.99)
+        << ", \"p999_us\": " << percentile(values, 0.999)
+        << ", \"max_us\": " << (values.empty() ? 0 : values.back()) << "}";
+}
+
+static std::string jsonEscape(const std::string& value)
+{
+    std::string escaped;
+    for (size_t i = 0; i < value.size(); ++i)
+    {
+        if (value[i] == '"' || value[i] == '\\')
+            escaped += '\\';
+        escaped += value[i];
+    }
+    return escaped;
+}
+
+void LoadGenerator::report(std::ostream& out) const
+{
+    double seconds = (_measureEnd - _measureStart) / 1e6;
+    std::vector<unsigned long> all;
+    unsigned long errors = 0;
+    unsigned long bytes = 0;
+
+    for (int i = 0; i < OP_COUNT; ++i)
+    {
+        all.insert(all.end(), _stats[i].latencies.begin(), _stats[i].latencies.end());
+        errors += _stats[i].errors;
+        bytes += _stats[i].bytes;
+    }
+
+    char throughput[32];
+    snprintf(throughput, sizeof(throughput), "%.1f", seconds > 0 ? all.size() / seconds : 0.0);
+
+    out << "{\n";
+    out << "  \"label\": \"" << jsonEscape(_options.label) << "\",\n";
+    out << "  \"config\": \"" << jsonEscape(_options.config) << "\",\n";
+    out << "  \"target\": \"" << jsonEscape(targetName(_options)) << "\",\n";
+    out << "  \"connections\": " << _options.connections << ",\n";
+    if (_options.idle)
+        out << "  \"idle_connections\": " << _options.idle << ",\n";
+    out << "  \"duration_s\": " << seconds << ",\n";
+    out << "  \"requests\": " << all.size() << ",\n";
+    out << "  \"errors\": " << errors << ",\n";
+    out << "  \"reconnects\": " << _reconnects << ",\n";
+    out << "  \"throughput_rps\": " << throughput << ",\n";
+    out << "  \"bytes_received\": " << bytes << ",\n";
+    if (_cpuEnd >= 0)
+    {
+        long cpu = _cpuEnd - _cpuStart;
+        out << "  \"server_cpu_ms\": " << cpu << ",\n";
+        out << "  \"server_cpu_us_per_request\": " << (all.empty() ? 0 : cpu * 1000 / static_cast<long>(all.size()))
+            << ",\n";
+    }
+    out << "  \"latency\": ";
+    writeLatency(out, all);
+    out << ",\n  \"by_type\": {";
+    bool first = true;
+    for (int i = 0; i < OP_COUNT; ++i)
+    {
+        if (_options.weights[i] == 0)
+            continue;
+        out << (first ? "\n" : ",\n") << "    \"" << g_opNames[i] << "\": ";
+        writeLatency(out, _stats[i].latencies);
+        first = false;
+    }
+    out << "\n  },\n  \"status\": {";
+    first = true;
+    for (std::map<int, unsigned long>::const_iterator it = _statusCounts.begin(); it != _statusCounts.end(); ++it)
+    {
+        out << (first ? "" : ", ") << "\"" << it->first << "\": " << it->second;
+        first = false;
+    }
+    out << "}\n}\n";
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        usage();
+        return 2;
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+    std::srand(static_cast<unsigned int>(time(NULL)));
+
+    // One run per target, one after the other: against the same server for
+    // --compare-unix, against a server of its own for --compare-engines.
+    std::vector<Options> targets(1, options);
+    std::vector<std::string> names;
+    if (!options.compareUnix.empty())
+    {
+        targets.push_back(options);
+        targets[1].unixPath = options.compareUnix;
+        names.push_back("tcp");
+        names.push_back("unix");
+    }
+    else if (options.compareEngines)
+    {
+        targets.push_back(options);
+        names.push_back("poll");
+        names.push_back("io_uring");
+        for (size_t i = 0; i < targets.size(); ++i)
+        {
+            targets[i].config = engineConfig(options.config, names[i]);
+            if (targets[i].config.empty())
+            {
+                std::cerr << "loadgen: cannot write a configuration for " << names[i] << std::endl;
+                return 1;
+            }
+        }
+    }
+    std::vector<LoadGenerator*> generators;
+    pid_t server = -1;
+    bool ok = true;
+    for (size_t i = 0; i < targets.size() && ok; ++i)
+    {
+        if (options.spawn && server < 0)
+        {
+            server = spawnServer(targets[i]);
+            if (server < 0)
+            {
+                std::cerr << "loadgen: failed to start " << options.serverBinary << std::endl;
+                ok = false;
+                break;
+            }
+        }
+        if (!waitForServer(targets[i], server))
+        {
+            std::cerr << "loadgen: server not reachable on " << targetName(targets[i]) << std::endl;
+            ok = false;
+            break;
+        }
+        std::vector<int> idle = openIdle(targets[i]);
+        generators.push_back(new LoadGenerator(targets[i]));
+        generators.back()->watchServer(server);
+        if (!generators.back()->run())
+        {
+            std::cerr << "loadgen: benchmark aborted" << std::endl;
+            ok = false;
+        }
+        for (size_t j = 0; j < idle.size(); ++j)
+            close(idle[j]);
+        if (options.compareEngines && server > 0)
+        {
+            kill(server, ok ? SIGINT : SIGKILL);
+            waitpid(server, NULL, 0);
+            server = -1;
+        }
+    }
+
+    if (server > 0)
+    {
+        kill(server, ok ? SIGINT : SIGKILL);
+        waitpid(server, NULL, 0);
+    }
+    if (options.compareEngines)
+    {
+        for (size_t i = 0; i < targets.size(); ++i)
+            std::remove(targets[i].config.c_str());
+    }
+
+    std::ofstream file;
+    if (ok && !options.output.empty())
+    {
+        file.open(options.output.c_str());
+        if (!file.is_open())
+        {
+            std::cerr << "loadgen: cannot write " << options.output << std::endl;
+            ok = false;
+        }
+    }
+    if (ok)
+    {
+        std::ostream& out = options.output.empty() ? std::cout : file;
+        if (generators.size() == 1)
+            generators[0]->report(out);
+        else
+        {
+            out << "{\n\"" << names[0] << "\": ";
+            generators[0]->report(out);
+            out << ",\n\"" << names[1] << "\": ";
+            generators[1]->report(out);
+            out << "}\n";
+        }
+    }
+    for (size_t i = 0; i < generators.size(); ++i)
+        delete generators[i];
+    return ok ? 0 : 1;
+}
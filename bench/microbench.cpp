@@ -0,0 +1,576 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*   microbench.cpp - CPU microbenchmarks for webserv hot paths               */
+/*                                                                            */
+/*   Self-contained (no network): links the server objects and times the      */
+/*   parsing, routing and response-formatting functions in isolation.        */
+/*   Every allocation made through operator new is counted, so each result   */
+/*   reports ns/op and allocs/op.                                             */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <new>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include "Server.hpp"
+#include "HttpRequest.hpp"
+#include "ServerConfig.hpp"
+#include "RequestArena.hpp"
+
+/* ------------------------------------------------------------------------ */
+/*                           Allocation counting                            */
+/* ------------------------------------------------------------------------ */
+
+static unsigned long g_allocCount = 0;
+static unsigned long g_allocBytes = 0;
+
+void* operator new(size_t size) throw(std::bad_alloc)
+{
+    ++g_allocCount;
+    g_allocBytes += size;
+    void* p = std::malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size) throw(std::bad_alloc)
+{
+    ++g_allocCount;
+    g_allocBytes += size;
+    void* p = std::malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) throw()
+{
+    std::free(p);
+}
+
+void operator delete[](void* p) throw()
+{
+    std::free(p);
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                Framework                                 */
+/* ------------------------------------------------------------------------ */
+
+typedef void (*BenchFunction)(size_t iterations);
+
+struct BenchEntry
+{
+    const char*   name;
+    BenchFunction function;
+};
+
+static std::vector<BenchEntry>& registry()
+{
+    static std::vector<BenchEntry> entries;
+    return entries;
+}
+
+struct BenchRegistrar
+{
+    BenchRegistrar(const char* name, BenchFunction function)
+    {
+        BenchEntry entry = { name, function };
+        registry().push_back(entry);
+    }
+};
+
+#define BENCHMARK(name) \
+    static void name(size_t iterations); \
+    static BenchRegistrar registrar_##name(#name, &name); \
+    static void name(size_t iterations)
+
+template <typename T>
+static void doNotOptimize(const T& value)
+{
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+static double nowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct BenchResult
+{
+    std::string   name;
+    size_t        iterations;
+    double        nsPerOp;
+    double        allocsPerOp;
+    double        bytesPerOp;
+};
+
+// Grows the iteration count until one run lasts at least minTime, then
+// reports that run. One untimed iteration warms caches and lazy statics.
+static BenchResult runBenchmark(const BenchEntry& entry, double minTime)
+{
+    BenchResult result;
+    size_t iterations = 1;
+
+    entry.function(1);
+    for (;;)
+    {
+        unsigned long allocs = g_allocCount;
+        unsigned long bytes = g_allocBytes;
+        double start = nowSeconds();
+        entry.function(iterations);
+        double elapsed = nowSeconds() - start;
+
+        if (elapsed >= minTime || iterations >= 1000000000UL)
+        {
+            result.name = entry.name;
+            result.iterations = iterations;
+            result.nsPerOp = elapsed * 1e9 / iterations;
+            result.allocsPerOp = static_cast<double>(g_allocCount - allocs) / iterations;
+            result.bytesPerOp = static_cast<double>(g_allocBytes - bytes) / iterations;
+            return result;
+        }
+        double scale = elapsed > 0 ? minTime * 1.4 / elapsed : 100.0;
+        if (scale > 100.0)
+            scale = 100.0;
+        if (scale < 2.0)
+            scale = 2.0;
+        iterations = static_cast<size_t>(iterations * scale);
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                 Fixtures                                 */
+/* ------------------------------------------------------------------------ */
+
+static const char* kSimpleGet =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:8083\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static const char* kBrowserGet =
+    "GET /style.css HTTP/1.1\r\n"
+    "Host: exemple2.com:8084\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: http://exemple2.com:8084/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: fr-FR,fr;q=0.9,en-US;q=0.8,en;q=0.7\r\n"
+    "Cookie: session=4f2c1a9be37d; theme=dark\r\n"
+    "\r\n";
+
+static std::string postRequest()
+{
+    std::string body(4096, 'x');
+    std::ostringstream oss;
+    oss << "POST /post HTTP/1.1\r\n"
+        << "Host: 127.0.0.1:8084\r\n"
+        << "Content-Type: plain/text\r\n"
+        << "Content-Length: " << body.size() << "\r\n"
+        << "\r\n" << body;
+    return oss.str();
+}
+
+static ServerConfig& routingConfig()
+{
+    static ServerConfig config;
+    static bool ready = false;
+
+    if (!ready)
+    {
+        config.setRoot("var/www/");
+        config.setIndex("index.html");
+        config.setPort(8083);
+        for (int i = 0; i < 32; ++i)
+        {
+            std::ostringstream path;
+            path << "/section" << i;
+            ServerLocation location(path.str());
+            location.setRoot("var/www/");
+            location.setIndex("index.html");
+            config.addLocation(location);
+        }
+        ready = true;
+    }
+    return config;
+}
+
+static std::vector<ServerConfig>& virtualHosts()
+{
+    static std::vector<ServerConfig> configs;
+
+    if (configs.empty())
+    {
+        for (int i = 0; i < 100; ++i)
+        {
+            ServerConfig config;
+            std::ostringstream name;
+            name << "vhost" << i << ".example.com";
+            config.setServerName(name.str());
+            config.setPort(8000 + i % 4);
+            configs.push_back(config);
+        }
+    }
+    return configs;
+}
+
+static VirtualHostIndex& virtualHostIndex()
+{
+    static VirtualHostIndex index;
+
+    if (index.size() == 0)
+        index.build(virtualHosts());
+    return index;
+}
+
+// A generated deployment: thousands of name-based virtual hosts sharing one
+// listener, the shape that made startup quadratic.
+static const char* startupConfig()
+{
+    static const char* path = "/tmp/webserv_microbench_10k.conf";
+    static bool written = false;
+
+    if (!written)
+    {
+        std::ofstream out(path);
+        out << "access_log off;\nerror_log off;\n";
+        for (int i = 0; i < 10000; ++i)
+        {
+            out << "server {\n"
+                << "    listen 18080;\n"
+                << "    host 127.0.0.1;\n"
+                << "    server_name vhost" << i << ".example.com;\n"
+                << "    root var/www/;\n"
+                << "    index index.html;\n"
+                << "    location /login {\n"
+                << "        root var/www/main/;\n"
+                << "        index login.html;\n"
+                << "    }\n"
+                << "}\n";
+        }
+        written = true;
+    }
+    return path;
+}
+
+static std::string largeServerBlock()
+{
+    std::ostringstream block;
+    block << "server {\n"
+          << "    listen 8083;\n"
+          << "    listen 8084;\n"
+          << "    host 127.0.0.1;\n"
+          << "    server_name large.example.com;\n"
+          << "    root var/www/;\n"
+          << "    index index.html;\n"
+          << "    client_max_body_size 1000000;\n"
+          << "    error_page 404 /main/errors/404.html;\n"
+          << "    error_page 500 /main/errors/500.html;\n"
+          << "    error_page 403 /main/errors/403.html;\n";
+    for (int i = 0; i < 200; ++i)
+    {
+        block << "    location /section" << i << " {\n"
+              << "        root var/www/main/;\n"
+              << "        index login.html;\n"
+              << "        methods GET POST;\n"
+              << "    }\n";
+    }
+    block << "}\n";
+    return block.str();
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                Benchmarks                                */
+/* ------------------------------------------------------------------------ */
+
+BENCHMARK(HttpRequest_ctor_simpleGet)
+{
+    std::string raw(kSimpleGet);
+    RequestArena arena;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        {
+            HttpRequest request(raw, arena);
+            doNotOptimize(request);
+        }
+        arena.release();
+    }
+}
+
+BENCHMARK(HttpRequest_ctor_browserGet)
+{
+    std::string raw(kBrowserGet);
+    RequestArena arena;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        {
+            HttpRequest request(raw, arena);
+            doNotOptimize(request);
+        }
+        arena.release();
+    }
+}
+
+BENCHMARK(HttpRequest_ctor_post4k)
+{
+    std::string raw = postRequest();
+    RequestArena arena;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        {
+            HttpRequest request(raw, arena);
+            doNotOptimize(request);
+        }
+        arena.release();
+    }
+}
+
+BENCHMARK(resolveFilePath_locationHit)
+{
+    RequestArena arena;
+    HttpRequest request("GET /section31 HTTP/1.1\r\nHost: localhost\r\n\r\n", arena);
+    ServerConfig& config = routingConfig();
+    RequestArena::Mark parsed = arena.mark();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        const char* path = request.resolveFilePath(config);
+        doNotOptimize(path);
+        arena.rewind(parsed);
+    }
+}
+
+BENCHMARK(resolveFilePath_locationMiss)
+{
+    RequestArena arena;
+    HttpRequest request("GET /assets/style.css HTTP/1.1\r\nHost: localhost\r\n\r\n", arena);
+    ServerConfig& config = routingConfig();
+    RequestArena::Mark parsed = arena.mark();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        const char* path = request.resolveFilePath(config);
+        doNotOptimize(path);
+        arena.rewind(parsed);
+    }
+}
+
+BENCHMARK(findLocation_scan32)
+{
+    ServerConfig& config = routingConfig();
+    std::string path = "/section31";
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        const ServerLocation* location = config.findLocation(path);
+        doNotOptimize(location);
+    }
+}
+
+BENCHMARK(getConfigForRequest_serverName100)
+{
+    std::vector<ServerConfig>& configs = virtualHosts();
+    VirtualHostIndex& index = virtualHostIndex();
+    std::string host = "vhost99.example.com:8003";
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        ServerConfig* config = Server::matchConfig(configs, index, host, 8003);
+        doNotOptimize(config);
+    }
+}
+
+BENCHMARK(getConfigForRequest_defaultForPort100)
+{
+    std::vector<ServerConfig>& configs = virtualHosts();
+    VirtualHostIndex& index = virtualHostIndex();
+    std::string host = "unknown.example.com";
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        ServerConfig* config = Server::matchConfig(configs, index, host, 8002);
+        doNotOptimize(config);
+    }
+}
+
+BENCHMARK(getMimeType_css)
+{
+    RequestArena arena;
+    HttpRequest request(kSimpleGet, arena);
+    std::string path = "var/www/style.css";
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        std::string type = request.getMimeType(path);
+        doNotOptimize(type);
+    }
+}
+
+BENCHMARK(getMimeType_unknown)
+{
+    RequestArena arena;
+    HttpRequest request(kSimpleGet, arena);
+    std::string path = "var/www/archive.tar.zst";
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        std::string type = request.getMimeType(path);
+        doNotOptimize(type);
+    }
+}
+
+BENCHMARK(findErrorPage_404)
+{
+    RequestArena arena;
+    HttpRequest request(kSimpleGet, arena);
+    ServerConfig config;
+    config.setRoot("var/www/");
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        ResponseBuilder response = request.findErrorPage(config, 404);
+        response.finish();
+        doNotOptimize(response);
+    }
+}
+
+BENCHMARK(generateDefaultErrorPage_500)
+{
+    RequestArena arena;
+    HttpRequest request(kSimpleGet, arena);
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        ResponseBuilder response = request.generateDefaultErrorPage(500);
+        response.finish();
+        doNotOptimize(response);
+    }
+}
+
+// Everything the event loop does for a keep-alive GET of a static file
+// between recv() and sendmsg(): parse, route, read, format, release. Once
+// the buffer pool and the arena free list are warm this must report 0
+// allocs/op.
+BENCHMARK(request_staticGet_steadyState)
+{
+    std::string raw(kBrowserGet);
+    ServerConfig& config = routingConfig();
+    RequestArena arena;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        {
+            HttpRequest request(raw, arena);
+            const ServerLocation* location = config.findLocation(request.getPath());
+            doNotOptimize(location);
+            ResponseBuilder response = request.handleRequest(config);
+            response.finish();
+            doNotOptimize(response);
+        }
+        arena.release();
+    }
+}
+
+BENCHMARK(parseServerBlock_200locations)
+{
+    std::string block = largeServerBlock();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        ServerConfig config;
+        config.parseServerBlock(block);
+        doNotOptimize(config);
+    }
+}
+
+// Full Server construction: parse, validate, index, register metrics and
+// bind the shared listener. Target: under 100 ms.
+BENCHMARK(startup_10kServerBlocks)
+{
+    const char* path = startupConfig();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Server server(path);
+        doNotOptimize(server);
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                   Main                                   */
+/* ------------------------------------------------------------------------ */
+
+static void printTable(const std::vector<BenchResult>& results)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "%-40s %14s %12s %12s %12s", "Benchmark", "ns/op", "allocs/op", "bytes/op", "iterations");
+    std::cout << line << "\n" << std::string(94, '-') << "\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        snprintf(line, sizeof(line), "%-40s %14.1f %12.2f %12.1f %12lu", results[i].name.c_str(), results[i].nsPerOp,
+            results[i].allocsPerOp, results[i].bytesPerOp, static_cast<unsigned long>(results[i].iterations));
+        std::cout << line << "\n";
+    }
+}
+
+static void printJson(const std::vector<BenchResult>& results)
+{
+    char line[256];
+    std::cout << "{\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        snprintf(line, sizeof(line),
+            "%s\n    {\"name\": \"%s\", \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f, \"iterations\": %lu}",
+            i ? "," : "", results[i].name.c_str(), results[i].nsPerOp, results[i].allocsPerOp, results[i].bytesPerOp,
+            static_cast<unsigned long>(results[i].iterations));
+        std::cout << line;
+    }
+    std::cout << "\n  ]\n}\n";
+}
+
+int main(int argc, char** argv)
+{
+    std::string filter;
+    double minTime = 0.25;
+    bool json = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--json")
+            json = true;
+        else if (arg == "--filter" && i + 1 < argc)
+            filter = argv[++i];
+        else if (arg == "--min-time" && i + 1 < argc)
+            minTime = std::atof(argv[++i]);
+        else
+        {
+            std::cerr << "usage: microbench [--filter SUBSTRING] [--min-time SECONDS] [--json]" << std::endl;
+            return 2;
+        }
+    }
+
+    std::vector<BenchResult> results;
+    const std::vector<BenchEntry>& entries = registry();
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        if (!filter.empty() && std::string(entries[i].name).find(filter) == std::string::npos)
+            continue;
+        results.push_back(runBenchmark(entries[i], minTime));
+    }
+    if (json)
+        printJson(results);
+    else
+        printTable(results);
+    return 0;
+}
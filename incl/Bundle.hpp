@@ -0,0 +1,99 @@
+#ifndef BUNDLE_HPP
+#define BUNDLE_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include <sys/types.h>
+
+// On-disk layout of a docroot bundle, written by tools/mkbundle. Integers are
+// little-endian and offsets count from the start of the file:
+//
+//   BundleHeader | BundleEntry[count], sorted by path | strings | file data
+//
+// Strings (path, MIME type, ETag) are NUL-terminated so they can be handed to
+// the response headers as they are; the lengths exclude the terminator.
+struct BundleHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t entriesOffset;
+    uint64_t stringsOffset;
+    uint64_t dataOffset;
+    uint64_t fileSize;
+};
+
+struct BundleEntry
+{
+    uint32_t pathOffset;
+    uint32_t pathLength;
+    uint32_t mimeOffset;
+    uint32_t mimeLength;
+    uint32_t etagOffset;
+    uint32_t etagLength;
+    uint64_t dataOffset;
+    uint64_t dataLength;
+    uint64_t gzipOffset;
+    uint64_t gzipLength;
+};
+
+// A read-only mapping of one bundle file. Lookups are a binary search over
+// the entry table and return pointers straight into the mapping, so serving
+// a file costs no stat(), open() or copy. The mapping is MAP_SHARED: every
+// process serving the bundle shares the same page cache.
+class Bundle
+{
+public:
+    struct File
+    {
+        const char* data;
+        size_t      length;
+        const char* gzipData;
+        size_t      gzipLength;
+        const char* mime;
+        const char* etag;
+    };
+
+    static const uint32_t VERSION = 1;
+    static const char MAGIC[8];
+
+    // Maps path once per process and returns the shared instance. A bundle
+    // replaced on disk is mapped again on the next call (config reload).
+    static const Bundle* open(const std::string& path);
+    // A configuration that serves from a bundle holds it from acquire() to
+    // release(). The registry holds the current mapping of each path too; a
+    // replaced one is unmapped when its last holder releases it.
+    static void acquire(const Bundle* bundle);
+    static void release(const Bundle* bundle);
+    // Whether [offset, offset + length) lies within size bytes, without
+    // computing offset + length, which a crafted file could make wrap.
+    static bool fits(uint64_t offset, uint64_t length, uint64_t size);
+
+    bool find(const char* path, size_t length, File& file) const;
+    size_t count() const;
+    const std::string& path() const;
+
+private:
+    std::string         _path;
+    const char*         _base;
+    size_t              _size;
+    ino_t               _inode;
+    time_t              _mtime;
+    const BundleHeader* _header;
+    const BundleEntry*  _entries;
+    mutable unsigned    _references;
+
+    static std::map<std::string, Bundle*>& registry();
+
+    Bundle(const std::string& path);
+    Bundle(const Bundle&);
+    Bundle& operator=(const Bundle&);
+    ~Bundle();
+
+    void map();
+    void validate() const;
+};
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef CGI_HPP
+#define CGI_HPP
+
+#include <string>
+#include <sys/types.h>
+#include "RequestArena.hpp"
+#include "ResponseBuilder.hpp"
+
+class EventEngine;
+class TlsConnection;
+struct GzipPolicy;
+
+// A CGI script run by the event loop for an HTTP/1.1 client or an HTTP/2
+// stream, instead of the server waiting for it.
+//
+// The request body goes to the script's stdin as it arrives: the bytes read
+// with the head first, then the rest spliced from the socket straight into
+// the pipe. Once the script stops reading, the rest of the body is read and
+// dropped, so the connection stays in sync for its next request.
+//
+// The output is collected up to HIGH_WATER bytes. A script that is done by
+// then is answered as executeCGI always has, with Content-Length and gzip.
+// Longer output is streamed: the head is parsed from what was collected and
+// sent, then the body goes from the stdout pipe into the socket with
+// splice(), in chunks sized by what the pipe holds (or delimited by the
+// connection closing, for HTTP/1.0). Through TLS without kTLS the chunks are
+// copied through user space. When the event engine manages the client's
+// writes, the framing and the splice of each chunk go out as one chain.
+//
+// Without a client descriptor (an HTTP/2 stream, whose body has been read
+// whole) nothing is streamed: the output is collected to the end and
+// answered as one response for the stream.
+//
+// The script has TIMEOUT_US to answer once it has the whole body; a
+// response that is already streaming is not timed.
+class CgiSession
+{
+public:
+    enum Result
+    {
+        CONTINUE,
+        RESPOND,          // response() is the whole answer
+        DONE,             // streamed response delivered
+        CLIENT_GONE
+    };
+
+    static const size_t HIGH_WATER = 64 * 1024;
+    static const size_t MAX_CHUNK = 1024 * 1024;
+    static const size_t MAX_PER_EVENT = 4 * 1024 * 1024;
+    static const unsigned long TIMEOUT_US = 5000000;
+
+    // Takes over the script and both pipe ends. body is the part of the
+    // request body already read; bodyOnSocket bytes are still to come.
+    // tls is the client's TLS connection, or NULL. clientFd is -1 for an
+    // HTTP/2 stream.
+    CgiSession(pid_t pid, int stdinFd, int stdoutFd, int clientFd, TlsConnection* tls, const std::string& body,
+        unsigned long bodyOnSocket, bool chunked, const GzipPolicy* gzip, bool gzipAccepted);
+    // Kills and reaps the script if it is still running.
+    ~CgiSession();
+
+    // Streams through engine's chains; set before start().
+    void sendThrough(EventEngine* engine);
+    Result start();
+    Result clientReady(short revents);
+    Result stdinReady(short revents);
+    Result stdoutReady(short revents);
+    // Answers 504 if the script is past its deadline.
+    Result expire(unsigned long nowUs);
+
+    short clientEvents() const;
+    short stdinEvents() const;
+    short stdoutEvents() const;
+    // Zero while the script is not timed.
+    unsigned long deadlineUs() const;
+    // The body has all been handed to the script, or the script stopped
+    // reading it: the caller stops polling stdin and closes it with
+    // closeStdin(), which is the script's EOF.
+    bool stdinDone() const;
+    void closeStdin();
+    // The output has all been read; the caller stops polling stdout and
+    // closes it with closeStdout().
+    bool stdoutDone() const;
+    void closeStdout();
+    // The script closed its output while a chain was splicing from it: the
+    // caller stops polling stdout, and the session reads the rest once the
+    // chain is done.
+    bool stdoutHungUp() const;
+
+    LogFields& logFields();
+    ResponseBuilder& response();
+    int clientFd() const;
+    int stdinFd() const;
+    int stdoutFd() const;
+    int status() const;
+    // The script's process id, and its status as waitpid() gave it or -1
+    // while it has not been reaped.
+    pid_t pid() const;
+    int waitStatus() const;
+    bool clientReusable() const;
+    unsigned long bytesToClient() const;
+
+private:
+    enum Phase
+    {
+        COLLECT,
+        STREAM,
+        ANSWERED           // response() holds the answer
+    };
+
+    pid_t          _pid;               // -1 once reaped
+    pid_t          _scriptPid;
+    int            _waitStatus;
+    int            _stdinFd;
+    int            _stdoutFd;
+    int            _clientFd;
+    TlsConnection* _tls;
+    EventEngine*   _engine;
+    bool           _chunked;
+    const GzipPolicy* _gzip;
+    bool           _gzipAccepted;
+    Phase          _phase;
+
+    std::string    _toScript;          // body bytes read but not yet written to stdin
+    size_t         _toScriptSent;
+    unsigned long  _bodyOnSocket;
+    bool           _stdinBlocked;      // the pipe is full
+    bool           _scriptGone;        // the script closed its stdin: the body is dropped
+    unsigned long  _deadlineUs;
+
+    std::string    _output;            // collected output
+    std::string    _pending;           // head and chunk framing not yet sent
+    size_t         _pendingSent;
+    size_t         _chunkLeft;         // bytes of the current chunk still in the pipe
+    bool           _clientBlocked;     // the socket is full
+    bool           _outputEnded;       // the script closed its stdout
+    bool           _hangup;            // ... with a chain splicing from it
+    ResponseBuilder _response;
+    unsigned long  _bytesToClient;
+    LogFields      _log;
+
+    CgiSession(const CgiSession&);
+    CgiSession& operator=(const CgiSession&);
+
+    bool readBody();
+    void writeBody();
+    bool collectOutput();
+    bool streamOutput();
+    bool streamThroughRing();
+    bool flushPending();
+    void startStreaming();
+    void finishCollected();
+    void drainOutput();
+    void frame(const char* data, size_t length);
+    void chunkHeader(size_t length);
+    void reap();
+    Result progress() const;
+};
+
+#endif
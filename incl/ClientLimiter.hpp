@@ -0,0 +1,96 @@
+#ifndef CLIENTLIMITER_HPP
+#define CLIENTLIMITER_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// limit_req and limit_conn of one server block or location. zone names the
+// rule in the limiter; it is derived from the block's metrics label so a
+// reload keeps every client's state.
+struct ClientLimit
+{
+    unsigned long zone;
+    unsigned long rate;          // requests per second, in thousandths
+    unsigned long burst;         // requests allowed above the rate
+    unsigned long connections;   // requests in flight at once
+
+    ClientLimit();
+
+    bool limitsRequests() const;
+    bool limitsConnections() const;
+
+    // "10r/s", "120r/m", optionally followed by "burst=N".
+    void parseRequestLimit(const std::string& value);
+    void parseConnectionLimit(const std::string& value);
+};
+
+// The address a client is limited under, as 16 bytes: an IPv6 address, or
+// the IPv4-mapped form of an IPv4 one so both spellings of a peer match.
+// Unix socket peers are all zero.
+struct ClientKey
+{
+    unsigned char bytes[16];
+
+    ClientKey();
+
+    bool operator==(const ClientKey& other) const;
+};
+
+// Per-client-address state for every ClientLimit, in a table of CAPACITY
+// entries allocated once. Entries are chained by hash and kept in LRU order;
+// when the table is full the least recently seen client is forgotten, except
+// for entries that still count requests in flight. A client that cannot be
+// tracked at all is let through rather than refused.
+class ClientLimiter
+{
+private:
+    struct Entry
+    {
+        ClientKey     address;
+        unsigned long zone;
+        unsigned long tokens;       // thousandths of a request
+        unsigned long refilledUs;
+        unsigned long inFlight;
+        int           hashNext;
+        int           newer;
+        int           older;
+    };
+
+    std::vector<Entry> _entries;
+    std::vector<int>   _buckets;
+    size_t             _used;
+    int                _newest;
+    int                _oldest;
+    unsigned long      _evictions;
+
+    ClientLimiter(const ClientLimiter&);
+    ClientLimiter& operator=(const ClientLimiter&);
+
+    size_t bucketFor(const ClientKey& address, unsigned long zone) const;
+    int find(const ClientKey& address, unsigned long zone);
+    int insert(const ClientKey& address, unsigned long zone, unsigned long nowUs, const ClientLimit& limit);
+    void unlinkHash(int index);
+    void unlinkLru(int index);
+    void pushNewest(int index);
+
+public:
+    static const size_t CAPACITY = 4096;
+    static const size_t BUCKETS = CAPACITY * 2;
+
+    ClientLimiter();
+
+    // Takes one request from the client's bucket. When it is empty, returns
+    // false and sets retryAfter to the seconds until the next request fits.
+    bool takeToken(const ClientKey& address, const ClientLimit& limit, unsigned long nowUs,
+        unsigned long& retryAfter);
+    // Counts one more request in flight. slot is what release() needs, or -1
+    // when the client is not tracked.
+    bool acquire(const ClientKey& address, const ClientLimit& limit, unsigned long nowUs, int& slot);
+    void release(int slot);
+
+    size_t size() const;
+    unsigned long evictions() const;
+};
+
+#endif
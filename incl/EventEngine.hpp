@@ -0,0 +1,221 @@
+#ifndef EVENTENGINE_HPP
+#define EVENTENGINE_HPP
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf;
+
+// How Server::run waits on its descriptors. Either way the set is the
+// server's pollfd vector and wait() behaves like poll() on it: level-
+// triggered, with revents filled in for the loop to dispatch.
+//
+// POLL calls poll() on the whole set each time.
+//
+// URING keeps a multishot poll armed in an io_uring for every descriptor,
+// re-armed only when its events change, so a wait is one io_uring_enter()
+// that also submits every change made since the last one, however many
+// descriptors sit idle. A multishot poll only reports new readiness, so a
+// descriptor reported by the last wait also gets a one-shot poll, which
+// checks it as it is armed: one the loop did not drain is reported again,
+// as poll() would. A poll for POLLOUT is one-shot, as a writable socket
+// would complete a multishot one on every wakeup. Listeners get a multishot accept instead: the kernel
+// accepts connections as they arrive and accept() hands them out. Out of
+// descriptors, a listener is polled and accepted from as with poll() until
+// an accept succeeds, since the kernel fails a multishot accept before it
+// looks for a connection.
+//
+// A managed descriptor is not polled for what the ring does for it. Its
+// reads are a receive into a buffer ring registered with the kernel,
+// armed while the loop asks for POLLIN and reported as POLLIN once it
+// completes; receive() hands the data over. Its writes are linked chains
+// queued by send() and submitted with the next wait: POLLOUT is reported
+// when one completes, and whenever none is in flight. A request and its
+// response thus cost the two waits that carry them and no other syscall.
+// Only the server's own plain-socket reads and writes are managed; a
+// session that works the socket itself (TLS, HTTP/2, splice) takes it back
+// between two reads.
+//
+// The ring holds a reference to a file while an operation is armed on it,
+// so a descriptor is forgotten before it is closed; a reused descriptor
+// number is a new watch.
+class EventEngine
+{
+public:
+    enum Backend
+    {
+        POLL,
+        URING
+    };
+
+    static const unsigned SQ_ENTRIES = 256;
+    static const unsigned CQ_ENTRIES = 4096;
+    static const unsigned RECV_BUFFERS = 256;
+    static const unsigned RECV_BUFFER_SIZE = 8192;
+    // Bytes of a send() copied into one chain.
+    static const size_t SEND_LIMIT = 256 * 1024;
+
+    EventEngine();
+    ~EventEngine();
+
+    // Switches to io_uring. False, staying on poll(), when the kernel lacks
+    // it or a feature the engine needs.
+    bool useUring();
+    Backend backend() const;
+    const char* name() const;
+
+    // poll() on fds; listeners are the descriptors that accept connections.
+    int wait(std::vector<pollfd>& fds, const std::vector<int>& listeners, int timeoutMs);
+    // fd leaves the set or is about to be closed.
+    void forget(int fd);
+    // accept() on a listener wait() reported readable. With io_uring the
+    // connection was already accepted; -1 with EAGAIN when none is left.
+    int accept(int listener, sockaddr_storage& address, socklen_t& length);
+    // Connections accepted on listener and not handed out yet.
+    bool acceptPending(int listener) const;
+
+    // Hands fd's reads and writes to the ring, or back. Without io_uring and
+    // a buffer ring (Linux 5.19) nothing is managed.
+    void manage(int fd, bool reads, bool writes);
+    bool managesWrites(int fd) const;
+    // Appends to buffer everything the ring has received for fd; with
+    // nothing there, one recv() of at most length bytes. Returns like recv().
+    ssize_t receive(int fd, std::string& buffer, size_t length);
+    // Writes iov, then up to spliceLength bytes of the pipe spliceFd once
+    // all of iov is out. On a managed descriptor the data is copied into a
+    // chain for the next wait and -1 returned with EAGAIN, as it is while the
+    // chain is in flight; the call after it completed returns what it
+    // moved. The caller passes what it still has to send each time.
+    ssize_t send(int fd, const struct iovec* iov, int count, int spliceFd, size_t spliceLength);
+    // send() has a chain on fd whose result it has not returned yet.
+    bool sending(int fd) const;
+
+private:
+    enum State
+    {
+        IDLE,
+        POLLING,
+        ACCEPTING
+    };
+
+    enum Kind
+    {
+        OP_POLL = 1,
+        OP_PROBE,               // one-shot level check next to a multishot poll
+        OP_ACCEPT,
+        OP_RECV,
+        OP_SEND,                // the send and the splice of a chain
+        OP_SEND_POLL,           // the poll for room before the splice
+        OP_CANCEL               // its completion is ignored
+    };
+
+    struct Watch
+    {
+        uint32_t generation;    // tells completions for an earlier poll or accept apart
+        uint32_t epoch;         // the same for receives and chains: bumped by forget()
+        short    armed;         // events the armed poll waits for
+        char     state;
+        bool     listener;
+        bool     acceptByPoll;  // the kernel refused a multishot accept
+        bool     outOfFds;      // the last one failed for want of a descriptor
+        bool     reported;      // by its poll, in the last wait
+        bool     probing;
+        bool     reads;         // managed
+        bool     writes;
+        bool     receiving;     // a receive is armed
+        bool     buffered;      // _received holds something for it
+        bool     sending;       // a chain is in flight
+        bool     sent;          // one completed and send() has not returned it yet
+        ssize_t  result;        // what it moved, or -errno
+        size_t   index;         // position in the set at the last wait()
+    };
+
+    // Ring buffers holding what a receive took off the socket, by
+    // descriptor, and how the stream ended.
+    struct Received
+    {
+        std::deque<std::pair<unsigned, unsigned> > buffers;  // id and length
+        bool ended;
+        int  error;
+
+        Received();
+    };
+
+    // The operations of a chain complete one by one; its data stays here
+    // until the last of them has, even if the descriptor is forgotten.
+    struct Chain
+    {
+        std::string data;
+        unsigned    pending;
+        ssize_t     moved;
+        int         error;
+    };
+
+    // Connections the kernel accepted, and the error that ended a multishot
+    // accept, by listener.
+    struct Accepted
+    {
+        std::deque<int> fds;
+        int             error;
+
+        Accepted();
+    };
+
+    Backend          _backend;
+    int              _ring;
+    void*            _rings;
+    size_t           _ringsSize;
+    io_uring_sqe*    _sqes;
+    size_t           _sqesSize;
+    unsigned*        _sqHead;
+    unsigned*        _sqTail;
+    unsigned*        _sqArray;
+    unsigned         _sqMask;
+    unsigned         _sqEntries;
+    unsigned         _unsubmitted;
+    unsigned*        _cqHead;
+    unsigned*        _cqTail;
+    io_uring_cqe*    _cqes;
+    unsigned         _cqMask;
+    io_uring_buf*    _buffers;      // the buffer ring, RECV_BUFFERS entries
+    char*            _bufferMemory;
+    uint16_t         _bufferTail;
+    std::vector<Watch> _watches;
+    std::map<int, Accepted> _accepted;
+    std::map<int, Received> _received;
+    std::map<uint64_t, Chain> _chains;
+    std::vector<pollfd>* _fds;   // during wait(), for completions to land in
+    int              _ready;
+    bool             _multishot;    // false on kernels without multishot polls
+
+    EventEngine(const EventEngine&);
+    EventEngine& operator=(const EventEngine&);
+
+    int waitUring(std::vector<pollfd>& fds, const std::vector<int>& listeners, int timeoutMs);
+    bool setupBuffers();
+    void arm(int fd, short events, bool listener);
+    void probe(int fd, Watch& watch);
+    void armReceive(int fd, Watch& watch);
+    void cancel(int fd, Watch& watch);
+    void cancelOperation(int opcode, uint64_t data, unsigned flags);
+    void recycle(unsigned id);
+    void completeReceive(int fd, uint32_t epoch, int result, unsigned flags);
+    void completeChain(uint64_t data, int result, bool poll);
+    io_uring_sqe* nextSqe(unsigned room = 1);
+    int enter(unsigned minComplete, int timeoutMs);
+    void reap();
+    void complete(uint64_t data, int result, unsigned flags);
+    void report(int fd, short revents);
+    Watch& watch(int fd);
+    void closeRing();
+};
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef GZIP_HPP
+#define GZIP_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <sys/stat.h>
+#include "RequestArena.hpp"
+
+class ResponseBuilder;
+
+// gzip of one server block or location:
+//   gzip on|off;
+//   gzip_types <mime type> ...;     text/html is always compressed
+//   gzip_min_length <bytes>;
+//   gzip_comp_level <1-9>;
+//   gzip_static on|off;
+// A location that sets any of them uses its own settings rather than the
+// server block's, as with cgi_cache.
+struct GzipPolicy
+{
+    bool   on;
+    bool   staticFiles;              // gzip_static
+    size_t minLength;
+    int    level;
+    std::vector<std::string> types;
+    bool   configured;
+
+    static const size_t DEFAULT_MIN_LENGTH = 256;
+
+    GzipPolicy();
+
+    // Returns false when line is not a gzip directive.
+    bool parse(const std::string& line);
+    bool enabled() const;
+    bool compresses(const char* contentType, size_t length) const;
+};
+
+// On-the-fly compression. One deflate stream is kept for the process and
+// reset per response, so a response costs no zlib allocation, and output
+// grows a chunk at a time instead of being sized for the worst case up
+// front.
+class Gzip
+{
+public:
+    static const size_t CHUNK = 16 * 1024;
+    static const size_t MEMO_LIMIT = 16 * 1024 * 1024;
+
+    // Accept-Encoding lists gzip (or *) without q=0.
+    static bool accepted(const StringRef& acceptEncoding);
+    static bool compress(const char* data, size_t length, int level, std::string& output);
+    // Compresses the body of response in place when policy covers
+    // contentType and its size, and the client accepts gzip. Adds Vary
+    // whenever the response could have been compressed.
+    static void encode(ResponseBuilder& response, const GzipPolicy& policy, const char* contentType, bool accepted);
+    // The compressed form of a static file, compressed once per path and
+    // modification time. NULL when it does not shrink the file.
+    static const std::string* staticVariant(const char* path, const struct stat& fileStat, const std::string& content,
+        int level);
+
+private:
+    struct Memo
+    {
+        time_t      mtime;
+        long        mtimeNs;
+        off_t       size;
+        std::string data;
+        bool        worthIt;
+        std::list<std::string>::iterator order;
+    };
+
+    static std::map<std::string, Memo>& memos();
+    static std::list<std::string>& memoOrder();
+    static size_t& memoBytes();
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef HPACK_HPP
+#define HPACK_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <cstddef>
+
+// HPACK header table (RFC 7541): the 61 static entries followed by the
+// dynamic table, newest first. Entries are evicted oldest first to keep the
+// table within maxSize, counted as name + value + 32 bytes per entry. Each
+// direction of a connection has its own: the decoder's follows what the
+// peer indexed, the encoder's what we did.
+class HpackTable
+{
+public:
+    static const size_t DEFAULT_SIZE = 4096;
+    static const size_t STATIC_ENTRIES = 61;
+
+    HpackTable();
+
+    // index is 1-based across the static then the dynamic table.
+    bool get(size_t index, std::string& name, std::string& value) const;
+    void add(const std::string& name, const std::string& value);
+    void resize(size_t maxSize);
+    // Index of name: value, or 0. nameIndex is set to an entry with the
+    // name alone when there is one.
+    size_t find(const std::string& name, const std::string& value, size_t& nameIndex) const;
+    size_t maxSize() const;
+
+private:
+    std::deque<std::pair<std::string, std::string> > _entries;
+    size_t _size;
+    size_t _maxSize;
+
+    void evict(size_t room);
+};
+
+// Header block coding. Strings are Huffman coded when that is shorter.
+class Hpack
+{
+public:
+    typedef std::vector<std::pair<std::string, std::string> > Headers;
+
+    // Decodes a complete header block. maxTableSize is the limit our
+    // SETTINGS_HEADER_TABLE_SIZE allows the peer. Returns false on a
+    // compression error, which is fatal to the connection.
+    static bool decode(HpackTable& table, const unsigned char* data, size_t length, size_t maxTableSize,
+        Headers& headers);
+    // Appends one field. indexed chooses literal with incremental indexing
+    // over without indexing when the field is not in the table yet.
+    static void encode(HpackTable& table, const std::string& name, const std::string& value, bool indexed,
+        std::string& output);
+    static void encodeTableSize(size_t size, std::string& output);
+
+    static bool huffmanDecode(const unsigned char* data, size_t length, std::string& output);
+    static void huffmanEncode(const std::string& text, std::string& output);
+    static size_t huffmanLength(const std::string& text);
+
+private:
+    static void encodeInteger(size_t value, int prefixBits, unsigned char flags, std::string& output);
+    static bool decodeInteger(const unsigned char*& cursor, const unsigned char* end, int prefixBits, size_t& value);
+    static void encodeString(const std::string& text, std::string& output);
+    static bool decodeString(const unsigned char*& cursor, const unsigned char* end, std::string& text);
+};
+
+#endif
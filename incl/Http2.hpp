@@ -0,0 +1,178 @@
+#ifndef HTTP2_HPP
+#define HTTP2_HPP
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <stdint.h>
+#include "Hpack.hpp"
+#include "ResponseBuilder.hpp"
+#include "RequestArena.hpp"
+
+class LatencyHistogram;
+class TlsConnection;
+
+// One HTTP/2 connection: over cleartext (h2c), entered with the connection
+// preface (prior knowledge) or from an HTTP/1.1 request asking for
+// Upgrade: h2c, which then becomes stream 1; or over TLS once ALPN chose h2.
+//
+// A request is handed to the server once its stream has ended, as the
+// HTTP/1.1 text the existing handlers parse. A response is framed as it is
+// given: its header block at once, so the HPACK tables of both ends see
+// blocks in wire order, and its body in DATA frames that a scheduler
+// interleaves across streams by priority, within the flow-control windows
+// the peer grants. Output is produced only while less than HIGH_WATER bytes
+// wait for the socket, so a stream of higher priority that gets data
+// overtakes what has not been framed yet.
+class Http2Session
+{
+public:
+    enum Result
+    {
+        CONTINUE,
+        CLOSE
+    };
+
+    enum ErrorCode
+    {
+        NO_ERROR = 0x0,
+        PROTOCOL_ERROR = 0x1,
+        INTERNAL_ERROR = 0x2,
+        FLOW_CONTROL_ERROR = 0x3,
+        STREAM_CLOSED = 0x5,
+        FRAME_SIZE_ERROR = 0x6,
+        REFUSED_STREAM = 0x7,
+        CANCEL = 0x8,
+        COMPRESSION_ERROR = 0x9,
+        ENHANCE_YOUR_CALM = 0xb,
+        HTTP_1_1_REQUIRED = 0xd
+    };
+
+    // What the server keeps about the request on a stream. It is handed
+    // back by nextClosed() when the stream closes, to record the latency
+    // and free the limit_conn slot.
+    struct Exchange
+    {
+        unsigned long     startUs;
+        LatencyHistogram* histogram;
+        int               limitSlot;
+    };
+
+    static const char PREFACE[];
+    static const size_t PREFACE_LENGTH = 24;
+    static const uint32_t MAX_CONCURRENT_STREAMS = 100;
+    static const uint32_t MAX_FRAME_SIZE = 16384;
+    static const uint32_t WINDOW = 1024 * 1024;          // granted per stream and for the connection
+    static const size_t HIGH_WATER = 64 * 1024;
+    static const size_t MAX_HEADER_BLOCK = 64 * 1024;
+    static const int DEFAULT_WEIGHT = 16;
+
+    // tls is the connection's TLS, or NULL.
+    Http2Session(int clientFd, TlsConnection* tls);
+    ~Http2Session();
+
+    // The connection was upgraded from HTTP/1.1: answers 101, applies the
+    // HTTP2-Settings header and makes request stream 1. The client preface
+    // is still to come.
+    bool upgrade(const StringRef& settings, const std::string& request);
+    Result receive(const char* data, size_t length);
+    Result readable();
+    Result writable();
+    short events() const;
+
+    // The next stream whose request is complete, as HTTP/1.1 text, or NULL.
+    const std::string* nextRequest(uint32_t& streamId);
+    RequestArena& arena(uint32_t streamId);
+    Exchange& exchange(uint32_t streamId);
+    bool streamOpen(uint32_t streamId) const;
+    void respond(uint32_t streamId, ResponseBuilder& response);
+    void reset(uint32_t streamId, ErrorCode code);
+    bool nextClosed(Exchange& exchange);
+    // No new streams are accepted; the connection closes once the open
+    // ones are answered.
+    void goAway();
+    // Streams open or output still to send.
+    bool busy() const;
+    // Closes every stream as the connection goes away, so that nextClosed()
+    // hands back all their exchanges.
+    void abort();
+    int clientFd() const;
+
+private:
+    struct Stream
+    {
+        bool          requestDone;         // END_STREAM received
+        bool          dispatched;          // handed to the server
+        bool          hasLength;           // the request carried content-length
+        std::string   request;             // head, then the whole request once done
+        std::string   body;
+        long          sendWindow;
+        uint32_t      receivedUnacked;
+        uint32_t      parent;
+        int           weight;
+        long          credit;
+        bool          responding;
+        ResponseBuilder response;
+        size_t        bodySent;
+        RequestArena* arena;
+        Exchange      exchange;
+    };
+
+    int           _clientFd;
+    TlsConnection* _tls;
+    std::string   _in;
+    std::string   _out;
+    size_t        _outSent;
+    bool          _awaitPreface;
+    bool          _settingsReceived;
+    bool          _closing;            // connection error sent: close once the output is flushed
+    bool          _draining;           // GOAWAY sent or received: no new streams, close once idle
+    uint32_t      _lastStreamId;
+    std::map<uint32_t, Stream> _streams;
+    std::deque<uint32_t> _ready;
+    std::vector<Exchange> _closed;
+    HpackTable    _decoder;
+    HpackTable    _encoder;
+    bool          _tableSizeChanged;
+    uint32_t      _headerStream;       // stream of a header block awaiting CONTINUATION
+    uint8_t       _headerFlags;
+    std::string   _headerBlock;
+    bool          _headerPriority;     // the HEADERS frame carried a priority
+    uint32_t      _headerParent;
+    int           _headerWeight;
+    bool          _headerExclusive;
+    long          _sendWindow;
+    uint32_t      _receivedUnacked;
+    long          _initialWindow;      // the peer's SETTINGS_INITIAL_WINDOW_SIZE
+    uint32_t      _peerMaxFrame;
+
+    Http2Session(const Http2Session&);
+    Http2Session& operator=(const Http2Session&);
+
+    bool handleFrame(uint8_t type, uint8_t flags, uint32_t streamId, const unsigned char* payload, uint32_t length);
+    bool handleHeaders(uint8_t flags, uint32_t streamId, const unsigned char* payload, uint32_t length);
+    bool handleContinuation(uint8_t flags, uint32_t streamId, const unsigned char* payload, uint32_t length);
+    bool endHeaders();
+    bool handleData(uint8_t flags, uint32_t streamId, const unsigned char* payload, uint32_t length);
+    bool handleSettings(uint8_t flags, uint32_t streamId, const unsigned char* payload, uint32_t length);
+    bool applySettings(const unsigned char* payload, uint32_t length);
+    bool handleWindowUpdate(uint32_t streamId, const unsigned char* payload, uint32_t length);
+    bool handlePriority(uint32_t streamId, const unsigned char* payload);
+    Stream& openStream(uint32_t streamId);
+    bool startRequest(uint32_t streamId, const Hpack::Headers& headers, bool endStream);
+    void finishRequest(uint32_t streamId, Stream& stream);
+    void setPriority(uint32_t streamId, uint32_t parent, int weight, bool exclusive);
+    bool connectionError(ErrorCode code);
+    void closeStream(uint32_t streamId);
+
+    void writeFrame(uint8_t type, uint8_t flags, uint32_t streamId, const char* payload, size_t length);
+    void writeWindowUpdate(uint32_t streamId, uint32_t increment);
+    void writeHeaders(uint32_t streamId, const std::string& block, bool endStream);
+    bool sendable(const Stream& stream) const;
+    uint32_t nextToSend();
+    bool canSend() const;
+    void schedule();
+};
+
+#endif
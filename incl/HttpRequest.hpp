@@ -16,41 +16,119 @@
 #include "ServerConfig.hpp"
 #include <sys/stat.h>
 #include "ServerLocation.hpp"
+#include "ResponseBuilder.hpp"
+#include "RequestArena.hpp"
+#include "ResponseCache.hpp"
 #include <ctime>
 
+struct UploadTarget;
+class CgiSession;
+class TlsConnection;
+
 class HttpRequest
 {
 private:
-	std::string _method;
-    std::string _path;
-    std::string _httpVersion;
+	struct HeaderField
+	{
+		StringRef name;
+		StringRef value;
+	};
+
+	// The request line and headers are copied into the arena and cut in
+	// place, so every field below points into it.
+	RequestArena& _arena;
+	StringRef _method;
+    StringRef _path;
+    StringRef _httpVersion;
     std::string _body;
-    std::map<std::string, std::string> _headers;
+    HeaderField* _headers;
+    size_t _headerCount;
+    size_t _headLength;
+    CacheFill* _fill;
+    std::string _cacheWait;
+    unsigned long _cacheLockTimeoutUs;
+    int _cgiClientFd;                 // -1 unless streamCgi() was called
+    TlsConnection* _cgiTls;
+    unsigned long _bodyOnSocket;      // body bytes not read yet
+    unsigned long _contentLength;     // 0 without a Content-Length
+    bool _lengthValid;                // false for a malformed Content-Length
+    CgiSession* _cgi;
+
+	HttpRequest(const HttpRequest&);
+	HttpRequest& operator=(const HttpRequest&);
 	
 public:
-	HttpRequest(const std::string rawRequest);
+	HttpRequest(const std::string& rawRequest, RequestArena& arena);
 	~HttpRequest();
 
-	std::string handleRequest(ServerConfig& config);
-	std::string resolveFilePath(const ServerConfig& config);
-	std::string readFile(const std::string& filePath);
-	std::string handleGet(ServerConfig& config);
-	std::string	handlePost(ServerConfig& config);
-	std::string handleDownload(ServerConfig& config, std::string& response);
-	std::string uploadTxt(ServerConfig& config, std::string response);
-	std::string uploadFile(ServerConfig& config, std::string response, std::string contentType);
-	std::string handleDelete(ServerConfig& config);
-	std::string findErrorPage(ServerConfig& config, int errorCode);
+	void takeBody(const std::string& rawRequest);
+	// Content-Length, parsed once with the head. A header that is not a plain
+	// decimal number fitting an unsigned long is refused with 400 by
+	// handleRequest; contentLength() is 0 for it.
+	unsigned long contentLength() const;
+	bool contentLengthValid() const;
+
+	ResponseBuilder handleRequest(ServerConfig& config);
+	const char* resolveFilePath(const ServerConfig& config);
+	bool readFile(const char* filePath, std::string& content);
+	ResponseBuilder handleGet(ServerConfig& config);
+	ResponseBuilder handlePost(ServerConfig& config);
+	ResponseBuilder uploadTxt(ServerConfig& config);
+	ResponseBuilder uploadFile(ServerConfig& config, const std::string& contentType);
+	// For a POST whose body is still arriving: 0 when handlePost would write
+	// it to a file, with target filled in, so that it can be streamed there;
+	// the status to refuse it with; or -1 when it is handled once complete.
+	int uploadPlan(ServerConfig& config, UploadTarget& target);
+	ResponseBuilder handleDelete(ServerConfig& config);
+	ResponseBuilder handleStubStatus();
+	ResponseBuilder handleTraceDump();
+	ResponseBuilder handleBundle(ServerConfig& config, const ServerLocation& location);
+	ResponseBuilder findErrorPage(ServerConfig& config, int errorCode);
 	std::string getMimeType(const std::string& filePath);
-	std::string getPath() const;
-	std::string getMethod() const;
+	static const char* mimeTypeFor(const std::string& filePath);
+	static const char* mimeTypeFor(const char* filePath);
+	const char* getPath() const;
+	const char* getMethod() const;
+	StringRef header(const char* name) const;
 	std::string getHeaderValue(const std::string& headerName) const;
-	std::string getHttpVersion(void);
-	std::string handleParentProcess(int outputPipe[2], int inputPipe[2], pid_t pid);
-	std::string constructCGIResponse(const std::string& output);
-	std::string executeCGI(const std::string& scriptPath, ServerConfig& config);
-	std::string generateDefaultErrorPage(int errorCode);
-	std::string intToString(int value);
+	const char* getHttpVersion() const;
+	StringRef getMethodRef() const;
+	StringRef getPathRef() const;
+	StringRef getHttpVersionRef() const;
+	size_t getHeadLength() const;
+	size_t getHeaderCount() const;
+	const StringRef& getHeaderName(size_t index) const;
+	const StringRef& getHeaderValue(size_t index) const;
+	ResponseBuilder handleParentProcess(int outputPipe[2], int inputPipe[2], pid_t pid);
+	ResponseBuilder constructCGIResponse(const std::string& output, const GzipPolicy* gzip = NULL, bool accepted = false);
+	ResponseBuilder executeCGI(const std::string& scriptPath, ServerConfig& config);
+	ResponseBuilder cachedCGI(const std::string& scriptPath, ServerConfig& config, const CachePolicy& policy);
+	std::string cacheKey(const ServerConfig& config, const CachePolicy& policy) const;
+	// Starts the script without waiting for it; its output is read from the
+	// returned non-blocking outputFd. With inputFd, the script's stdin is
+	// left open there for the caller to write the body to.
+	pid_t spawnCGI(const std::string& scriptPath, int& outputFd, int* inputFd = NULL);
+	// executeCGI always hands the script to the event loop as a CgiSession
+	// (takeCgiSession()). This names the client it streams to; rawRequest
+	// is what has been read of the request: a body still arriving is
+	// streamed to the script. Without it the session answers in one piece,
+	// as an HTTP/2 stream needs.
+	void streamCgi(int clientFd, TlsConnection* tls, const std::string& rawRequest);
+	CgiSession* takeCgiSession();
+	// Body bytes still on the socket when the request was handled.
+	unsigned long bodyOnSocket() const;
+	// The cgi_cache fill this request started, if any. The caller owns it
+	// afterwards.
+	CacheFill* takeCacheFill();
+	// Key of the in-flight fill the response is to come from, or empty when
+	// handleRequest returned the response itself.
+	const std::string& cacheWait(unsigned long& lockTimeoutUs) const;
+	// The gzip settings covering the request path, or NULL; accepted tells
+	// whether the client takes gzip.
+	const GzipPolicy* gzipPolicy(const ServerConfig& config, bool& accepted) const;
+	bool readGzipSibling(const char* filePath, bool accepted, ResponseBuilder& response, bool& found);
+	void compressStatic(const GzipPolicy& gzip, const char* filePath, bool accepted, ResponseBuilder& response);
+	static ResponseBuilder generateDefaultErrorPage(int errorCode);
 	std::string extractJsonValue(const std::string& json, const std::string& key);
 
 	void createPipes(int outputPipe[2], int inputPipe[2]);
@@ -58,7 +136,7 @@ public:
 	std::vector<char*> setupCGIEnvironment(const std::string& scriptPath);
 
 	bool ensureUploadDirectoryExists();
-	bool isFileAccessible(const std::string& filePath);
+	bool isFileAccessible(const char* filePath);
 
 	int extractStatusCode(const std::string& response);
 };
@@ -0,0 +1,104 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <string>
+#include <ctime>
+#include <csignal>
+#include <pthread.h>
+
+// Single-producer / single-consumer byte ring. The event loop appends
+// length-prefixed records, the writer thread drains them. Head and tail are
+// only ever advanced by their owning side, so no lock is taken.
+class LogRing
+{
+private:
+    char*           _data;
+    size_t          _capacity;
+    volatile size_t _head;
+    volatile size_t _tail;
+
+    LogRing(const LogRing&);
+    LogRing& operator=(const LogRing&);
+
+    void copyIn(size_t pos, const char* src, size_t len);
+    void copyOut(size_t pos, char* dst, size_t len) const;
+
+public:
+    explicit LogRing(size_t capacity);
+    ~LogRing();
+
+    bool push(const char* record, size_t len);
+    size_t pop(char* dst, size_t maxLen);
+    bool empty() const;
+    size_t capacity() const;
+};
+
+class Logger
+{
+public:
+    enum FullPolicy { DROP, BLOCK };
+
+private:
+    struct Channel
+    {
+        LogRing*     ring;
+        std::string  path;
+        int          fd;
+        unsigned long dropped;
+
+        Channel();
+    };
+
+    Channel         _access;
+    Channel         _error;
+    Channel         _slow;
+    FullPolicy      _policy;
+    pthread_t       _thread;
+    pthread_mutex_t _configLock;
+    bool            _started;
+    volatile int    _stopping;
+    int             _spaceFd;       // eventfd: the writer freed ring space
+    volatile int    _writerIdle;
+    volatile int    _producerWaiting;
+    pid_t           _owner;
+    std::time_t     _stampTime;
+    char            _stamp[32];
+
+    static volatile sig_atomic_t _reopenRequested;
+    static int                   _wakeFd;   // eventfd: work for the writer
+
+    Logger();
+    Logger(const Logger&);
+    Logger& operator=(const Logger&);
+
+    void start();
+    void enqueue(Channel& channel, const std::string& line);
+    void reopen();
+    void openChannel(Channel& channel);
+    bool drain(Channel& channel, char* batch, size_t batchSize);
+    bool pending() const;
+    void wakeWriter();
+    static void* writerMain(void* arg);
+
+public:
+    static const size_t DEFAULT_RING_SIZE = 1 << 20;
+    static const size_t SLOW_RING_SIZE = 1 << 16;
+    static const size_t MAX_RECORD = 8192;
+
+    ~Logger();
+    static Logger& instance();
+
+    void configure(const std::string& accessPath, const std::string& errorPath, const std::string& slowPath,
+        FullPolicy policy);
+    void error(const std::string& level, const std::string& message);
+    void access(const std::string& line);
+    void slow(const std::string& line);
+    void shutdown();
+
+    const char* timestamp();
+    unsigned long droppedCount() const;
+
+    static void requestReopen();
+};
+
+#endif
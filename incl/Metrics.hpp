@@ -0,0 +1,138 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+
+class UpstreamGroup;
+
+// Log-linear (HDR-style) latency histogram in microseconds: 16 sub-buckets
+// per power of two, i.e. about 6% relative precision. Counts are allocated on
+// the first sample so idle locations cost only a few words.
+class LatencyHistogram
+{
+private:
+    std::string    _server;
+    std::string    _location;
+    unsigned long* _counts;
+    unsigned long  _total;
+    unsigned long  _sumUs;
+    unsigned long  _maxUs;
+
+    LatencyHistogram(const LatencyHistogram&);
+    LatencyHistogram& operator=(const LatencyHistogram&);
+
+public:
+    static const int SUB_BUCKET_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int MAX_EXPONENT = 40;
+    static const int BUCKET_COUNT = (MAX_EXPONENT - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    LatencyHistogram(const std::string& server, const std::string& location);
+    ~LatencyHistogram();
+
+    void record(unsigned long micros);
+    unsigned long count() const;
+    unsigned long sumMicros() const;
+    unsigned long maxMicros() const;
+    unsigned long countAtOrBelow(unsigned long micros) const;
+    unsigned long percentile(double quantile) const;
+    const std::string& server() const;
+    const std::string& location() const;
+
+    static int bucketIndex(unsigned long micros);
+    static unsigned long bucketUpperBound(int index);
+};
+
+// Process-wide counters, exported in Prometheus text format by stub_status
+// locations. Everything runs on the event-loop thread, so plain integers are
+// enough and every update is a single increment.
+class Metrics
+{
+public:
+    enum RejectReason
+    {
+        REJECT_CONNECTIONS,   // worker_connections reached
+        REJECT_MEMORY,        // memory_limit reached
+        REJECT_LAG,           // event loop lag above shed_lag_threshold
+        REJECT_DESCRIPTORS,   // accept() failed with EMFILE/ENFILE
+        REJECT_REASONS
+    };
+
+    enum LimitKind
+    {
+        LIMIT_REQ,            // limit_req bucket empty
+        LIMIT_CONN,           // limit_conn requests already in flight
+        LIMIT_KINDS
+    };
+
+private:
+    struct CacheCounters
+    {
+        unsigned long hits;
+        unsigned long misses;
+        CacheCounters();
+    };
+
+    unsigned long _accepted;
+    unsigned long _active;
+    unsigned long _idle;
+    unsigned long _bytesIn;
+    unsigned long _bytesOut;
+    unsigned long _cgiSpawns;
+    unsigned long _cgiTimeouts;
+    unsigned long _rejected[REJECT_REASONS];
+    unsigned long _limited[LIMIT_KINDS];
+    unsigned long _limitEntries;
+    unsigned long _limitEvictions;
+    unsigned long _upstreamConnects;
+    unsigned long _upstreamReuses;
+    unsigned long _upstreamFailures;
+    unsigned long _tlsHandshakes;
+    unsigned long _tlsResumed;
+    unsigned long _tlsFailures;
+    unsigned long _tlsKernel;
+    unsigned long _loopLagUs;
+    unsigned long _bufferedBytes;
+    unsigned long _requestsByStatus[600];
+    std::map<std::string, CacheCounters> _caches;
+    std::map<std::string, LatencyHistogram*> _histograms;
+    std::vector<UpstreamGroup*> _upstreamGroups;
+
+    Metrics();
+    Metrics(const Metrics&);
+    Metrics& operator=(const Metrics&);
+
+    void renderHistograms(std::string& out) const;
+    void renderUpstreams(std::string& out) const;
+
+public:
+    ~Metrics();
+    static Metrics& instance();
+
+    void connectionAccepted();
+    void setConnections(unsigned long active, unsigned long idle);
+    void requestCompleted(int statusCode);
+    void bytesReceived(unsigned long bytes);
+    void bytesSent(unsigned long bytes);
+    void cgiSpawned();
+    void cgiTimedOut();
+    void connectionRejected(RejectReason reason);
+    void setLoad(unsigned long loopLagUs, unsigned long bufferedBytes);
+    void requestLimited(LimitKind kind);
+    void setLimiterState(unsigned long entries, unsigned long evictions);
+    void upstreamConnection(bool reused);
+    void upstreamFailed();
+    void tlsHandshake(bool resumed, bool kernelSend);
+    void tlsFailed();
+    void setUpstreamGroups(const std::vector<UpstreamGroup*>& groups);
+    void cacheLookup(const std::string& cache, bool hit);
+    LatencyHistogram* histogram(const std::string& server, const std::string& location);
+
+    void render(std::string& out) const;
+
+    static unsigned long nowMicros();
+};
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef PROXY_HPP
+#define PROXY_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <netinet/in.h>
+#include "RequestArena.hpp"
+
+class UpstreamGroup;
+class TlsConnection;
+
+// One upstream server: its address, resolved once, the idle keep-alive
+// connections to it and its health. Every location, upstream block and
+// configuration generation that names the same host:port shares one
+// instance, so the pool and the health state survive reloads.
+//
+// A server is unavailable while a run of max_fails failures within
+// fail_timeout keeps it down, or while the last active probe failed.
+class Upstream
+{
+private:
+    std::string      _name;
+    sockaddr_in      _address;
+    std::vector<int> _idle;
+    unsigned long    _active;
+    unsigned long    _requests;
+    unsigned long    _fails;
+    unsigned long    _firstFailUs;
+    unsigned long    _downUntilUs;
+    bool             _probeFailed;
+
+    static std::map<std::string, Upstream*>& registry();
+
+    Upstream(const std::string& name, const sockaddr_in& address);
+    Upstream(const Upstream&);
+    Upstream& operator=(const Upstream&);
+
+public:
+    static const size_t MAX_IDLE = 32;
+
+    // Throws when host does not resolve to an IPv4 address.
+    static Upstream* get(const std::string& host, int port);
+
+    // host[:port] as written in proxy_pass; also sent as the Host header.
+    const std::string& name() const;
+    // Non-blocking socket with the connect() started, or -1.
+    int connect() const;
+    int takeIdle();
+    bool keepIdle(int fd);
+    void forget(int fd);
+
+    bool available(unsigned long nowUs) const;
+    // Returns true when this failure takes the server down.
+    bool failed(unsigned long nowUs, unsigned long maxFails, unsigned long failTimeoutUs);
+    void succeeded();
+    // Returns true when the result changes the server's state.
+    bool probed(bool healthy);
+    bool probeFailed() const;
+
+    // Requests being proxied to this server, for least_conn, and all
+    // requests it has been given.
+    unsigned long active() const;
+    unsigned long requests() const;
+    void attach();
+    void detach();
+};
+
+// One request forwarded to an upstream and its response streamed back.
+// Both directions go through bounded buffers: the session stops reading from
+// one side while the other still has HIGH_WATER bytes to take, so a slow
+// client throttles the upstream (and a slow upstream the client upload)
+// instead of growing memory. The response is passed through as it comes,
+// chunked framing included; only the hop-by-hop headers are rewritten.
+//
+// The upstream has connectTimeoutUs to accept the connection and then
+// readTimeoutUs between two successful reads or writes on it; the window
+// is restarted while the client is the one holding the session up.
+class ProxySession
+{
+public:
+    enum Result
+    {
+        CONTINUE,
+        DONE,             // response delivered
+        CLIENT_GONE,
+        UPSTREAM_FAILED,
+        UPSTREAM_TIMED_OUT
+    };
+
+    static const size_t HIGH_WATER = 64 * 1024;
+    static const size_t MAX_RESPONSE_HEAD = 16 * 1024;
+
+    // clientTls is the client's TLS connection, or NULL.
+    ProxySession(int clientFd, TlsConnection* clientTls, UpstreamGroup* group, Upstream* upstream, int upstreamFd,
+        bool reused, bool headRequest, unsigned long connectTimeoutUs, unsigned long readTimeoutUs);
+    ~ProxySession();
+
+    std::string& requestBuffer();
+    void expectBody(unsigned long remaining);
+    LogFields& logFields();
+
+    Result clientReadable();
+    Result clientWritable();
+    Result upstreamReady(short revents);
+    // UPSTREAM_TIMED_OUT once the upstream is past its deadline.
+    Result expire(unsigned long nowUs);
+    short clientEvents() const;
+    short upstreamEvents() const;
+    // 0 while nothing is expected from the upstream.
+    unsigned long deadlineUs() const;
+
+    int clientFd() const;
+    int upstreamFd() const;
+    UpstreamGroup* group() const;
+    Upstream* upstream() const;
+    bool reused() const;
+    bool responseStarted() const;
+    bool upstreamReusable() const;
+    bool clientReusable() const;
+    int status() const;
+    unsigned long bytesToClient() const;
+
+private:
+    enum Framing
+    {
+        FRAMING_NONE,       // HEAD, 204, 304
+        FRAMING_LENGTH,
+        FRAMING_CHUNKED,
+        FRAMING_CLOSE       // delimited by the upstream closing
+    };
+
+    enum ChunkState
+    {
+        CHUNK_SIZE,
+        CHUNK_EXTENSION,
+        CHUNK_DATA,
+        CHUNK_DATA_END,
+        CHUNK_TRAILER
+    };
+
+    int           _clientFd;
+    TlsConnection* _clientTls;
+    UpstreamGroup* _group;
+    Upstream*     _upstream;
+    int           _upstreamFd;
+    bool          _connecting;
+    bool          _reused;
+    bool          _headRequest;
+    std::string   _toUpstream;
+    size_t        _toUpstreamSent;
+    unsigned long _bodyRemaining;
+    std::string   _responseHead;
+    std::string   _toClient;
+    size_t        _toClientSent;
+    bool          _headParsed;
+    bool          _responseDone;
+    bool          _upstreamClose;
+    int           _status;
+    Framing       _framing;
+    unsigned long _remaining;
+    ChunkState    _chunkState;
+    bool          _emptyLine;
+    unsigned long _bytesToClient;
+    unsigned long _connectTimeoutUs;
+    unsigned long _readTimeoutUs;
+    unsigned long _deadlineUs;
+    LogFields     _log;
+
+    ProxySession(const ProxySession&);
+    ProxySession& operator=(const ProxySession&);
+
+    void touch();
+    bool parseResponseHead(size_t headLength);
+    void forwardBody(const char* data, size_t length);
+    size_t scanChunked(const char* data, size_t length);
+    bool flushUpstream();
+    bool flushClient();
+    Result progress() const;
+};
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef REQUESTARENA_HPP
+#define REQUESTARENA_HPP
+
+#include <string>
+#include <cstddef>
+
+class HttpRequest;
+
+// A byte range owned by a RequestArena (or by anything else that outlives
+// it). data is never NULL and, for ranges the parser cut out of a request,
+// is NUL-terminated so it can be passed to C APIs as it is.
+struct StringRef
+{
+    const char* data;
+    size_t      length;
+
+    StringRef();
+    StringRef(const char* data, size_t length);
+
+    bool empty() const;
+    bool equals(const char* value) const;
+    bool equals(const std::string& value) const;
+    bool equalsIgnoreCase(const char* value) const;
+    bool contains(const char* needle) const;
+    // Strict decimal: digits only, no sign or blanks, and no wrap-around.
+    bool toUnsigned(unsigned long& value) const;
+    std::string str() const;
+};
+
+inline bool operator==(const StringRef& ref, const char* value) { return ref.equals(value); }
+inline bool operator!=(const StringRef& ref, const char* value) { return !ref.equals(value); }
+inline bool operator==(const StringRef& ref, const std::string& value) { return ref.equals(value); }
+inline bool operator!=(const StringRef& ref, const std::string& value) { return !ref.equals(value); }
+
+// Request fields for the access log of a request that is answered after
+// handleClientRequest returns. They point into the request arena, which is
+// released only when the response has been sent.
+struct LogFields
+{
+    StringRef method;
+    StringRef target;
+    StringRef version;
+    StringRef userAgent;
+
+    LogFields();
+    explicit LogFields(const HttpRequest& request);
+};
+
+// Bump-pointer allocator for everything parsed and built while serving one
+// request. Allocation is a pointer increment; release() hands every block
+// back at once when the response has been sent. Blocks of BLOCK_SIZE go to a
+// process-wide free list instead of the heap, so once the list is warm a
+// request costs no malloc at all. Objects placed in the arena are never
+// destroyed: only store plain data.
+class RequestArena
+{
+private:
+    struct Block
+    {
+        Block* next;
+        size_t size;
+    };
+
+    Block* _blocks;
+    char*  _cursor;
+    char*  _limit;
+    size_t _used;
+
+    static Block*        _spare;
+    static size_t        _spareCount;
+    static unsigned long _systemAllocations;
+    static unsigned long _blockReuses;
+
+    RequestArena(const RequestArena&);
+    RequestArena& operator=(const RequestArena&);
+
+    void addBlock(size_t minimum);
+    static void recycle(Block* block);
+
+public:
+    static const size_t BLOCK_SIZE = 16 * 1024;
+    static const size_t MAX_SPARE_BLOCKS = 64;
+    static const size_t ALIGNMENT = sizeof(void*) * 2;
+
+    // Position to rewind to, for callers that build scratch data in a
+    // loop while the arena already holds a parsed request.
+    struct Mark
+    {
+        const void* block;
+        char*       cursor;
+        size_t      used;
+    };
+
+    RequestArena();
+    ~RequestArena();
+
+    void* allocate(size_t size);
+    char* copy(const char* data, size_t length);
+    char* concat(const char* a, size_t aLength, const char* b, size_t bLength);
+    Mark mark() const;
+    void rewind(const Mark& mark);
+    void release();
+    size_t used() const;
+
+    static unsigned long systemAllocations();
+    static unsigned long blockReuses();
+    static size_t spareBlocks();
+};
+
+#endif
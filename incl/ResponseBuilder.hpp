@@ -0,0 +1,91 @@
+#ifndef RESPONSEBUILDER_HPP
+#define RESPONSEBUILDER_HPP
+
+#include <string>
+#include <vector>
+#include <ctime>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Free list of reusable string buffers. Released buffers keep their capacity
+// so steady-state responses do not reallocate.
+class BufferPool
+{
+private:
+    std::vector<std::string*> _free;
+
+    BufferPool();
+    BufferPool(const BufferPool&);
+    BufferPool& operator=(const BufferPool&);
+
+public:
+    static const size_t MAX_POOLED = 256;
+    static const size_t MAX_POOLED_CAPACITY = 256 * 1024;
+
+    ~BufferPool();
+    static BufferPool& instance();
+
+    std::string* acquire();
+    void release(std::string* buffer);
+};
+
+// An HTTP/1.1 response: status line and headers in one pooled buffer, the
+// body in another. The write path sends both with a single writev(). A body
+// can also be borrowed (bodyRef) from memory that outlives the response,
+// such as a mapped bundle, and is then sent without being copied.
+class ResponseBuilder
+{
+private:
+    int          _statusCode;
+    std::string* _head;
+    std::string* _body;
+    const char*  _borrowed;
+    size_t       _borrowedLength;
+    size_t       _sent;
+    bool         _finished;
+
+    std::string& head();
+
+public:
+    static const int MAX_IOV = 2;
+
+    ResponseBuilder();
+    explicit ResponseBuilder(int statusCode);
+    ResponseBuilder(const ResponseBuilder& other);
+    ResponseBuilder& operator=(const ResponseBuilder& other);
+    ~ResponseBuilder();
+
+    ResponseBuilder& status(int statusCode);
+    ResponseBuilder& header(const char* name, const std::string& value);
+    ResponseBuilder& header(const char* name, const char* value);
+    ResponseBuilder& header(const char* name, unsigned long value);
+    ResponseBuilder& body(const std::string& content);
+    std::string& bodyBuffer();
+    ResponseBuilder& bodyRef(const char* data, size_t length);
+    ResponseBuilder& finish();
+    // Closes the header block of a response whose body is sent on its own,
+    // framed by a header the caller gave (Transfer-Encoding, Connection).
+    ResponseBuilder& finishHead();
+
+    int getStatusCode() const;
+    size_t size() const;
+    size_t bodySize() const;
+    size_t remaining() const;
+    bool done() const;
+    int fillIov(struct iovec* iov, int maxIov) const;
+    // The header lines after the status line, and the body, for a protocol
+    // that frames them itself (HTTP/2).
+    const char* headerLines(size_t& length) const;
+    const char* bodyData() const;
+    void consume(size_t bytes);
+    std::string str() const;
+    void swap(ResponseBuilder& other);
+
+    static const char* statusLine(int statusCode, size_t& length);
+    static const char* reasonPhrase(int statusCode);
+    static const char* httpDate();
+    static char* formatUnsigned(char* end, unsigned long value);
+    static std::string toString(long value);
+};
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef RESPONSECACHE_HPP
+#define RESPONSECACHE_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <set>
+#include <ctime>
+#include <sys/types.h>
+#include "Gzip.hpp"
+
+class ResponseBuilder;
+
+// cgi_cache of one server block or location:
+//   cgi_cache <ttl> [stale=<time>];
+//   cgi_cache_vary <header> ...;
+//   cgi_cache_lock_timeout <time>;
+// ttl applies when the script sends no max-age. stale is how long past
+// expiry an entry may still be served while it is refreshed. A miss waits
+// up to lockTimeout for an identical miss already running the script.
+struct CachePolicy
+{
+    unsigned long ttl;                   // seconds; zero disables the cache
+    unsigned long stale;                 // seconds
+    unsigned long lockTimeout;           // seconds
+    std::vector<std::string> vary;       // request headers that are part of the key
+
+    static const unsigned long DEFAULT_LOCK_TIMEOUT = 5;
+
+    CachePolicy();
+
+    bool enabled() const;
+    void parse(const std::string& value);
+    void parseVary(const std::string& value);
+    void parseLockTimeout(const std::string& value);
+};
+
+// A CGI response: the optional header block of the script output (Status,
+// Content-Type, Cache-Control and anything else), then the body. Output
+// without a header block is an HTML body, as the scripts have always
+// been served.
+struct CgiOutput
+{
+    typedef std::vector<std::pair<std::string, std::string> > Headers;
+
+    int         status;
+    Headers     headers;
+    std::string body;
+
+    CgiOutput();
+
+    void parse(const std::string& output);
+    const std::string* header(const char* name) const;
+    // With a gzip policy, the body is compressed as Gzip::encode does
+    // unless the script encoded it itself.
+    void build(ResponseBuilder& response, const GzipPolicy* gzip = NULL, bool accepted = false) const;
+};
+
+// Cached CGI responses keyed on method, virtual host, URI and the
+// cgi_cache_vary headers. The memory tier holds up to a byte budget in LRU
+// order; what it evicts is written to the disk tier when cgi_cache_path is
+// set, where they also outlive a restart. A lookup that finds an
+// expired entry still inside its stale window serves it and, the first
+// time, asks the caller to start the single refresh for that key.
+//
+// A key is locked while a script run that will store it is in flight, so
+// each key has at most one.
+class ResponseCache
+{
+public:
+    enum Result
+    {
+        MISS,
+        HIT,
+        STALE
+    };
+
+    static const size_t DEFAULT_MEMORY = 8 * 1024 * 1024;
+    static const size_t DEFAULT_DISK = 64 * 1024 * 1024;
+
+    static ResponseCache& instance();
+
+    void configure(size_t memoryLimit, const std::string& diskPath, size_t diskLimit);
+
+    // Fills response on HIT and STALE, gzipped under gzip if the client
+    // accepts it; the compressed body is kept with the entry. On STALE,
+    // refresh is set when this lookup took the lock of the key and should
+    // start the refresh.
+    Result lookup(const std::string& key, ResponseBuilder& response, bool& refresh, const GzipPolicy* gzip,
+        bool accepted);
+    // Returns false when the response may not be cached: an error status,
+    // Set-Cookie, or Cache-Control no-store, no-cache or private.
+    bool store(const std::string& key, const CgiOutput& output, const CachePolicy& policy);
+
+    // Returns false when the key is already locked.
+    bool lock(const std::string& key);
+    void unlock(const std::string& key);
+
+    size_t memoryUsed() const;
+    size_t entries() const;
+
+private:
+    struct Entry
+    {
+        CgiOutput output;
+        time_t    stored;
+        time_t    expires;
+        time_t    staleUntil;
+        size_t    size;
+        std::string gzipped;          // empty until a gzip hit, or if it does not shrink
+        bool      gzipTried;
+        std::list<std::string>::iterator lru;
+    };
+
+    std::map<std::string, Entry> _entries;
+    std::list<std::string>       _lru;            // most recently used first
+    std::set<std::string>        _locks;
+    size_t                       _memoryUsed;
+    size_t                       _memoryLimit;
+    std::string                  _diskPath;
+    size_t                       _diskLimit;
+    std::map<std::string, size_t> _diskFiles;     // file name -> size, written or read by us
+    std::list<std::string>       _diskOrder;      // oldest first
+    size_t                       _diskUsed;
+
+    ResponseCache();
+    ResponseCache(const ResponseCache&);
+    ResponseCache& operator=(const ResponseCache&);
+
+    Entry& insert(const std::string& key, const Entry& entry);
+    void evict();
+    std::string diskFile(const std::string& key) const;
+    void writeDisk(const std::string& key, const Entry& entry);
+    bool readDisk(const std::string& key, Entry& entry);
+    void trackDisk(const std::string& file, size_t size);
+};
+
+// The one run of a script that fills a key, holding its lock: the refresh
+// of a stale entry, or the run for a miss that identical misses wait on.
+// The event loop reads the output from a non-blocking pipe; the response is
+// stored only if the script exits cleanly.
+class CacheFill
+{
+private:
+    std::string   _key;
+    CachePolicy   _policy;
+    pid_t         _pid;
+    int           _fd;
+    unsigned long _deadlineUs;
+    std::string   _raw;
+    CgiOutput     _output;
+
+    CacheFill(const CacheFill&);
+    CacheFill& operator=(const CacheFill&);
+
+public:
+    static const unsigned long TIMEOUT_US = 5000000;
+
+    // Takes over the lock of key.
+    CacheFill(const std::string& key, const CachePolicy& policy, pid_t pid, int fd, unsigned long deadlineUs);
+    // Kills and reaps the script if it has not been finished.
+    ~CacheFill();
+
+    // Returns true once the script closed its output.
+    bool readOutput();
+    // Reaps the script, parses its output and stores it if the script
+    // exited cleanly. Returns false if it did not.
+    bool finish();
+    // Gives up on the script; a stale entry stays until the next try.
+    void abandon();
+
+    const CgiOutput& output() const;
+    const CachePolicy& policy() const;
+    int fd() const;
+    unsigned long deadlineUs() const;
+    const std::string& key() const;
+};
+
+#endif
@@ -30,48 +30,303 @@
 #include <ctime>
 #include <memory>
 #include <iomanip>
+#include <cerrno>
 #include "ServerConfig.hpp"
+#include "ResponseBuilder.hpp"
+#include "Metrics.hpp"
+#include "VirtualHostIndex.hpp"
+#include "Proxy.hpp"
+#include "UpstreamGroup.hpp"
+#include "ResponseCache.hpp"
+#include "Http2.hpp"
+#include "Upload.hpp"
+#include "Cgi.hpp"
+#include "EventEngine.hpp"
+#include "Tracer.hpp"
+
+class HttpRequest;
+class RequestArena;
 
 class Server {
 private:
+    // Request state of one connection, kept for the connection's lifetime so
+    // keep-alive requests reuse it. active runs from the first byte of a
+    // request until its response is sent; the arena is released then, and so
+    // is the limit_conn slot the request holds. routed is set once a request
+    // whose body is still arriving has been checked for proxy_pass. trace
+    // times the phases of the request while tracing is on.
+    struct InFlight
+    {
+        unsigned long startUs;
+        LatencyHistogram* histogram;
+        RequestArena* arena;
+        bool active;
+        bool routed;
+        HttpRequest* request;              // parsed once its head is in; lives as long as the arena
+        unsigned long bodyLength;          // Content-Length of request
+        ClientKey address;                 // limit_req/limit_conn key, see clientAddress()
+        int limitSlot;
+        RequestTrace trace;
+    };
+
+    // Every reload builds a new generation. A request keeps the generation
+    // that was current when its first byte arrived, so a reload never changes
+    // the rules under an upload that is already running. configs is frozen
+    // once the generation is published: index and _socketToConfig refer into
+    // it. upstreams are the groups its upstream blocks define, probed while
+    // the generation is current. bundles are the bundles its locations serve
+    // from, held until the generation is deleted.
+    struct ConfigGeneration
+    {
+        unsigned long id;
+        std::vector<ServerConfig> configs;
+        std::vector<UpstreamGroup*> upstreams;
+        std::vector<const Bundle*> bundles;
+        VirtualHostIndex index;
+        int references;
+
+        ~ConfigGeneration();
+    };
+    typedef std::pair<std::string, int> ListenKey;
+
+    // Top-level connection limits. Zero disables memory_limit and
+    // shed_lag_threshold.
+    struct Limits
+    {
+        size_t workerConnections;
+        int backlog;
+        size_t memoryLimit;
+        unsigned long shedLagUs;
+        unsigned long retryAfter;
+
+        Limits();
+    };
+
+    // cgi_cache_memory, and cgi_cache_path with its max_size. An empty path
+    // keeps the cache in memory only.
+    struct CacheSettings
+    {
+        size_t memoryLimit;
+        std::string path;
+        size_t diskLimit;
+
+        CacheSettings();
+    };
+
+    // trace_sample, trace_threshold, trace_buffer and
+    // slow_request_threshold.
+    struct TraceSettings
+    {
+        unsigned long sampleEvery;
+        unsigned long thresholdUs;
+        size_t capacity;
+        unsigned long slowUs;
+
+        TraceSettings();
+    };
+
+    // The directives outside any block. A reload parses them into a fresh
+    // set, so a directive removed from the file is back to its default, and
+    // the running set is replaced only once the new configuration is valid.
+    struct GlobalSettings
+    {
+        std::string accessLogPath;
+        std::string errorLogPath;
+        std::string slowLogPath;                        // empty: the error log
+        std::string logPolicy;
+        std::string eventEngine;
+        Limits limits;
+        CacheSettings cache;
+        TraceSettings trace;
+
+        GlobalSettings();
+    };
+
+    // A client whose cgi_cache miss is answered when fill is done, or with
+    // 504 at deadlineUs. gzip points into the configuration generation the
+    // client holds. stream is the HTTP/2 stream waiting, or 0.
+    struct CacheWaiter
+    {
+        CacheFill* fill;
+        uint32_t stream;
+        unsigned long deadlineUs;
+        const GzipPolicy* gzip;
+        bool gzipAccepted;
+        LogFields log;
+    };
+
+    // An HTTP/2 stream answered by a CgiSession, which has no client
+    // descriptor of its own.
+    struct CgiStream
+    {
+        int clientFd;
+        uint32_t stream;
+    };
+
     // Parsing
-    bool parseConfigFile(std::string configFile);
+    bool parseConfigFile(std::string configFile, ConfigGeneration& generation, GlobalSettings& settings);
     void printServerBlocks() const;
-    bool parseFileInBlock(std::string configFile);
+    bool parseFileInBlock(std::string configFile, GlobalSettings& settings);
+    bool parseGlobalDirective(const std::string& line, GlobalSettings& settings);
+    void applySettings(const GlobalSettings& settings);
 
     // Sockets
-    int createSocket();
-    void configureSocket(int server_fd);
+    int createSocket(int family);
+    void configureSocket(int server_fd, int family);
     void bindSocket(int server_fd, int port);
     void listenOnSocket(int server_fd);
     void addServerSocketToPoll(int server_fd);
+    void closeListener(int server_fd);
+    void adoptInheritedSockets();
+    int takeInheritedSocket(const ListenKey& key);
     void cleanupSockets();
     void cleanup();
     bool isServerSocket(int fd) const;
 
     // Handle connections
     void handleNewConnection(int server_fd);
+    void acceptConnection(int server_fd);
+    bool overloaded(Metrics::RejectReason& reason) const;
+    static ClientKey clientAddress(const sockaddr_storage& address, std::string& text);
+    void rejectConnection(int client_fd, Metrics::RejectReason reason, bool plain);
+    void acceptWithSpareFd(int server_fd);
+    void updateLoopLag(unsigned long busyUs, unsigned long idleUs);
+    void updateConnectionGauges();
     void handleClientRequest(int clientIndex);
-    void logResponseDetails(const std::string& response, const std::string& path);
-    std::string readClientRequest(int client_fd, int clientIndex);
+    int admitRequest(InFlight& inflight, const ServerConfig& config, const ServerLocation* location,
+        unsigned long& retryAfter);
+    void logAccess(int client_fd, HttpRequest& request, const ResponseBuilder& response);
+    void logAccess(int client_fd, const LogFields& log, int statusCode, unsigned long bytes);
+    bool readClientRequest(int client_fd, int clientIndex, std::string& buffer, bool& bodyPending);
+    void sendPendingResponse(int clientIndex);
     void unchunk();
     std::string chunkedToBody(int client_fd, int clientIndex, std::string buffer, size_t transferEncodingPos);
     void removeClient(int index);
-    void validateServerConfigurations();
+    void validateServerConfigurations(std::vector<ServerConfig>& configs);
+    void registerMetrics();
+    void finishRequest(int client_fd);
+    // The trace of the client's request, or NULL while it is not traced.
+    RequestTrace* traceFor(int fd);
+    void queueResponse(int client_fd, ResponseBuilder& response);
+
+    // Reverse proxy
+    void startProxy(int client_fd, HttpRequest& request, const ServerLocation& location, const std::string& buffer);
+    bool handleProxyEvent(int index);
+    void proxyProgress(ProxySession* session, ProxySession::Result result);
+    void endProxy(ProxySession* session, ProxySession::Result result);
+    void expireProxySessions(unsigned long nowUs);
+    int proxyTimeout(unsigned long nowUs) const;
+    void closeIdleUpstream(int upstream_fd);
+
+    // Uploads
+    void startUpload(int client_fd, HttpRequest& request, UploadSession* session, const char* body, size_t length);
+    bool handleUploadEvent(int index);
+    void endUpload(UploadSession* session, UploadSession::Result result);
+
+    // CGI scripts run by the event loop
+    void startCgi(int client_fd, uint32_t stream, HttpRequest& request, CgiSession* session);
+    bool handleCgiEvent(int index);
+    void cgiProgress(CgiSession* session, CgiSession::Result result);
+    void endCgi(CgiSession* session, CgiSession::Result result);
+    void answerCgiStream(const CgiStream& stream, CgiSession* session);
+    void dropCgiPipes(CgiSession* session);
+    void expireCgiSessions(unsigned long nowUs);
+    int cgiTimeout(unsigned long nowUs) const;
+    void runHealthChecks(unsigned long nowUs);
+    int healthCheckTimeout(unsigned long nowUs) const;
+    void endProbe(HealthProbe* probe);
+
+    // TLS
+    void syncTlsContext(int server_fd, const ServerConfig& config, int port);
+    bool handleTlsHandshake(int index);
+    TlsConnection* tlsFor(int fd) const;
+    bool tlsBuffered() const;
+    void markTlsReadable();
+
+    // HTTP/2 connections
+    bool startHttp2(int clientIndex, std::string& buffer, HttpRequest& request, const ServerConfig& config,
+        bool bodyPending);
+    bool handleHttp2Event(int index);
+    Http2Session::Result progressHttp2(Http2Session* session);
+    void handleHttp2Request(Http2Session& session, uint32_t streamId, const std::string& raw);
+    void endHttp2Streams(Http2Session* session);
+
+    // cgi_cache script runs and the misses waiting on them
+    typedef std::multimap<int, CacheWaiter> CacheWaiters;
+    void startCacheFill(CacheFill* fill);
+    void waitForCacheFill(int client_fd, uint32_t stream, HttpRequest& request, const ServerConfig& config,
+        const std::string& key, unsigned long lockTimeoutUs);
+    void answerCacheWaiter(CacheWaiters::iterator waiter, ResponseBuilder response);
+    bool handleCacheFill(int index);
+    void endCacheFill(CacheFill* fill, bool finished);
+    void expireCacheFills(unsigned long nowUs);
+    int cacheFillTimeout(unsigned long nowUs) const;
+    pollfd* pollFor(int fd);
+    void addPollFd(int fd, short events);
+    void removePollFd(int fd);
     void displayConfigs(const std::vector<ServerConfig>& configs);
+
+    // Config generations
+    void reload();
+    void pinGeneration(int client_fd);
+    void releaseGeneration(int client_fd);
+    void destroyGenerations();
+
+    // Binary upgrade and graceful drain
+    void upgradeBinary();
+    void checkUpgradeChild();
+    void beginDrain();
+    bool drainFinished();
     
     // Variables
     bool running;
     std::vector<int> _server_fds;
     std::vector<int> _ports;
-    std::vector<sockaddr_in> _addresses;
+    std::vector<sockaddr_storage> _addresses;
     std::vector<pollfd> _poll_fds;
+    EventEngine _events;
     std::vector<std::string> serverBlocks;
-    std::vector<ServerConfig> _configs;
+    std::vector<std::string> upstreamBlocks;
+    std::string _configFile;
+    ConfigGeneration* _generation;
+    std::map<int, ConfigGeneration*> _clientGeneration;
+    std::map<ListenKey, int> _listeners;
+    std::map<ListenKey, int> _inherited;
+    std::string _programPath;
+    pid_t _upgradePid;
+    pid_t _upgradeParent;
+    bool _draining;
+    unsigned long _drainDeadlineUs;
     std::map<int, ServerConfig*> _socketToConfig;
-    std::map<int, std::string> responseBuffer;
+    std::map<int, ResponseBuilder> responseBuffer;
     std::map<int, std::string> clientBuffers;
+    std::map<int, std::string> _clientAddresses;
+    std::map<int, InFlight> _inflight;
+    std::map<int, ProxySession*> _proxyClients;
+    std::map<int, ProxySession*> _proxyUpstreams;
+    std::map<int, UploadSession*> _uploads;
+    std::map<int, CgiSession*> _cgiClients;
+    std::map<int, CgiSession*> _cgiPipes;              // by stdin and stdout
+    std::map<CgiSession*, CgiStream> _cgiStreams;
+    std::map<int, Upstream*> _idleUpstreams;
+    std::map<int, HealthProbe*> _probes;
+    std::map<int, CacheFill*> _cacheFills;
+    std::map<std::string, CacheFill*> _fillsByKey;
+    CacheWaiters _cacheWaiters;
+    std::map<int, Http2Session*> _http2Clients;
+    std::map<int, TlsContext*> _tlsContexts;           // by listener
+    std::map<int, TlsConnection*> _tlsClients;
+    size_t _activeRequests;
+    GlobalSettings _settings;
+    ClientLimiter _clientLimiter;
+    int _spareFd;
+    unsigned long _loopLagUs;
+    size_t _bufferedBytes;
+    std::string _accessLine;
     static volatile sig_atomic_t signal_received;
+    static volatile sig_atomic_t reload_requested;
+    static volatile sig_atomic_t upgrade_requested;
+    static volatile sig_atomic_t drain_requested;
 public:
     Server(const std::string configFile);
     ~Server();
@@ -82,16 +337,24 @@ public:
     void stop();
     bool isRunning() const;
     void setRunning(bool status);
+    void setProgramPath(const std::string& path);
+
+    static const unsigned long DRAIN_TIMEOUT_US = 30000000UL;
+    static const size_t MAX_RETAINED_BUFFER = 64 * 1024;
 
     static void signalHandler(int signal);
 
     // Utils and logMessages
-    std::string intToString(int value);
+    std::string intToString(long value);
     void logMessage(const std::string& level, const std::string& message) const;
     std::string logMessageError(const std::string& level, const std::string& message) const;
 
     ServerConfig* getConfigForSocket(int socket);
     ServerConfig* getConfigForRequest(const std::string& hostHeader, int connectedPort);
+    static ServerConfig* matchConfig(std::vector<ServerConfig>& configs, const VirtualHostIndex& index,
+        const std::string& hostHeader, int connectedPort);
+    static ServerConfig* matchConfig(std::vector<ServerConfig>& configs, const VirtualHostIndex& index,
+        const char* hostHeader, size_t length, int connectedPort);
 };
 
-#endif // SERVER_HPP
\ No newline at end of file
+#endif // SERVER_HPP
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define SERVERCONFIG_HPP
 
 #include "ServerLocation.hpp"
+#include "Tls.hpp"
 #include <string>
 #include <vector>
 #include <map>
@@ -14,9 +15,14 @@
 #include <cstdlib>
 #include <unistd.h>
 
+class LatencyHistogram;
+class UpstreamGroup;
+
 class ServerConfig {
 private:
-    std::vector<int>               _ports;                   
+    std::vector<int>               _ports;
+    std::vector<std::string>       _listenHosts;             // address of each listen, empty for host
+    std::vector<int>               _sslPorts;                // listen <port> ssl
     std::string                    _root;
     std::string                    _index;
     std::map<int, std::string>     _error_pages;
@@ -24,6 +30,14 @@ private:
     std::string                    _serverName;
     std::string                    _host;
     size_t                         _clientMaxBodySize;
+    LatencyHistogram*              _latency;
+    ClientLimit                    _clientLimit;
+    CachePolicy                    _cachePolicy;
+    GzipPolicy                     _gzip;
+    bool                           _http2;                   // h2c accepted on the listeners of this block
+    bool                           _uploadTmpfile;           // streamed uploads linked into place when complete
+    TlsPolicy                      _tls;
+    std::string                    _label;
     std::string rawBlock;
 public:
     // Default constructor
@@ -32,6 +46,11 @@ public:
     void parseLocationBlock(const std::string& locationBlock, ServerLocation& location);
     void handleErrorPageDirective(const std::string& line);
     void handleLocationDirective(const std::string& line, const std::string& serverBlock, size_t& pos);
+    static UpstreamGroup* parseUpstreamBlock(const std::string& upstreamBlock);
+
+    // Paths found readable by the configuration being parsed; cleared before
+    // each parse so a reload notices files removed since.
+    static void beginConfiguration();
 
     void print() const;
     void clear();
@@ -41,6 +60,11 @@ public:
     // Getters and Setters
     void setPort(int serverPort);
     const std::vector<int>& getPorts() const;
+    // Address the i-th port is bound to: an IPv4 or IPv6 address, or
+    // "unix:<path>" for a unix socket, whose port is unixSocketPort(path).
+    const std::string& getListenHost(size_t i) const;
+    static int unixSocketPort(const std::string& path);
+    static std::string listenName(const std::string& host, int port);
 
     size_t getClientMaxBodySize() const;
     void setClientMaxBodySize(size_t size);
@@ -62,6 +86,20 @@ public:
 
     void addLocation(const ServerLocation& location);
     const std::vector<ServerLocation>& getLocations() const;
+    const ServerLocation* findLocation(const std::string& path) const;
+    const ServerLocation* findLocation(const char* path) const;
+    const ServerLocation* findProxyLocation(const char* path) const;
+    const CachePolicy* findCachePolicy(const char* path) const;
+    const GzipPolicy* findGzipPolicy(const char* path) const;
+
+    void registerMetrics();
+    LatencyHistogram* getLatencyHistogram() const;
+    const ClientLimit& getClientLimit() const;
+    const std::string& getLabel() const;
+    bool http2Enabled() const;
+    bool uploadTmpfile() const;
+    bool isSslPort(int port) const;
+    const TlsPolicy& getTlsPolicy() const;
 
 	int	getValid() const;
     std::string toString() const;
@@ -3,6 +3,13 @@
 
 #include <string>
 #include <map>
+#include "ClientLimiter.hpp"
+#include "ResponseCache.hpp"
+#include "Gzip.hpp"
+
+class LatencyHistogram;
+class Bundle;
+class UpstreamGroup;
 
 class ServerLocation {
 private:
@@ -12,6 +19,17 @@ private:
     bool _getAllowed;
     bool _postAllowed;
     bool _deleteAllowed;
+    bool _stubStatus;
+    bool _traceDump;
+    LatencyHistogram* _latency;
+    const Bundle* _bundle;
+    ClientLimit _clientLimit;
+    UpstreamGroup* _upstream;
+    std::string _proxyUri;
+    unsigned long _proxyConnectTimeoutUs;
+    unsigned long _proxyReadTimeoutUs;
+    CachePolicy _cachePolicy;
+    GzipPolicy _gzip;
 
 public:
     // Constructor
@@ -37,6 +55,39 @@ public:
 
     void setAllowedMethods(const std::string& methodsLine);
 
+    void enableStubStatus();
+    bool isStubStatus() const;
+    void enableTraceDump();
+    bool isTraceDump() const;
+
+    void setLatencyHistogram(LatencyHistogram* histogram);
+    LatencyHistogram* getLatencyHistogram() const;
+
+    void setBundle(const Bundle* bundle);
+    const Bundle* getBundle() const;
+    bool contains(const char* requestPath, size_t length) const;
+
+    void setRequestLimit(const std::string& value);
+    void setConnectionLimit(const std::string& value);
+    void setLimitZone(unsigned long zone);
+    const ClientLimit& getClientLimit() const;
+
+    void setProxyPass(const std::string& url);
+    UpstreamGroup* getUpstream() const;
+    const std::string& getProxyUri() const;
+    void setProxyConnectTimeout(unsigned long timeoutUs);
+    void setProxyReadTimeout(unsigned long timeoutUs);
+    unsigned long getProxyConnectTimeoutUs() const;
+    unsigned long getProxyReadTimeoutUs() const;
+
+    void setCache(const std::string& value);
+    void setCacheVary(const std::string& value);
+    void setCacheLockTimeout(const std::string& value);
+    const CachePolicy& getCachePolicy() const;
+
+    bool parseGzip(const std::string& line);
+    const GzipPolicy& getGzipPolicy() const;
+
     void display() const;
 };
 
@@ -0,0 +1,111 @@
+#ifndef TLS_HPP
+#define TLS_HPP
+
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct ssl_st;
+struct ssl_ctx_st;
+
+// TLS of one server block:
+//   listen <port> ssl;
+//   ssl_certificate <file>;
+//   ssl_certificate_key <file>;
+//   ssl_session_cache <entries>|off;
+//   ssl_session_timeout <time>;
+//   ssl_session_tickets on|off;
+// A listener takes them from its default server, the first block that
+// listens on it; SNI does not switch certificates.
+struct TlsPolicy
+{
+    std::string   certificate;
+    std::string   key;
+    size_t        sessionCache;       // sessions kept server-side; zero disables the cache
+    unsigned long sessionTimeout;     // seconds
+    bool          tickets;
+
+    static const size_t DEFAULT_SESSION_CACHE = 20000;
+    static const unsigned long DEFAULT_SESSION_TIMEOUT = 300;
+
+    TlsPolicy();
+
+    // Returns false when line is not an ssl_ directive.
+    bool parse(const std::string& line);
+    bool configured() const;
+};
+
+// The SSL_CTX of one listener. Handshakes resume from the server-side
+// session cache (TLS 1.2 session ids, TLS 1.3 stateful tickets) or from
+// stateless session tickets. ALPN offers h2 when the server has http2 on.
+// kTLS is asked for on every connection; the kernel takes over the record
+// layer where it supports the negotiated cipher.
+class TlsContext
+{
+public:
+    // Throws std::runtime_error when the certificate or key cannot be used.
+    TlsContext(const TlsPolicy& policy, bool http2);
+    ~TlsContext();
+
+    // Tickets issued under previous stay valid, so a reload that rebuilds
+    // the context does not cost every client a full handshake.
+    void inheritTicketKeys(const TlsContext& previous);
+    ssl_ctx_st* get() const;
+
+private:
+    ssl_ctx_st* _ctx;
+
+    TlsContext(const TlsContext&);
+    TlsContext& operator=(const TlsContext&);
+};
+
+// The TLS side of one client connection, whose socket it makes
+// non-blocking. The handshake is driven from the event loop; afterwards
+// read() and write() stand in for recv() and sendmsg(), reporting a record
+// that is not complete yet as EAGAIN.
+class TlsConnection
+{
+public:
+    enum State
+    {
+        HANDSHAKE,
+        ESTABLISHED,
+        FAILED
+    };
+
+    TlsConnection(TlsContext& context, int fd);
+    // Sends close_notify if it can without blocking.
+    ~TlsConnection();
+
+    State handshake();
+    // What the handshake waits for.
+    short events() const;
+    bool established() const;
+    bool resumed() const;
+    // ALPN chose h2.
+    bool http2() const;
+    // The kernel encrypts what is written to the socket.
+    bool kernelSend() const;
+    // Decrypted bytes wait inside OpenSSL, where poll() cannot see them.
+    bool pending() const;
+
+    // recv() and sendmsg() on fd, through tls when it is not NULL.
+    static ssize_t read(TlsConnection* tls, int fd, void* buffer, size_t length);
+    static ssize_t write(TlsConnection* tls, int fd, const struct iovec* iov, int count);
+
+private:
+    ssl_st* _ssl;
+    int     _fd;
+    State   _state;
+    short   _events;
+    bool    _kernelSend;
+
+    TlsConnection(const TlsConnection&);
+    TlsConnection& operator=(const TlsConnection&);
+
+    ssize_t receive(void* buffer, size_t length);
+    ssize_t send(const struct iovec* iov, int count);
+    ssize_t failed(int result);
+};
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef TRACER_HPP
+#define TRACER_HPP
+
+#include <string>
+#include <vector>
+#include "RequestArena.hpp"
+
+// The phases of one HTTP/1.1 request on a connection, on the monotonic
+// clock in microseconds. A phase entered again right after itself, like the
+// reads of a request arriving in pieces, extends its last span, which then
+// also covers the waits in between; events counts the entries. Besides the
+// phases it keeps what the slow request log reports about the request.
+class RequestTrace
+{
+public:
+    enum Phase
+    {
+        RECV,           // reading the head and the buffered body
+        PARSE,          // cutting the head in the arena
+        ROUTE,          // virtual host, location and limits
+        HANDLE,         // the handler: filesystem, bundle, cache, script start
+        CGI,            // script run, streamed output included
+        UPLOAD,         // body streamed into a file or dropped
+        PROXY,          // upstream exchange
+        SEND,           // writing the queued response
+        PHASES
+    };
+
+    static const int MAX_SPANS = 16;
+    static const size_t LABEL_SIZE = 128;
+    static const size_t HOST_SIZE = 64;
+
+    struct Span
+    {
+        unsigned long startUs;
+        unsigned long endUs;
+        unsigned      events;
+        Phase         phase;
+    };
+
+    RequestTrace();
+
+    // The time to pass to span() later: zero, without reading the clock,
+    // while tracing is off.
+    static unsigned long clock();
+
+    // A new request on fd, its first read started at startUs.
+    void begin(int fd, unsigned long startUs);
+    bool active() const;
+    void span(Phase phase, unsigned long startUs);
+    // The request once its head is parsed and its server block chosen.
+    void describe(const StringRef& method, const StringRef& target, const StringRef& host,
+        unsigned long bodyBytes);
+    void setResponse(int status, unsigned long bytesSent);
+    // waitStatus as waitpid() gave it, or -1 if the script was not reaped.
+    void setCgi(int pid, int waitStatus);
+    // Keeps the start of a phase that ends in a later event.
+    void mark();
+    unsigned long markedUs() const;
+    // The request is over: hands it to the tracer, which keeps it if it was
+    // sampled or slow.
+    void end();
+
+    static const char* phaseName(Phase phase);
+
+private:
+    friend class Tracer;
+
+    bool          _active;
+    bool          _sampled;
+    int           _fd;
+    int           _status;
+    unsigned long _bodyBytes;
+    unsigned long _bytesSent;
+    int           _cgiPid;          // 0 without a script
+    int           _cgiWaitStatus;
+    unsigned long _startUs;
+    unsigned long _endUs;
+    unsigned long _markUs;
+    int           _spans;
+    unsigned      _dropped;         // spans past MAX_SPANS
+    Span          _span[MAX_SPANS];
+    char          _label[LABEL_SIZE];
+    char          _host[HOST_SIZE];
+};
+
+// Ring of the last traced requests, exported as Chrome trace_event JSON by
+// trace_dump locations for chrome://tracing or Perfetto:
+//   trace_sample <n>;       every nth request, 0 for none
+//   trace_threshold <ms>;   and every request that took at least this long
+//   trace_buffer <n>;       requests kept
+// Independently of the ring, a request slower than
+//   slow_request_threshold <ms>;
+// is written to the slow log with its phases. With none of them set,
+// requests are not timed at all. Everything runs on the event-loop thread.
+class Tracer
+{
+public:
+    static const size_t DEFAULT_CAPACITY = 1024;
+
+    static Tracer& instance();
+
+    void configure(unsigned long sampleEvery, unsigned long thresholdUs, size_t capacity, unsigned long slowUs);
+    bool enabled() const;
+    // Whether the next request is one of the 1-in-n.
+    bool sampleNext();
+    void record(const RequestTrace& trace);
+
+    // One thread per connection descriptor, with each request as a slice
+    // and its phases nested under it.
+    void render(std::string& out) const;
+
+private:
+    bool          _enabled;
+    unsigned long _sampleEvery;
+    unsigned long _thresholdUs;
+    unsigned long _slowUs;
+    unsigned long _seen;
+    std::vector<RequestTrace> _ring;
+    size_t        _next;
+    size_t        _stored;
+
+    Tracer();
+    Tracer(const Tracer&);
+    Tracer& operator=(const Tracer&);
+
+    void logSlow(const RequestTrace& trace);
+};
+
+#endif
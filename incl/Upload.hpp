@@ -0,0 +1,111 @@
+#ifndef UPLOAD_HPP
+#define UPLOAD_HPP
+
+#include <string>
+#include <sys/types.h>
+#include "RequestArena.hpp"
+#include "ResponseBuilder.hpp"
+
+class TlsConnection;
+
+// Where handlePost would write a body: a plain/text body as a whole to
+// path, or the file part of a multipart/form-data body, named by its
+// filename, into directory.
+struct UploadTarget
+{
+    std::string   directory;
+    std::string   path;            // empty for multipart: taken from the part
+    std::string   boundary;        // "--" and the boundary, for multipart
+    unsigned long length;          // Content-Length
+    bool          tmpfile;
+
+    UploadTarget();
+};
+
+// A POST body moved into its file as it arrives, so an upload costs the
+// same memory whatever its size. On a plain socket the bytes go from the
+// socket through a pipe into the file with splice() and never reach user
+// space; through TLS they are decrypted into a fixed buffer first. The file
+// is preallocated from Content-Length. With tmpfile it is an unnamed
+// O_TMPFILE in the target directory; otherwise it is written under a
+// temporary name there, removed if the upload fails. Either way it is
+// renamed over the target only once complete, so a failed upload leaves
+// any previous file in place.
+//
+// A multipart part head is read into memory up to MAX_PART_HEAD. Everything
+// after it is spliced into the file and cut at the delimiter that follows
+// the part, which must lie within the last TRAILER_WINDOW bytes of the
+// body: the fields after a file are small.
+//
+// A session started with a status discards the body instead, so the
+// connection stays in sync for its next request.
+class UploadSession
+{
+public:
+    enum Result
+    {
+        CONTINUE,
+        DONE,             // body consumed, response() is the answer
+        CLIENT_GONE
+    };
+
+    static const size_t PIPE_SIZE = 1024 * 1024;
+    static const size_t MAX_PART_HEAD = 16 * 1024;
+    static const size_t TRAILER_WINDOW = 64 * 1024;
+    static const size_t MAX_PER_EVENT = 4 * 1024 * 1024;
+
+    // tls is the client's TLS connection, or NULL.
+    UploadSession(int clientFd, TlsConnection* tls, const UploadTarget& target);
+    // Discards length bytes, then answers response.
+    UploadSession(int clientFd, TlsConnection* tls, unsigned long length, ResponseBuilder& response);
+    ~UploadSession();
+
+    // Body bytes that arrived with the head.
+    Result start(const char* data, size_t length);
+    Result readable();
+
+    LogFields& logFields();
+    ResponseBuilder& response();
+    int clientFd() const;
+
+    // Cuts the written bytes of file at the first "\r\n" + boundary in
+    // their last TRAILER_WINDOW bytes, and truncates file there. Returns
+    // false when there is none.
+    static bool trimToDelimiter(int file, const std::string& boundary, off_t& written);
+
+private:
+    enum Phase
+    {
+        PART_HEAD,
+        BODY,
+        DISCARD
+    };
+
+    int             _clientFd;
+    TlsConnection*  _tls;
+    UploadTarget    _target;
+    Phase           _phase;
+    unsigned long   _remaining;       // body bytes still on the socket
+    std::string     _partHead;
+    std::string     _partial;         // name written under until commit(), or empty
+    int             _file;
+    int             _pipe[2];
+    off_t           _written;
+    bool            _committed;
+    ResponseBuilder _response;
+    LogFields       _log;
+
+    UploadSession(const UploadSession&);
+    UploadSession& operator=(const UploadSession&);
+
+    Result fail(int status);
+    Result consume(const char* data, size_t length);
+    bool openFile(const std::string& path);
+    void removePartial();
+    bool writeAll(const char* data, size_t length);
+    ssize_t spliceIn(size_t length);
+    Result complete();
+    bool commit();
+};
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef UPSTREAMGROUP_HPP
+#define UPSTREAMGROUP_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include "RequestArena.hpp"
+
+class Upstream;
+
+// The servers a proxy_pass forwards to and how one is picked per request:
+// smooth weighted round robin (the default), least_conn, or a consistent
+// hash of the request URI. An upstream block defines a named group; a
+// proxy_pass naming a host directly gets a group of its own with that one
+// server, which is never taken out of rotation.
+//
+// Everything runs on the event loop, so selection and the health counters
+// are plain reads and increments on the peers; picking a server walks the
+// peer list (or binary-searches the hash ring) and allocates nothing.
+//
+// A definition that is unchanged across a reload maps to the same instance,
+// which keeps the round-robin position and the probe schedule.
+class UpstreamGroup
+{
+public:
+    enum Policy
+    {
+        ROUND_ROBIN,
+        LEAST_CONN,
+        HASH_URI
+    };
+
+    struct Peer
+    {
+        Upstream*     server;
+        unsigned long weight;
+        unsigned long maxFails;
+        unsigned long failTimeoutUs;
+        long          currentWeight;   // smooth weighted round robin
+        unsigned long nextProbeUs;
+        bool          probing;
+    };
+
+    static const unsigned long RING_POINTS = 160;   // hash ring points per unit of weight
+
+    UpstreamGroup(const std::string& name);
+
+    void setPolicy(Policy policy);
+    void addServer(Upstream* server, unsigned long weight, unsigned long maxFails, unsigned long failTimeoutUs);
+    // An interval of zero disables active probes.
+    void setHealthCheck(unsigned long intervalUs, const std::string& uri);
+
+    // Makes the group findable by name for the rest of the parse. An
+    // identical group defined earlier is returned instead, and this one
+    // deleted.
+    static UpstreamGroup* publish(UpstreamGroup* group);
+
+    // Groups named by the configuration being parsed; cleared before each
+    // parse so a failed reload leaves the running generation alone.
+    static void beginConfiguration();
+    static UpstreamGroup* find(const std::string& name);
+    static UpstreamGroup* forServer(Upstream* server);
+
+    // NULL when no server is available.
+    Upstream* select(const StringRef& uri, unsigned long nowUs);
+    // Returns true when the failure takes the server down.
+    bool failed(Upstream* server, unsigned long nowUs);
+
+    const std::string& name() const;
+    Policy policy() const;
+    size_t size() const;
+    Peer& peer(size_t index);
+    const Peer& peer(size_t index) const;
+    unsigned long healthCheckIntervalUs() const;
+    const std::string& healthCheckUri() const;
+
+private:
+    std::string       _name;
+    Policy            _policy;
+    std::vector<Peer> _peers;
+    size_t            _cursor;
+    unsigned long     _probeIntervalUs;
+    std::string       _probeUri;
+    std::vector<std::pair<uint32_t, size_t> > _ring;
+
+    static std::map<std::string, UpstreamGroup*>& registry();
+    static std::map<std::string, UpstreamGroup*>& named();
+
+    UpstreamGroup(const UpstreamGroup&);
+    UpstreamGroup& operator=(const UpstreamGroup&);
+
+    std::string signature() const;
+    void buildRing();
+    Upstream* selectRoundRobin(unsigned long nowUs);
+    Upstream* selectLeastConn(unsigned long nowUs);
+    Upstream* selectHash(const StringRef& uri, unsigned long nowUs);
+};
+
+// One active health check: a GET of the group's probe URI on a fresh
+// connection. The server passes when the status line shows 2xx or 3xx
+// before the deadline.
+class HealthProbe
+{
+private:
+    UpstreamGroup* _group;
+    size_t         _peer;
+    int            _fd;
+    unsigned long  _deadlineUs;
+    bool           _connecting;
+    std::string    _request;
+    size_t         _sent;
+    std::string    _response;
+    bool           _healthy;
+
+    HealthProbe(const HealthProbe&);
+    HealthProbe& operator=(const HealthProbe&);
+
+public:
+    HealthProbe(UpstreamGroup* group, size_t peer, int fd, unsigned long deadlineUs);
+
+    // Returns true once the probe has a verdict.
+    bool handle(short revents);
+    short events() const;
+
+    UpstreamGroup::Peer& peer() const;
+    Upstream* server() const;
+    int fd() const;
+    unsigned long deadlineUs() const;
+    bool healthy() const;
+};
+
+#endif
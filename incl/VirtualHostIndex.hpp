@@ -0,0 +1,58 @@
+#ifndef VIRTUALHOSTINDEX_HPP
+#define VIRTUALHOSTINDEX_HPP
+
+#include <string>
+#include <vector>
+
+class ServerConfig;
+
+// Open-addressing hash table over the server blocks of one configuration.
+// Keys are (kind, host, server_name, port) and values are indexes into the
+// config vector; a key keeps the first config that claimed it, which is the
+// precedence the routing rules use. Lookups take raw character ranges so the
+// Host header is matched in place, without building temporary strings.
+class VirtualHostIndex
+{
+public:
+    enum Kind
+    {
+        EXACT,  // (host, server_name, port): duplicate detection
+        NAME,   // (server_name, port)
+        HOST,   // (host, port)
+        PORT    // (port): default server for a port
+    };
+
+    VirtualHostIndex();
+
+    void build(std::vector<ServerConfig>& configs);
+    void clear();
+    void reserve(size_t keys);
+    size_t size() const;
+
+    int claim(Kind kind, const std::string& host, const std::string& name, int port, int config);
+    int find(Kind kind, const std::string& host, const std::string& name, int port) const;
+    int find(Kind kind, const char* host, size_t hostLen, const char* name, size_t nameLen, int port) const;
+    int route(const char* host, size_t hostLen, int port) const;
+
+private:
+    struct Slot
+    {
+        unsigned long hash;
+        int           kind;
+        int           port;
+        int           config;
+        std::string   host;
+        std::string   name;
+
+        Slot();
+    };
+
+    std::vector<Slot> _slots;
+    size_t            _used;
+
+    static unsigned long hashKey(int kind, const char* host, size_t hostLen, const char* name, size_t nameLen, int port);
+    size_t probe(unsigned long hash, int kind, const char* host, size_t hostLen, const char* name, size_t nameLen, int port) const;
+    void rehash(size_t slots);
+};
+
+#endif
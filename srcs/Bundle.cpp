@@ -0,0 +1,175 @@
+#include "Bundle.hpp"
+#include <stdexcept>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const char Bundle::MAGIC[8] = { 'W', 'S', 'B', 'U', 'N', 'D', 'L', '1' };
+
+Bundle::Bundle(const std::string& path)
+    : _path(path), _base(NULL), _size(0), _inode(0), _mtime(0), _header(NULL), _entries(NULL), _references(1)
+{
+}
+
+Bundle::~Bundle()
+{
+    if (_base)
+        munmap(const_cast<char*>(_base), _size);
+}
+
+std::map<std::string, Bundle*>& Bundle::registry()
+{
+    static std::map<std::string, Bundle*> bundles;
+    return bundles;
+}
+
+const Bundle* Bundle::open(const std::string& path)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        throw std::runtime_error("Bundle file does not exist: " + path);
+
+    std::map<std::string, Bundle*>::iterator it = registry().find(path);
+    if (it != registry().end())
+    {
+        if (it->second->_inode == info.st_ino && it->second->_mtime == info.st_mtime
+            && it->second->_size == static_cast<size_t>(info.st_size))
+            return it->second;
+        Bundle* replaced = it->second;
+        registry().erase(it);
+        release(replaced);
+    }
+
+    Bundle* bundle = new Bundle(path);
+    try
+    {
+        bundle->map();
+    }
+    catch (...)
+    {
+        delete bundle;
+        throw;
+    }
+    registry()[path] = bundle;
+    return bundle;
+}
+
+void Bundle::acquire(const Bundle* bundle)
+{
+    ++bundle->_references;
+}
+
+void Bundle::release(const Bundle* bundle)
+{
+    if (--bundle->_references == 0)
+        delete bundle;
+}
+
+void Bundle::map()
+{
+    int fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Failed to open bundle: " + _path);
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(sizeof(BundleHeader)))
+    {
+        close(fd);
+        throw std::runtime_error("Bundle is truncated: " + _path);
+    }
+    void* base = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        throw std::runtime_error("Failed to map bundle: " + _path);
+
+    _base = static_cast<const char*>(base);
+    _size = info.st_size;
+    _inode = info.st_ino;
+    _mtime = info.st_mtime;
+    _header = reinterpret_cast<const BundleHeader*>(_base);
+    validate();
+    _entries = reinterpret_cast<const BundleEntry*>(_base + _header->entriesOffset);
+}
+
+bool Bundle::fits(uint64_t offset, uint64_t length, uint64_t size)
+{
+    return offset <= size && length <= size - offset;
+}
+
+// Every offset is checked once here so that find() can trust the table.
+void Bundle::validate() const
+{
+    const BundleHeader& h = *_header;
+
+    if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION)
+        throw std::runtime_error("Not a webserv bundle (or wrong version): " + _path);
+    if (h.fileSize != _size || h.entriesOffset % 8 != 0 || h.dataOffset > _size || h.stringsOffset > h.dataOffset
+        || !fits(h.entriesOffset, static_cast<uint64_t>(h.count) * sizeof(BundleEntry), h.stringsOffset))
+        throw std::runtime_error("Corrupt bundle header: " + _path);
+
+    const BundleEntry* entries = reinterpret_cast<const BundleEntry*>(_base + h.entriesOffset);
+    uint64_t stringsSize = h.dataOffset - h.stringsOffset;
+    for (uint32_t i = 0; i < h.count; ++i)
+    {
+        const BundleEntry& e = entries[i];
+        if (static_cast<uint64_t>(e.pathOffset) + e.pathLength >= stringsSize
+            || static_cast<uint64_t>(e.mimeOffset) + e.mimeLength >= stringsSize
+            || static_cast<uint64_t>(e.etagOffset) + e.etagLength >= stringsSize
+            || !fits(e.dataOffset, e.dataLength, _size) || !fits(e.gzipOffset, e.gzipLength, _size))
+            throw std::runtime_error("Corrupt bundle entry table: " + _path);
+        const char* strings = _base + h.stringsOffset;
+        if (strings[e.pathOffset + e.pathLength] || strings[e.mimeOffset + e.mimeLength] || strings[e.etagOffset + e.etagLength])
+            throw std::runtime_error("Corrupt bundle string table: " + _path);
+    }
+}
+
+static int comparePath(const char* a, size_t aLength, const char* b, size_t bLength)
+{
+    int order = std::memcmp(a, b, aLength < bLength ? aLength : bLength);
+    if (order != 0)
+        return order;
+    if (aLength == bLength)
+        return 0;
+    return aLength < bLength ? -1 : 1;
+}
+
+bool Bundle::find(const char* path, size_t length, File& file) const
+{
+    const char* strings = _base + _header->stringsOffset;
+    size_t low = 0;
+    size_t high = _header->count;
+
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        const BundleEntry& entry = _entries[middle];
+        int order = comparePath(strings + entry.pathOffset, entry.pathLength, path, length);
+        if (order == 0)
+        {
+            file.data = _base + entry.dataOffset;
+            file.length = entry.dataLength;
+            file.gzipData = entry.gzipLength ? _base + entry.gzipOffset : NULL;
+            file.gzipLength = entry.gzipLength;
+            file.mime = strings + entry.mimeOffset;
+            file.etag = strings + entry.etagOffset;
+            return true;
+        }
+        if (order < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return false;
+}
+
+size_t Bundle::count() const
+{
+    return _header->count;
+}
+
+const std::string& Bundle::path() const
+{
+    return _path;
+}
@@ -0,0 +1,568 @@
+#include "Cgi.hpp"
+#include "EventEngine.hpp"
+#include "HttpRequest.hpp"
+#include "ResponseCache.hpp"
+#include "Metrics.hpp"
+#include "Tls.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+CgiSession::CgiSession(pid_t pid, int stdinFd, int stdoutFd, int clientFd, TlsConnection* tls,
+    const std::string& body, unsigned long bodyOnSocket, bool chunked, const GzipPolicy* gzip, bool gzipAccepted)
+    : _pid(pid), _scriptPid(pid), _waitStatus(-1), _stdinFd(stdinFd), _stdoutFd(stdoutFd), _clientFd(clientFd), _tls(tls),
+      _engine(NULL), _chunked(chunked),
+      _gzip(gzip), _gzipAccepted(gzipAccepted), _phase(COLLECT), _toScript(body), _toScriptSent(0),
+      _bodyOnSocket(bodyOnSocket), _stdinBlocked(false), _scriptGone(false), _deadlineUs(0), _pendingSent(0),
+      _chunkLeft(0), _clientBlocked(false), _outputEnded(false), _hangup(false),
+      _bytesToClient(0)
+{
+    fcntl(stdinFd, F_SETFL, fcntl(stdinFd, F_GETFL) | O_NONBLOCK);
+    fcntl(stdoutFd, F_SETFL, fcntl(stdoutFd, F_GETFL) | O_NONBLOCK);
+    if (clientFd >= 0)
+        fcntl(clientFd, F_SETFL, fcntl(clientFd, F_GETFL) | O_NONBLOCK);
+}
+
+CgiSession::~CgiSession()
+{
+    closeStdin();
+    closeStdout();
+    if (_pid > 0)
+    {
+        kill(_pid, SIGKILL);
+        waitpid(_pid, NULL, 0);
+    }
+}
+
+void CgiSession::sendThrough(EventEngine* engine)
+{
+    _engine = engine;
+}
+
+CgiSession::Result CgiSession::start()
+{
+    writeBody();
+    return progress();
+}
+
+CgiSession::Result CgiSession::clientReady(short revents)
+{
+    if ((revents & POLLERR) || ((revents & POLLHUP) && !(revents & POLLIN)))
+        return CLIENT_GONE;
+    if ((revents & POLLIN) && !readBody())
+        return CLIENT_GONE;
+    if ((revents & POLLOUT) && _phase == STREAM)
+    {
+        _clientBlocked = false;
+        if (!streamOutput())
+            return CLIENT_GONE;
+    }
+    return progress();
+}
+
+// A pipe whose reader is gone reports POLLERR.
+CgiSession::Result CgiSession::stdinReady(short revents)
+{
+    if (revents & (POLLERR | POLLHUP))
+        _scriptGone = true;
+    else
+    {
+        _stdinBlocked = false;
+        writeBody();
+    }
+    return progress();
+}
+
+// POLLHUP is reported whatever was asked, so once the script has closed its
+// output the rest is taken off the pipe at once.
+CgiSession::Result CgiSession::stdoutReady(short revents)
+{
+    if (_phase == COLLECT && !collectOutput())
+        return CLIENT_GONE;
+    if (_phase == STREAM)
+    {
+        if ((revents & (POLLHUP | POLLERR)) && _engine && _engine->sending(_clientFd))
+        {
+            _hangup = true;
+            return progress();
+        }
+        if (revents & (POLLHUP | POLLERR))
+            drainOutput();
+        if (!streamOutput())
+            return CLIENT_GONE;
+    }
+    return progress();
+}
+
+CgiSession::Result CgiSession::expire(unsigned long nowUs)
+{
+    if (!_deadlineUs || nowUs < _deadlineUs)
+        return CONTINUE;
+    if (_pid > 0)
+        kill(_pid, SIGKILL);
+    reap();
+    Metrics::instance().cgiTimedOut();
+    _deadlineUs = 0;
+    _phase = ANSWERED;
+    _outputEnded = true;
+    _scriptGone = true;
+    std::string().swap(_output);
+    ResponseBuilder response = HttpRequest::generateDefaultErrorPage(504);
+    _response.swap(response);
+    return progress();
+}
+
+short CgiSession::clientEvents() const
+{
+    short events = 0;
+    if (_bodyOnSocket && (_scriptGone || (!_stdinBlocked && _toScriptSent == _toScript.size())))
+        events |= POLLIN;
+    if (_phase == STREAM && (_clientBlocked || _chunkLeft || _pendingSent < _pending.size()))
+        events |= POLLOUT;
+    return events;
+}
+
+short CgiSession::stdinEvents() const
+{
+    return _stdinFd >= 0 && !stdinDone() && _stdinBlocked ? POLLOUT : 0;
+}
+
+short CgiSession::stdoutEvents() const
+{
+    if (_stdoutFd < 0 || _outputEnded)
+        return 0;
+    if (_phase == STREAM && (_clientBlocked || _chunkLeft))
+        return 0;
+    return POLLIN;
+}
+
+unsigned long CgiSession::deadlineUs() const
+{
+    return _deadlineUs;
+}
+
+bool CgiSession::stdinDone() const
+{
+    return _stdinFd >= 0 && (_scriptGone || (!_bodyOnSocket && _toScriptSent == _toScript.size()));
+}
+
+// The script is timed from the end of its input.
+void CgiSession::closeStdin()
+{
+    if (_stdinFd < 0)
+        return;
+    close(_stdinFd);
+    _stdinFd = -1;
+    std::string().swap(_toScript);
+    _toScriptSent = 0;
+    if (_phase == COLLECT)
+        _deadlineUs = Metrics::nowMicros() + TIMEOUT_US;
+}
+
+bool CgiSession::stdoutDone() const
+{
+    return _stdoutFd >= 0 && _outputEnded;
+}
+
+bool CgiSession::stdoutHungUp() const
+{
+    return _hangup && !_outputEnded;
+}
+
+void CgiSession::closeStdout()
+{
+    if (_stdoutFd < 0)
+        return;
+    close(_stdoutFd);
+    _stdoutFd = -1;
+}
+
+LogFields& CgiSession::logFields()
+{
+    return _log;
+}
+
+ResponseBuilder& CgiSession::response()
+{
+    return _response;
+}
+
+int CgiSession::clientFd() const
+{
+    return _clientFd;
+}
+
+int CgiSession::stdinFd() const
+{
+    return _stdinFd;
+}
+
+int CgiSession::stdoutFd() const
+{
+    return _stdoutFd;
+}
+
+int CgiSession::status() const
+{
+    return _response.getStatusCode();
+}
+
+pid_t CgiSession::pid() const
+{
+    return _scriptPid;
+}
+
+int CgiSession::waitStatus() const
+{
+    return _waitStatus;
+}
+
+bool CgiSession::clientReusable() const
+{
+    return _phase == ANSWERED || _chunked;
+}
+
+unsigned long CgiSession::bytesToClient() const
+{
+    return _bytesToClient;
+}
+
+// Moves what the socket has towards the script, up to MAX_PER_EVENT. Off
+// TLS the bytes are spliced from the socket into the pipe. Returns false
+// when the client is gone.
+bool CgiSession::readBody()
+{
+    size_t moved = 0;
+    while (_bodyOnSocket && moved < MAX_PER_EVENT)
+    {
+        ssize_t count;
+        if (_scriptGone || _tls)
+        {
+            if (!_scriptGone && _toScriptSent < _toScript.size())
+                break;
+            char buffer[16384];
+            count = TlsConnection::read(_tls, _clientFd, buffer,
+                _bodyOnSocket < sizeof(buffer) ? _bodyOnSocket : sizeof(buffer));
+            if (count > 0 && !_scriptGone)
+            {
+                _toScript.assign(buffer, count);
+                _toScriptSent = 0;
+            }
+        }
+        else
+        {
+            if (_toScriptSent < _toScript.size() || _stdinBlocked)
+                break;
+            count = splice(_clientFd, NULL, _stdinFd, NULL, _bodyOnSocket < MAX_CHUNK ? _bodyOnSocket : MAX_CHUNK,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (count < 0 && errno == EPIPE)
+            {
+                _scriptGone = true;
+                continue;
+            }
+            if (count < 0 && errno == EAGAIN)
+            {
+                // Either side may have blocked: a pipe with room means the
+                // socket is empty.
+                struct pollfd room = { _stdinFd, POLLOUT, 0 };
+                if (poll(&room, 1, 0) == 1 && (room.revents & POLLERR))
+                {
+                    _scriptGone = true;
+                    continue;
+                }
+                _stdinBlocked = !(room.revents & POLLOUT);
+                break;
+            }
+        }
+        if (count == 0)
+            return false;
+        if (count < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        _bodyOnSocket -= count;
+        moved += count;
+        Metrics::instance().bytesReceived(count);
+        writeBody();
+    }
+    return true;
+}
+
+// Writes the body bytes held in user space; a script that has stopped
+// reading leaves them unwritten.
+void CgiSession::writeBody()
+{
+    while (!_scriptGone && _toScriptSent < _toScript.size())
+    {
+        ssize_t count = write(_stdinFd, _toScript.data() + _toScriptSent, _toScript.size() - _toScriptSent);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            _stdinBlocked = true;
+            return;
+        }
+        if (count <= 0)
+            _scriptGone = true;
+        else
+            _toScriptSent += count;
+    }
+    _toScript.clear();
+    _toScriptSent = 0;
+}
+
+// Returns false when the client is gone.
+bool CgiSession::collectOutput()
+{
+    char buffer[16384];
+    while (true)
+    {
+        ssize_t count = read(_stdoutFd, buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if (count <= 0)
+        {
+            finishCollected();
+            return true;
+        }
+        _output.append(buffer, count);
+        if (_clientFd >= 0 && _output.size() >= HIGH_WATER)
+        {
+            startStreaming();
+            return streamOutput();
+        }
+    }
+}
+
+// Sends the head and framing held in _pending, then splices each chunk
+// from the pipe into the socket; through TLS it is read into _pending
+// instead. Returns false when the client is gone.
+bool CgiSession::streamOutput()
+{
+    if (_engine)
+        return streamThroughRing();
+    size_t moved = 0;
+    while (moved < MAX_PER_EVENT)
+    {
+        if (!flushPending())
+            return false;
+        if (_clientBlocked)
+            return true;
+        if (!_chunkLeft)
+        {
+            int available = 0;
+            if (_outputEnded || ioctl(_stdoutFd, FIONREAD, &available) < 0 || available <= 0)
+                return true;
+            _chunkLeft = static_cast<size_t>(available) < MAX_CHUNK ? available : MAX_CHUNK;
+            chunkHeader(_chunkLeft);
+            continue;
+        }
+        ssize_t count;
+        if (!_tls || _tls->kernelSend())
+        {
+            count = splice(_stdoutFd, NULL, _clientFd, NULL, _chunkLeft, SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+                | SPLICE_F_MORE);
+            if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                // The pipe holds the whole chunk, so the socket is full.
+                _clientBlocked = true;
+                return true;
+            }
+            if (count <= 0)
+                return false;
+            _bytesToClient += count;
+            Metrics::instance().bytesSent(count);
+        }
+        else
+        {
+            char buffer[16384];
+            count = read(_stdoutFd, buffer, _chunkLeft < sizeof(buffer) ? _chunkLeft : sizeof(buffer));
+            if (count <= 0)
+                return false;
+            _pending.append(buffer, count);
+        }
+        _chunkLeft -= count;
+        moved += count;
+        if (!_chunkLeft && _chunked)
+            _pending.append("\r\n", 2);
+    }
+    return true;
+}
+
+// One chain at a time: what is left of _pending, then the current chunk
+// spliced from the pipe. Its result comes back on the next call, once the
+// engine reported the client writable.
+bool CgiSession::streamThroughRing()
+{
+    while (true)
+    {
+        if (!_chunkLeft && _pendingSent == _pending.size() && !_engine->sending(_clientFd) && !_outputEnded)
+        {
+            int available = 0;
+            if (ioctl(_stdoutFd, FIONREAD, &available) == 0 && available > 0)
+            {
+                _chunkLeft = static_cast<size_t>(available) < MAX_CHUNK ? available : MAX_CHUNK;
+                chunkHeader(_chunkLeft);
+            }
+            else if (_hangup)
+                drainOutput();
+        }
+        struct iovec iov;
+        iov.iov_base = const_cast<char*>(_pending.data() + _pendingSent);
+        iov.iov_len = _pending.size() - _pendingSent;
+        if (!iov.iov_len && !_chunkLeft && !_engine->sending(_clientFd))
+            return true;
+        ssize_t count = _engine->send(_clientFd, &iov, iov.iov_len ? 1 : 0, _chunkLeft ? _stdoutFd : -1, _chunkLeft);
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            _clientBlocked = true;
+            return true;
+        }
+        if (count <= 0)
+            return false;
+        size_t fromPending = std::min(static_cast<size_t>(count), iov.iov_len);
+        size_t spliced = count - fromPending;
+        _pendingSent += fromPending;
+        _chunkLeft -= spliced;
+        _bytesToClient += count;
+        Metrics::instance().bytesSent(count);
+        if (_pendingSent == _pending.size())
+        {
+            _pending.clear();
+            _pendingSent = 0;
+        }
+        if (spliced && !_chunkLeft && _chunked)
+            _pending.append("\r\n", 2);
+    }
+}
+
+bool CgiSession::flushPending()
+{
+    while (_pendingSent < _pending.size())
+    {
+        struct iovec iov;
+        iov.iov_base = const_cast<char*>(_pending.data() + _pendingSent);
+        iov.iov_len = _pending.size() - _pendingSent;
+        ssize_t count = TlsConnection::write(_tls, _clientFd, &iov, 1);
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            _clientBlocked = true;
+            return true;
+        }
+        if (count <= 0)
+            return false;
+        _pendingSent += count;
+        _bytesToClient += count;
+        Metrics::instance().bytesSent(count);
+    }
+    _pending.clear();
+    _pendingSent = 0;
+    return true;
+}
+
+// The head is taken from the collected output, which has to hold all of
+// it; the rest of what was collected is the first chunk.
+void CgiSession::startStreaming()
+{
+    CgiOutput parsed;
+    parsed.parse(_output);
+    std::string().swap(_output);
+    std::string first;
+    first.swap(parsed.body);
+    parsed.build(_response);
+    if (_chunked)
+        _response.header("Transfer-Encoding", "chunked");
+    else
+        _response.header("Connection", "close");
+    _response.finishHead();
+    _pending = _response.str();
+    frame(first.data(), first.size());
+    _phase = STREAM;
+    _deadlineUs = 0;
+}
+
+// The script exited within HIGH_WATER: it is answered whole.
+void CgiSession::finishCollected()
+{
+    reap();
+    _outputEnded = true;
+    _scriptGone = true;
+    _deadlineUs = 0;
+    _phase = ANSWERED;
+    CgiOutput parsed;
+    parsed.parse(_output);
+    std::string().swap(_output);
+    parsed.build(_response, _gzip, _gzipAccepted);
+}
+
+// The script closed its output: what is left in the pipe, at most its
+// capacity, is read into _pending so that only the client is waited for.
+void CgiSession::drainOutput()
+{
+    std::string rest;
+    char buffer[16384];
+    ssize_t count;
+    while ((count = read(_stdoutFd, buffer, sizeof(buffer))) > 0 || (count < 0 && errno == EINTR))
+    {
+        if (count > 0)
+            rest.append(buffer, count);
+    }
+    size_t current = _chunkLeft < rest.size() ? _chunkLeft : rest.size();
+    _pending.append(rest, 0, current);
+    if (_chunkLeft && _chunked)
+        _pending.append("\r\n", 2);
+    _chunkLeft = 0;
+    frame(rest.data() + current, rest.size() - current);
+    if (_chunked)
+        _pending.append("0\r\n\r\n", 5);
+    _outputEnded = true;
+    _scriptGone = true;
+    reap();
+}
+
+void CgiSession::frame(const char* data, size_t length)
+{
+    if (!length)
+        return;
+    chunkHeader(length);
+    _pending.append(data, length);
+    if (_chunked)
+        _pending.append("\r\n", 2);
+}
+
+void CgiSession::chunkHeader(size_t length)
+{
+    if (!_chunked)
+        return;
+    char header[24];
+    int size = std::snprintf(header, sizeof(header), "%lx\r\n", static_cast<unsigned long>(length));
+    _pending.append(header, size);
+}
+
+// The output is closed, so the script is exiting: it is waited for as
+// CacheFill does. Its exit status does not change the response.
+void CgiSession::reap()
+{
+    if (_pid <= 0)
+        return;
+    waitpid(_pid, &_waitStatus, 0);
+    _pid = -1;
+}
+
+CgiSession::Result CgiSession::progress() const
+{
+    if (_bodyOnSocket)
+        return CONTINUE;
+    if (_phase == ANSWERED)
+        return RESPOND;
+    if (_phase == STREAM && _outputEnded && !_chunkLeft && _pending.empty())
+        return DONE;
+    return CONTINUE;
+}
@@ -0,0 +1,242 @@
+#include "ClientLimiter.hpp"
+#include <sstream>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstring>
+
+/* ------------------------------------------------------------------------ */
+/*                               ClientLimit                                */
+/* ------------------------------------------------------------------------ */
+
+ClientLimit::ClientLimit() : zone(0), rate(0), burst(0), connections(0)
+{
+}
+
+bool ClientLimit::limitsRequests() const
+{
+    return rate != 0;
+}
+
+bool ClientLimit::limitsConnections() const
+{
+    return connections != 0;
+}
+
+void ClientLimit::parseRequestLimit(const std::string& value)
+{
+    std::istringstream words(value);
+    std::string word;
+    if (!(words >> word))
+        throw std::runtime_error("Error: Missing value for 'limit_req'");
+
+    char* end;
+    unsigned long count = std::strtoul(word.c_str(), &end, 10);
+    std::string unit = end;
+    if (count == 0 || count > 1000000 || (unit != "r/s" && unit != "r/m"))
+        throw std::runtime_error("Error: Invalid rate '" + word + "' for 'limit_req'. Expected: <n>r/s or <n>r/m");
+    rate = unit == "r/s" ? count * 1000 : (count * 1000 + 59) / 60;
+
+    burst = 0;
+    while (words >> word)
+    {
+        if (word.compare(0, 6, "burst=") != 0)
+            throw std::runtime_error("Error: Unknown parameter '" + word + "' for 'limit_req'");
+        burst = std::strtoul(word.c_str() + 6, &end, 10);
+        if (*end || end == word.c_str() + 6 || burst > 1000000)
+            throw std::runtime_error("Error: Invalid burst '" + word + "' for 'limit_req'");
+    }
+}
+
+void ClientLimit::parseConnectionLimit(const std::string& value)
+{
+    char* end;
+    connections = std::strtoul(value.c_str(), &end, 10);
+    if (value.empty() || *end || connections == 0)
+        throw std::runtime_error("Error: Invalid value '" + value + "' for 'limit_conn'");
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                ClientKey                                 */
+/* ------------------------------------------------------------------------ */
+
+ClientKey::ClientKey()
+{
+    std::memset(bytes, 0, sizeof(bytes));
+}
+
+bool ClientKey::operator==(const ClientKey& other) const
+{
+    return std::memcmp(bytes, other.bytes, sizeof(bytes)) == 0;
+}
+
+/* ------------------------------------------------------------------------ */
+/*                              ClientLimiter                               */
+/* ------------------------------------------------------------------------ */
+
+ClientLimiter::ClientLimiter()
+    : _entries(CAPACITY), _buckets(BUCKETS, -1), _used(0), _newest(-1), _oldest(-1), _evictions(0)
+{
+}
+
+// Only spreads the chains: find() compares whole keys, so addresses that
+// share a bucket never share an entry.
+size_t ClientLimiter::bucketFor(const ClientKey& address, unsigned long zone) const
+{
+    uint64_t words[2];
+    std::memcpy(words, address.bytes, sizeof(words));
+    uint64_t hash = (words[0] * 0x9E3779B97F4A7C15ULL) ^ words[1] ^ (zone << 7) ^ (zone >> 13);
+    hash *= 0x9E3779B97F4A7C15ULL;
+    return (hash >> 32) & (BUCKETS - 1);
+}
+
+int ClientLimiter::find(const ClientKey& address, unsigned long zone)
+{
+    for (int i = _buckets[bucketFor(address, zone)]; i >= 0; i = _entries[i].hashNext)
+    {
+        if (_entries[i].address == address && _entries[i].zone == zone)
+        {
+            unlinkLru(i);
+            pushNewest(i);
+            return i;
+        }
+    }
+    return -1;
+}
+
+// A new client starts with a full bucket. Returns -1 when every entry still
+// has requests in flight.
+int ClientLimiter::insert(const ClientKey& address, unsigned long zone, unsigned long nowUs, const ClientLimit& limit)
+{
+    int index;
+    if (_used < CAPACITY)
+        index = static_cast<int>(_used++);
+    else
+    {
+        index = _oldest;
+        while (index >= 0 && _entries[index].inFlight)
+            index = _entries[index].newer;
+        if (index < 0)
+            return -1;
+        unlinkHash(index);
+        unlinkLru(index);
+        ++_evictions;
+    }
+
+    Entry& entry = _entries[index];
+    size_t bucket = bucketFor(address, zone);
+    entry.address = address;
+    entry.zone = zone;
+    entry.tokens = (limit.burst + 1) * 1000;
+    entry.refilledUs = nowUs;
+    entry.inFlight = 0;
+    entry.hashNext = _buckets[bucket];
+    _buckets[bucket] = index;
+    pushNewest(index);
+    return index;
+}
+
+void ClientLimiter::unlinkHash(int index)
+{
+    int* link = &_buckets[bucketFor(_entries[index].address, _entries[index].zone)];
+    while (*link != index)
+        link = &_entries[*link].hashNext;
+    *link = _entries[index].hashNext;
+}
+
+void ClientLimiter::unlinkLru(int index)
+{
+    Entry& entry = _entries[index];
+    if (entry.newer >= 0)
+        _entries[entry.newer].older = entry.older;
+    else
+        _newest = entry.older;
+    if (entry.older >= 0)
+        _entries[entry.older].newer = entry.newer;
+    else
+        _oldest = entry.newer;
+}
+
+void ClientLimiter::pushNewest(int index)
+{
+    Entry& entry = _entries[index];
+    entry.newer = -1;
+    entry.older = _newest;
+    if (_newest >= 0)
+        _entries[_newest].newer = index;
+    _newest = index;
+    if (_oldest < 0)
+        _oldest = index;
+}
+
+// Token bucket holding burst + 1 requests, refilled at rate. Tokens are
+// counted in thousandths so rates below one request per second stay exact
+// enough.
+bool ClientLimiter::takeToken(const ClientKey& address, const ClientLimit& limit, unsigned long nowUs,
+    unsigned long& retryAfter)
+{
+    int index = find(address, limit.zone);
+    if (index < 0)
+        index = insert(address, limit.zone, nowUs, limit);
+    if (index < 0)
+        return true;
+
+    Entry& entry = _entries[index];
+    unsigned long capacity = (limit.burst + 1) * 1000;
+    unsigned long elapsedUs = nowUs - entry.refilledUs;
+    if (entry.tokens >= capacity || elapsedUs >= (capacity - entry.tokens) * 1000000UL / limit.rate)
+    {
+        entry.tokens = capacity;
+        entry.refilledUs = nowUs;
+    }
+    else
+    {
+        unsigned long gained = limit.rate * elapsedUs / 1000000UL;
+        if (gained)
+        {
+            entry.tokens += gained;
+            entry.refilledUs = nowUs;
+        }
+    }
+
+    if (entry.tokens >= 1000)
+    {
+        entry.tokens -= 1000;
+        return true;
+    }
+    retryAfter = ((1000 - entry.tokens) + limit.rate - 1) / limit.rate;
+    if (retryAfter == 0)
+        retryAfter = 1;
+    return false;
+}
+
+bool ClientLimiter::acquire(const ClientKey& address, const ClientLimit& limit, unsigned long nowUs, int& slot)
+{
+    slot = find(address, limit.zone);
+    if (slot < 0)
+        slot = insert(address, limit.zone, nowUs, limit);
+    if (slot < 0)
+        return true;
+    if (_entries[slot].inFlight >= limit.connections)
+    {
+        slot = -1;
+        return false;
+    }
+    ++_entries[slot].inFlight;
+    return true;
+}
+
+void ClientLimiter::release(int slot)
+{
+    if (slot >= 0 && _entries[slot].inFlight)
+        --_entries[slot].inFlight;
+}
+
+size_t ClientLimiter::size() const
+{
+    return _used;
+}
+
+unsigned long ClientLimiter::evictions() const
+{
+    return _evictions;
+}
@@ -0,0 +1,805 @@
+#include "EventEngine.hpp"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static uint64_t userData(int kind, uint32_t generation, int fd)
+{
+    return static_cast<uint64_t>(kind) << 56 | static_cast<uint64_t>(generation & 0xffffff) << 32
+        | static_cast<uint32_t>(fd);
+}
+
+static uint32_t pollMask(short events)
+{
+    uint32_t mask = static_cast<unsigned short>(events);
+#if __BYTE_ORDER == __BIG_ENDIAN
+    mask = mask << 16 | mask >> 16;
+#endif
+    return mask;
+}
+
+EventEngine::Accepted::Accepted() : error(0)
+{
+}
+
+EventEngine::Received::Received() : ended(false), error(0)
+{
+}
+
+EventEngine::EventEngine()
+    : _backend(POLL), _ring(-1), _rings(MAP_FAILED), _ringsSize(0), _sqes(NULL), _sqesSize(0), _sqHead(NULL),
+      _sqTail(NULL), _sqArray(NULL), _sqMask(0), _sqEntries(0), _unsubmitted(0), _cqHead(NULL), _cqTail(NULL),
+      _cqes(NULL), _cqMask(0), _buffers(NULL), _bufferMemory(NULL), _bufferTail(0), _fds(NULL), _ready(0),
+      _multishot(true)
+{
+}
+
+EventEngine::~EventEngine()
+{
+    closeRing();
+}
+
+// Deferred task running leaves completions to be processed in
+// io_uring_enter(), by the one thread that waits anyway. Older kernels
+// refuse the flags they do not know, so they are dropped one set at a time.
+bool EventEngine::useUring()
+{
+    static const unsigned attempts[] = {
+        IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL,
+        IORING_SETUP_CQSIZE
+    };
+    io_uring_params params;
+    for (size_t i = 0; i < sizeof(attempts) / sizeof(attempts[0]); ++i)
+    {
+        std::memset(&params, 0, sizeof(params));
+        params.flags = attempts[i];
+        params.cq_entries = CQ_ENTRIES;
+        _ring = syscall(__NR_io_uring_setup, SQ_ENTRIES, &params);
+        if (_ring >= 0 || errno != EINVAL)
+            break;
+    }
+    if (_ring < 0)
+        return false;
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & needed) != needed)
+    {
+        closeRing();
+        return false;
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    _ringsSize = std::max(sqSize, cqSize);
+    _rings = mmap(NULL, _ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+    _sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQES);
+    if (_rings == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, _sqesSize);
+        closeRing();
+        return false;
+    }
+    _sqes = static_cast<io_uring_sqe*>(sqes);
+    char* base = static_cast<char*>(_rings);
+    _sqHead = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+    _sqTail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+    _sqArray = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+    _sqMask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+    _sqEntries = params.sq_entries;
+    _cqHead = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+    _cqTail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+    _cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+    _cqMask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+    _backend = URING;
+    _multishot = true;
+    setupBuffers();
+    return true;
+}
+
+// The buffers receives are made into. Without them (before Linux 5.19)
+// nothing is managed and the loop does its own reads and writes.
+bool EventEngine::setupBuffers()
+{
+    size_t ringSize = RECV_BUFFERS * sizeof(io_uring_buf);
+    size_t memorySize = static_cast<size_t>(RECV_BUFFERS) * RECV_BUFFER_SIZE;
+    void* ring = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void* memory = mmap(NULL, memorySize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    io_uring_buf_reg registration;
+    std::memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = reinterpret_cast<uint64_t>(ring);
+    registration.ring_entries = RECV_BUFFERS;
+    if (ring == MAP_FAILED || memory == MAP_FAILED
+        || syscall(__NR_io_uring_register, _ring, IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+    {
+        if (ring != MAP_FAILED)
+            munmap(ring, ringSize);
+        if (memory != MAP_FAILED)
+            munmap(memory, memorySize);
+        return false;
+    }
+    _buffers = static_cast<io_uring_buf*>(ring);
+    _bufferMemory = static_cast<char*>(memory);
+    _bufferTail = 0;
+    for (unsigned id = 0; id < RECV_BUFFERS; ++id)
+        recycle(id);
+    return true;
+}
+
+EventEngine::Backend EventEngine::backend() const
+{
+    return _backend;
+}
+
+const char* EventEngine::name() const
+{
+    return _backend == URING ? "io_uring" : "poll";
+}
+
+int EventEngine::wait(std::vector<pollfd>& fds, const std::vector<int>& listeners, int timeoutMs)
+{
+    if (_backend == POLL)
+        return poll(&fds[0], fds.size(), timeoutMs);
+    return waitUring(fds, listeners, timeoutMs);
+}
+
+// Every descriptor is placed first: a full submission queue reaps
+// completions while the second pass arms, and they have to land.
+int EventEngine::waitUring(std::vector<pollfd>& fds, const std::vector<int>& listeners, int timeoutMs)
+{
+    _fds = &fds;
+    _ready = 0;
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        fds[i].revents = 0;
+        if (fds[i].fd >= 0)
+            watch(fds[i].fd).index = i;
+    }
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        int fd = fds[i].fd;
+        if (fd < 0)
+            continue;
+        Watch& current = _watches[fd];
+        bool reported = current.reported;
+        current.reported = false;
+        short events = fds[i].events;
+        if (current.reads)
+        {
+            if ((events & POLLIN) && current.buffered)
+                report(fd, POLLIN);
+            else if ((events & POLLIN) && !current.receiving)
+                armReceive(fd, current);
+            events &= ~POLLIN;
+        }
+        if (current.writes)
+        {
+            if ((events & POLLOUT) && !current.sending)
+                report(fd, POLLOUT);
+            events &= ~POLLOUT;
+        }
+
+        bool listener = current.listener || std::find(listeners.begin(), listeners.end(), fd) != listeners.end();
+        bool accepting = listener && !current.acceptByPoll && !current.outOfFds;
+        if (current.state == ACCEPTING && accepting)
+            continue;
+        if (current.reads && !events && !accepting)
+        {
+            // All it waits for comes from the ring.
+            if (current.state != IDLE)
+                cancel(fd, current);
+            continue;
+        }
+        if (current.state == POLLING && current.armed == events && !accepting)
+        {
+            if (reported && !current.probing && _multishot && !(events & POLLOUT))
+                probe(fd, current);
+            continue;
+        }
+        if (current.state != IDLE)
+            cancel(fd, current);
+        arm(fd, events, listener);
+    }
+
+    bool queued = _ready > 0;
+    for (std::map<int, Accepted>::iterator it = _accepted.begin(); it != _accepted.end(); ++it)
+        queued = queued || !it->second.fds.empty() || it->second.error;
+    int result = enter(queued || timeoutMs == 0 ? 0 : 1, timeoutMs);
+    int error = errno;
+    reap();
+    for (std::map<int, Accepted>::iterator it = _accepted.begin(); it != _accepted.end(); ++it)
+    {
+        if (!it->second.fds.empty() || it->second.error)
+            report(it->first, POLLIN);
+    }
+    _fds = NULL;
+    // ETIME is the timeout; EBUSY and EAGAIN a full completion queue, just
+    // emptied.
+    if (result < 0 && error != ETIME && error != EBUSY && error != EAGAIN && !_ready)
+    {
+        errno = error;
+        return -1;
+    }
+    return _ready;
+}
+
+// What a cancelled receive or chain still completes with belongs to an
+// earlier epoch, and only gives its buffers back.
+void EventEngine::forget(int fd)
+{
+    if (_backend == POLL || fd < 0 || static_cast<size_t>(fd) >= _watches.size())
+        return;
+    Watch& current = _watches[fd];
+    if (current.state != IDLE)
+        cancel(fd, current);
+    if (current.receiving)
+        cancelOperation(IORING_OP_ASYNC_CANCEL, userData(OP_RECV, current.epoch, fd), 0);
+    if (current.sending)
+    {
+        cancelOperation(IORING_OP_ASYNC_CANCEL, userData(OP_SEND, current.epoch, fd), IORING_ASYNC_CANCEL_ALL);
+        cancelOperation(IORING_OP_ASYNC_CANCEL, userData(OP_SEND_POLL, current.epoch, fd), 0);
+    }
+    ++current.epoch;
+    current.listener = false;
+    current.acceptByPoll = false;
+    current.outOfFds = false;
+    current.reported = false;
+    current.reads = false;
+    current.writes = false;
+    current.receiving = false;
+    current.buffered = false;
+    current.sending = false;
+    current.sent = false;
+    std::map<int, Received>::iterator received = _received.find(fd);
+    if (received != _received.end())
+    {
+        for (size_t i = 0; i < received->second.buffers.size(); ++i)
+            recycle(received->second.buffers[i].first);
+        _received.erase(received);
+    }
+    std::map<int, Accepted>::iterator it = _accepted.find(fd);
+    if (it != _accepted.end())
+    {
+        for (size_t i = 0; i < it->second.fds.size(); ++i)
+            close(it->second.fds[i]);
+        _accepted.erase(it);
+    }
+}
+
+// Connections the kernel accepted go first, even once the listener is back
+// to being polled. The peer address did not come with them, as a multishot
+// accept shares one buffer between all of them.
+int EventEngine::accept(int listener, sockaddr_storage& address, socklen_t& length)
+{
+    std::map<int, Accepted>::iterator it = _accepted.find(listener);
+    if (it != _accepted.end() && !it->second.fds.empty())
+    {
+        int fd = it->second.fds.front();
+        it->second.fds.pop_front();
+        std::memset(&address, 0, sizeof(address));
+        if (getpeername(fd, reinterpret_cast<sockaddr*>(&address), &length) != 0)
+            length = 0;
+        return fd;
+    }
+    if (it != _accepted.end() && it->second.error)
+    {
+        errno = it->second.error;
+        it->second.error = 0;
+        return -1;
+    }
+    Watch* current = static_cast<size_t>(listener) < _watches.size() ? &_watches[listener] : NULL;
+    if (_backend == POLL || (current && (current->acceptByPoll || current->outOfFds)))
+    {
+        int fd = ::accept(listener, reinterpret_cast<sockaddr*>(&address), &length);
+        if (fd >= 0 && current)
+            current->outOfFds = false;
+        return fd;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+bool EventEngine::acceptPending(int listener) const
+{
+    std::map<int, Accepted>::const_iterator it = _accepted.find(listener);
+    return it != _accepted.end() && !it->second.fds.empty();
+}
+
+// A receive armed when the reads are handed back is cancelled; if it
+// already had data, that is still reported and handed over by receive().
+void EventEngine::manage(int fd, bool reads, bool writes)
+{
+    if (_backend == POLL || !_buffers || fd < 0)
+        return;
+    Watch& current = watch(fd);
+    current.reads = reads;
+    current.writes = writes;
+    if (!reads && current.receiving)
+    {
+        cancelOperation(IORING_OP_ASYNC_CANCEL, userData(OP_RECV, current.epoch, fd), 0);
+        current.receiving = false;
+    }
+}
+
+bool EventEngine::managesWrites(int fd) const
+{
+    return _backend == URING && fd >= 0 && static_cast<size_t>(fd) < _watches.size() && _watches[fd].writes;
+}
+
+ssize_t EventEngine::receive(int fd, std::string& buffer, size_t length)
+{
+    std::map<int, Received>::iterator it = _received.end();
+    if (_backend == URING && fd >= 0 && static_cast<size_t>(fd) < _watches.size() && _watches[fd].buffered)
+        it = _received.find(fd);
+    if (it == _received.end())
+    {
+        char chunk[16384];
+        ssize_t count = recv(fd, chunk, std::min(length, sizeof(chunk)), MSG_DONTWAIT);
+        if (count > 0)
+            buffer.append(chunk, count);
+        return count;
+    }
+
+    Received& received = it->second;
+    size_t total = 0;
+    for (; !received.buffers.empty(); received.buffers.pop_front())
+    {
+        unsigned id = received.buffers.front().first;
+        buffer.append(_bufferMemory + static_cast<size_t>(id) * RECV_BUFFER_SIZE, received.buffers.front().second);
+        total += received.buffers.front().second;
+        recycle(id);
+    }
+    int error = received.error;
+    bool ended = received.ended;
+    if (!total || (!ended && !error))
+    {
+        _received.erase(it);
+        _watches[fd].buffered = false;
+    }
+    if (total)
+        return total;
+    if (error)
+    {
+        errno = error;
+        return -1;
+    }
+    if (ended)
+        return 0;
+    errno = EAGAIN;
+    return -1;
+}
+
+// Without the ring, the data is written at once and the pipe spliced after
+// it as far as the socket takes them.
+ssize_t EventEngine::send(int fd, const struct iovec* iov, int count, int spliceFd, size_t spliceLength)
+{
+    size_t total = 0;
+    for (int i = 0; i < count; ++i)
+        total += iov[i].iov_len;
+    if (!managesWrites(fd))
+    {
+        ssize_t sent = 0;
+        if (total)
+        {
+            struct msghdr message;
+            std::memset(&message, 0, sizeof(message));
+            message.msg_iov = const_cast<struct iovec*>(iov);
+            message.msg_iovlen = count;
+            sent = sendmsg(fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        if (sent < 0 || static_cast<size_t>(sent) < total || spliceFd < 0 || !spliceLength)
+            return sent;
+        ssize_t spliced = splice(spliceFd, NULL, fd, NULL, spliceLength, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (spliced < 0)
+            return sent ? sent : -1;
+        return sent + spliced;
+    }
+
+    Watch& current = _watches[fd];
+    if (current.sent)
+    {
+        current.sent = false;
+        if (current.result >= 0)
+            return current.result;
+        errno = static_cast<int>(-current.result);
+        return -1;
+    }
+    errno = EAGAIN;
+    if (current.sending)
+        return -1;
+
+    uint64_t key = userData(OP_SEND, current.epoch, fd);
+    Chain& chain = _chains[key];
+    chain.data.clear();
+    for (int i = 0; i < count && chain.data.size() < SEND_LIMIT; ++i)
+        chain.data.append(static_cast<const char*>(iov[i].iov_base),
+            std::min(iov[i].iov_len, SEND_LIMIT - chain.data.size()));
+    bool splicing = chain.data.size() == total && spliceFd >= 0 && spliceLength;
+    chain.pending = (chain.data.empty() ? 0 : 1) + (splicing ? 2 : 0);
+    chain.moved = 0;
+    chain.error = 0;
+    if (!chain.pending)
+    {
+        _chains.erase(key);
+        return 0;
+    }
+    io_uring_sqe* sqe = nextSqe(chain.pending);
+    if (!sqe)
+    {
+        _chains.erase(key);
+        return -1;
+    }
+    if (!chain.data.empty())
+    {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(chain.data.data());
+        sqe->len = chain.data.size();
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = key;
+        if (splicing)
+        {
+            sqe->flags = IOSQE_IO_LINK;
+            sqe = nextSqe();
+        }
+    }
+    if (splicing)
+    {
+        // A splice into a full socket fails rather than waits, so it waits
+        // on a poll for room first.
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = pollMask(POLLOUT);
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = userData(OP_SEND_POLL, current.epoch, fd);
+        sqe = nextSqe();
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = fd;
+        sqe->splice_fd_in = spliceFd;
+        sqe->splice_off_in = static_cast<uint64_t>(-1);
+        sqe->off = static_cast<uint64_t>(-1);
+        sqe->len = spliceLength < 0x40000000 ? spliceLength : 0x40000000;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->user_data = key;
+    }
+    current.sending = true;
+    return -1;
+}
+
+bool EventEngine::sending(int fd) const
+{
+    return managesWrites(fd) && (_watches[fd].sending || _watches[fd].sent);
+}
+
+// Left idle when the submission queue cannot take it; the next wait()
+// tries again. A writable socket stays writable, and a multishot poll for
+// POLLOUT would complete on every wakeup of the socket: that one, like
+// every poll on kernels before 5.13, is one-shot and re-armed each time it
+// fires.
+void EventEngine::arm(int fd, short events, bool listener)
+{
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe)
+        return;
+    Watch& current = watch(fd);
+    ++current.generation;
+    current.listener = listener;
+    sqe->fd = fd;
+    if (listener && !current.acceptByPoll && !current.outOfFds)
+    {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = userData(OP_ACCEPT, current.generation, fd);
+        current.state = ACCEPTING;
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->len = _multishot && !(events & POLLOUT) ? IORING_POLL_ADD_MULTI : 0;
+    sqe->poll32_events = pollMask(events);
+    sqe->user_data = userData(OP_POLL, current.generation, fd);
+    current.armed = events;
+    current.state = POLLING;
+    current.probing = false;
+}
+
+// A one-shot poll next to the multishot one: it completes at once if the
+// descriptor is still ready, or along with the multishot poll otherwise.
+void EventEngine::probe(int fd, Watch& watch)
+{
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = pollMask(watch.armed);
+    sqe->user_data = userData(OP_PROBE, watch.generation, fd);
+    watch.probing = true;
+}
+
+void EventEngine::armReceive(int fd, Watch& watch)
+{
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->len = RECV_BUFFER_SIZE;
+    sqe->user_data = userData(OP_RECV, watch.epoch, fd);
+    watch.receiving = true;
+}
+
+// The watch is idle at once: whatever the cancelled operation still
+// completes with belongs to an older generation.
+void EventEngine::cancel(int fd, Watch& watch)
+{
+    bool accepting = watch.state == ACCEPTING;
+    watch.state = IDLE;
+    cancelOperation(accepting ? IORING_OP_ASYNC_CANCEL : IORING_OP_POLL_REMOVE,
+        userData(accepting ? OP_ACCEPT : OP_POLL, watch.generation, fd), 0);
+    if (watch.probing)
+        cancelOperation(IORING_OP_POLL_REMOVE, userData(OP_PROBE, watch.generation, fd), 0);
+    watch.probing = false;
+}
+
+void EventEngine::cancelOperation(int opcode, uint64_t data, unsigned flags)
+{
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe)
+        return;
+    sqe->opcode = opcode;
+    sqe->fd = -1;
+    sqe->addr = data;
+    sqe->cancel_flags = flags;
+    sqe->user_data = userData(OP_CANCEL, 0, static_cast<int>(data & 0xffffffff));
+}
+
+// Gives a receive buffer back to the kernel. The ring's tail overlays the
+// reserved field of its first entry.
+void EventEngine::recycle(unsigned id)
+{
+    io_uring_buf& entry = _buffers[_bufferTail & (RECV_BUFFERS - 1)];
+    entry.addr = reinterpret_cast<uint64_t>(_bufferMemory + static_cast<size_t>(id) * RECV_BUFFER_SIZE);
+    entry.len = RECV_BUFFER_SIZE;
+    entry.bid = id;
+    ++_bufferTail;
+    __atomic_store_n(&_buffers[0].resv, _bufferTail, __ATOMIC_RELEASE);
+}
+
+// room entries are made free together, for a chain. A full queue is
+// submitted first; if the kernel takes none of it the completion queue is
+// emptied and submission tried once more.
+io_uring_sqe* EventEngine::nextSqe(unsigned room)
+{
+    unsigned tail = *_sqTail;
+    for (int attempt = 0; tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) + room > _sqEntries; ++attempt)
+    {
+        if (attempt == 2)
+            return NULL;
+        if (attempt)
+            reap();
+        enter(0, 0);
+    }
+    unsigned slot = tail & _sqMask;
+    io_uring_sqe* sqe = &_sqes[slot];
+    std::memset(sqe, 0, sizeof(*sqe));
+    _sqArray[slot] = slot;
+    __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++_unsubmitted;
+    return sqe;
+}
+
+// Submits what is queued and waits for minComplete completions, at most
+// timeoutMs when it is not negative.
+int EventEngine::enter(unsigned minComplete, int timeoutMs)
+{
+    io_uring_getevents_arg arg;
+    __kernel_timespec timeout;
+    std::memset(&arg, 0, sizeof(arg));
+    if (minComplete && timeoutMs >= 0)
+    {
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+        arg.ts = reinterpret_cast<uint64_t>(&timeout);
+    }
+    int result = syscall(__NR_io_uring_enter, _ring, _unsubmitted, minComplete,
+        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (result > 0)
+        _unsubmitted -= std::min(static_cast<unsigned>(result), _unsubmitted);
+    return result;
+}
+
+void EventEngine::reap()
+{
+    unsigned head = *_cqHead;
+    unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+        const io_uring_cqe& cqe = _cqes[head & _cqMask];
+        complete(cqe.user_data, cqe.res, cqe.flags);
+    }
+    __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+}
+
+// A poll that fired marks its descriptor for a probe at the next wait,
+// even if the report found no place in the set: a multishot poll does not
+// fire again for the same readiness. A connection accepted for a listener
+// that has since been forgotten is closed. EINVAL on a multishot accept
+// means the kernel predates it: the listener is polled and accepted from
+// instead. So it is after EMFILE and ENFILE, which come whether a
+// connection is waiting or not.
+void EventEngine::complete(uint64_t data, int result, unsigned flags)
+{
+    int kind = static_cast<int>(data >> 56);
+    int fd = static_cast<int>(data & 0xffffffff);
+    uint32_t generation = (data >> 32) & 0xffffff;
+    if (kind == OP_CANCEL)
+        return;
+    if (kind == OP_RECV)
+    {
+        completeReceive(fd, generation, result, flags);
+        return;
+    }
+    if (kind == OP_SEND || kind == OP_SEND_POLL)
+    {
+        completeChain(userData(OP_SEND, generation, fd), result, kind == OP_SEND_POLL);
+        return;
+    }
+    bool current = static_cast<size_t>(fd) < _watches.size() && _watches[fd].state != IDLE
+        && _watches[fd].generation == generation;
+    if (kind == OP_POLL || kind == OP_PROBE)
+    {
+        if (!current)
+            return;
+        Watch& watch = _watches[fd];
+        if (kind == OP_PROBE)
+            watch.probing = false;
+        else if (!(flags & IORING_CQE_F_MORE))
+            watch.state = IDLE;
+        if (kind == OP_POLL && result == -EINVAL && _multishot)
+        {
+            _multishot = false;
+            return;
+        }
+        if (kind == OP_PROBE && result < 0)
+            return;
+        watch.reported = true;
+        report(fd, result < 0 ? POLLNVAL : static_cast<short>(result));
+        return;
+    }
+    if (!current)
+    {
+        if (result >= 0)
+            close(result);
+        return;
+    }
+    if (!(flags & IORING_CQE_F_MORE))
+        _watches[fd].state = IDLE;
+    if (result >= 0)
+        _accepted[fd].fds.push_back(result);
+    else if (result == -EINVAL && _accepted.find(fd) == _accepted.end())
+        _watches[fd].acceptByPoll = true;
+    else if (result == -EMFILE || result == -ENFILE)
+        _watches[fd].outOfFds = true;
+    else
+        _accepted[fd].error = -result;
+}
+
+// ENOBUFS is a receive that found the buffer ring empty: the descriptor
+// is reported and receive() reads it itself.
+void EventEngine::completeReceive(int fd, uint32_t epoch, int result, unsigned flags)
+{
+    bool hasBuffer = flags & IORING_CQE_F_BUFFER;
+    unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+    if (static_cast<size_t>(fd) >= _watches.size() || (_watches[fd].epoch & 0xffffff) != epoch
+        || result == -ECANCELED)
+    {
+        if (hasBuffer)
+            recycle(id);
+        return;
+    }
+    Watch& watch = _watches[fd];
+    watch.receiving = false;
+    if (result > 0 && hasBuffer)
+        _received[fd].buffers.push_back(std::make_pair(id, static_cast<unsigned>(result)));
+    else
+    {
+        if (hasBuffer)
+            recycle(id);
+        if (result == 0)
+            _received[fd].ended = true;
+        else if (result != -ENOBUFS)
+            _received[fd].error = -result;
+    }
+    watch.buffered = _received.find(fd) != _received.end();
+    report(fd, POLLIN);
+}
+
+// A short send breaks the chain, and the rest of it completes with
+// ECANCELED. The chain reports what it moved, or its first error.
+void EventEngine::completeChain(uint64_t data, int result, bool poll)
+{
+    std::map<uint64_t, Chain>::iterator it = _chains.find(data);
+    if (it == _chains.end())
+        return;
+    Chain& chain = it->second;
+    if (result > 0 && !poll)
+        chain.moved += result;
+    else if (result < 0 && result != -ECANCELED && !chain.error)
+        chain.error = -result;
+    if (--chain.pending)
+        return;
+
+    int fd = static_cast<int>(data & 0xffffffff);
+    uint32_t epoch = (data >> 32) & 0xffffff;
+    if (static_cast<size_t>(fd) < _watches.size() && _watches[fd].sending
+        && (_watches[fd].epoch & 0xffffff) == epoch)
+    {
+        Watch& watch = _watches[fd];
+        watch.sending = false;
+        watch.sent = true;
+        watch.result = chain.moved ? chain.moved : -(chain.error ? chain.error : EAGAIN);
+        report(fd, POLLOUT);
+    }
+    _chains.erase(it);
+}
+
+void EventEngine::report(int fd, short revents)
+{
+    if (!_fds)
+        return;
+    std::vector<pollfd>& fds = *_fds;
+    size_t index = _watches[fd].index;
+    if (index >= fds.size() || fds[index].fd != fd)
+        return;
+    if (!fds[index].revents)
+        ++_ready;
+    fds[index].revents |= revents;
+}
+
+EventEngine::Watch& EventEngine::watch(int fd)
+{
+    if (static_cast<size_t>(fd) >= _watches.size())
+    {
+        Watch idle = { 0, 0, 0, IDLE, false, false, false, false, false, false, false, false, false, false, false, 0,
+            0 };
+        _watches.resize(std::max(static_cast<size_t>(fd) + 1, _watches.size() * 2), idle);
+    }
+    return _watches[fd];
+}
+
+void EventEngine::closeRing()
+{
+    for (std::map<int, Accepted>::iterator it = _accepted.begin(); it != _accepted.end(); ++it)
+    {
+        for (size_t i = 0; i < it->second.fds.size(); ++i)
+            close(it->second.fds[i]);
+    }
+    _accepted.clear();
+    _received.clear();
+    if (_sqes)
+        munmap(_sqes, _sqesSize);
+    if (_rings != MAP_FAILED)
+        munmap(_rings, _ringsSize);
+    if (_ring >= 0)
+        close(_ring);
+    _chains.clear();
+    if (_buffers)
+        munmap(_buffers, RECV_BUFFERS * sizeof(io_uring_buf));
+    if (_bufferMemory)
+        munmap(_bufferMemory, static_cast<size_t>(RECV_BUFFERS) * RECV_BUFFER_SIZE);
+    _buffers = NULL;
+    _bufferMemory = NULL;
+    _sqes = NULL;
+    _rings = MAP_FAILED;
+    _ring = -1;
+    _backend = POLL;
+}
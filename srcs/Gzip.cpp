@@ -0,0 +1,252 @@
+#include "Gzip.hpp"
+#include "ResponseBuilder.hpp"
+#include <sstream>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <zlib.h>
+
+/* ------------------------------------------------------------------------ */
+/*                                GzipPolicy                                */
+/* ------------------------------------------------------------------------ */
+
+GzipPolicy::GzipPolicy()
+    : on(false), staticFiles(false), minLength(DEFAULT_MIN_LENGTH), level(1), configured(false)
+{
+}
+
+static bool parseSwitch(const std::string& directive, const std::string& value)
+{
+    if (value != "on" && value != "off")
+        throw std::runtime_error("Error: '" + directive + "' expects on or off, got '" + value + "'");
+    return value == "on";
+}
+
+bool GzipPolicy::parse(const std::string& line)
+{
+    std::istringstream words(line);
+    std::string directive;
+    words >> directive;
+    if (directive.compare(0, 4, "gzip") != 0)
+        return false;
+    std::string value;
+    std::getline(words, value);
+    value.erase(0, value.find_first_not_of(" \t"));
+    value.erase(value.find_last_not_of(" \t;") + 1);
+    if (value.empty())
+        throw std::runtime_error("Error: Missing value for '" + directive + "'");
+
+    if (directive == "gzip")
+        on = parseSwitch(directive, value);
+    else if (directive == "gzip_static")
+        staticFiles = parseSwitch(directive, value);
+    else if (directive == "gzip_types")
+    {
+        std::istringstream list(value);
+        std::string type;
+        types.clear();
+        while (list >> type)
+            types.push_back(type);
+    }
+    else if (directive == "gzip_min_length")
+    {
+        char* end;
+        minLength = std::strtoul(value.c_str(), &end, 10);
+        if (*end != '\0' || value[0] == '-')
+            throw std::runtime_error("Error: 'gzip_min_length' expects a number of bytes");
+    }
+    else if (directive == "gzip_comp_level")
+    {
+        level = std::atoi(value.c_str());
+        if (level < 1 || level > 9)
+            throw std::runtime_error("Error: 'gzip_comp_level' expects 1 to 9");
+    }
+    else
+        return false;
+    configured = true;
+    return true;
+}
+
+bool GzipPolicy::enabled() const
+{
+    return on || staticFiles;
+}
+
+// The media type is compared up to its parameters, so
+// "text/html; charset=utf-8" matches text/html.
+bool GzipPolicy::compresses(const char* contentType, size_t length) const
+{
+    if (!on || !contentType || length < minLength)
+        return false;
+    size_t typeLength = strcspn(contentType, "; \t");
+    if (typeLength == 9 && !strncasecmp(contentType, "text/html", 9))
+        return true;
+    for (size_t i = 0; i < types.size(); ++i)
+    {
+        if (types[i] == "*"
+            || (types[i].size() == typeLength && !strncasecmp(contentType, types[i].c_str(), typeLength)))
+            return true;
+    }
+    return false;
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                   Gzip                                   */
+/* ------------------------------------------------------------------------ */
+
+bool Gzip::accepted(const StringRef& acceptEncoding)
+{
+    bool gzipListed = false;
+    bool gzip = false;
+    bool any = false;
+    size_t pos = 0;
+    while (pos < acceptEncoding.length)
+    {
+        const char* item = acceptEncoding.data + pos;
+        size_t end = pos;
+        while (end < acceptEncoding.length && acceptEncoding.data[end] != ',')
+            ++end;
+        size_t itemLength = end - pos;
+        pos = end + 1;
+
+        while (itemLength && (*item == ' ' || *item == '\t'))
+        {
+            ++item;
+            --itemLength;
+        }
+        size_t nameLength = 0;
+        while (nameLength < itemLength && item[nameLength] != ';' && item[nameLength] != ' ')
+            ++nameLength;
+        bool wanted = true;
+        std::string params(item + nameLength, itemLength - nameLength);
+        size_t q = params.find("q=");
+        if (q != std::string::npos)
+            wanted = std::strtod(params.c_str() + q + 2, NULL) > 0;
+
+        if ((nameLength == 4 && !strncasecmp(item, "gzip", 4)) || (nameLength == 6 && !strncasecmp(item, "x-gzip", 6)))
+        {
+            gzipListed = true;
+            gzip = wanted;
+        }
+        else if (nameLength == 1 && *item == '*')
+            any = wanted;
+    }
+    return gzipListed ? gzip : any;
+}
+
+// Level 0 means no stream has been set up yet.
+static z_stream deflater;
+static int deflaterLevel = 0;
+
+bool Gzip::compress(const char* data, size_t length, int level, std::string& output)
+{
+    if (!deflaterLevel)
+    {
+        if (deflateInit2(&deflater, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        deflaterLevel = level;
+    }
+    else if (deflateReset(&deflater) != Z_OK)
+        return false;
+    if (level != deflaterLevel)
+    {
+        if (deflateParams(&deflater, level, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        deflaterLevel = level;
+    }
+
+    output.clear();
+    deflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    deflater.avail_in = length;
+    int result;
+    do
+    {
+        size_t used = output.size();
+        output.resize(used + CHUNK);
+        deflater.next_out = reinterpret_cast<Bytef*>(&output[used]);
+        deflater.avail_out = CHUNK;
+        result = deflate(&deflater, Z_FINISH);
+        output.resize(used + CHUNK - deflater.avail_out);
+    }
+    while (result == Z_OK || result == Z_BUF_ERROR);
+    return result == Z_STREAM_END;
+}
+
+// The body must be owned by the response, not borrowed with bodyRef.
+void Gzip::encode(ResponseBuilder& response, const GzipPolicy& policy, const char* contentType, bool accepted)
+{
+    if (!policy.compresses(contentType, response.bodySize()))
+        return;
+    response.header("Vary", "Accept-Encoding");
+    if (!accepted)
+        return;
+    std::string& body = response.bodyBuffer();
+    std::string compressed;
+    if (!compress(body.data(), body.size(), policy.level, compressed) || compressed.size() >= body.size())
+        return;
+    body.swap(compressed);
+    response.header("Content-Encoding", "gzip");
+}
+
+std::map<std::string, Gzip::Memo>& Gzip::memos()
+{
+    static std::map<std::string, Memo> entries;
+    return entries;
+}
+
+std::list<std::string>& Gzip::memoOrder()
+{
+    static std::list<std::string> order;
+    return order;
+}
+
+size_t& Gzip::memoBytes()
+{
+    static size_t bytes = 0;
+    return bytes;
+}
+
+// Memos are kept in LRU order within MEMO_LIMIT bytes. A file that does not
+// shrink is remembered too, so it is not compressed again either.
+const std::string* Gzip::staticVariant(const char* path, const struct stat& fileStat, const std::string& content,
+    int level)
+{
+    std::map<std::string, Memo>& entries = memos();
+    std::list<std::string>& order = memoOrder();
+    std::map<std::string, Memo>::iterator it = entries.find(path);
+    if (it != entries.end())
+    {
+        Memo& memo = it->second;
+        if (memo.mtime == fileStat.st_mtim.tv_sec && memo.mtimeNs == fileStat.st_mtim.tv_nsec
+            && memo.size == fileStat.st_size)
+        {
+            order.splice(order.begin(), order, memo.order);
+            return memo.worthIt ? &memo.data : NULL;
+        }
+        memoBytes() -= memo.data.size();
+        order.erase(memo.order);
+        entries.erase(it);
+    }
+
+    Memo& memo = entries[path];
+    memo.mtime = fileStat.st_mtim.tv_sec;
+    memo.mtimeNs = fileStat.st_mtim.tv_nsec;
+    memo.size = fileStat.st_size;
+    memo.worthIt = compress(content.data(), content.size(), level, memo.data) && memo.data.size() < content.size();
+    if (!memo.worthIt)
+        std::string().swap(memo.data);
+    order.push_front(path);
+    memo.order = order.begin();
+    memoBytes() += memo.data.size();
+
+    const std::string* result = memo.worthIt ? &memo.data : NULL;
+    while (memoBytes() > MEMO_LIMIT && order.size() > 1)
+    {
+        std::map<std::string, Memo>::iterator oldest = entries.find(order.back());
+        memoBytes() -= oldest->second.data.size();
+        entries.erase(oldest);
+        order.pop_back();
+    }
+    return result;
+}
@@ -0,0 +1,459 @@
+#include "Hpack.hpp"
+#include <stdint.h>
+
+/* ------------------------------------------------------------------------ */
+/*                                HpackTable                                */
+/* ------------------------------------------------------------------------ */
+
+static const char* const STATIC_TABLE[][2] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" }
+};
+
+static const size_t ENTRY_OVERHEAD = 32;
+
+HpackTable::HpackTable() : _size(0), _maxSize(DEFAULT_SIZE)
+{
+}
+
+bool HpackTable::get(size_t index, std::string& name, std::string& value) const
+{
+    if (index == 0)
+        return false;
+    if (index <= STATIC_ENTRIES)
+    {
+        name = STATIC_TABLE[index - 1][0];
+        value = STATIC_TABLE[index - 1][1];
+        return true;
+    }
+    index -= STATIC_ENTRIES + 1;
+    if (index >= _entries.size())
+        return false;
+    name = _entries[index].first;
+    value = _entries[index].second;
+    return true;
+}
+
+// An entry larger than the whole table empties it and is not added.
+void HpackTable::add(const std::string& name, const std::string& value)
+{
+    size_t size = name.size() + value.size() + ENTRY_OVERHEAD;
+    if (size > _maxSize)
+    {
+        evict(_maxSize);
+        return;
+    }
+    evict(size);
+    _entries.push_front(std::make_pair(name, value));
+    _size += size;
+}
+
+void HpackTable::resize(size_t maxSize)
+{
+    _maxSize = maxSize;
+    evict(0);
+}
+
+void HpackTable::evict(size_t room)
+{
+    while (!_entries.empty() && _size + room > _maxSize)
+    {
+        _size -= _entries.back().first.size() + _entries.back().second.size() + ENTRY_OVERHEAD;
+        _entries.pop_back();
+    }
+}
+
+size_t HpackTable::find(const std::string& name, const std::string& value, size_t& nameIndex) const
+{
+    nameIndex = 0;
+    for (size_t i = 0; i < STATIC_ENTRIES; ++i)
+    {
+        if (name != STATIC_TABLE[i][0])
+            continue;
+        if (value == STATIC_TABLE[i][1])
+            return i + 1;
+        if (!nameIndex)
+            nameIndex = i + 1;
+    }
+    for (size_t i = 0; i < _entries.size(); ++i)
+    {
+        if (_entries[i].first != name)
+            continue;
+        if (_entries[i].second == value)
+            return STATIC_ENTRIES + 1 + i;
+        if (!nameIndex)
+            nameIndex = STATIC_ENTRIES + 1 + i;
+    }
+    return 0;
+}
+
+size_t HpackTable::maxSize() const
+{
+    return _maxSize;
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                  Hpack                                   */
+/* ------------------------------------------------------------------------ */
+
+// The canonical Huffman code of RFC 7541 appendix B; symbol 256 is EOS.
+static const uint32_t HUFFMAN_CODES[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff
+};
+
+static const unsigned char HUFFMAN_LENGTHS[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+// Decoding walks a binary tree of the code, built on first use: 256 inner
+// nodes and 257 leaves. Node 0 is the root; a leaf holds its symbol.
+struct HuffmanNode
+{
+    short child[2];
+    short symbol;
+};
+
+static const HuffmanNode* huffmanTree()
+{
+    static HuffmanNode nodes[513];
+    static size_t count = 0;
+    if (count)
+        return nodes;
+    nodes[0].child[0] = nodes[0].child[1] = -1;
+    nodes[0].symbol = -1;
+    count = 1;
+    for (int symbol = 0; symbol < 257; ++symbol)
+    {
+        size_t node = 0;
+        for (int bit = HUFFMAN_LENGTHS[symbol] - 1; bit >= 0; --bit)
+        {
+            int branch = (HUFFMAN_CODES[symbol] >> bit) & 1;
+            if (nodes[node].child[branch] < 0)
+            {
+                nodes[count].child[0] = nodes[count].child[1] = -1;
+                nodes[count].symbol = -1;
+                nodes[node].child[branch] = static_cast<short>(count++);
+            }
+            node = nodes[node].child[branch];
+        }
+        nodes[node].symbol = static_cast<short>(symbol);
+    }
+    return nodes;
+}
+
+// Padding must be fewer than 8 bits, all ones (a prefix of EOS).
+bool Hpack::huffmanDecode(const unsigned char* data, size_t length, std::string& output)
+{
+    const HuffmanNode* nodes = huffmanTree();
+    size_t node = 0;
+    int depth = 0;
+    bool ones = true;
+    output.clear();
+    for (size_t i = 0; i < length; ++i)
+    {
+        for (int bit = 7; bit >= 0; --bit)
+        {
+            int branch = (data[i] >> bit) & 1;
+            short next = nodes[node].child[branch];
+            if (next < 0)
+                return false;
+            node = next;
+            ++depth;
+            ones = ones && branch;
+            if (nodes[node].symbol >= 0)
+            {
+                if (nodes[node].symbol == 256)
+                    return false;
+                output += static_cast<char>(nodes[node].symbol);
+                node = 0;
+                depth = 0;
+                ones = true;
+            }
+        }
+    }
+    return depth < 8 && ones;
+}
+
+size_t Hpack::huffmanLength(const std::string& text)
+{
+    size_t bits = 0;
+    for (size_t i = 0; i < text.size(); ++i)
+        bits += HUFFMAN_LENGTHS[static_cast<unsigned char>(text[i])];
+    return (bits + 7) / 8;
+}
+
+void Hpack::huffmanEncode(const std::string& text, std::string& output)
+{
+    uint64_t pending = 0;
+    int bits = 0;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        unsigned char symbol = static_cast<unsigned char>(text[i]);
+        pending = (pending << HUFFMAN_LENGTHS[symbol]) | HUFFMAN_CODES[symbol];
+        bits += HUFFMAN_LENGTHS[symbol];
+        while (bits >= 8)
+        {
+            bits -= 8;
+            output += static_cast<char>(pending >> bits);
+        }
+    }
+    if (bits)
+        output += static_cast<char>((pending << (8 - bits)) | (0xff >> bits));
+}
+
+void Hpack::encodeInteger(size_t value, int prefixBits, unsigned char flags, std::string& output)
+{
+    size_t limit = (1u << prefixBits) - 1;
+    if (value < limit)
+    {
+        output += static_cast<char>(flags | value);
+        return;
+    }
+    output += static_cast<char>(flags | limit);
+    value -= limit;
+    while (value >= 128)
+    {
+        output += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    output += static_cast<char>(value);
+}
+
+// Values past 2^28 are refused: nothing legitimate in a header block is
+// that large.
+bool Hpack::decodeInteger(const unsigned char*& cursor, const unsigned char* end, int prefixBits, size_t& value)
+{
+    if (cursor >= end)
+        return false;
+    size_t limit = (1u << prefixBits) - 1;
+    value = *cursor++ & limit;
+    if (value < limit)
+        return true;
+    for (int shift = 0; shift <= 21; shift += 7)
+    {
+        if (cursor >= end)
+            return false;
+        unsigned char byte = *cursor++;
+        value += static_cast<size_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+void Hpack::encodeString(const std::string& text, std::string& output)
+{
+    size_t coded = huffmanLength(text);
+    if (coded < text.size())
+    {
+        encodeInteger(coded, 7, 0x80, output);
+        huffmanEncode(text, output);
+        return;
+    }
+    encodeInteger(text.size(), 7, 0, output);
+    output += text;
+}
+
+bool Hpack::decodeString(const unsigned char*& cursor, const unsigned char* end, std::string& text)
+{
+    if (cursor >= end)
+        return false;
+    bool huffman = *cursor & 0x80;
+    size_t length;
+    if (!decodeInteger(cursor, end, 7, length) || length > static_cast<size_t>(end - cursor))
+        return false;
+    const unsigned char* data = cursor;
+    cursor += length;
+    if (huffman)
+        return huffmanDecode(data, length, text);
+    text.assign(reinterpret_cast<const char*>(data), length);
+    return true;
+}
+
+// The decoded list is capped like the compressed block, so a few bytes of
+// references to a large entry cannot expand without bound.
+bool Hpack::decode(HpackTable& table, const unsigned char* data, size_t length, size_t maxTableSize,
+    Headers& headers)
+{
+    static const size_t MAX_HEADER_LIST = 64 * 1024;
+
+    const unsigned char* cursor = data;
+    const unsigned char* end = data + length;
+    size_t listSize = 0;
+    headers.clear();
+    while (cursor < end)
+    {
+        unsigned char first = *cursor;
+        std::string name;
+        std::string value;
+        size_t index;
+        if (first & 0x80)
+        {
+            if (!decodeInteger(cursor, end, 7, index) || !table.get(index, name, value))
+                return false;
+        }
+        else if ((first & 0xe0) == 0x20)
+        {
+            if (!headers.empty() || !decodeInteger(cursor, end, 5, index) || index > maxTableSize)
+                return false;
+            table.resize(index);
+            continue;
+        }
+        else
+        {
+            bool indexed = (first & 0xc0) == 0x40;
+            if (!decodeInteger(cursor, end, indexed ? 6 : 4, index))
+                return false;
+            if (index)
+            {
+                std::string unused;
+                if (!table.get(index, name, unused))
+                    return false;
+            }
+            else if (!decodeString(cursor, end, name))
+                return false;
+            if (!decodeString(cursor, end, value))
+                return false;
+            if (indexed)
+                table.add(name, value);
+        }
+        listSize += name.size() + value.size() + ENTRY_OVERHEAD;
+        if (listSize > MAX_HEADER_LIST)
+            return false;
+        headers.push_back(std::make_pair(name, value));
+    }
+    return true;
+}
+
+void Hpack::encode(HpackTable& table, const std::string& name, const std::string& value, bool indexed,
+    std::string& output)
+{
+    size_t nameIndex;
+    size_t index = table.find(name, value, nameIndex);
+    if (index)
+    {
+        encodeInteger(index, 7, 0x80, output);
+        return;
+    }
+    if (indexed)
+        encodeInteger(nameIndex, 6, 0x40, output);
+    else
+        encodeInteger(nameIndex, 4, 0, output);
+    if (!nameIndex)
+        encodeString(name, output);
+    encodeString(value, output);
+    if (indexed)
+        table.add(name, value);
+}
+
+void Hpack::encodeTableSize(size_t size, std::string& output)
+{
+    encodeInteger(size, 5, 0x20, output);
+}
@@ -0,0 +1,968 @@
+#include "Http2.hpp"
+#include "Metrics.hpp"
+#include "Tls.hpp"
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <poll.h>
+#include <sys/socket.h>
+
+enum FrameType
+{
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9
+};
+
+enum Setting
+{
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5
+};
+
+static const uint8_t FLAG_END_STREAM = 0x1;
+static const uint8_t FLAG_ACK = 0x1;
+static const uint8_t FLAG_END_HEADERS = 0x4;
+static const uint8_t FLAG_PADDED = 0x8;
+static const uint8_t FLAG_PRIORITY = 0x20;
+
+static const size_t FRAME_HEADER = 9;
+static const long MAX_WINDOW = 0x7fffffff;
+static const uint32_t DEFAULT_WINDOW = 65535;
+
+const char Http2Session::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+static uint32_t readUint32(const unsigned char* data)
+{
+    return (static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static void appendUint32(std::string& output, uint32_t value)
+{
+    output += static_cast<char>(value >> 24);
+    output += static_cast<char>(value >> 16);
+    output += static_cast<char>(value >> 8);
+    output += static_cast<char>(value);
+}
+
+static void appendSetting(std::string& output, uint16_t id, uint32_t value)
+{
+    output += static_cast<char>(id >> 8);
+    output += static_cast<char>(id);
+    appendUint32(output, value);
+}
+
+// HTTP2-Settings is base64url without padding (RFC 7540 3.2.1).
+static bool decodeBase64Url(const StringRef& text, std::string& output)
+{
+    unsigned long bits = 0;
+    int count = 0;
+    for (size_t i = 0; i < text.length; ++i)
+    {
+        char c = text.data[i];
+        int value;
+        if (c >= 'A' && c <= 'Z')
+            value = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            value = c - '0' + 52;
+        else if (c == '-' || c == '+')
+            value = 62;
+        else if (c == '_' || c == '/')
+            value = 63;
+        else if (c == '=')
+            break;
+        else
+            return false;
+        bits = (bits << 6) | value;
+        count += 6;
+        if (count >= 8)
+        {
+            count -= 8;
+            output += static_cast<char>((bits >> count) & 0xff);
+        }
+    }
+    return true;
+}
+
+// Header names reach the handlers as HTTP/1.1 text, so anything that could
+// end a line or a field early is refused, as RFC 9113 8.2.1 requires.
+static bool validName(const std::string& name)
+{
+    if (name.empty())
+        return false;
+    for (size_t i = 0; i < name.size(); ++i)
+    {
+        unsigned char c = name[i];
+        if (c <= 0x20 || c >= 0x7f || c == ':' || (c >= 'A' && c <= 'Z'))
+            return false;
+    }
+    return true;
+}
+
+static bool validValue(const std::string& value)
+{
+    return value.find_first_of(std::string("\r\n\0", 3)) == std::string::npos;
+}
+
+static bool validToken(const std::string& text)
+{
+    if (text.empty())
+        return false;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        unsigned char c = text[i];
+        if (c <= 0x20 || c >= 0x7f)
+            return false;
+    }
+    return true;
+}
+
+static bool connectionSpecific(const std::string& name)
+{
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "transfer-encoding"
+        || name == "upgrade";
+}
+
+Http2Session::Http2Session(int clientFd, TlsConnection* tls)
+    : _clientFd(clientFd), _tls(tls), _outSent(0), _awaitPreface(true), _settingsReceived(false), _closing(false),
+      _draining(false), _lastStreamId(0), _tableSizeChanged(false), _headerStream(0), _headerFlags(0),
+      _headerPriority(false), _headerParent(0), _headerWeight(DEFAULT_WEIGHT), _headerExclusive(false),
+      _sendWindow(DEFAULT_WINDOW), _receivedUnacked(0), _initialWindow(DEFAULT_WINDOW), _peerMaxFrame(MAX_FRAME_SIZE)
+{
+    std::string settings;
+    appendSetting(settings, SETTINGS_MAX_CONCURRENT_STREAMS, MAX_CONCURRENT_STREAMS);
+    appendSetting(settings, SETTINGS_INITIAL_WINDOW_SIZE, WINDOW);
+    writeFrame(FRAME_SETTINGS, 0, 0, settings.data(), settings.size());
+    writeWindowUpdate(0, WINDOW - DEFAULT_WINDOW);
+}
+
+Http2Session::~Http2Session()
+{
+    for (std::map<uint32_t, Stream>::iterator it = _streams.begin(); it != _streams.end(); ++it)
+        delete it->second.arena;
+}
+
+bool Http2Session::upgrade(const StringRef& settings, const std::string& request)
+{
+    std::string decoded;
+    if (!decodeBase64Url(settings, decoded) || decoded.size() % 6)
+        return false;
+    _out.insert(0, "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    if (!applySettings(reinterpret_cast<const unsigned char*>(decoded.data()), decoded.size()))
+        return true;
+    Stream& stream = openStream(1);
+    stream.request = request;
+    stream.requestDone = true;
+    _ready.push_back(1);
+    return true;
+}
+
+/* --- Input --- */
+
+Http2Session::Result Http2Session::readable()
+{
+    char buffer[16384];
+    ssize_t received = TlsConnection::read(_tls, _clientFd, buffer, sizeof(buffer));
+    if (received == 0)
+        return CLOSE;
+    if (received < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? CONTINUE : CLOSE;
+    Metrics::instance().bytesReceived(received);
+    return receive(buffer, received);
+}
+
+// Input after a connection error is dropped; the GOAWAY is still flushed.
+Http2Session::Result Http2Session::receive(const char* data, size_t length)
+{
+    if (_closing)
+        return CONTINUE;
+    _in.append(data, length);
+    size_t pos = 0;
+    if (_awaitPreface)
+    {
+        if (memcmp(_in.data(), PREFACE, _in.size() < PREFACE_LENGTH ? _in.size() : PREFACE_LENGTH) != 0)
+            return CLOSE;
+        if (_in.size() < PREFACE_LENGTH)
+            return CONTINUE;
+        pos = PREFACE_LENGTH;
+        _awaitPreface = false;
+    }
+    while (!_closing && _in.size() - pos >= FRAME_HEADER)
+    {
+        const unsigned char* head = reinterpret_cast<const unsigned char*>(_in.data()) + pos;
+        uint32_t frameLength = (head[0] << 16) | (head[1] << 8) | head[2];
+        if (frameLength > MAX_FRAME_SIZE)
+        {
+            connectionError(FRAME_SIZE_ERROR);
+            break;
+        }
+        if (_in.size() - pos - FRAME_HEADER < frameLength)
+            break;
+        pos += FRAME_HEADER + frameLength;
+        uint32_t streamId = readUint32(head + 5) & 0x7fffffff;
+        if (!_settingsReceived && head[3] != FRAME_SETTINGS)
+        {
+            connectionError(PROTOCOL_ERROR);
+            break;
+        }
+        if (!handleFrame(head[3], head[4], streamId, head + FRAME_HEADER, frameLength))
+            break;
+    }
+    if (_closing)
+        _in.clear();
+    else
+        _in.erase(0, pos);
+    return CONTINUE;
+}
+
+// Returns false after a connection error.
+bool Http2Session::handleFrame(uint8_t type, uint8_t flags, uint32_t streamId, const unsigned char* payload,
+    uint32_t length)
+{
+    if (_headerStream && (type != FRAME_CONTINUATION || streamId != _headerStream))
+        return connectionError(PROTOCOL_ERROR);
+    switch (type)
+    {
+    case FRAME_DATA:
+        return handleData(flags, streamId, payload, length);
+    case FRAME_HEADERS:
+        return handleHeaders(flags, streamId, payload, length);
+    case FRAME_PRIORITY:
+        if (!streamId)
+            return connectionError(PROTOCOL_ERROR);
+        if (length != 5)
+            return connectionError(FRAME_SIZE_ERROR);
+        return handlePriority(streamId, payload);
+    case FRAME_RST_STREAM:
+        if (!streamId || streamId > _lastStreamId)
+            return connectionError(PROTOCOL_ERROR);
+        if (length != 4)
+            return connectionError(FRAME_SIZE_ERROR);
+        closeStream(streamId);
+        return true;
+    case FRAME_SETTINGS:
+        return handleSettings(flags, streamId, payload, length);
+    case FRAME_PUSH_PROMISE:
+        return connectionError(PROTOCOL_ERROR);
+    case FRAME_PING:
+        if (streamId)
+            return connectionError(PROTOCOL_ERROR);
+        if (length != 8)
+            return connectionError(FRAME_SIZE_ERROR);
+        if (!(flags & FLAG_ACK))
+            writeFrame(FRAME_PING, FLAG_ACK, 0, reinterpret_cast<const char*>(payload), length);
+        return true;
+    case FRAME_GOAWAY:
+        if (streamId)
+            return connectionError(PROTOCOL_ERROR);
+        _draining = true;
+        return true;
+    case FRAME_WINDOW_UPDATE:
+        return handleWindowUpdate(streamId, payload, length);
+    case FRAME_CONTINUATION:
+        return handleContinuation(flags, streamId, payload, length);
+    }
+    return true;
+}
+
+bool Http2Session::handleHeaders(uint8_t flags, uint32_t streamId, const unsigned char* payload, uint32_t length)
+{
+    if (!streamId || !(streamId & 1))
+        return connectionError(PROTOCOL_ERROR);
+    uint32_t padding = 0;
+    if (flags & FLAG_PADDED)
+    {
+        if (length < 1)
+            return connectionError(PROTOCOL_ERROR);
+        padding = payload[0];
+        ++payload;
+        --length;
+    }
+    _headerPriority = flags & FLAG_PRIORITY;
+    if (_headerPriority)
+    {
+        if (length < 5)
+            return connectionError(PROTOCOL_ERROR);
+        uint32_t dependency = readUint32(payload);
+        _headerExclusive = dependency >> 31;
+        _headerParent = dependency & 0x7fffffff;
+        _headerWeight = payload[4] + 1;
+        payload += 5;
+        length -= 5;
+        if (_headerParent == streamId)
+            return connectionError(PROTOCOL_ERROR);
+    }
+    if (padding > length)
+        return connectionError(PROTOCOL_ERROR);
+    length -= padding;
+
+    std::map<uint32_t, Stream>::iterator it = _streams.find(streamId);
+    if (it == _streams.end() && streamId <= _lastStreamId)
+        return connectionError(STREAM_CLOSED);
+    // A second header block on a stream is its trailers, which end it.
+    if (it != _streams.end() && (it->second.requestDone || !(flags & FLAG_END_STREAM)))
+        return connectionError(it->second.requestDone ? STREAM_CLOSED : PROTOCOL_ERROR);
+    _headerStream = streamId;
+    _headerFlags = flags;
+    _headerBlock.assign(reinterpret_cast<const char*>(payload), length);
+    if (flags & FLAG_END_HEADERS)
+        return endHeaders();
+    return true;
+}
+
+bool Http2Session::handleContinuation(uint8_t flags, uint32_t streamId, const unsigned char* payload, uint32_t length)
+{
+    if (!_headerStream || streamId != _headerStream)
+        return connectionError(PROTOCOL_ERROR);
+    if (_headerBlock.size() + length > MAX_HEADER_BLOCK)
+        return connectionError(ENHANCE_YOUR_CALM);
+    _headerBlock.append(reinterpret_cast<const char*>(payload), length);
+    if (flags & FLAG_END_HEADERS)
+        return endHeaders();
+    return true;
+}
+
+// Every block is decoded, even for a stream about to be refused, so the
+// decoder table stays in step with the peer's encoder.
+bool Http2Session::endHeaders()
+{
+    uint32_t streamId = _headerStream;
+    _headerStream = 0;
+    Hpack::Headers headers;
+    if (!Hpack::decode(_decoder, reinterpret_cast<const unsigned char*>(_headerBlock.data()), _headerBlock.size(),
+            HpackTable::DEFAULT_SIZE, headers))
+        return connectionError(COMPRESSION_ERROR);
+    std::string().swap(_headerBlock);
+    std::map<uint32_t, Stream>::iterator it = _streams.find(streamId);
+    if (it != _streams.end())
+    {
+        finishRequest(streamId, it->second);
+        return true;
+    }
+    return startRequest(streamId, headers, _headerFlags & FLAG_END_STREAM);
+}
+
+Http2Session::Stream& Http2Session::openStream(uint32_t streamId)
+{
+    _lastStreamId = streamId;
+    Stream& stream = _streams[streamId];
+    stream.requestDone = false;
+    stream.dispatched = false;
+    stream.hasLength = false;
+    stream.sendWindow = _initialWindow;
+    stream.receivedUnacked = 0;
+    stream.parent = 0;
+    stream.weight = DEFAULT_WEIGHT;
+    stream.credit = 0;
+    stream.responding = false;
+    stream.bodySent = 0;
+    stream.arena = NULL;
+    stream.exchange.startUs = Metrics::nowMicros();
+    stream.exchange.histogram = NULL;
+    stream.exchange.limitSlot = -1;
+    return stream;
+}
+
+// Pseudo-headers become the request line, :authority the Host header, and
+// split cookie fields are joined again (RFC 9113 8.2.3). A malformed
+// request resets its stream.
+bool Http2Session::startRequest(uint32_t streamId, const Hpack::Headers& headers, bool endStream)
+{
+    if (_draining || _streams.size() >= MAX_CONCURRENT_STREAMS)
+    {
+        _lastStreamId = streamId;
+        reset(streamId, REFUSED_STREAM);
+        return true;
+    }
+    std::string method;
+    std::string path;
+    std::string authority;
+    std::string cookie;
+    bool regular = false;
+    bool host = false;
+    bool valid = true;
+    for (size_t i = 0; i < headers.size() && valid; ++i)
+    {
+        const std::string& name = headers[i].first;
+        const std::string& value = headers[i].second;
+        valid = validValue(value);
+        if (!name.empty() && name[0] == ':')
+        {
+            valid = valid && !regular;
+            if (name == ":method")
+                method = value;
+            else if (name == ":path")
+                path = value;
+            else if (name == ":authority")
+                authority = value;
+            else if (name != ":scheme")
+                valid = false;
+            continue;
+        }
+        regular = true;
+        valid = valid && validName(name) && !connectionSpecific(name) && (name != "te" || value == "trailers");
+        host = host || name == "host";
+    }
+    if (!valid || !validToken(method) || !validToken(path) || (path[0] != '/' && path != "*"))
+    {
+        _lastStreamId = streamId;
+        reset(streamId, PROTOCOL_ERROR);
+        return true;
+    }
+
+    Stream& stream = openStream(streamId);
+    if (_headerPriority)
+        setPriority(streamId, _headerParent, _headerWeight, _headerExclusive);
+    std::string& request = stream.request;
+    request = method + ' ' + path + " HTTP/2.0\r\n";
+    if (!host && !authority.empty())
+        request += "Host: " + authority + "\r\n";
+    for (size_t i = 0; i < headers.size(); ++i)
+    {
+        const std::string& name = headers[i].first;
+        if (name[0] == ':')
+            continue;
+        if (name == "cookie")
+        {
+            if (!cookie.empty())
+                cookie += "; ";
+            cookie += headers[i].second;
+            continue;
+        }
+        stream.hasLength = stream.hasLength || name == "content-length";
+        request += name + ": " + headers[i].second + "\r\n";
+    }
+    if (!cookie.empty())
+        request += "cookie: " + cookie + "\r\n";
+    if (endStream)
+        finishRequest(streamId, stream);
+    return true;
+}
+
+// The handlers expect a Content-Length on a request with a body.
+void Http2Session::finishRequest(uint32_t streamId, Stream& stream)
+{
+    stream.requestDone = true;
+    if (!stream.body.empty() && !stream.hasLength)
+        stream.request += "Content-Length: " + ResponseBuilder::toString(stream.body.size()) + "\r\n";
+    stream.request += "\r\n";
+    stream.request += stream.body;
+    std::string().swap(stream.body);
+    _ready.push_back(streamId);
+}
+
+// Windows are counted on the whole payload, padding included, and given
+// back once half of one has been used. DATA for a stream that was reset is
+// still counted against the connection, then ignored.
+bool Http2Session::handleData(uint8_t flags, uint32_t streamId, const unsigned char* payload, uint32_t length)
+{
+    if (!streamId)
+        return connectionError(PROTOCOL_ERROR);
+    _receivedUnacked += length;
+    if (_receivedUnacked > WINDOW)
+        return connectionError(FLOW_CONTROL_ERROR);
+    if (_receivedUnacked >= WINDOW / 2)
+    {
+        writeWindowUpdate(0, _receivedUnacked);
+        _receivedUnacked = 0;
+    }
+    uint32_t size = length;
+    if (flags & FLAG_PADDED)
+    {
+        if (length < 1 || payload[0] >= length)
+            return connectionError(PROTOCOL_ERROR);
+        size = length - 1 - payload[0];
+        ++payload;
+    }
+
+    std::map<uint32_t, Stream>::iterator it = _streams.find(streamId);
+    if (it == _streams.end())
+        return streamId <= _lastStreamId || connectionError(PROTOCOL_ERROR);
+    Stream& stream = it->second;
+    if (stream.requestDone)
+    {
+        reset(streamId, STREAM_CLOSED);
+        return true;
+    }
+    stream.receivedUnacked += length;
+    if (stream.receivedUnacked > WINDOW)
+    {
+        reset(streamId, FLOW_CONTROL_ERROR);
+        return true;
+    }
+    stream.body.append(reinterpret_cast<const char*>(payload), size);
+    if (flags & FLAG_END_STREAM)
+        finishRequest(streamId, stream);
+    else if (stream.receivedUnacked >= WINDOW / 2)
+    {
+        writeWindowUpdate(streamId, stream.receivedUnacked);
+        stream.receivedUnacked = 0;
+    }
+    return true;
+}
+
+bool Http2Session::handleSettings(uint8_t flags, uint32_t streamId, const unsigned char* payload, uint32_t length)
+{
+    if (streamId)
+        return connectionError(PROTOCOL_ERROR);
+    if (flags & FLAG_ACK)
+        return !length || connectionError(FRAME_SIZE_ERROR);
+    if (length % 6)
+        return connectionError(FRAME_SIZE_ERROR);
+    if (!applySettings(payload, length))
+        return false;
+    _settingsReceived = true;
+    writeFrame(FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+    return true;
+}
+
+// The encoder table is kept within our default size whatever the peer
+// allows; a smaller limit is announced at the start of the next block.
+bool Http2Session::applySettings(const unsigned char* payload, uint32_t length)
+{
+    for (uint32_t pos = 0; pos + 6 <= length; pos += 6)
+    {
+        uint16_t id = (payload[pos] << 8) | payload[pos + 1];
+        uint32_t value = readUint32(payload + pos + 2);
+        if (id == SETTINGS_HEADER_TABLE_SIZE)
+        {
+            size_t size = value < HpackTable::DEFAULT_SIZE ? value : HpackTable::DEFAULT_SIZE;
+            if (size != _encoder.maxSize())
+            {
+                _encoder.resize(size);
+                _tableSizeChanged = true;
+            }
+        }
+        else if (id == SETTINGS_ENABLE_PUSH && value > 1)
+            return connectionError(PROTOCOL_ERROR);
+        else if (id == SETTINGS_INITIAL_WINDOW_SIZE)
+        {
+            if (value > static_cast<uint32_t>(MAX_WINDOW))
+                return connectionError(FLOW_CONTROL_ERROR);
+            long delta = static_cast<long>(value) - _initialWindow;
+            for (std::map<uint32_t, Stream>::iterator it = _streams.begin(); it != _streams.end(); ++it)
+            {
+                it->second.sendWindow += delta;
+                if (it->second.sendWindow > MAX_WINDOW)
+                    return connectionError(FLOW_CONTROL_ERROR);
+            }
+            _initialWindow = value;
+        }
+        else if (id == SETTINGS_MAX_FRAME_SIZE)
+        {
+            if (value < MAX_FRAME_SIZE || value > 0xffffff)
+                return connectionError(PROTOCOL_ERROR);
+            _peerMaxFrame = value;
+        }
+    }
+    return true;
+}
+
+bool Http2Session::handleWindowUpdate(uint32_t streamId, const unsigned char* payload, uint32_t length)
+{
+    if (length != 4)
+        return connectionError(FRAME_SIZE_ERROR);
+    uint32_t increment = readUint32(payload) & 0x7fffffff;
+    if (!streamId)
+    {
+        if (!increment)
+            return connectionError(PROTOCOL_ERROR);
+        _sendWindow += increment;
+        return _sendWindow <= MAX_WINDOW || connectionError(FLOW_CONTROL_ERROR);
+    }
+    std::map<uint32_t, Stream>::iterator it = _streams.find(streamId);
+    if (it == _streams.end())
+        return streamId <= _lastStreamId || connectionError(PROTOCOL_ERROR);
+    it->second.sendWindow += increment;
+    if (!increment)
+        reset(streamId, PROTOCOL_ERROR);
+    else if (it->second.sendWindow > MAX_WINDOW)
+        reset(streamId, FLOW_CONTROL_ERROR);
+    return true;
+}
+
+// Priorities of streams that are not open are not kept.
+bool Http2Session::handlePriority(uint32_t streamId, const unsigned char* payload)
+{
+    uint32_t dependency = readUint32(payload);
+    uint32_t parent = dependency & 0x7fffffff;
+    if (_streams.find(streamId) == _streams.end())
+        return true;
+    if (parent == streamId)
+        reset(streamId, PROTOCOL_ERROR);
+    else
+        setPriority(streamId, parent, payload[4] + 1, dependency >> 31);
+    return true;
+}
+
+// RFC 7540 5.3: a stream made to depend on its own descendant first moves
+// that descendant up to its former place; an exclusive dependency adopts the
+// other children of the new parent. Only open streams are kept in the tree,
+// so a dependency on any other stream is taken as one on the root with the
+// weight as given: clients such as nghttp hang their requests under idle
+// streams they use as priority groups.
+void Http2Session::setPriority(uint32_t streamId, uint32_t parent, int weight, bool exclusive)
+{
+    Stream& stream = _streams[streamId];
+    if (parent && _streams.find(parent) == _streams.end())
+    {
+        parent = 0;
+        exclusive = false;
+    }
+    for (uint32_t ancestor = parent; ancestor;)
+    {
+        Stream& up = _streams[ancestor];
+        if (up.parent == streamId)
+        {
+            up.parent = stream.parent;
+            break;
+        }
+        ancestor = up.parent;
+    }
+    if (exclusive)
+    {
+        for (std::map<uint32_t, Stream>::iterator it = _streams.begin(); it != _streams.end(); ++it)
+        {
+            if (it->second.parent == parent && it->first != streamId)
+                it->second.parent = streamId;
+        }
+    }
+    stream.parent = parent;
+    stream.weight = weight;
+}
+
+bool Http2Session::connectionError(ErrorCode code)
+{
+    std::string payload;
+    appendUint32(payload, _lastStreamId);
+    appendUint32(payload, code);
+    writeFrame(FRAME_GOAWAY, 0, 0, payload.data(), payload.size());
+    _closing = true;
+    return false;
+}
+
+// Children of a closed stream move up to its parent.
+void Http2Session::closeStream(uint32_t streamId)
+{
+    std::map<uint32_t, Stream>::iterator it = _streams.find(streamId);
+    if (it == _streams.end())
+        return;
+    for (std::map<uint32_t, Stream>::iterator child = _streams.begin(); child != _streams.end(); ++child)
+    {
+        if (child->second.parent == streamId)
+            child->second.parent = it->second.parent;
+    }
+    if (it->second.dispatched)
+        _closed.push_back(it->second.exchange);
+    delete it->second.arena;
+    _streams.erase(it);
+}
+
+/* --- Requests and responses --- */
+
+const std::string* Http2Session::nextRequest(uint32_t& streamId)
+{
+    while (!_ready.empty())
+    {
+        streamId = _ready.front();
+        _ready.pop_front();
+        std::map<uint32_t, Stream>::iterator it = _streams.find(streamId);
+        if (it == _streams.end() || it->second.dispatched)
+            continue;
+        it->second.dispatched = true;
+        return &it->second.request;
+    }
+    return NULL;
+}
+
+RequestArena& Http2Session::arena(uint32_t streamId)
+{
+    Stream& stream = _streams[streamId];
+    if (!stream.arena)
+        stream.arena = new RequestArena();
+    return *stream.arena;
+}
+
+Http2Session::Exchange& Http2Session::exchange(uint32_t streamId)
+{
+    return _streams[streamId].exchange;
+}
+
+bool Http2Session::streamOpen(uint32_t streamId) const
+{
+    return _streams.find(streamId) != _streams.end();
+}
+
+// The header block goes out at once; the body is left to the scheduler.
+// Hop-by-hop headers have no meaning in HTTP/2 and are dropped. Fields that
+// differ on every response are not indexed, so they do not push useful
+// entries out of the peer's table.
+void Http2Session::respond(uint32_t streamId, ResponseBuilder& response)
+{
+    std::map<uint32_t, Stream>::iterator it = _streams.find(streamId);
+    if (it == _streams.end())
+        return;
+    std::string block;
+    if (_tableSizeChanged)
+    {
+        Hpack::encodeTableSize(_encoder.maxSize(), block);
+        _tableSizeChanged = false;
+    }
+    Hpack::encode(_encoder, ":status", ResponseBuilder::toString(response.getStatusCode()), false, block);
+
+    size_t length;
+    const char* lines = response.headerLines(length);
+    const char* end = lines + length;
+    while (lines < end)
+    {
+        const char* lineEnd = static_cast<const char*>(memchr(lines, '\n', end - lines));
+        if (!lineEnd)
+            lineEnd = end;
+        const char* colon = static_cast<const char*>(memchr(lines, ':', lineEnd - lines));
+        if (colon)
+        {
+            std::string name(lines, colon - lines);
+            for (size_t i = 0; i < name.size(); ++i)
+                name[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(name[i])));
+            const char* value = colon + 1;
+            const char* valueEnd = lineEnd;
+            while (value < valueEnd && (*value == ' ' || *value == '\t'))
+                ++value;
+            while (valueEnd > value && (valueEnd[-1] == '\r' || valueEnd[-1] == ' '))
+                --valueEnd;
+            if (!connectionSpecific(name))
+            {
+                bool indexed = name != "content-length" && name != "age" && name != "etag" && name != "set-cookie";
+                Hpack::encode(_encoder, name, std::string(value, valueEnd - value), indexed, block);
+            }
+        }
+        lines = lineEnd + 1;
+    }
+
+    Stream& stream = it->second;
+    bool endStream = response.bodySize() == 0;
+    writeHeaders(streamId, block, endStream);
+    if (endStream)
+    {
+        closeStream(streamId);
+        return;
+    }
+    stream.response.swap(response);
+    stream.bodySent = 0;
+    stream.responding = true;
+}
+
+void Http2Session::reset(uint32_t streamId, ErrorCode code)
+{
+    std::string payload;
+    appendUint32(payload, code);
+    writeFrame(FRAME_RST_STREAM, 0, streamId, payload.data(), payload.size());
+    closeStream(streamId);
+}
+
+bool Http2Session::nextClosed(Exchange& exchange)
+{
+    if (_closed.empty())
+        return false;
+    exchange = _closed.back();
+    _closed.pop_back();
+    return true;
+}
+
+void Http2Session::goAway()
+{
+    if (_draining || _closing)
+        return;
+    std::string payload;
+    appendUint32(payload, _lastStreamId);
+    appendUint32(payload, NO_ERROR);
+    writeFrame(FRAME_GOAWAY, 0, 0, payload.data(), payload.size());
+    _draining = true;
+}
+
+bool Http2Session::busy() const
+{
+    return !_streams.empty() || _outSent < _out.size();
+}
+
+void Http2Session::abort()
+{
+    while (!_streams.empty())
+        closeStream(_streams.begin()->first);
+}
+
+int Http2Session::clientFd() const
+{
+    return _clientFd;
+}
+
+/* --- Output --- */
+
+void Http2Session::writeFrame(uint8_t type, uint8_t flags, uint32_t streamId, const char* payload, size_t length)
+{
+    _out += static_cast<char>(length >> 16);
+    _out += static_cast<char>(length >> 8);
+    _out += static_cast<char>(length);
+    _out += static_cast<char>(type);
+    _out += static_cast<char>(flags);
+    appendUint32(_out, streamId);
+    if (length)
+        _out.append(payload, length);
+}
+
+void Http2Session::writeWindowUpdate(uint32_t streamId, uint32_t increment)
+{
+    std::string payload;
+    appendUint32(payload, increment);
+    writeFrame(FRAME_WINDOW_UPDATE, 0, streamId, payload.data(), payload.size());
+}
+
+// A block larger than a frame continues in CONTINUATION frames, which
+// nothing may interleave with.
+void Http2Session::writeHeaders(uint32_t streamId, const std::string& block, bool endStream)
+{
+    size_t pos = 0;
+    uint8_t type = FRAME_HEADERS;
+    uint8_t flags = endStream ? FLAG_END_STREAM : 0;
+    do
+    {
+        size_t length = std::min<size_t>(block.size() - pos, _peerMaxFrame);
+        bool last = pos + length == block.size();
+        writeFrame(type, flags | (last ? FLAG_END_HEADERS : 0), streamId, block.data() + pos, length);
+        pos += length;
+        type = FRAME_CONTINUATION;
+        flags = 0;
+    }
+    while (pos < block.size());
+}
+
+bool Http2Session::sendable(const Stream& stream) const
+{
+    return stream.responding && stream.sendWindow > 0;
+}
+
+bool Http2Session::canSend() const
+{
+    if (_awaitPreface || _sendWindow <= 0)
+        return false;
+    for (std::map<uint32_t, Stream>::const_iterator it = _streams.begin(); it != _streams.end(); ++it)
+    {
+        if (sendable(it->second))
+            return true;
+    }
+    return false;
+}
+
+// The streams that can send and have no ancestor that can are served by
+// smooth weighted round robin, as upstream peers are: weights 32 and 16
+// give a a b a a b rather than runs. A dependent stream only gets the
+// bandwidth its ancestors cannot use.
+uint32_t Http2Session::nextToSend()
+{
+    Stream* best = NULL;
+    uint32_t bestId = 0;
+    long total = 0;
+    for (std::map<uint32_t, Stream>::iterator it = _streams.begin(); it != _streams.end(); ++it)
+    {
+        Stream& stream = it->second;
+        if (!sendable(stream))
+            continue;
+        bool blocked = false;
+        for (uint32_t parent = stream.parent; parent && !blocked;)
+        {
+            std::map<uint32_t, Stream>::const_iterator up = _streams.find(parent);
+            if (up == _streams.end())
+                break;
+            blocked = sendable(up->second);
+            parent = up->second.parent;
+        }
+        if (blocked)
+            continue;
+        stream.credit += stream.weight;
+        total += stream.weight;
+        if (!best || stream.credit > best->credit)
+        {
+            best = &stream;
+            bestId = it->first;
+        }
+    }
+    if (best)
+        best->credit -= total;
+    return bestId;
+}
+
+// After an upgrade, bodies wait for the client preface: clients read what
+// follows the 101 into a buffer of their own, which a body could overrun.
+void Http2Session::schedule()
+{
+    if (_awaitPreface)
+        return;
+    while (_sendWindow > 0 && _out.size() - _outSent < HIGH_WATER)
+    {
+        uint32_t streamId = nextToSend();
+        if (!streamId)
+            break;
+        Stream& stream = _streams[streamId];
+        size_t left = stream.response.bodySize() - stream.bodySent;
+        size_t chunk = std::min<size_t>(left, _peerMaxFrame);
+        chunk = std::min<size_t>(chunk, std::min(stream.sendWindow, _sendWindow));
+        bool last = chunk == left;
+        writeFrame(FRAME_DATA, last ? FLAG_END_STREAM : 0, streamId, stream.response.bodyData() + stream.bodySent, chunk);
+        stream.bodySent += chunk;
+        stream.sendWindow -= chunk;
+        _sendWindow -= chunk;
+        if (last)
+            closeStream(streamId);
+    }
+}
+
+// One send per call, as the other client paths do. The connection closes
+// once a connection error, or a GOAWAY with no stream left, is flushed.
+Http2Session::Result Http2Session::writable()
+{
+    schedule();
+    if (_outSent < _out.size())
+    {
+        struct iovec iov;
+        iov.iov_base = const_cast<char*>(_out.data() + _outSent);
+        iov.iov_len = _out.size() - _outSent;
+        ssize_t sent = TlsConnection::write(_tls, _clientFd, &iov, 1);
+        if (sent < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? CONTINUE : CLOSE;
+        Metrics::instance().bytesSent(sent);
+        _outSent += sent;
+        if (_outSent == _out.size())
+        {
+            _out.clear();
+            _outSent = 0;
+        }
+        else if (_outSent >= HIGH_WATER)
+        {
+            _out.erase(0, _outSent);
+            _outSent = 0;
+        }
+    }
+    if (_outSent == _out.size() && (_closing || (_draining && _streams.empty())))
+        return CLOSE;
+    return CONTINUE;
+}
+
+short Http2Session::events() const
+{
+    short events = _closing ? 0 : POLLIN;
+    if (_outSent < _out.size() || canSend())
+        events |= POLLOUT;
+    return events;
+}
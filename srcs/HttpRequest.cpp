@@ -11,52 +11,140 @@
 /* ************************************************************************** */
 
 #include "HttpRequest.hpp"
+#include "Metrics.hpp"
+#include "Tracer.hpp"
+#include "Bundle.hpp"
+#include "Cgi.hpp"
+#include <fcntl.h>
+
+// Cuts the line at cursor: its terminator (and a trailing '\r') becomes a NUL.
+// Advances cursor past the line and returns the line length.
+static size_t cutLine(char*& cursor, char* end)
+{
+    char* line = cursor;
+    char* newline = static_cast<char*>(memchr(cursor, '\n', end - cursor));
+    char* stop = newline ? newline : end;
+
+    cursor = newline ? newline + 1 : end;
+    if (stop > line && stop[-1] == '\r')
+        --stop;
+    *stop = '\0';
+    return stop - line;
+}
 
-HttpRequest::HttpRequest(const std::string rawRequest) : _method(""), _path(""), _httpVersion(""), _body("")
+// Next whitespace-separated word of a NUL-terminated line, terminated in place.
+static StringRef cutWord(char*& cursor)
 {
-    std::istringstream requestStream(rawRequest);
-    std::string line;
+    while (*cursor == ' ' || *cursor == '\t')
+        ++cursor;
+    char* word = cursor;
+    while (*cursor && *cursor != ' ' && *cursor != '\t')
+        ++cursor;
+    StringRef result(word, cursor - word);
+    if (*cursor)
+        *cursor++ = '\0';
+    return result;
+}
 
-    if (std::getline(requestStream, line))
-    {
-        std::istringstream lineStream(line);
-        lineStream >> _method >> _path >> _httpVersion;
-    }
+HttpRequest::HttpRequest(const std::string& rawRequest, RequestArena& arena)
+    : _arena(arena), _headers(NULL), _headerCount(0), _headLength(0), _fill(NULL), _cacheLockTimeoutUs(0),
+      _cgiClientFd(-1), _cgiTls(NULL), _bodyOnSocket(0), _contentLength(0), _lengthValid(true), _cgi(NULL)
+{
+    const char* raw = rawRequest.data();
+    size_t size = rawRequest.size();
+    size_t headLength = size;
+    size_t lines = 1;
 
-    while (std::getline(requestStream, line) && line != "\r")
+    // The head ends at the first empty line; the body follows it.
+    for (size_t pos = 0; pos < size;)
     {
-        std::size_t delimiter = line.find(":");
-        if (delimiter != std::string::npos)
+        const char* newline = static_cast<const char*>(memchr(raw + pos, '\n', size - pos));
+        if (!newline)
+            break;
+        size_t next = newline - raw + 1;
+        if (pos > 0 && (next - pos == 1 || (next - pos == 2 && raw[pos] == '\r')))
         {
-            std::string headerName = line.substr(0, delimiter);
-            std::string headerValue = line.substr(delimiter + 2);
-            _headers[headerName] = headerValue;
+            headLength = next;
+            break;
         }
+        ++lines;
+        pos = next;
     }
 
-    if (_method == "POST")
+    _headLength = headLength;
+    char* cursor = _arena.copy(raw, headLength);
+    char* end = cursor + headLength;
+    _headers = static_cast<HeaderField*>(_arena.allocate(lines * sizeof(HeaderField)));
+
+    char* line = cursor;
+    cutLine(cursor, end);
+    _method = cutWord(line);
+    _path = cutWord(line);
+    _httpVersion = cutWord(line);
+
+    while (cursor < end)
     {
-        std::map<std::string, std::string>::const_iterator it = _headers.find("Content-Length");
-        if (it != _headers.end())
-        {
-            int contentLength = std::atoi(it->second.c_str());
-            if (contentLength > 0)
-            {
-                std::vector<char> buffer(contentLength);
-                requestStream.read(&buffer[0], contentLength);
-                _body.assign(buffer.begin(), buffer.end());
-            }
-        }
+        line = cursor;
+        size_t length = cutLine(cursor, end);
+        if (length == 0)
+            break;
+        char* colon = static_cast<char*>(memchr(line, ':', length));
+        if (!colon)
+            continue;
+        *colon = '\0';
+        char* value = colon + 1;
+        char* valueEnd = line + length;
+        while (value < valueEnd && (*value == ' ' || *value == '\t'))
+            ++value;
+        while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t'))
+            *--valueEnd = '\0';
+        HeaderField& field = _headers[_headerCount++];
+        field.name = StringRef(line, colon - line);
+        field.value = StringRef(value, valueEnd - value);
     }
+    StringRef lengthHeader = header("Content-Length");
+    if (!lengthHeader.empty() && !lengthHeader.toUnsigned(_contentLength))
+    {
+        _contentLength = 0;
+        _lengthValid = false;
+    }
+    takeBody(rawRequest);
 }
 
-std::string HttpRequest::handleRequest(ServerConfig& config)
+// Copies the body of a POST out of rawRequest once all of it is there. A
+// request routed before its body has arrived calls this again when the body
+// is complete; a streamed body is never copied here.
+void HttpRequest::takeBody(const std::string& rawRequest)
+{
+    if (_method != "POST" || !_body.empty())
+        return;
+    if (_contentLength > 0 && rawRequest.size() - _headLength >= _contentLength)
+        _body.assign(rawRequest, _headLength, _contentLength);
+}
+
+unsigned long HttpRequest::contentLength() const
+{
+    return _contentLength;
+}
+
+bool HttpRequest::contentLengthValid() const
+{
+    return _lengthValid;
+}
+
+ResponseBuilder HttpRequest::handleRequest(ServerConfig& config)
 {
     const std::vector<ServerLocation>& locations = config.getLocations();
-    if (_body.size() > config.getClientMaxBodySize())
+    const ServerLocation* bundled = NULL;
+    if (!_lengthValid)
+        return findErrorPage(config, 400);
+    if (static_cast<unsigned long>(_body.size()) + _bodyOnSocket > static_cast<unsigned long>(config.getClientMaxBodySize()))
         return findErrorPage(config, 413);
     for (std::vector<ServerLocation>::const_iterator it = locations.begin(); it != locations.end(); ++it)
     {
+        if (it->getBundle() && it->contains(_path.data, _path.length)
+            && (!bundled || it->getPath().size() > bundled->getPath().size()))
+            bundled = &*it;
         if (_path == it->getPath())
         {
             if (_method == "GET" && !it->isGetAllowed())
@@ -65,9 +153,16 @@ std::string HttpRequest::handleRequest(ServerConfig& config)
                 return findErrorPage(config, 405);
             if (_method == "DELETE" && !it->isDeleteAllowed())
                 return findErrorPage(config, 405);
+            if (it->isStubStatus())
+                return _method == "GET" ? handleStubStatus() : findErrorPage(config, 405);
+            if (it->isTraceDump())
+                return _method == "GET" ? handleTraceDump() : findErrorPage(config, 405);
+            bundled = it->getBundle() ? &*it : NULL;
             break;
         }
     }
+    if (bundled)
+        return handleBundle(config, *bundled);
     if (_method == "GET")
         return handleGet(config);
     else if (_method == "POST")
@@ -78,46 +173,47 @@ std::string HttpRequest::handleRequest(ServerConfig& config)
         return findErrorPage(config, 400);
 }
 
-std::string HttpRequest::handleGet(ServerConfig& config)
+ResponseBuilder HttpRequest::handleGet(ServerConfig& config)
 {
-    std::string fullPath = resolveFilePath(config);
+    const char* fullPath = resolveFilePath(config);
     
     struct stat fileStat;
-    if (stat(fullPath.c_str(), &fileStat) != 0)
+    if (stat(fullPath, &fileStat) != 0)
         return findErrorPage(config, 404);
     if (S_ISDIR(fileStat.st_mode))
     {
-        std::string indexPath = fullPath + "/index.html";
-        if (access(indexPath.c_str(), F_OK) != 0)
+        const char* indexPath = _arena.concat(fullPath, strlen(fullPath), "/index.html", 11);
+        if (access(indexPath, F_OK) != 0)
             return findErrorPage(config, 403);
         fullPath = indexPath;
     }
     if (!isFileAccessible(fullPath))
         return findErrorPage(config, 404);
-    if (fullPath.find(".py") != std::string::npos && fullPath.find("/var/www/upload/") == std::string::npos)
-        return executeCGI(fullPath, config);
-    std::string fileContent = readFile(fullPath);
-    if (fileContent.empty() && S_ISREG(fileStat.st_mode))
+    if (strstr(fullPath, ".py") && !strstr(fullPath, "/var/www/upload/"))
     {
-        std::string response = "HTTP/1.1 204 No Content\r\n";
-        response += "Content-Length: 0\r\n";
-        response += "Connection: close\r\n\r\n";
-        return response;
+        const CachePolicy* policy = config.findCachePolicy(getPath());
+        return policy ? cachedCGI(fullPath, config, *policy) : executeCGI(fullPath, config);
     }
-    if (fileContent.empty())
+    ResponseBuilder response(200);
+    bool accepted = false;
+    const GzipPolicy* gzip = gzipPolicy(config, accepted);
+    bool sibling = false;
+    bool precompressed = gzip && gzip->staticFiles && readGzipSibling(fullPath, accepted, response, sibling);
+    if (!precompressed && !readFile(fullPath, response.bodyBuffer()))
         return findErrorPage(config, 500);
-    std::ostringstream oss;
-    oss << fileContent.size();
-    std::string response = "HTTP/1.1 200 OK\r\n";
-    response += "Content-Length: " + oss.str() + "\r\n";
-    response += "Content-Type: " + getMimeType(fullPath) + "\r\n";
-    if (_headers["Connection"] == "keep-alive")
-        response += "Connection: keep-alive\r\n";
+    if (!precompressed && response.bodySize() == 0 && S_ISREG(fileStat.st_mode))
+    {
+        ResponseBuilder empty(204);
+        empty.header("Connection", "close");
+        return empty;
+    }
+    response.header("Content-Type", mimeTypeFor(fullPath));
+    if (gzip && !sibling)
+        compressStatic(*gzip, fullPath, accepted, response);
+    if (header("Connection") == "keep-alive")
+        response.header("Connection", "keep-alive");
     else
-        response += "Connection: close\r\n";
-    response += "\r\n";
-    response += fileContent;
-
+        response.header("Connection", "close");
     return response;
 }
 
@@ -146,7 +242,7 @@ void HttpRequest::setupChildProcess(int outputPipe[2], int inputPipe[2], const s
     exit(1);
 }
 
-std::string HttpRequest::handleParentProcess(int outputPipe[2], int inputPipe[2], pid_t pid)
+ResponseBuilder HttpRequest::handleParentProcess(int outputPipe[2], int inputPipe[2], pid_t pid)
 {
     close(outputPipe[1]);
     close(inputPipe[0]);
@@ -156,13 +252,10 @@ std::string HttpRequest::handleParentProcess(int outputPipe[2], int inputPipe[2]
         throw std::runtime_error("Erreur lors de l'écriture dans le pipe d'entrée");
 
     std::string output;
-    char buffer[1024];
+    char buffer[16384];
     ssize_t bytesRead;
-    while ((bytesRead = read(outputPipe[0], buffer, sizeof(buffer) - 1)) > 0)
-    {
-        buffer[bytesRead] = '\0';
-        output += buffer;
-    }
+    while ((bytesRead = read(outputPipe[0], buffer, sizeof(buffer))) > 0)
+        output.append(buffer, bytesRead);
     close(outputPipe[0]);
     int status;
     if (waitpid(pid, &status, 0) == -1)
@@ -172,75 +265,152 @@ std::string HttpRequest::handleParentProcess(int outputPipe[2], int inputPipe[2]
     return constructCGIResponse(output);
 }
 
-std::string HttpRequest::executeCGI(const std::string& scriptPath, ServerConfig& config)
+ResponseBuilder HttpRequest::executeCGI(const std::string& scriptPath, ServerConfig& config)
 {
-    (void)config;
-    try
-    {
-        int outputPipe[2], inputPipe[2];
-        createPipes(outputPipe, inputPipe);
+    bool accepted = false;
+    const GzipPolicy* gzip = gzipPolicy(config, accepted);
+    int outputFd;
+    int inputFd;
+    pid_t pid = spawnCGI(scriptPath, outputFd, &inputFd);
+    if (pid < 0)
+        return generateDefaultErrorPage(500);
+    _cgi = new CgiSession(pid, inputFd, outputFd, _cgiClientFd, _cgiTls, _body, _bodyOnSocket,
+        _httpVersion == "HTTP/1.1", gzip, accepted);
+    return ResponseBuilder();
+}
 
-        pid_t pid = fork();
-        if (pid == 0)
-        {
-            setupChildProcess(outputPipe, inputPipe, scriptPath);
-        }
-        else if (pid > 0)
-        {
-            close(outputPipe[1]);
-            close(inputPipe[0]);
-
-            write(inputPipe[1], _body.c_str(), _body.size());
-            close(inputPipe[1]);
-
-            std::string output;
-            char buffer[1024];
-            ssize_t bytesRead;
-            int status;
-            int elapsedTime = 0;
-
-            while (elapsedTime < 5)
-            {
-                pid_t result = waitpid(pid, &status, WNOHANG);
-                if (result == pid)
-                {
-                    while ((bytesRead = read(outputPipe[0], buffer, sizeof(buffer) - 1)) > 0)
-                    {
-                        buffer[bytesRead] = '\0';
-                        output += buffer;
-                    }
-                    close(outputPipe[0]);
-                    
-                    return constructCGIResponse(output);
-                }
-                else if (result == 0)
-                {
-                    usleep(500000);
-                    elapsedTime++;
-                }
-                else
-                    throw std::runtime_error("Erreur lors de l'attente du processus CGI");
-            }
-            kill(pid, SIGKILL);
-            waitpid(pid, NULL, 0);
-            close(outputPipe[0]);
-            return findErrorPage(config,504);
-        }
+// A hit is answered from the cache; a stale hit too, and the one refresh
+// of its key left for the event loop to collect with takeCacheFill(). A
+// miss is answered by the event loop as well: the first one for a key
+// starts the script, and it and every identical miss until the script is
+// done wait for that one run (cacheWait()). A miss whose script cannot be
+// started is answered with 500: running it in line would stall the loop.
+ResponseBuilder HttpRequest::cachedCGI(const std::string& scriptPath, ServerConfig& config, const CachePolicy& policy)
+{
+    std::string key = cacheKey(config, policy);
+    ResponseCache& cache = ResponseCache::instance();
+    ResponseBuilder cached;
+    bool refresh = false;
+    bool accepted = false;
+    const GzipPolicy* gzip = gzipPolicy(config, accepted);
+    ResponseCache::Result result = cache.lookup(key, cached, refresh, gzip, accepted);
+    Metrics::instance().cacheLookup("cgi", result != ResponseCache::MISS);
+    bool leader = refresh || (result == ResponseCache::MISS && cache.lock(key));
+    if (leader)
+    {
+        int fd;
+        pid_t pid = spawnCGI(scriptPath, fd);
+        if (pid > 0)
+            _fill = new CacheFill(key, policy, pid, fd, Metrics::nowMicros() + CacheFill::TIMEOUT_US);
         else
-            throw std::runtime_error("Fork failed");
+            cache.unlock(key);
     }
-    catch (const std::exception& e)
+    if (result != ResponseCache::MISS)
+        return cached;
+    if (_fill || !leader)
     {
-        std::cerr << "Erreur CGI : " << e.what() << std::endl;
-        return generateDefaultErrorPage(500);
+        _cacheWait = key;
+        _cacheLockTimeoutUs = _fill ? CacheFill::TIMEOUT_US : policy.lockTimeout * 1000000UL;
+        return ResponseBuilder();
     }
     return generateDefaultErrorPage(500);
 }
 
-std::string HttpRequest::handlePost(ServerConfig& config)
+// Method, virtual host, request target and the cgi_cache_vary headers.
+std::string HttpRequest::cacheKey(const ServerConfig& config, const CachePolicy& policy) const
 {
-    std::string response;
+    std::string key;
+    key.reserve(_method.length + config.getLabel().size() + _path.length + 2);
+    key.append(_method.data, _method.length).append(1, ' ').append(config.getLabel()).append(1, ' ')
+        .append(_path.data, _path.length);
+    for (size_t i = 0; i < policy.vary.size(); ++i)
+    {
+        StringRef value = header(policy.vary[i].c_str());
+        key.append(1, '\n').append(policy.vary[i]).append(1, ':');
+        if (value.length)
+            key.append(value.data, value.length);
+    }
+    return key;
+}
 
+// Returns -1 if the script could not be started. The parent's ends of the
+// pipes are close-on-exec, so a later script does not hold them open.
+pid_t HttpRequest::spawnCGI(const std::string& scriptPath, int& outputFd, int* inputFd)
+{
+    int outputPipe[2], inputPipe[2];
+    try
+    {
+        createPipes(outputPipe, inputPipe);
+    }
+    catch (const std::exception&)
+    {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+        setupChildProcess(outputPipe, inputPipe, scriptPath);
+    close(outputPipe[1]);
+    close(inputPipe[0]);
+    if (pid < 0 || !inputFd)
+        close(inputPipe[1]);
+    if (pid < 0)
+    {
+        close(outputPipe[0]);
+        return -1;
+    }
+    Metrics::instance().cgiSpawned();
+    fcntl(outputPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(outputPipe[0], F_SETFD, FD_CLOEXEC);
+    outputFd = outputPipe[0];
+    if (inputFd)
+    {
+        fcntl(inputPipe[1], F_SETFL, O_NONBLOCK);
+        fcntl(inputPipe[1], F_SETFD, FD_CLOEXEC);
+        *inputFd = inputPipe[1];
+    }
+    return pid;
+}
+
+void HttpRequest::streamCgi(int clientFd, TlsConnection* tls, const std::string& rawRequest)
+{
+    _cgiClientFd = clientFd;
+    _cgiTls = tls;
+    if (_method != "POST" || _contentLength == 0 || !_body.empty())
+        return;
+    size_t received = rawRequest.size() > _headLength ? rawRequest.size() - _headLength : 0;
+    if (received >= _contentLength)
+        return;
+    _body.assign(rawRequest, _headLength, received);
+    _bodyOnSocket = _contentLength - received;
+}
+
+CgiSession* HttpRequest::takeCgiSession()
+{
+    CgiSession* session = _cgi;
+    _cgi = NULL;
+    return session;
+}
+
+unsigned long HttpRequest::bodyOnSocket() const
+{
+    return _bodyOnSocket;
+}
+
+CacheFill* HttpRequest::takeCacheFill()
+{
+    CacheFill* fill = _fill;
+    _fill = NULL;
+    return fill;
+}
+
+const std::string& HttpRequest::cacheWait(unsigned long& lockTimeoutUs) const
+{
+    lockTimeoutUs = _cacheLockTimeoutUs;
+    return _cacheWait;
+}
+
+ResponseBuilder HttpRequest::handlePost(ServerConfig& config)
+{
     const std::vector<ServerLocation>& locations = config.getLocations();
     for (std::vector<ServerLocation>::const_iterator it = locations.begin(); it != locations.end(); ++it) {
         if ("/post" == it->getPath() && _path != "/cgi-bin/auth.py")
@@ -250,31 +420,26 @@ std::string HttpRequest::handlePost(ServerConfig& config)
             break;
         }
     }
-    std::map<std::string, std::string>::const_iterator it = this->_headers.find("Content-Length");
-    if (it == this->_headers.end())
+    if (header("Content-Length").empty())
         return findErrorPage(config, 411);
-
-    int contentLength;
-    std::istringstream lengthStream(it->second);
-    lengthStream >> contentLength;
-
-    if (contentLength == 0)
+    if (_contentLength == 0)
         return findErrorPage(config, 400);
-    if (this->_body.size() != static_cast<std::string::size_type>(contentLength))
+    if (static_cast<unsigned long>(this->_body.size()) + _bodyOnSocket != _contentLength)
         return findErrorPage(config, 400);
-    std::map<std::string, std::string>::const_iterator contentTypeHeader = _headers.find("Content-Type");
-    if (contentTypeHeader == _headers.end())
+    StringRef contentTypeHeader = header("Content-Type");
+    if (contentTypeHeader.empty())
         return findErrorPage(config, 400);
 
-    std::string contentType = contentTypeHeader->second;
+    std::string contentType = contentTypeHeader.str();
     if (contentType.find("application/json") != std::string::npos)
-        return (uploadTxt(config, response));
+        return uploadTxt(config);
     else if (contentType.find("multipart/form-data") != std::string::npos)
-        return (uploadFile(config, response, contentType));
+        return uploadFile(config, contentType);
     else if (contentType.find("application/x-www-form-urlencoded") != std::string::npos)
     {
-        std::string scriptPath = _path;
-        scriptPath = config.getRoot() + scriptPath.substr(1);
+        std::string scriptPath = config.getRoot();
+        if (_path.length > 0)
+            scriptPath.append(_path.data + 1, _path.length - 1);
         return executeCGI(scriptPath, config);
     }
     else if (contentType.find("plain/text") != std::string::npos)
@@ -296,16 +461,14 @@ std::string HttpRequest::handlePost(ServerConfig& config)
         outFile.write(this->_body.c_str(), this->_body.size());
         outFile.close();
 
-        response = "HTTP/1.1 201 Created\r\n";
-        response += "Content-Length: 0\r\n";
-        response += "Content-Type: text/plain\r\n";
-        response += "\r\n";
+        ResponseBuilder response(201);
+        response.header("Content-Type", "text/plain");
         return response;
     }
     return findErrorPage(config, 415);
 }
 
-std::string HttpRequest::handleDelete(ServerConfig& config)
+ResponseBuilder HttpRequest::handleDelete(ServerConfig& config)
 {
     const std::vector<ServerLocation>& locations = config.getLocations();
     for (std::vector<ServerLocation>::const_iterator it = locations.begin(); it != locations.end(); ++it) {
@@ -316,7 +479,8 @@ std::string HttpRequest::handleDelete(ServerConfig& config)
             break;
         }
     }
-    std::string resourcePath = "var/www/upload" + _path;
+    std::string resourcePath = "var/www/upload";
+    resourcePath.append(_path.data, _path.length);
 
     struct stat fileStat;
     if (stat(resourcePath.c_str(), &fileStat) != 0)
@@ -325,71 +489,163 @@ std::string HttpRequest::handleDelete(ServerConfig& config)
     if (access(resourcePath.c_str(), W_OK) != 0)
         return findErrorPage(config, 403);
 
-    std::map<std::string, std::string>::const_iterator methodIt = _headers.find("Allow");
-    if (methodIt != _headers.end() && methodIt->second.find("DELETE") == std::string::npos)
+    StringRef allow = header("Allow");
+    if (!allow.empty() && !allow.contains("DELETE"))
         return findErrorPage(config, 405);
     if (unlink(resourcePath.c_str()) != 0)
         return findErrorPage(config, 500);
-    std::string response = "HTTP/1.1 204 Created\r\n";
-        response += "Content-Length: 0\r\n";
-        response += "Content-Type: text/plain\r\n";
-        response += "\r\n";
-        return response;
+    return ResponseBuilder(204);
+}
+
+// Serves a location backed by a mapped bundle. The body points into the
+// mapping, so nothing is read or copied per request.
+ResponseBuilder HttpRequest::handleBundle(ServerConfig& config, const ServerLocation& location)
+{
+    if (_method != "GET")
+        return findErrorPage(config, 405);
+
+    size_t start = location.getPath().size();
+    const char* query = static_cast<const char*>(memchr(_path.data, '?', _path.length));
+    size_t end = query ? query - _path.data : _path.length;
+    while (start < end && _path.data[start] == '/')
+        ++start;
+    const char* relative = _path.data + start;
+    size_t relativeLength = end - start;
+    if (relativeLength == 0 || relative[relativeLength - 1] == '/')
+    {
+        const char* index = location.getIndex().empty() ? "index.html" : location.getIndex().c_str();
+        size_t indexLength = strlen(index);
+        relative = _arena.concat(relative, relativeLength, index, indexLength);
+        relativeLength += indexLength;
+    }
+
+    Bundle::File file;
+    if (!location.getBundle()->find(relative, relativeLength, file))
+        return findErrorPage(config, 404);
+
+    if (header("If-None-Match") == file.etag)
+    {
+        ResponseBuilder notModified(304);
+        notModified.header("ETag", file.etag);
+        return notModified;
+    }
+    ResponseBuilder response(200);
+    response.header("Content-Type", file.mime);
+    response.header("ETag", file.etag);
+    if (file.gzipData)
+    {
+        response.header("Vary", "Accept-Encoding");
+        if (Gzip::accepted(header("Accept-Encoding")))
+        {
+            response.header("Content-Encoding", "gzip");
+            response.bodyRef(file.gzipData, file.gzipLength);
+        }
+        else
+            response.bodyRef(file.data, file.length);
+    }
+    else
+        response.bodyRef(file.data, file.length);
+    response.header("Connection", header("Connection") == "keep-alive" ? "keep-alive" : "close");
+    return response;
 }
 
-std::string HttpRequest::findErrorPage(ServerConfig& config, int errorCode)
+ResponseBuilder HttpRequest::findErrorPage(ServerConfig& config, int errorCode)
 {
-    std::string errorPagePath = config.getRoot() + config.getErrorPage(errorCode);
-    if (errorPagePath.empty())
+    std::string errorPage = config.getErrorPage(errorCode);
+    if (errorPage.empty())
     {
         std::cerr << "Erreur : Aucune page d'erreur définie pour le code " << errorCode << std::endl;
         return generateDefaultErrorPage(errorCode);
     }
-    std::string fullPath =  errorPagePath;
+    std::string fullPath = config.getRoot() + errorPage;
     struct stat fileStat;
     if (stat(fullPath.c_str(), &fileStat) != 0 || access(fullPath.c_str(), R_OK) != 0)
     {
         std::cerr << "Erreur : La page d'erreur " << fullPath << " est introuvable ou inaccessible" << std::endl;
         return generateDefaultErrorPage(errorCode);
     }
-    std::ifstream errorFile(fullPath.c_str());
-    if (!errorFile.is_open())
+    ResponseBuilder response(errorCode);
+    if (!readFile(fullPath.c_str(), response.bodyBuffer()))
     {
         std::cerr << "Erreur : Impossible d'ouvrir la page d'erreur " << fullPath << std::endl;
         return generateDefaultErrorPage(errorCode);
     }
+    response.header("Content-Type", "text/html");
+    return response;
+}
 
-    std::string content;
-    std::string line;
-    while (std::getline(errorFile, line))
-        content += line + "\n";
-    errorFile.close();
-
-    std::ostringstream response;
-    response << "HTTP/1.1 " << errorCode << " Error\r\n";
-    response << "Content-Type: text/html\r\n";
-    response << "Content-Length: " << content.size() << "\r\n";
-    response << "\r\n";
-    response << content;
+ResponseBuilder HttpRequest::handleStubStatus()
+{
+    ResponseBuilder response(200);
+    Metrics::instance().render(response.bodyBuffer());
+    response.header("Content-Type", "text/plain; version=0.0.4");
+    response.header("Cache-Control", "no-cache");
+    return response;
+}
 
-    return response.str();
+ResponseBuilder HttpRequest::handleTraceDump()
+{
+    ResponseBuilder response(200);
+    Tracer::instance().render(response.bodyBuffer());
+    response.header("Content-Type", "application/json");
+    response.header("Cache-Control", "no-cache");
+    return response;
 }
 
-std::string HttpRequest::getHttpVersion(void)
+const char* HttpRequest::getHttpVersion() const
 {
-    return _httpVersion;
+    return _httpVersion.data;
 }
 
-std::string HttpRequest::getMethod() const
+StringRef HttpRequest::getMethodRef() const
 {
     return _method;
 }
 
-std::string HttpRequest::getPath() const
+StringRef HttpRequest::getPathRef() const
 {
     return _path;
 }
 
+StringRef HttpRequest::getHttpVersionRef() const
+{
+    return _httpVersion;
+}
+
+// Bytes of the raw request taken by the request line and headers; the body
+// starts right after.
+size_t HttpRequest::getHeadLength() const
+{
+    return _headLength;
+}
+
+size_t HttpRequest::getHeaderCount() const
+{
+    return _headerCount;
+}
+
+const StringRef& HttpRequest::getHeaderName(size_t index) const
+{
+    return _headers[index].name;
+}
+
+const StringRef& HttpRequest::getHeaderValue(size_t index) const
+{
+    return _headers[index].value;
+}
+
+const char* HttpRequest::getMethod() const
+{
+    return _method.data;
+}
+
+const char* HttpRequest::getPath() const
+{
+    return _path.data;
+}
+
 HttpRequest::~HttpRequest()
 {
-}
\ No newline at end of file
+    delete _fill;
+    delete _cgi;
+}
@@ -0,0 +1,397 @@
+#include "Logger.hpp"
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+volatile sig_atomic_t Logger::_reopenRequested = 0;
+int Logger::_wakeFd = -1;
+
+// Both are async-signal-safe: requestReopen() posts from a signal handler.
+static void postEvent(int fd)
+{
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+static void waitEvent(int fd)
+{
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) < 0 && errno == EINTR)
+        ;
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                 LogRing                                  */
+/* ------------------------------------------------------------------------ */
+
+LogRing::LogRing(size_t capacity) : _data(NULL), _capacity(1), _head(0), _tail(0)
+{
+    while (_capacity < capacity)
+        _capacity <<= 1;
+    _data = new char[_capacity];
+}
+
+LogRing::~LogRing()
+{
+    delete[] _data;
+}
+
+void LogRing::copyIn(size_t pos, const char* src, size_t len)
+{
+    size_t offset = pos & (_capacity - 1);
+    size_t first = std::min(len, _capacity - offset);
+    std::memcpy(_data + offset, src, first);
+    std::memcpy(_data, src + first, len - first);
+}
+
+void LogRing::copyOut(size_t pos, char* dst, size_t len) const
+{
+    size_t offset = pos & (_capacity - 1);
+    size_t first = std::min(len, _capacity - offset);
+    std::memcpy(dst, _data + offset, first);
+    std::memcpy(dst + first, _data, len - first);
+}
+
+// Producer side. Fails without blocking when the record does not fit.
+bool LogRing::push(const char* record, size_t len)
+{
+    size_t head = _head;
+    size_t tail = __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+    unsigned int header = static_cast<unsigned int>(len);
+
+    if (_capacity - (head - tail) < len + sizeof(header))
+        return false;
+    copyIn(head, reinterpret_cast<const char*>(&header), sizeof(header));
+    copyIn(head + sizeof(header), record, len);
+    __atomic_store_n(&_head, head + sizeof(header) + len, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Consumer side. Returns the record length, or 0 when the ring is empty or
+// the next record does not fit in dst.
+size_t LogRing::pop(char* dst, size_t maxLen)
+{
+    size_t tail = _tail;
+    size_t head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+    unsigned int header;
+
+    if (head == tail)
+        return 0;
+    copyOut(tail, reinterpret_cast<char*>(&header), sizeof(header));
+    if (header > maxLen)
+        return 0;
+    copyOut(tail + sizeof(header), dst, header);
+    __atomic_store_n(&_tail, tail + sizeof(header) + header, __ATOMIC_RELEASE);
+    return header;
+}
+
+bool LogRing::empty() const
+{
+    return __atomic_load_n(&_head, __ATOMIC_ACQUIRE) == __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+}
+
+size_t LogRing::capacity() const
+{
+    return _capacity;
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                  Logger                                  */
+/* ------------------------------------------------------------------------ */
+
+Logger::Channel::Channel() : ring(NULL), path("-"), fd(STDOUT_FILENO), dropped(0)
+{
+}
+
+Logger::Logger()
+    : _policy(DROP), _started(false), _stopping(0), _spaceFd(-1), _writerIdle(0), _producerWaiting(0),
+      _owner(getpid()), _stampTime(0)
+{
+    _stamp[0] = '\0';
+    _access.ring = new LogRing(DEFAULT_RING_SIZE);
+    _error.ring = new LogRing(DEFAULT_RING_SIZE);
+    _slow.ring = new LogRing(SLOW_RING_SIZE);
+    pthread_mutex_init(&_configLock, NULL);
+    _wakeFd = eventfd(0, EFD_CLOEXEC);
+    _spaceFd = eventfd(0, EFD_CLOEXEC);
+    if (_wakeFd >= 0 && _spaceFd >= 0)
+        start();
+}
+
+Logger::~Logger()
+{
+    shutdown();
+    pthread_mutex_destroy(&_configLock);
+    delete _access.ring;
+    delete _error.ring;
+    delete _slow.ring;
+    if (_wakeFd >= 0)
+        close(_wakeFd);
+    if (_spaceFd >= 0)
+        close(_spaceFd);
+    _wakeFd = -1;
+}
+
+Logger& Logger::instance()
+{
+    static Logger logger;
+    return logger;
+}
+
+// The writer thread blocks every signal so that SIGINT/SIGHUP keep
+// interrupting poll() on the event-loop thread.
+void Logger::start()
+{
+    sigset_t all;
+    sigset_t previous;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    _started = pthread_create(&_thread, NULL, &Logger::writerMain, this) == 0;
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+void Logger::shutdown()
+{
+    if (!_started || getpid() != _owner)
+        return;
+    __atomic_store_n(&_stopping, 1, __ATOMIC_RELEASE);
+    postEvent(_wakeFd);
+    pthread_join(_thread, NULL);
+    _started = false;
+    if (_access.fd > STDERR_FILENO)
+        close(_access.fd);
+    if (_error.fd > STDERR_FILENO)
+        close(_error.fd);
+    if (_slow.fd > STDERR_FILENO)
+        close(_slow.fd);
+    _access.fd = -1;
+    _error.fd = -1;
+    _slow.fd = -1;
+}
+
+void Logger::openChannel(Channel& channel)
+{
+    int fd;
+
+    if (channel.path == "off")
+        fd = -1;
+    else if (channel.path == "-" || channel.path == "stdout")
+        fd = STDOUT_FILENO;
+    else if (channel.path == "stderr")
+        fd = STDERR_FILENO;
+    else
+    {
+        fd = open(channel.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw std::runtime_error("Failed to open log file: " + channel.path);
+    }
+    if (channel.fd > STDERR_FILENO)
+        close(channel.fd);
+    channel.fd = fd;
+}
+
+// An empty slowPath sends the slow request log to the error log.
+void Logger::configure(const std::string& accessPath, const std::string& errorPath, const std::string& slowPath,
+    FullPolicy policy)
+{
+    pthread_mutex_lock(&_configLock);
+    try
+    {
+        _access.path = accessPath;
+        _error.path = errorPath;
+        _slow.path = slowPath.empty() ? errorPath : slowPath;
+        _policy = policy;
+        openChannel(_access);
+        openChannel(_error);
+        openChannel(_slow);
+    }
+    catch (...)
+    {
+        pthread_mutex_unlock(&_configLock);
+        throw;
+    }
+    pthread_mutex_unlock(&_configLock);
+}
+
+// Runs on the writer thread after SIGUSR1. Files are reopened by path so a
+// rotated log starts fresh; failures keep the previous descriptor.
+void Logger::reopen()
+{
+    pthread_mutex_lock(&_configLock);
+    Channel* channels[3] = { &_access, &_error, &_slow };
+    for (int i = 0; i < 3; ++i)
+    {
+        if (channels[i]->fd <= STDERR_FILENO)
+            continue;
+        int fd = open(channels[i]->path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+            continue;
+        close(channels[i]->fd);
+        channels[i]->fd = fd;
+    }
+    pthread_mutex_unlock(&_configLock);
+}
+
+void Logger::enqueue(Channel& channel, const std::string& line)
+{
+    if (channel.path == "off")
+        return;
+    size_t len = std::min(line.size(), static_cast<size_t>(MAX_RECORD));
+
+    if (channel.dropped && _policy == DROP)
+    {
+        std::string note = "[WARNING] " + std::string(timestamp()) + " - log ring full, messages dropped\n";
+        if (channel.ring->push(note.data(), note.size()))
+            channel.dropped = 0;
+    }
+    while (!channel.ring->push(line.data(), len))
+    {
+        if (_policy == DROP || !_started)
+        {
+            ++channel.dropped;
+            return;
+        }
+        // Ask the writer to post once it has freed space, then try once more
+        // in case it already has. A stale post only costs another failed push.
+        __atomic_store_n(&_producerWaiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (channel.ring->push(line.data(), len))
+            break;
+        waitEvent(_spaceFd);
+    }
+    wakeWriter();
+}
+
+// The writer only goes idle once every ring is empty, so this posts on the
+// push that makes a ring non-empty and costs a fence on every other one. The
+// fence pairs with the writer's: either it sees the record or we see it idle.
+void Logger::wakeWriter()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&_writerIdle, 0, __ATOMIC_SEQ_CST))
+        postEvent(_wakeFd);
+}
+
+void Logger::error(const std::string& level, const std::string& message)
+{
+    std::string line;
+    line.reserve(level.size() + message.size() + 32);
+    line += '[';
+    line += level;
+    line += "] ";
+    line += timestamp();
+    line += " - ";
+    line += message;
+    line += '\n';
+    enqueue(_error, line);
+}
+
+void Logger::access(const std::string& line)
+{
+    enqueue(_access, line);
+}
+
+void Logger::slow(const std::string& line)
+{
+    enqueue(_slow, line);
+}
+
+// Local time formatted once per second; only called from the event loop.
+const char* Logger::timestamp()
+{
+    std::time_t now = std::time(NULL);
+    if (now != _stampTime)
+    {
+        struct tm localTime;
+        localtime_r(&now, &localTime);
+        std::strftime(_stamp, sizeof(_stamp), "%Y-%m-%d %H:%M:%S", &localTime);
+        _stampTime = now;
+    }
+    return _stamp;
+}
+
+unsigned long Logger::droppedCount() const
+{
+    return _access.dropped + _error.dropped + _slow.dropped;
+}
+
+void Logger::requestReopen()
+{
+    _reopenRequested = 1;
+    if (_wakeFd >= 0)
+        postEvent(_wakeFd);
+}
+
+// Moves as many records as fit into one batch and writes them with a single
+// write(). Returns true if anything was written.
+bool Logger::drain(Channel& channel, char* batch, size_t batchSize)
+{
+    size_t used = 0;
+    size_t len;
+
+    while (batchSize - used >= MAX_RECORD && (len = channel.ring->pop(batch + used, batchSize - used)) > 0)
+        used += len;
+    if (used == 0)
+        return false;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&_producerWaiting, 0, __ATOMIC_SEQ_CST))
+        postEvent(_spaceFd);
+    pthread_mutex_lock(&_configLock);
+    size_t written = 0;
+    while (channel.fd >= 0 && written < used)
+    {
+        ssize_t n = write(channel.fd, batch + written, used - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        written += n;
+    }
+    pthread_mutex_unlock(&_configLock);
+    return true;
+}
+
+// Anything for the writer to do. Read after it has marked itself idle, so a
+// record pushed after this check is posted for.
+bool Logger::pending() const
+{
+    return !_access.ring->empty() || !_error.ring->empty() || !_slow.ring->empty() || _reopenRequested
+        || __atomic_load_n(&_stopping, __ATOMIC_ACQUIRE);
+}
+
+void* Logger::writerMain(void* arg)
+{
+    Logger* self = static_cast<Logger*>(arg);
+    static const size_t BATCH_SIZE = 64 * 1024;
+    char* batch = new char[BATCH_SIZE];
+
+    for (;;)
+    {
+        if (_reopenRequested)
+        {
+            _reopenRequested = 0;
+            self->reopen();
+        }
+        bool wroteError = self->drain(self->_error, batch, BATCH_SIZE);
+        bool wroteAccess = self->drain(self->_access, batch, BATCH_SIZE);
+        bool wroteSlow = self->drain(self->_slow, batch, BATCH_SIZE);
+        if (wroteError || wroteAccess || wroteSlow)
+            continue;
+        if (__atomic_load_n(&self->_stopping, __ATOMIC_ACQUIRE))
+            break;
+        __atomic_store_n(&self->_writerIdle, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!self->pending())
+            waitEvent(_wakeFd);
+        __atomic_store_n(&self->_writerIdle, 0, __ATOMIC_SEQ_CST);
+    }
+    delete[] batch;
+    return NULL;
+}
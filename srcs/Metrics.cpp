@@ -0,0 +1,454 @@
+#include "Metrics.hpp"
+#include "ResponseBuilder.hpp"
+#include "RequestArena.hpp"
+#include "Proxy.hpp"
+#include "UpstreamGroup.hpp"
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+/* ------------------------------------------------------------------------ */
+/*                             LatencyHistogram                             */
+/* ------------------------------------------------------------------------ */
+
+LatencyHistogram::LatencyHistogram(const std::string& server, const std::string& location)
+    : _server(server), _location(location), _counts(NULL), _total(0), _sumUs(0), _maxUs(0)
+{
+}
+
+LatencyHistogram::~LatencyHistogram()
+{
+    delete[] _counts;
+}
+
+int LatencyHistogram::bucketIndex(unsigned long micros)
+{
+    if (micros < static_cast<unsigned long>(SUB_BUCKETS))
+        return static_cast<int>(micros);
+    int exponent = 63 - __builtin_clzl(micros);
+    if (exponent >= MAX_EXPONENT)
+        return BUCKET_COUNT - 1;
+    int shift = exponent - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + static_cast<int>((micros >> shift) & (SUB_BUCKETS - 1));
+}
+
+unsigned long LatencyHistogram::bucketUpperBound(int index)
+{
+    if (index < SUB_BUCKETS)
+        return index;
+    int shift = index / SUB_BUCKETS - 1;
+    unsigned long lower = static_cast<unsigned long>(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+    return lower + (1UL << shift) - 1;
+}
+
+void LatencyHistogram::record(unsigned long micros)
+{
+    if (!_counts)
+    {
+        _counts = new unsigned long[BUCKET_COUNT];
+        std::memset(_counts, 0, sizeof(unsigned long) * BUCKET_COUNT);
+    }
+    ++_counts[bucketIndex(micros)];
+    ++_total;
+    _sumUs += micros;
+    if (micros > _maxUs)
+        _maxUs = micros;
+}
+
+unsigned long LatencyHistogram::count() const
+{
+    return _total;
+}
+
+unsigned long LatencyHistogram::sumMicros() const
+{
+    return _sumUs;
+}
+
+unsigned long LatencyHistogram::maxMicros() const
+{
+    return _maxUs;
+}
+
+unsigned long LatencyHistogram::countAtOrBelow(unsigned long micros) const
+{
+    if (!_counts)
+        return 0;
+    unsigned long total = 0;
+    int last = bucketIndex(micros);
+    for (int i = 0; i <= last; ++i)
+        total += _counts[i];
+    return total;
+}
+
+unsigned long LatencyHistogram::percentile(double quantile) const
+{
+    if (!_counts || _total == 0)
+        return 0;
+    unsigned long target = static_cast<unsigned long>(quantile * _total + 0.5);
+    if (target == 0)
+        target = 1;
+    unsigned long seen = 0;
+    for (int i = 0; i < BUCKET_COUNT; ++i)
+    {
+        seen += _counts[i];
+        if (seen >= target)
+        {
+            unsigned long bound = bucketUpperBound(i);
+            return bound < _maxUs ? bound : _maxUs;
+        }
+    }
+    return _maxUs;
+}
+
+const std::string& LatencyHistogram::server() const
+{
+    return _server;
+}
+
+const std::string& LatencyHistogram::location() const
+{
+    return _location;
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                 Metrics                                  */
+/* ------------------------------------------------------------------------ */
+
+Metrics::CacheCounters::CacheCounters() : hits(0), misses(0)
+{
+}
+
+Metrics::Metrics() : _accepted(0), _active(0), _idle(0), _bytesIn(0), _bytesOut(0), _cgiSpawns(0), _cgiTimeouts(0),
+    _limitEntries(0), _limitEvictions(0), _upstreamConnects(0), _upstreamReuses(0), _upstreamFailures(0),
+    _tlsHandshakes(0), _tlsResumed(0), _tlsFailures(0), _tlsKernel(0),
+    _loopLagUs(0), _bufferedBytes(0)
+{
+    std::memset(_requestsByStatus, 0, sizeof(_requestsByStatus));
+    std::memset(_rejected, 0, sizeof(_rejected));
+    std::memset(_limited, 0, sizeof(_limited));
+}
+
+Metrics::~Metrics()
+{
+    for (std::map<std::string, LatencyHistogram*>::iterator it = _histograms.begin(); it != _histograms.end(); ++it)
+        delete it->second;
+}
+
+Metrics& Metrics::instance()
+{
+    static Metrics metrics;
+    return metrics;
+}
+
+void Metrics::connectionAccepted()
+{
+    ++_accepted;
+}
+
+void Metrics::setConnections(unsigned long active, unsigned long idle)
+{
+    _active = active;
+    _idle = idle;
+}
+
+void Metrics::requestCompleted(int statusCode)
+{
+    if (statusCode >= 100 && statusCode < 600)
+        ++_requestsByStatus[statusCode];
+}
+
+void Metrics::bytesReceived(unsigned long bytes)
+{
+    _bytesIn += bytes;
+}
+
+void Metrics::bytesSent(unsigned long bytes)
+{
+    _bytesOut += bytes;
+}
+
+void Metrics::cgiSpawned()
+{
+    ++_cgiSpawns;
+}
+
+void Metrics::cgiTimedOut()
+{
+    ++_cgiTimeouts;
+}
+
+void Metrics::connectionRejected(RejectReason reason)
+{
+    ++_rejected[reason];
+}
+
+void Metrics::setLoad(unsigned long loopLagUs, unsigned long bufferedBytes)
+{
+    _loopLagUs = loopLagUs;
+    _bufferedBytes = bufferedBytes;
+}
+
+void Metrics::requestLimited(LimitKind kind)
+{
+    ++_limited[kind];
+}
+
+void Metrics::setLimiterState(unsigned long entries, unsigned long evictions)
+{
+    _limitEntries = entries;
+    _limitEvictions = evictions;
+}
+
+void Metrics::upstreamConnection(bool reused)
+{
+    if (reused)
+        ++_upstreamReuses;
+    else
+        ++_upstreamConnects;
+}
+
+void Metrics::upstreamFailed()
+{
+    ++_upstreamFailures;
+}
+
+void Metrics::tlsHandshake(bool resumed, bool kernelSend)
+{
+    if (resumed)
+        ++_tlsResumed;
+    else
+        ++_tlsHandshakes;
+    if (kernelSend)
+        ++_tlsKernel;
+}
+
+void Metrics::tlsFailed()
+{
+    ++_tlsFailures;
+}
+
+void Metrics::cacheLookup(const std::string& cache, bool hit)
+{
+    CacheCounters& counters = _caches[cache];
+    if (hit)
+        ++counters.hits;
+    else
+        ++counters.misses;
+}
+
+// Histograms are looked up once when a configuration is loaded; the request
+// path only follows the returned pointer.
+LatencyHistogram* Metrics::histogram(const std::string& server, const std::string& location)
+{
+    std::string key;
+    key.reserve(server.size() + 1 + location.size());
+    key.append(server).append(1, '\n').append(location);
+    std::map<std::string, LatencyHistogram*>::iterator it = _histograms.lower_bound(key);
+    if (it != _histograms.end() && it->first == key)
+        return it->second;
+    LatencyHistogram* created = new LatencyHistogram(server, location);
+    _histograms.insert(it, std::make_pair(key, created));
+    return created;
+}
+
+unsigned long Metrics::nowMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<unsigned long>(ts.tv_sec) * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static std::string escapeLabel(const std::string& value)
+{
+    std::string escaped;
+    for (size_t i = 0; i < value.size(); ++i)
+    {
+        if (value[i] == '"' || value[i] == '\\')
+            escaped += '\\';
+        if (value[i] == '\n')
+            escaped += "\\n";
+        else
+            escaped += value[i];
+    }
+    return escaped;
+}
+
+static void appendSeconds(std::string& out, unsigned long micros)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.6f", micros / 1000000.0);
+    out += buffer;
+}
+
+static void appendCounter(std::string& out, const char* name, const char* help, unsigned long value)
+{
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += " counter\n";
+    out += name;
+    out += ' ';
+    out += ResponseBuilder::toString(value);
+    out += '\n';
+}
+
+void Metrics::renderHistograms(std::string& out) const
+{
+    static const unsigned long bounds[] = {
+        100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+        100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+    };
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    out += "# HELP webserv_request_duration_seconds Time from first request byte to last response byte.\n";
+    out += "# TYPE webserv_request_duration_seconds histogram\n";
+    for (std::map<std::string, LatencyHistogram*>::const_iterator it = _histograms.begin(); it != _histograms.end(); ++it)
+    {
+        const LatencyHistogram& h = *it->second;
+        if (h.count() == 0)
+            continue;
+        std::string labels = "server=\"" + escapeLabel(h.server()) + "\",location=\"" + escapeLabel(h.location()) + "\"";
+        for (size_t i = 0; i < sizeof(bounds) / sizeof(bounds[0]); ++i)
+        {
+            out += "webserv_request_duration_seconds_bucket{" + labels + ",le=\"";
+            appendSeconds(out, bounds[i]);
+            out += "\"} " + ResponseBuilder::toString(h.countAtOrBelow(bounds[i])) + "\n";
+        }
+        out += "webserv_request_duration_seconds_bucket{" + labels + ",le=\"+Inf\"} " + ResponseBuilder::toString(h.count()) + "\n";
+        out += "webserv_request_duration_seconds_sum{" + labels + "} ";
+        appendSeconds(out, h.sumMicros());
+        out += "\nwebserv_request_duration_seconds_count{" + labels + "} " + ResponseBuilder::toString(h.count()) + "\n";
+    }
+
+    out += "# HELP webserv_request_duration_quantile_seconds Latency percentiles from the HDR histograms.\n";
+    out += "# TYPE webserv_request_duration_quantile_seconds gauge\n";
+    for (std::map<std::string, LatencyHistogram*>::const_iterator it = _histograms.begin(); it != _histograms.end(); ++it)
+    {
+        const LatencyHistogram& h = *it->second;
+        if (h.count() == 0)
+            continue;
+        std::string labels = "server=\"" + escapeLabel(h.server()) + "\",location=\"" + escapeLabel(h.location()) + "\"";
+        for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i)
+        {
+            char quantile[16];
+            snprintf(quantile, sizeof(quantile), "%g", quantiles[i]);
+            out += "webserv_request_duration_quantile_seconds{" + labels + ",quantile=\"" + quantile + "\"} ";
+            appendSeconds(out, h.percentile(quantiles[i]));
+            out += '\n';
+        }
+    }
+}
+
+// Per-server state of the current configuration's upstream blocks.
+void Metrics::renderUpstreams(std::string& out) const
+{
+    unsigned long nowUs = nowMicros();
+    std::string up;
+    std::string active;
+    std::string requests;
+    for (size_t g = 0; g < _upstreamGroups.size(); ++g)
+    {
+        const UpstreamGroup& group = *_upstreamGroups[g];
+        for (size_t p = 0; p < group.size(); ++p)
+        {
+            const Upstream& server = *group.peer(p).server;
+            std::string labels = "{upstream=\"" + escapeLabel(group.name()) + "\",server=\"" + escapeLabel(server.name()) + "\"} ";
+            up += "webserv_upstream_server_up" + labels + (server.available(nowUs) ? "1\n" : "0\n");
+            active += "webserv_upstream_server_active" + labels + ResponseBuilder::toString(server.active()) + "\n";
+            requests += "webserv_upstream_server_requests_total" + labels + ResponseBuilder::toString(server.requests()) + "\n";
+        }
+    }
+    out += "# HELP webserv_upstream_server_up Whether the balancer currently sends requests to the server.\n";
+    out += "# TYPE webserv_upstream_server_up gauge\n" + up;
+    out += "# HELP webserv_upstream_server_active Proxied requests in flight to the server.\n";
+    out += "# TYPE webserv_upstream_server_active gauge\n" + active;
+    out += "# HELP webserv_upstream_server_requests_total Proxied requests given to the server.\n";
+    out += "# TYPE webserv_upstream_server_requests_total counter\n" + requests;
+}
+
+void Metrics::setUpstreamGroups(const std::vector<UpstreamGroup*>& groups)
+{
+    _upstreamGroups = groups;
+}
+
+void Metrics::render(std::string& out) const
+{
+    appendCounter(out, "webserv_connections_accepted_total", "Accepted client connections.", _accepted);
+
+    out += "# HELP webserv_connections Open client connections by state.\n";
+    out += "# TYPE webserv_connections gauge\n";
+    out += "webserv_connections{state=\"active\"} " + ResponseBuilder::toString(_active) + "\n";
+    out += "webserv_connections{state=\"idle\"} " + ResponseBuilder::toString(_idle) + "\n";
+
+    static const char* const rejectReasons[REJECT_REASONS] = { "worker_connections", "memory_limit", "lag", "descriptors" };
+    out += "# HELP webserv_connections_rejected_total Connections refused with a 503, by reason.\n";
+    out += "# TYPE webserv_connections_rejected_total counter\n";
+    for (int i = 0; i < REJECT_REASONS; ++i)
+        out += std::string("webserv_connections_rejected_total{reason=\"") + rejectReasons[i] + "\"} " + ResponseBuilder::toString(_rejected[i]) + "\n";
+    static const char* const limitKinds[LIMIT_KINDS] = { "limit_req", "limit_conn" };
+    out += "# HELP webserv_limited_requests_total Requests refused by a per-client limit.\n";
+    out += "# TYPE webserv_limited_requests_total counter\n";
+    for (int i = 0; i < LIMIT_KINDS; ++i)
+        out += std::string("webserv_limited_requests_total{limit=\"") + limitKinds[i] + "\"} " + ResponseBuilder::toString(_limited[i]) + "\n";
+    out += "# HELP webserv_limit_clients Client entries held by the per-client limiter.\n";
+    out += "# TYPE webserv_limit_clients gauge\nwebserv_limit_clients " + ResponseBuilder::toString(_limitEntries) + "\n";
+    appendCounter(out, "webserv_limit_evictions_total", "Limiter entries evicted to make room for new clients.", _limitEvictions);
+    out += "# HELP webserv_event_loop_lag_seconds Smoothed time ready events wait behind a busy loop.\n";
+    out += "# TYPE webserv_event_loop_lag_seconds gauge\nwebserv_event_loop_lag_seconds ";
+    appendSeconds(out, _loopLagUs);
+    out += "\n# HELP webserv_buffered_bytes Unparsed request bytes and unsent response bytes held for clients.\n";
+    out += "# TYPE webserv_buffered_bytes gauge\nwebserv_buffered_bytes " + ResponseBuilder::toString(_bufferedBytes) + "\n";
+
+    out += "# HELP webserv_requests_total Responses sent, by status code.\n";
+    out += "# TYPE webserv_requests_total counter\n";
+    for (int code = 100; code < 600; ++code)
+    {
+        if (_requestsByStatus[code])
+            out += "webserv_requests_total{code=\"" + ResponseBuilder::toString(code) + "\"} " + ResponseBuilder::toString(_requestsByStatus[code]) + "\n";
+    }
+
+    appendCounter(out, "webserv_received_bytes_total", "Bytes read from clients.", _bytesIn);
+    appendCounter(out, "webserv_sent_bytes_total", "Bytes written to clients.", _bytesOut);
+    appendCounter(out, "webserv_cgi_spawns_total", "CGI processes started.", _cgiSpawns);
+    appendCounter(out, "webserv_cgi_timeouts_total", "CGI processes killed after the timeout.", _cgiTimeouts);
+    out += "# HELP webserv_upstream_connections_total Upstream connections used by proxied requests.\n";
+    out += "# TYPE webserv_upstream_connections_total counter\n";
+    out += "webserv_upstream_connections_total{origin=\"new\"} " + ResponseBuilder::toString(_upstreamConnects) + "\n";
+    out += "webserv_upstream_connections_total{origin=\"pool\"} " + ResponseBuilder::toString(_upstreamReuses) + "\n";
+    appendCounter(out, "webserv_upstream_failures_total", "Proxied requests that failed on the upstream side.", _upstreamFailures);
+    out += "# HELP webserv_tls_handshakes_total TLS handshakes completed, by whether the session was resumed.\n";
+    out += "# TYPE webserv_tls_handshakes_total counter\n";
+    out += "webserv_tls_handshakes_total{session=\"new\"} " + ResponseBuilder::toString(_tlsHandshakes) + "\n";
+    out += "webserv_tls_handshakes_total{session=\"resumed\"} " + ResponseBuilder::toString(_tlsResumed) + "\n";
+    appendCounter(out, "webserv_tls_handshake_failures_total", "TLS handshakes that failed.", _tlsFailures);
+    appendCounter(out, "webserv_tls_ktls_connections_total", "TLS connections whose records the kernel encrypts.", _tlsKernel);
+    renderUpstreams(out);
+    appendCounter(out, "webserv_arena_heap_blocks_total", "Request arena blocks allocated from the heap.",
+        RequestArena::systemAllocations());
+    appendCounter(out, "webserv_arena_reused_blocks_total", "Request arena blocks taken from the free list.",
+        RequestArena::blockReuses());
+
+    out += "# HELP webserv_cache_requests_total Cache lookups by cache and result.\n";
+    out += "# TYPE webserv_cache_requests_total counter\n";
+    for (std::map<std::string, CacheCounters>::const_iterator it = _caches.begin(); it != _caches.end(); ++it)
+    {
+        std::string cache = escapeLabel(it->first);
+        out += "webserv_cache_requests_total{cache=\"" + cache + "\",result=\"hit\"} " + ResponseBuilder::toString(it->second.hits) + "\n";
+        out += "webserv_cache_requests_total{cache=\"" + cache + "\",result=\"miss\"} " + ResponseBuilder::toString(it->second.misses) + "\n";
+    }
+    out += "# HELP webserv_cache_hit_ratio Share of cache lookups served from the cache.\n";
+    out += "# TYPE webserv_cache_hit_ratio gauge\n";
+    for (std::map<std::string, CacheCounters>::const_iterator it = _caches.begin(); it != _caches.end(); ++it)
+    {
+        unsigned long lookups = it->second.hits + it->second.misses;
+        char ratio[32];
+        snprintf(ratio, sizeof(ratio), "%.4f", lookups ? static_cast<double>(it->second.hits) / lookups : 0.0);
+        out += "webserv_cache_hit_ratio{cache=\"" + escapeLabel(it->first) + "\"} " + ratio + "\n";
+    }
+
+    renderHistograms(out);
+}
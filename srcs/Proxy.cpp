@@ -0,0 +1,610 @@
+#include "Proxy.hpp"
+#include "Metrics.hpp"
+#include "Tls.hpp"
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <strings.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/* ------------------------------------------------------------------------ */
+/*                                 Upstream                                 */
+/* ------------------------------------------------------------------------ */
+
+Upstream::Upstream(const std::string& name, const sockaddr_in& address)
+    : _name(name), _address(address), _active(0), _requests(0), _fails(0), _firstFailUs(0), _downUntilUs(0), _probeFailed(false)
+{
+}
+
+std::map<std::string, Upstream*>& Upstream::registry()
+{
+    static std::map<std::string, Upstream*> upstreams;
+    return upstreams;
+}
+
+Upstream* Upstream::get(const std::string& host, int port)
+{
+    std::ostringstream name;
+    name << host;
+    if (port != 80)
+        name << ':' << port;
+
+    std::map<std::string, Upstream*>::iterator it = registry().find(name.str());
+    if (it != registry().end())
+        return it->second;
+
+    struct addrinfo hints;
+    struct addrinfo* result = NULL;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), NULL, &hints, &result) != 0 || !result)
+        throw std::runtime_error("Cannot resolve upstream host: " + host);
+    sockaddr_in address = *reinterpret_cast<sockaddr_in*>(result->ai_addr);
+    address.sin_port = htons(port);
+    freeaddrinfo(result);
+
+    Upstream* upstream = new Upstream(name.str(), address);
+    registry()[name.str()] = upstream;
+    return upstream;
+}
+
+const std::string& Upstream::name() const
+{
+    return _name;
+}
+
+int Upstream::connect() const
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&_address), sizeof(_address)) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Most recently used first: it is the least likely to have been closed by
+// the upstream's own keep-alive timeout.
+int Upstream::takeIdle()
+{
+    if (_idle.empty())
+        return -1;
+    int fd = _idle.back();
+    _idle.pop_back();
+    return fd;
+}
+
+bool Upstream::keepIdle(int fd)
+{
+    if (_idle.size() >= MAX_IDLE)
+        return false;
+    _idle.push_back(fd);
+    return true;
+}
+
+void Upstream::forget(int fd)
+{
+    _idle.erase(std::remove(_idle.begin(), _idle.end(), fd), _idle.end());
+}
+
+bool Upstream::available(unsigned long nowUs) const
+{
+    return !_probeFailed && nowUs >= _downUntilUs;
+}
+
+// Failures count within a window of fail_timeout that starts with the first
+// one; max_fails of them take the server down for fail_timeout. A max_fails
+// of zero never does.
+bool Upstream::failed(unsigned long nowUs, unsigned long maxFails, unsigned long failTimeoutUs)
+{
+    if (!maxFails)
+        return false;
+    if (!_fails || nowUs - _firstFailUs >= failTimeoutUs)
+    {
+        _fails = 0;
+        _firstFailUs = nowUs;
+    }
+    if (++_fails < maxFails)
+        return false;
+    _fails = 0;
+    _downUntilUs = nowUs + failTimeoutUs;
+    return true;
+}
+
+void Upstream::succeeded()
+{
+    _fails = 0;
+}
+
+// A passing probe also ends a passive down period: the server answered.
+bool Upstream::probed(bool healthy)
+{
+    bool changed = _probeFailed == healthy;
+    _probeFailed = !healthy;
+    if (healthy)
+    {
+        _fails = 0;
+        _downUntilUs = 0;
+    }
+    return changed;
+}
+
+bool Upstream::probeFailed() const
+{
+    return _probeFailed;
+}
+
+unsigned long Upstream::active() const
+{
+    return _active;
+}
+
+unsigned long Upstream::requests() const
+{
+    return _requests;
+}
+
+void Upstream::attach()
+{
+    ++_active;
+    ++_requests;
+}
+
+void Upstream::detach()
+{
+    if (_active)
+        --_active;
+}
+
+/* ------------------------------------------------------------------------ */
+/*                               ProxySession                               */
+/* ------------------------------------------------------------------------ */
+
+ProxySession::ProxySession(int clientFd, TlsConnection* clientTls, UpstreamGroup* group, Upstream* upstream,
+    int upstreamFd, bool reused, bool headRequest, unsigned long connectTimeoutUs, unsigned long readTimeoutUs)
+    : _clientFd(clientFd), _clientTls(clientTls), _group(group), _upstream(upstream), _upstreamFd(upstreamFd), _connecting(!reused), _reused(reused),
+      _headRequest(headRequest), _toUpstreamSent(0), _bodyRemaining(0), _toClientSent(0), _headParsed(false),
+      _responseDone(false), _upstreamClose(false), _status(0), _framing(FRAMING_CLOSE), _remaining(0),
+      _chunkState(CHUNK_SIZE), _emptyLine(true), _bytesToClient(0), _connectTimeoutUs(connectTimeoutUs),
+      _readTimeoutUs(readTimeoutUs), _deadlineUs(0)
+{
+    _upstream->attach();
+    touch();
+}
+
+ProxySession::~ProxySession()
+{
+    _upstream->detach();
+}
+
+std::string& ProxySession::requestBuffer()
+{
+    return _toUpstream;
+}
+
+void ProxySession::expectBody(unsigned long remaining)
+{
+    _bodyRemaining = remaining;
+}
+
+LogFields& ProxySession::logFields()
+{
+    return _log;
+}
+
+// Request body bytes still on the client socket, read only while the
+// upstream keeps up.
+ProxySession::Result ProxySession::clientReadable()
+{
+    if (!_bodyRemaining || _toUpstream.size() - _toUpstreamSent >= HIGH_WATER)
+        return CONTINUE;
+
+    char buffer[16384];
+    ssize_t received = TlsConnection::read(_clientTls, _clientFd, buffer,
+        std::min<unsigned long>(sizeof(buffer), _bodyRemaining));
+    if (received == 0)
+        return CLIENT_GONE;
+    if (received < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? CONTINUE : CLIENT_GONE;
+    Metrics::instance().bytesReceived(received);
+    _toUpstream.append(buffer, received);
+    _bodyRemaining -= received;
+    if (!_connecting && !flushUpstream())
+        return UPSTREAM_FAILED;
+    return progress();
+}
+
+ProxySession::Result ProxySession::clientWritable()
+{
+    if (!flushClient())
+        return CLIENT_GONE;
+    return progress();
+}
+
+ProxySession::Result ProxySession::upstreamReady(short revents)
+{
+    if (_connecting)
+    {
+        if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+            return CONTINUE;
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(_upstreamFd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error)
+            return UPSTREAM_FAILED;
+        _connecting = false;
+        touch();
+        revents |= POLLOUT;
+    }
+    if ((revents & POLLOUT) && !flushUpstream())
+        return UPSTREAM_FAILED;
+    if (!(revents & (POLLIN | POLLHUP | POLLERR)) || _responseDone)
+        return progress();
+
+    char buffer[16384];
+    ssize_t received = recv(_upstreamFd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (received < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? progress() : UPSTREAM_FAILED;
+    touch();
+    if (received == 0)
+    {
+        if (!_headParsed || _framing != FRAMING_CLOSE)
+            return UPSTREAM_FAILED;
+        _responseDone = true;
+        _upstreamClose = true;
+        return flushClient() ? progress() : CLIENT_GONE;
+    }
+
+    if (_headParsed)
+        forwardBody(buffer, received);
+    else
+    {
+        _responseHead.append(buffer, received);
+        while (!_headParsed)
+        {
+            size_t crlf = _responseHead.find("\r\n\r\n");
+            size_t lf = _responseHead.find("\n\n");
+            size_t headLength;
+            if (crlf != std::string::npos && (lf == std::string::npos || crlf < lf))
+                headLength = crlf + 4;
+            else if (lf != std::string::npos)
+                headLength = lf + 2;
+            else if (_responseHead.size() > MAX_RESPONSE_HEAD)
+                return UPSTREAM_FAILED;
+            else
+                break;
+            if (!parseResponseHead(headLength))
+                return UPSTREAM_FAILED;
+            _responseHead.erase(0, headLength);
+        }
+        if (_headParsed)
+        {
+            std::string rest;
+            rest.swap(_responseHead);
+            forwardBody(rest.data(), rest.size());
+        }
+    }
+    return flushClient() ? progress() : CLIENT_GONE;
+}
+
+ProxySession::Result ProxySession::expire(unsigned long nowUs)
+{
+    unsigned long deadline = deadlineUs();
+    if (!deadline || nowUs < deadline)
+        return CONTINUE;
+    return UPSTREAM_TIMED_OUT;
+}
+
+short ProxySession::clientEvents() const
+{
+    short events = 0;
+    if (_bodyRemaining && _toUpstream.size() - _toUpstreamSent < HIGH_WATER)
+        events |= POLLIN;
+    if (_toClientSent < _toClient.size())
+        events |= POLLOUT;
+    return events;
+}
+
+short ProxySession::upstreamEvents() const
+{
+    if (_connecting)
+        return POLLOUT;
+    short events = 0;
+    if (_toUpstreamSent < _toUpstream.size())
+        events |= POLLOUT;
+    if (!_responseDone && _toClient.size() - _toClientSent < HIGH_WATER)
+        events |= POLLIN;
+    return events;
+}
+
+// Not counted while the response is complete or the client has not yet
+// taken what the upstream already sent.
+unsigned long ProxySession::deadlineUs() const
+{
+    if (_responseDone || (!_connecting && _toClient.size() - _toClientSent >= HIGH_WATER))
+        return 0;
+    return _deadlineUs;
+}
+
+void ProxySession::touch()
+{
+    _deadlineUs = Metrics::nowMicros() + (_connecting ? _connectTimeoutUs : _readTimeoutUs);
+}
+
+// Status line and headers of the upstream response. Interim 1xx responses
+// are dropped; the final head is forwarded without the hop-by-hop headers
+// and with our own Connection header.
+bool ProxySession::parseResponseHead(size_t headLength)
+{
+    const std::string& raw = _responseHead;
+    size_t lineEnd = raw.find('\n');
+    size_t stop = lineEnd > 0 && raw[lineEnd - 1] == '\r' ? lineEnd - 1 : lineEnd;
+    if (stop < 12 || raw.compare(0, 5, "HTTP/") != 0)
+        return false;
+    _status = std::atoi(raw.c_str() + 9);
+    if (_status < 100 || _status > 999)
+        return false;
+    if (_status < 200 && _status != 101)
+        return true;
+
+    bool keepAlive = raw.compare(0, 8, "HTTP/1.0") != 0;
+    bool chunked = false;
+    bool hasLength = false;
+    unsigned long length = 0;
+
+    _toClient.append(raw, 0, stop);
+    _toClient += "\r\n";
+    for (size_t pos = lineEnd + 1; pos < headLength;)
+    {
+        size_t end = raw.find('\n', pos);
+        stop = end > pos && raw[end - 1] == '\r' ? end - 1 : end;
+        size_t colon = raw.find(':', pos);
+        if (stop == pos || colon == std::string::npos || colon > stop)
+        {
+            pos = end + 1;
+            continue;
+        }
+        std::string name = raw.substr(pos, colon - pos);
+        size_t valueStart = raw.find_first_not_of(" \t", colon + 1);
+        std::string value = valueStart < stop ? raw.substr(valueStart, stop - valueStart) : "";
+        if (!strcasecmp(name.c_str(), "Connection"))
+        {
+            if (strcasestr(value.c_str(), "close"))
+                _upstreamClose = true;
+            else if (strcasestr(value.c_str(), "keep-alive"))
+                keepAlive = true;
+        }
+        else if (strcasecmp(name.c_str(), "Keep-Alive") && strcasecmp(name.c_str(), "Proxy-Connection"))
+        {
+            if (!strcasecmp(name.c_str(), "Transfer-Encoding") && strcasestr(value.c_str(), "chunked"))
+                chunked = true;
+            else if (!strcasecmp(name.c_str(), "Content-Length"))
+            {
+                hasLength = true;
+                if (!StringRef(value.data(), value.size()).toUnsigned(length))
+                    return false;
+            }
+            _toClient.append(raw, pos, stop - pos);
+            _toClient += "\r\n";
+        }
+        pos = end + 1;
+    }
+    if (!keepAlive)
+        _upstreamClose = true;
+
+    if (_headRequest || _status == 204 || _status == 304)
+        _framing = FRAMING_NONE;
+    else if (_status == 101)
+        _framing = FRAMING_CLOSE;
+    else if (chunked)
+        _framing = FRAMING_CHUNKED;
+    else if (hasLength)
+        _framing = FRAMING_LENGTH;
+    else
+        _framing = FRAMING_CLOSE;
+    _remaining = _framing == FRAMING_LENGTH ? length : 0;
+    _responseDone = _framing == FRAMING_NONE || (_framing == FRAMING_LENGTH && _remaining == 0);
+    _toClient += _framing == FRAMING_CLOSE ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n";
+    _headParsed = true;
+    return true;
+}
+
+// Queues response body bytes for the client up to the end of the response;
+// anything the upstream sends past it is dropped.
+void ProxySession::forwardBody(const char* data, size_t length)
+{
+    size_t take = length;
+    if (_responseDone)
+        take = 0;
+    else if (_framing == FRAMING_LENGTH)
+    {
+        take = std::min<unsigned long>(length, _remaining);
+        _remaining -= take;
+        _responseDone = _remaining == 0;
+    }
+    else if (_framing == FRAMING_CHUNKED)
+        take = scanChunked(data, length);
+    _toClient.append(data, take);
+}
+
+// Follows the chunked framing only far enough to see where it ends; the
+// bytes themselves are passed through unchanged. Returns how many bytes
+// belong to the response.
+size_t ProxySession::scanChunked(const char* data, size_t length)
+{
+    size_t i = 0;
+    while (i < length && !_responseDone)
+    {
+        char c = data[i];
+        switch (_chunkState)
+        {
+        case CHUNK_SIZE:
+            if (std::isxdigit(static_cast<unsigned char>(c)))
+            {
+                _remaining = _remaining * 16 + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+                ++i;
+            }
+            else
+                _chunkState = CHUNK_EXTENSION;
+            break;
+        case CHUNK_EXTENSION:
+            ++i;
+            if (c == '\n')
+            {
+                _chunkState = _remaining ? CHUNK_DATA : CHUNK_TRAILER;
+                _emptyLine = true;
+            }
+            break;
+        case CHUNK_DATA:
+        {
+            size_t take = std::min<unsigned long>(length - i, _remaining);
+            i += take;
+            _remaining -= take;
+            if (_remaining == 0)
+                _chunkState = CHUNK_DATA_END;
+            break;
+        }
+        case CHUNK_DATA_END:
+            ++i;
+            if (c == '\n')
+            {
+                _chunkState = CHUNK_SIZE;
+                _remaining = 0;
+            }
+            break;
+        case CHUNK_TRAILER:
+            ++i;
+            if (c == '\n')
+            {
+                _responseDone = _emptyLine;
+                _emptyLine = true;
+            }
+            else if (c != '\r')
+                _emptyLine = false;
+            break;
+        }
+    }
+    return i;
+}
+
+// One non-blocking send. Returns false only on a hard error.
+bool ProxySession::flushUpstream()
+{
+    if (_toUpstreamSent == _toUpstream.size())
+        return true;
+    ssize_t sent = send(_upstreamFd, _toUpstream.data() + _toUpstreamSent, _toUpstream.size() - _toUpstreamSent,
+        MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    touch();
+    _toUpstreamSent += sent;
+    if (_toUpstreamSent == _toUpstream.size())
+    {
+        _toUpstream.clear();
+        _toUpstreamSent = 0;
+    }
+    else if (_toUpstreamSent >= HIGH_WATER)
+    {
+        _toUpstream.erase(0, _toUpstreamSent);
+        _toUpstreamSent = 0;
+    }
+    return true;
+}
+
+bool ProxySession::flushClient()
+{
+    if (_toClientSent == _toClient.size())
+        return true;
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>(_toClient.data() + _toClientSent);
+    iov.iov_len = _toClient.size() - _toClientSent;
+    ssize_t sent = TlsConnection::write(_clientTls, _clientFd, &iov, 1);
+    if (sent < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    Metrics::instance().bytesSent(sent);
+    touch();
+    _bytesToClient += sent;
+    _toClientSent += sent;
+    if (_toClientSent == _toClient.size())
+    {
+        _toClient.clear();
+        _toClientSent = 0;
+    }
+    else if (_toClientSent >= HIGH_WATER)
+    {
+        _toClient.erase(0, _toClientSent);
+        _toClientSent = 0;
+    }
+    return true;
+}
+
+ProxySession::Result ProxySession::progress() const
+{
+    return _responseDone && _toClientSent == _toClient.size() ? DONE : CONTINUE;
+}
+
+int ProxySession::clientFd() const
+{
+    return _clientFd;
+}
+
+int ProxySession::upstreamFd() const
+{
+    return _upstreamFd;
+}
+
+UpstreamGroup* ProxySession::group() const
+{
+    return _group;
+}
+
+Upstream* ProxySession::upstream() const
+{
+    return _upstream;
+}
+
+bool ProxySession::reused() const
+{
+    return _reused;
+}
+
+bool ProxySession::responseStarted() const
+{
+    return _headParsed;
+}
+
+// The upstream connection can carry another request only if both messages
+// ended on their framing, not on a close.
+bool ProxySession::upstreamReusable() const
+{
+    return _responseDone && !_upstreamClose && _framing != FRAMING_CLOSE && !_connecting
+        && _bodyRemaining == 0 && _toUpstreamSent == _toUpstream.size();
+}
+
+bool ProxySession::clientReusable() const
+{
+    return _responseDone && _framing != FRAMING_CLOSE && _bodyRemaining == 0;
+}
+
+int ProxySession::status() const
+{
+    return _status;
+}
+
+unsigned long ProxySession::bytesToClient() const
+{
+    return _bytesToClient;
+}
@@ -0,0 +1,237 @@
+#include "RequestArena.hpp"
+#include "HttpRequest.hpp"
+#include <cstring>
+#include <climits>
+#include <strings.h>
+#include <new>
+
+/* ------------------------------------------------------------------------ */
+/*                                StringRef                                 */
+/* ------------------------------------------------------------------------ */
+
+StringRef::StringRef() : data(""), length(0)
+{
+}
+
+StringRef::StringRef(const char* data, size_t length) : data(data), length(length)
+{
+}
+
+bool StringRef::empty() const
+{
+    return length == 0;
+}
+
+bool StringRef::equals(const char* value) const
+{
+    return strncmp(data, value, length) == 0 && value[length] == '\0';
+}
+
+bool StringRef::equals(const std::string& value) const
+{
+    return value.size() == length && memcmp(data, value.data(), length) == 0;
+}
+
+bool StringRef::equalsIgnoreCase(const char* value) const
+{
+    return strncasecmp(data, value, length) == 0 && value[length] == '\0';
+}
+
+bool StringRef::contains(const char* needle) const
+{
+    size_t needleLength = strlen(needle);
+    for (size_t i = 0; i + needleLength <= length; ++i)
+    {
+        if (memcmp(data + i, needle, needleLength) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool StringRef::toUnsigned(unsigned long& value) const
+{
+    if (length == 0)
+        return false;
+    unsigned long result = 0;
+    for (size_t i = 0; i < length; ++i)
+    {
+        if (data[i] < '0' || data[i] > '9')
+            return false;
+        unsigned long digit = data[i] - '0';
+        if (result > (ULONG_MAX - digit) / 10)
+            return false;
+        result = result * 10 + digit;
+    }
+    value = result;
+    return true;
+}
+
+std::string StringRef::str() const
+{
+    return std::string(data, length);
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                LogFields                                 */
+/* ------------------------------------------------------------------------ */
+
+LogFields::LogFields()
+{
+}
+
+LogFields::LogFields(const HttpRequest& request)
+    : method(request.getMethodRef()), target(request.getPathRef()), version(request.getHttpVersionRef()),
+      userAgent(request.header("User-Agent"))
+{
+}
+
+/* ------------------------------------------------------------------------ */
+/*                               RequestArena                               */
+/* ------------------------------------------------------------------------ */
+
+RequestArena::Block* RequestArena::_spare = NULL;
+size_t RequestArena::_spareCount = 0;
+unsigned long RequestArena::_systemAllocations = 0;
+unsigned long RequestArena::_blockReuses = 0;
+
+static const size_t BLOCK_HEADER = 2 * sizeof(void*);
+
+static size_t alignUp(size_t size)
+{
+    return (size + RequestArena::ALIGNMENT - 1) & ~(RequestArena::ALIGNMENT - 1);
+}
+
+RequestArena::RequestArena() : _blocks(NULL), _cursor(NULL), _limit(NULL), _used(0)
+{
+}
+
+RequestArena::~RequestArena()
+{
+    release();
+}
+
+// Standard blocks come from the free list when it has one; larger requests
+// (a big header block) get a block of their own that is freed on release.
+void RequestArena::addBlock(size_t minimum)
+{
+    Block* block;
+    if (minimum <= BLOCK_SIZE && _spare)
+    {
+        block = _spare;
+        _spare = block->next;
+        --_spareCount;
+        ++_blockReuses;
+    }
+    else
+    {
+        size_t size = minimum <= BLOCK_SIZE ? BLOCK_SIZE : alignUp(minimum);
+        block = static_cast<Block*>(::operator new(BLOCK_HEADER + size));
+        block->size = size;
+        ++_systemAllocations;
+    }
+    block->next = _blocks;
+    _blocks = block;
+    _cursor = reinterpret_cast<char*>(block) + BLOCK_HEADER;
+    _limit = _cursor + block->size;
+}
+
+void RequestArena::recycle(Block* block)
+{
+    if (block->size != BLOCK_SIZE || _spareCount >= MAX_SPARE_BLOCKS)
+    {
+        ::operator delete(block);
+        return;
+    }
+    block->next = _spare;
+    _spare = block;
+    ++_spareCount;
+}
+
+void* RequestArena::allocate(size_t size)
+{
+    size = alignUp(size ? size : 1);
+    if (static_cast<size_t>(_limit - _cursor) < size)
+        addBlock(size);
+    void* result = _cursor;
+    _cursor += size;
+    _used += size;
+    return result;
+}
+
+// NUL-terminated copy.
+char* RequestArena::copy(const char* data, size_t length)
+{
+    char* result = static_cast<char*>(allocate(length + 1));
+    memcpy(result, data, length);
+    result[length] = '\0';
+    return result;
+}
+
+char* RequestArena::concat(const char* a, size_t aLength, const char* b, size_t bLength)
+{
+    char* result = static_cast<char*>(allocate(aLength + bLength + 1));
+    memcpy(result, a, aLength);
+    memcpy(result + aLength, b, bLength);
+    result[aLength + bLength] = '\0';
+    return result;
+}
+
+RequestArena::Mark RequestArena::mark() const
+{
+    Mark position = { _blocks, _cursor, _used };
+    return position;
+}
+
+void RequestArena::rewind(const Mark& position)
+{
+    while (_blocks && _blocks != position.block)
+    {
+        Block* block = _blocks;
+        _blocks = block->next;
+        recycle(block);
+    }
+    if (!_blocks)
+    {
+        _cursor = NULL;
+        _limit = NULL;
+        _used = 0;
+        return;
+    }
+    _cursor = position.cursor;
+    _limit = reinterpret_cast<char*>(_blocks) + BLOCK_HEADER + _blocks->size;
+    _used = position.used;
+}
+
+// Everything allocated since the last release becomes invalid at once.
+void RequestArena::release()
+{
+    while (_blocks)
+    {
+        Block* block = _blocks;
+        _blocks = block->next;
+        recycle(block);
+    }
+    _cursor = NULL;
+    _limit = NULL;
+    _used = 0;
+}
+
+size_t RequestArena::used() const
+{
+    return _used;
+}
+
+unsigned long RequestArena::systemAllocations()
+{
+    return _systemAllocations;
+}
+
+unsigned long RequestArena::blockReuses()
+{
+    return _blockReuses;
+}
+
+size_t RequestArena::spareBlocks()
+{
+    return _spareCount;
+}
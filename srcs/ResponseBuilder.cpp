@@ -0,0 +1,440 @@
+#include "ResponseBuilder.hpp"
+#include <algorithm>
+#include <cstring>
+
+struct StatusEntry
+{
+    int         code;
+    const char* line;
+    size_t      length;
+    const char* reason;
+};
+
+#define STATUS_ENTRY(code, reason) \
+    { code, "HTTP/1.1 " #code " " reason "\r\n", sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1, reason }
+
+static const StatusEntry g_statusTable[] = {
+    STATUS_ENTRY(100, "Continue"),
+    STATUS_ENTRY(101, "Switching Protocols"),
+    STATUS_ENTRY(200, "OK"),
+    STATUS_ENTRY(201, "Created"),
+    STATUS_ENTRY(202, "Accepted"),
+    STATUS_ENTRY(204, "No Content"),
+    STATUS_ENTRY(206, "Partial Content"),
+    STATUS_ENTRY(301, "Moved Permanently"),
+    STATUS_ENTRY(302, "Found"),
+    STATUS_ENTRY(303, "See Other"),
+    STATUS_ENTRY(304, "Not Modified"),
+    STATUS_ENTRY(307, "Temporary Redirect"),
+    STATUS_ENTRY(308, "Permanent Redirect"),
+    STATUS_ENTRY(400, "Bad Request"),
+    STATUS_ENTRY(401, "Unauthorized"),
+    STATUS_ENTRY(403, "Forbidden"),
+    STATUS_ENTRY(404, "Not Found"),
+    STATUS_ENTRY(405, "Method Not Allowed"),
+    STATUS_ENTRY(408, "Request Timeout"),
+    STATUS_ENTRY(411, "Length Required"),
+    STATUS_ENTRY(413, "Payload Too Large"),
+    STATUS_ENTRY(414, "URI Too Long"),
+    STATUS_ENTRY(415, "Unsupported Media Type"),
+    STATUS_ENTRY(421, "Misdirected Request"),
+    STATUS_ENTRY(429, "Too Many Requests"),
+    STATUS_ENTRY(431, "Request Header Fields Too Large"),
+    STATUS_ENTRY(500, "Internal Server Error"),
+    STATUS_ENTRY(501, "Not Implemented"),
+    STATUS_ENTRY(502, "Bad Gateway"),
+    STATUS_ENTRY(503, "Service Unavailable"),
+    STATUS_ENTRY(504, "Gateway Timeout"),
+    STATUS_ENTRY(505, "HTTP Version Not Supported")
+};
+
+#undef STATUS_ENTRY
+
+static const StatusEntry* findStatus(int statusCode)
+{
+    static const StatusEntry* byCode[600];
+    static bool indexed = false;
+
+    if (!indexed)
+    {
+        for (size_t i = 0; i < sizeof(g_statusTable) / sizeof(g_statusTable[0]); ++i)
+            byCode[g_statusTable[i].code] = &g_statusTable[i];
+        indexed = true;
+    }
+    if (statusCode < 100 || statusCode >= 600)
+        return NULL;
+    return byCode[statusCode];
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                BufferPool                                */
+/* ------------------------------------------------------------------------ */
+
+BufferPool::BufferPool()
+{
+}
+
+BufferPool::~BufferPool()
+{
+    for (size_t i = 0; i < _free.size(); ++i)
+        delete _free[i];
+}
+
+BufferPool& BufferPool::instance()
+{
+    static BufferPool pool;
+    return pool;
+}
+
+std::string* BufferPool::acquire()
+{
+    if (_free.empty())
+        return new std::string();
+    std::string* buffer = _free.back();
+    _free.pop_back();
+    return buffer;
+}
+
+void BufferPool::release(std::string* buffer)
+{
+    if (!buffer)
+        return;
+    if (_free.size() >= MAX_POOLED || buffer->capacity() > MAX_POOLED_CAPACITY)
+    {
+        delete buffer;
+        return;
+    }
+    buffer->clear();
+    _free.push_back(buffer);
+}
+
+/* ------------------------------------------------------------------------ */
+/*                             ResponseBuilder                              */
+/* ------------------------------------------------------------------------ */
+
+ResponseBuilder::ResponseBuilder()
+    : _statusCode(0), _head(NULL), _body(NULL), _borrowed(NULL), _borrowedLength(0), _sent(0), _finished(false)
+{
+}
+
+ResponseBuilder::ResponseBuilder(int statusCode)
+    : _statusCode(0), _head(NULL), _body(NULL), _borrowed(NULL), _borrowedLength(0), _sent(0), _finished(false)
+{
+    status(statusCode);
+}
+
+ResponseBuilder::ResponseBuilder(const ResponseBuilder& other)
+    : _statusCode(other._statusCode), _head(NULL), _body(NULL), _borrowed(other._borrowed),
+      _borrowedLength(other._borrowedLength), _sent(other._sent), _finished(other._finished)
+{
+    if (other._head)
+    {
+        _head = BufferPool::instance().acquire();
+        _head->assign(*other._head);
+    }
+    if (other._body)
+    {
+        _body = BufferPool::instance().acquire();
+        _body->assign(*other._body);
+    }
+}
+
+ResponseBuilder& ResponseBuilder::operator=(const ResponseBuilder& other)
+{
+    if (this != &other)
+    {
+        ResponseBuilder copy(other);
+        swap(copy);
+    }
+    return *this;
+}
+
+ResponseBuilder::~ResponseBuilder()
+{
+    BufferPool::instance().release(_head);
+    BufferPool::instance().release(_body);
+}
+
+std::string& ResponseBuilder::head()
+{
+    if (!_head)
+        _head = BufferPool::instance().acquire();
+    return *_head;
+}
+
+ResponseBuilder& ResponseBuilder::status(int statusCode)
+{
+    std::string& buffer = head();
+    size_t length;
+    const char* line = statusLine(statusCode, length);
+
+    _statusCode = statusCode;
+    _finished = false;
+    buffer.clear();
+    if (line)
+        buffer.append(line, length);
+    else
+    {
+        char digits[16];
+        char* start = formatUnsigned(digits + sizeof(digits), statusCode);
+        buffer.append("HTTP/1.1 ", 9);
+        buffer.append(start, digits + sizeof(digits) - start);
+        buffer += ' ';
+        buffer.append(reasonPhrase(statusCode));
+        buffer.append("\r\n", 2);
+    }
+    buffer.append(httpDate());
+    return *this;
+}
+
+ResponseBuilder& ResponseBuilder::header(const char* name, const std::string& value)
+{
+    std::string& buffer = head();
+    buffer.append(name);
+    buffer.append(": ", 2);
+    buffer.append(value);
+    buffer.append("\r\n", 2);
+    return *this;
+}
+
+ResponseBuilder& ResponseBuilder::header(const char* name, const char* value)
+{
+    std::string& buffer = head();
+    buffer.append(name);
+    buffer.append(": ", 2);
+    buffer.append(value);
+    buffer.append("\r\n", 2);
+    return *this;
+}
+
+ResponseBuilder& ResponseBuilder::header(const char* name, unsigned long value)
+{
+    char digits[24];
+    char* start = formatUnsigned(digits + sizeof(digits), value);
+    std::string& buffer = head();
+    buffer.append(name);
+    buffer.append(": ", 2);
+    buffer.append(start, digits + sizeof(digits) - start);
+    buffer.append("\r\n", 2);
+    return *this;
+}
+
+ResponseBuilder& ResponseBuilder::body(const std::string& content)
+{
+    bodyBuffer().assign(content);
+    return *this;
+}
+
+std::string& ResponseBuilder::bodyBuffer()
+{
+    _borrowed = NULL;
+    _borrowedLength = 0;
+    if (!_body)
+        _body = BufferPool::instance().acquire();
+    return *_body;
+}
+
+// The caller guarantees data stays valid until the response is sent.
+ResponseBuilder& ResponseBuilder::bodyRef(const char* data, size_t length)
+{
+    if (_body)
+        _body->clear();
+    _borrowed = data;
+    _borrowedLength = length;
+    return *this;
+}
+
+// Closes the header block. Content-Length is derived from the body, except
+// for statuses that must not carry one.
+ResponseBuilder& ResponseBuilder::finish()
+{
+    if (_finished)
+        return *this;
+    if (!_head)
+        status(500);
+    if (_statusCode >= 200 && _statusCode != 204 && _statusCode != 304)
+        header("Content-Length", static_cast<unsigned long>(bodySize()));
+    _head->append("\r\n", 2);
+    _finished = true;
+    return *this;
+}
+
+ResponseBuilder& ResponseBuilder::finishHead()
+{
+    if (_finished)
+        return *this;
+    if (!_head)
+        status(500);
+    _head->append("\r\n", 2);
+    _finished = true;
+    return *this;
+}
+
+int ResponseBuilder::getStatusCode() const
+{
+    return _statusCode;
+}
+
+size_t ResponseBuilder::size() const
+{
+    return (_head ? _head->size() : 0) + bodySize();
+}
+
+size_t ResponseBuilder::bodySize() const
+{
+    if (_borrowed)
+        return _borrowedLength;
+    return _body ? _body->size() : 0;
+}
+
+size_t ResponseBuilder::remaining() const
+{
+    return size() - _sent;
+}
+
+bool ResponseBuilder::done() const
+{
+    return _finished && _sent >= size();
+}
+
+// Fills iov with the unsent part of the response, starting at the current
+// send offset. Returns the number of entries used.
+int ResponseBuilder::fillIov(struct iovec* iov, int maxIov) const
+{
+    int count = 0;
+    size_t offset = _sent;
+    const char* parts[2] = { _head ? _head->data() : NULL, _borrowed ? _borrowed : (_body ? _body->data() : NULL) };
+    size_t lengths[2] = { _head ? _head->size() : 0, bodySize() };
+
+    for (int i = 0; i < 2 && count < maxIov; ++i)
+    {
+        if (!parts[i])
+            continue;
+        size_t length = lengths[i];
+        if (offset >= length)
+        {
+            offset -= length;
+            continue;
+        }
+        iov[count].iov_base = const_cast<char*>(parts[i] + offset);
+        iov[count].iov_len = length - offset;
+        offset = 0;
+        ++count;
+    }
+    return count;
+}
+
+const char* ResponseBuilder::headerLines(size_t& length) const
+{
+    size_t start = _head ? _head->find('\n') : std::string::npos;
+    if (start == std::string::npos)
+    {
+        length = 0;
+        return "";
+    }
+    length = _head->size() - start - 1;
+    return _head->data() + start + 1;
+}
+
+const char* ResponseBuilder::bodyData() const
+{
+    if (_borrowed)
+        return _borrowed;
+    return _body ? _body->data() : "";
+}
+
+void ResponseBuilder::consume(size_t bytes)
+{
+    _sent += bytes;
+    if (_sent > size())
+        _sent = size();
+}
+
+std::string ResponseBuilder::str() const
+{
+    std::string out;
+    out.reserve(size());
+    if (_head)
+        out += *_head;
+    if (_borrowed)
+        out.append(_borrowed, _borrowedLength);
+    else if (_body)
+        out += *_body;
+    return out;
+}
+
+void ResponseBuilder::swap(ResponseBuilder& other)
+{
+    std::swap(_statusCode, other._statusCode);
+    std::swap(_head, other._head);
+    std::swap(_body, other._body);
+    std::swap(_borrowed, other._borrowed);
+    std::swap(_borrowedLength, other._borrowedLength);
+    std::swap(_sent, other._sent);
+    std::swap(_finished, other._finished);
+}
+
+const char* ResponseBuilder::statusLine(int statusCode, size_t& length)
+{
+    const StatusEntry* entry = findStatus(statusCode);
+    if (!entry)
+    {
+        length = 0;
+        return NULL;
+    }
+    length = entry->length;
+    return entry->line;
+}
+
+const char* ResponseBuilder::reasonPhrase(int statusCode)
+{
+    const StatusEntry* entry = findStatus(statusCode);
+    if (entry)
+        return entry->reason;
+    if (statusCode >= 500)
+        return "Internal Server Error";
+    if (statusCode >= 400)
+        return "Bad Request";
+    return "OK";
+}
+
+// Full "Date: ...\r\n" header line, rendered at most once per second.
+const char* ResponseBuilder::httpDate()
+{
+    static char buffer[64];
+    static std::time_t cachedAt = 0;
+    std::time_t now = std::time(NULL);
+
+    if (now != cachedAt)
+    {
+        struct tm gmt;
+        gmtime_r(&now, &gmt);
+        std::strftime(buffer, sizeof(buffer), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &gmt);
+        cachedAt = now;
+    }
+    return buffer;
+}
+
+// Writes the decimal digits of value right-aligned, ending just before end.
+// Returns a pointer to the first digit.
+char* ResponseBuilder::formatUnsigned(char* end, unsigned long value)
+{
+    char* cursor = end;
+    do
+    {
+        *--cursor = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value);
+    return cursor;
+}
+
+std::string ResponseBuilder::toString(long value)
+{
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    unsigned long magnitude = value < 0 ? 0UL - static_cast<unsigned long>(value) : static_cast<unsigned long>(value);
+    char* start = formatUnsigned(end, magnitude);
+    if (value < 0)
+        *--start = '-';
+    return std::string(start, end - start);
+}
@@ -0,0 +1,587 @@
+#include "ResponseCache.hpp"
+#include "ResponseBuilder.hpp"
+#include "Metrics.hpp"
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <csignal>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// "30", "30s", "5m" or "1h", in seconds.
+static unsigned long parseSeconds(const std::string& value, const std::string& directive)
+{
+    char* end;
+    unsigned long number = std::strtoul(value.c_str(), &end, 10);
+    std::string unit = end;
+    if (end == value.c_str() || value[0] == '-' || (unit != "" && unit != "s" && unit != "m" && unit != "h"))
+        throw std::runtime_error("Error: Invalid time '" + value + "' for '" + directive + "'");
+    return unit == "h" ? number * 3600 : unit == "m" ? number * 60 : number;
+}
+
+/* ------------------------------------------------------------------------ */
+/*                               CachePolicy                                */
+/* ------------------------------------------------------------------------ */
+
+CachePolicy::CachePolicy() : ttl(0), stale(0), lockTimeout(DEFAULT_LOCK_TIMEOUT)
+{
+}
+
+bool CachePolicy::enabled() const
+{
+    return ttl != 0;
+}
+
+void CachePolicy::parse(const std::string& value)
+{
+    std::istringstream words(value);
+    std::string word;
+    if (!(words >> word))
+        throw std::runtime_error("Error: Missing value for 'cgi_cache'");
+    ttl = parseSeconds(word, "cgi_cache");
+    if (ttl == 0)
+        throw std::runtime_error("Error: 'cgi_cache' time must be at least 1s");
+    stale = 60;
+    while (words >> word)
+    {
+        if (word.compare(0, 6, "stale=") != 0)
+            throw std::runtime_error("Error: Unknown parameter '" + word + "' for 'cgi_cache'");
+        stale = parseSeconds(word.substr(6), "cgi_cache");
+    }
+}
+
+void CachePolicy::parseVary(const std::string& value)
+{
+    std::istringstream words(value);
+    std::string name;
+    vary.clear();
+    while (words >> name)
+        vary.push_back(name);
+    if (vary.empty())
+        throw std::runtime_error("Error: Missing value for 'cgi_cache_vary'");
+}
+
+void CachePolicy::parseLockTimeout(const std::string& value)
+{
+    if (value.empty())
+        throw std::runtime_error("Error: Missing value for 'cgi_cache_lock_timeout'");
+    lockTimeout = parseSeconds(value, "cgi_cache_lock_timeout");
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                CgiOutput                                 */
+/* ------------------------------------------------------------------------ */
+
+CgiOutput::CgiOutput() : status(200)
+{
+}
+
+static bool isHeaderName(const std::string& text, size_t start, size_t end)
+{
+    if (start == end)
+        return false;
+    for (size_t i = start; i < end; ++i)
+    {
+        char c = text[i];
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_')
+            return false;
+    }
+    return true;
+}
+
+// A header block is recognised only when every line up to the first empty
+// one is "Name: value"; anything else (a script printing JSON or HTML
+// straight away) is all body.
+void CgiOutput::parse(const std::string& output)
+{
+    status = 200;
+    headers.clear();
+    body.clear();
+
+    Headers parsed;
+    size_t pos = 0;
+    bool headerBlock = false;
+    while (pos < output.size())
+    {
+        size_t newline = output.find('\n', pos);
+        if (newline == std::string::npos)
+            break;
+        size_t stop = newline > pos && output[newline - 1] == '\r' ? newline - 1 : newline;
+        if (stop == pos)
+        {
+            headerBlock = !parsed.empty();
+            pos = newline + 1;
+            break;
+        }
+        size_t colon = output.find(':', pos);
+        if (colon == std::string::npos || colon > stop || !isHeaderName(output, pos, colon))
+            break;
+        size_t valueStart = output.find_first_not_of(" \t", colon + 1);
+        std::string value = valueStart < stop ? output.substr(valueStart, stop - valueStart) : "";
+        parsed.push_back(std::make_pair(output.substr(pos, colon - pos), value));
+        pos = newline + 1;
+    }
+
+    if (!headerBlock)
+    {
+        headers.push_back(std::make_pair(std::string("Content-Type"), std::string("text/html")));
+        body = output;
+        return;
+    }
+    bool hasType = false;
+    for (size_t i = 0; i < parsed.size(); ++i)
+    {
+        const char* name = parsed[i].first.c_str();
+        if (!strcasecmp(name, "Status"))
+        {
+            int code = std::atoi(parsed[i].second.c_str());
+            if (code >= 100 && code < 600)
+                status = code;
+        }
+        else if (strcasecmp(name, "Content-Length") && strcasecmp(name, "Connection"))
+        {
+            hasType = hasType || !strcasecmp(name, "Content-Type");
+            headers.push_back(parsed[i]);
+        }
+    }
+    if (!hasType)
+        headers.push_back(std::make_pair(std::string("Content-Type"), std::string("text/html")));
+    body = output.substr(pos);
+}
+
+const std::string* CgiOutput::header(const char* name) const
+{
+    for (size_t i = 0; i < headers.size(); ++i)
+    {
+        if (!strcasecmp(headers[i].first.c_str(), name))
+            return &headers[i].second;
+    }
+    return NULL;
+}
+
+void CgiOutput::build(ResponseBuilder& response, const GzipPolicy* gzip, bool accepted) const
+{
+    response.status(status);
+    for (size_t i = 0; i < headers.size(); ++i)
+        response.header(headers[i].first.c_str(), headers[i].second);
+    response.body(body);
+    if (gzip && !header("Content-Encoding"))
+    {
+        const std::string* type = header("Content-Type");
+        Gzip::encode(response, *gzip, type ? type->c_str() : NULL, accepted);
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/*                              ResponseCache                               */
+/* ------------------------------------------------------------------------ */
+
+ResponseCache::ResponseCache()
+    : _memoryUsed(0), _memoryLimit(DEFAULT_MEMORY), _diskLimit(DEFAULT_DISK), _diskUsed(0)
+{
+}
+
+ResponseCache& ResponseCache::instance()
+{
+    static ResponseCache cache;
+    return cache;
+}
+
+void ResponseCache::configure(size_t memoryLimit, const std::string& diskPath, size_t diskLimit)
+{
+    _memoryLimit = memoryLimit;
+    _diskLimit = diskLimit;
+    if (diskPath != _diskPath)
+    {
+        _diskFiles.clear();
+        _diskOrder.clear();
+        _diskUsed = 0;
+    }
+    _diskPath = diskPath;
+    evict();
+}
+
+ResponseCache::Result ResponseCache::lookup(const std::string& key, ResponseBuilder& response, bool& refresh,
+    const GzipPolicy* gzip, bool accepted)
+{
+    time_t now = time(NULL);
+    refresh = false;
+
+    std::map<std::string, Entry>::iterator it = _entries.find(key);
+    if (it == _entries.end())
+    {
+        Entry loaded;
+        if (_diskPath.empty() || !readDisk(key, loaded) || now >= loaded.staleUntil)
+            return MISS;
+        insert(key, loaded);
+        evict();
+        it = _entries.find(key);
+        if (it == _entries.end())
+            return MISS;
+    }
+
+    Entry& entry = it->second;
+    if (now >= entry.staleUntil)
+    {
+        _memoryUsed -= entry.size;
+        _lru.erase(entry.lru);
+        _entries.erase(it);
+        return MISS;
+    }
+    _lru.splice(_lru.begin(), _lru, entry.lru);
+
+    const CgiOutput& output = entry.output;
+    output.build(response);
+    const std::string* type = output.header("Content-Type");
+    if (gzip && !output.header("Content-Encoding") && gzip->compresses(type ? type->c_str() : NULL, output.body.size()))
+    {
+        response.header("Vary", "Accept-Encoding");
+        if (accepted && !entry.gzipTried)
+        {
+            entry.gzipTried = true;
+            if (Gzip::compress(output.body.data(), output.body.size(), gzip->level, entry.gzipped)
+                && entry.gzipped.size() < output.body.size())
+            {
+                entry.size += entry.gzipped.size();
+                _memoryUsed += entry.gzipped.size();
+            }
+            else
+                std::string().swap(entry.gzipped);
+        }
+        if (accepted && !entry.gzipped.empty())
+        {
+            response.bodyBuffer().assign(entry.gzipped);
+            response.header("Content-Encoding", "gzip");
+        }
+    }
+    response.header("Age", static_cast<unsigned long>(now - entry.stored));
+    Result result = HIT;
+    if (now < entry.expires)
+        response.header("X-Cache-Status", "HIT");
+    else
+    {
+        response.header("X-Cache-Status", "STALE");
+        refresh = lock(key);
+        result = STALE;
+    }
+    evict();
+    return result;
+}
+
+static bool cacheableStatus(int status)
+{
+    return status == 200 || status == 203 || status == 204 || status == 301 || status == 404 || status == 410;
+}
+
+bool ResponseCache::store(const std::string& key, const CgiOutput& output, const CachePolicy& policy)
+{
+    unsigned long ttl = policy.ttl;
+    unsigned long stale = policy.stale;
+    bool cacheable = cacheableStatus(output.status) && !output.header("Set-Cookie");
+
+    const std::string* control = output.header("Cache-Control");
+    if (cacheable && control)
+    {
+        bool shared = false;
+        std::istringstream directives(*control);
+        std::string directive;
+        while (std::getline(directives, directive, ','))
+        {
+            directive.erase(0, directive.find_first_not_of(" \t"));
+            directive.erase(directive.find_last_not_of(" \t") + 1);
+            const char* text = directive.c_str();
+            if (!strcasecmp(text, "no-store") || !strcasecmp(text, "no-cache") || !strcasecmp(text, "private"))
+                cacheable = false;
+            else if (!strncasecmp(text, "s-maxage=", 9))
+            {
+                ttl = std::strtoul(text + 9, NULL, 10);
+                shared = true;
+            }
+            else if (!strncasecmp(text, "max-age=", 8) && !shared)
+                ttl = std::strtoul(text + 8, NULL, 10);
+            else if (!strncasecmp(text, "stale-while-revalidate=", 23))
+                stale = std::strtoul(text + 23, NULL, 10);
+        }
+    }
+
+    if (!cacheable || ttl == 0)
+    {
+        std::map<std::string, Entry>::iterator it = _entries.find(key);
+        if (it != _entries.end())
+        {
+            _memoryUsed -= it->second.size;
+            _lru.erase(it->second.lru);
+            _entries.erase(it);
+        }
+        return false;
+    }
+
+    Entry entry;
+    entry.output = output;
+    entry.stored = time(NULL);
+    entry.expires = entry.stored + ttl;
+    entry.staleUntil = entry.expires + stale;
+    entry.gzipTried = false;
+    entry.size = key.size() + output.body.size() + 256;
+    for (size_t i = 0; i < output.headers.size(); ++i)
+        entry.size += output.headers[i].first.size() + output.headers[i].second.size();
+    insert(key, entry);
+    evict();
+    return true;
+}
+
+bool ResponseCache::lock(const std::string& key)
+{
+    return _locks.insert(key).second;
+}
+
+void ResponseCache::unlock(const std::string& key)
+{
+    _locks.erase(key);
+}
+
+ResponseCache::Entry& ResponseCache::insert(const std::string& key, const Entry& entry)
+{
+    std::map<std::string, Entry>::iterator it = _entries.find(key);
+    if (it != _entries.end())
+    {
+        _memoryUsed -= it->second.size;
+        _lru.erase(it->second.lru);
+        _entries.erase(it);
+    }
+    Entry& stored = _entries[key];
+    stored = entry;
+    _lru.push_front(key);
+    stored.lru = _lru.begin();
+    _memoryUsed += stored.size;
+    return stored;
+}
+
+// Least recently used entries leave memory first, to disk when there is one.
+void ResponseCache::evict()
+{
+    while (_memoryUsed > _memoryLimit && !_lru.empty())
+    {
+        std::map<std::string, Entry>::iterator it = _entries.find(_lru.back());
+        if (!_diskPath.empty())
+            writeDisk(it->first, it->second);
+        _memoryUsed -= it->second.size;
+        _entries.erase(it);
+        _lru.pop_back();
+    }
+}
+
+std::string ResponseCache::diskFile(const std::string& key) const
+{
+    unsigned long hash = 14695981039346656037UL;
+    for (size_t i = 0; i < key.size(); ++i)
+    {
+        hash ^= static_cast<unsigned char>(key[i]);
+        hash *= 1099511628211UL;
+    }
+    char name[17];
+    snprintf(name, sizeof(name), "%016lx", hash);
+    return name;
+}
+
+// Lengths precede every string, so bodies are stored as they are. The key
+// is kept to tell hash collisions apart. Written to a temporary name and
+// renamed, so a reader never sees half a file.
+void ResponseCache::writeDisk(const std::string& key, const Entry& entry)
+{
+    std::string file = diskFile(key);
+    std::string path = _diskPath + "/" + file;
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary.c_str(), std::ios::binary | std::ios::trunc);
+        if (!out)
+            return;
+        const CgiOutput& output = entry.output;
+        out << "WSCACHE1\n" << key.size() << '\n' << key
+            << entry.stored << ' ' << entry.expires << ' ' << entry.staleUntil << ' '
+            << output.status << ' ' << output.headers.size() << '\n';
+        for (size_t i = 0; i < output.headers.size(); ++i)
+            out << output.headers[i].first.size() << ' ' << output.headers[i].second.size() << '\n'
+                << output.headers[i].first << output.headers[i].second;
+        out << output.body.size() << '\n' << output.body;
+        if (!out)
+        {
+            unlink(temporary.c_str());
+            return;
+        }
+    }
+    if (rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        unlink(temporary.c_str());
+        return;
+    }
+    trackDisk(file, entry.size);
+}
+
+static bool readSized(std::istream& in, size_t length, std::string& value)
+{
+    value.resize(length);
+    return length == 0 || in.read(&value[0], length);
+}
+
+bool ResponseCache::readDisk(const std::string& key, Entry& entry)
+{
+    std::string file = diskFile(key);
+    std::ifstream in((_diskPath + "/" + file).c_str(), std::ios::binary);
+    std::string magic;
+    size_t keyLength;
+    if (!std::getline(in, magic) || magic != "WSCACHE1" || !(in >> keyLength) || in.get() != '\n')
+        return false;
+    std::string storedKey;
+    if (!readSized(in, keyLength, storedKey) || storedKey != key)
+        return false;
+
+    long stored, expires, staleUntil;
+    size_t headerCount;
+    CgiOutput& output = entry.output;
+    if (!(in >> stored >> expires >> staleUntil >> output.status >> headerCount) || in.get() != '\n')
+        return false;
+    output.headers.clear();
+    for (size_t i = 0; i < headerCount; ++i)
+    {
+        size_t nameLength, valueLength;
+        std::string name, value;
+        if (!(in >> nameLength >> valueLength) || in.get() != '\n'
+            || !readSized(in, nameLength, name) || !readSized(in, valueLength, value))
+            return false;
+        output.headers.push_back(std::make_pair(name, value));
+    }
+    size_t bodyLength;
+    if (!(in >> bodyLength) || in.get() != '\n' || !readSized(in, bodyLength, output.body))
+        return false;
+
+    entry.stored = stored;
+    entry.expires = expires;
+    entry.staleUntil = staleUntil;
+    entry.gzipTried = false;
+    entry.size = key.size() + output.body.size() + 256;
+    for (size_t i = 0; i < output.headers.size(); ++i)
+        entry.size += output.headers[i].first.size() + output.headers[i].second.size();
+    trackDisk(file, entry.size);
+    return true;
+}
+
+// Only files this process wrote or read count against the disk budget; the
+// oldest of them are removed first.
+void ResponseCache::trackDisk(const std::string& file, size_t size)
+{
+    std::map<std::string, size_t>::iterator it = _diskFiles.find(file);
+    if (it != _diskFiles.end())
+        _diskUsed -= it->second;
+    else
+        _diskOrder.push_back(file);
+    _diskFiles[file] = size;
+    _diskUsed += size;
+    while (_diskUsed > _diskLimit && !_diskOrder.empty())
+    {
+        std::string oldest = _diskOrder.front();
+        _diskOrder.pop_front();
+        _diskUsed -= _diskFiles[oldest];
+        _diskFiles.erase(oldest);
+        unlink((_diskPath + "/" + oldest).c_str());
+    }
+}
+
+size_t ResponseCache::memoryUsed() const
+{
+    return _memoryUsed;
+}
+
+size_t ResponseCache::entries() const
+{
+    return _entries.size();
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                CacheFill                                 */
+/* ------------------------------------------------------------------------ */
+
+CacheFill::CacheFill(const std::string& key, const CachePolicy& policy, pid_t pid, int fd, unsigned long deadlineUs)
+    : _key(key), _policy(policy), _pid(pid), _fd(fd), _deadlineUs(deadlineUs)
+{
+}
+
+CacheFill::~CacheFill()
+{
+    if (_fd >= 0)
+        close(_fd);
+    if (_pid > 0)
+    {
+        kill(_pid, SIGKILL);
+        waitpid(_pid, NULL, 0);
+        ResponseCache::instance().unlock(_key);
+    }
+}
+
+bool CacheFill::readOutput()
+{
+    char buffer[16384];
+    ssize_t received = read(_fd, buffer, sizeof(buffer));
+    if (received > 0)
+    {
+        _raw.append(buffer, received);
+        return false;
+    }
+    return received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+bool CacheFill::finish()
+{
+    int status = 0;
+    pid_t reaped = waitpid(_pid, &status, 0);
+    _pid = -1;
+    ResponseCache::instance().unlock(_key);
+    _output.parse(_raw);
+    std::string().swap(_raw);
+    if (reaped <= 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return false;
+    if (_output.status < 500)
+        ResponseCache::instance().store(_key, _output, _policy);
+    return true;
+}
+
+void CacheFill::abandon()
+{
+    if (_pid > 0)
+    {
+        kill(_pid, SIGKILL);
+        waitpid(_pid, NULL, 0);
+        _pid = -1;
+        ResponseCache::instance().unlock(_key);
+    }
+}
+
+const CgiOutput& CacheFill::output() const
+{
+    return _output;
+}
+
+const CachePolicy& CacheFill::policy() const
+{
+    return _policy;
+}
+
+int CacheFill::fd() const
+{
+    return _fd;
+}
+
+unsigned long CacheFill::deadlineUs() const
+{
+    return _deadlineUs;
+}
+
+const std::string& CacheFill::key() const
+{
+    return _key;
+}
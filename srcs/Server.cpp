@@ -13,71 +13,236 @@
 #include "Server.hpp"
 #include "HttpRequest.hpp"
 #include "ServerConfig.hpp"
+#include "RequestArena.hpp"
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+
+extern char** environ;
 
 volatile sig_atomic_t Server::signal_received = 0;
+volatile sig_atomic_t Server::reload_requested = 0;
+volatile sig_atomic_t Server::upgrade_requested = 0;
+volatile sig_atomic_t Server::drain_requested = 0;
 
-int Server::createSocket()
+int Server::createSocket(int family)
 {
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int server_fd = socket(family, SOCK_STREAM, 0);
 
     if (server_fd < 0)
         throw std::runtime_error(logMessageError("ERROR", "Failed to create socket."));
     return server_fd;
 }
 
+// The socket address of a listen: "unix:<path>", an IPv6 or an IPv4
+// address. Returns 0 when host is none of them.
+static socklen_t listenAddress(const std::string& host, int port, sockaddr_storage& storage)
+{
+    std::memset(&storage, 0, sizeof(storage));
+    if (host.compare(0, 5, "unix:") == 0)
+    {
+        sockaddr_un* address = reinterpret_cast<sockaddr_un*>(&storage);
+        std::string path = host.substr(5);
+        if (path.empty() || path.size() >= sizeof(address->sun_path))
+            return 0;
+        address->sun_family = AF_UNIX;
+        std::memcpy(address->sun_path, path.c_str(), path.size() + 1);
+        return sizeof(sockaddr_un);
+    }
+    if (host.find(':') != std::string::npos)
+    {
+        sockaddr_in6* address = reinterpret_cast<sockaddr_in6*>(&storage);
+        if (inet_pton(AF_INET6, host.c_str(), &address->sin6_addr) != 1)
+            return 0;
+        address->sin6_family = AF_INET6;
+        address->sin6_port = htons(port);
+        return sizeof(sockaddr_in6);
+    }
+    sockaddr_in* address = reinterpret_cast<sockaddr_in*>(&storage);
+    if (inet_pton(AF_INET, host.c_str(), &address->sin_addr) != 1)
+        return 0;
+    address->sin_family = AF_INET;
+    address->sin_port = htons(port);
+    return sizeof(sockaddr_in);
+}
+
+// A unix socket file outlives the process that bound it. One that refuses
+// connections is left over and removed so bind() can create it again; a
+// live one is left alone and bind() fails.
+static void removeStaleSocket(const sockaddr_un& address)
+{
+    struct stat info;
+    if (lstat(address.sun_path, &info) != 0 || !S_ISSOCK(info.st_mode))
+        return;
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe < 0)
+        return;
+    if (connect(probe, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0 && errno == ECONNREFUSED)
+        unlink(address.sun_path);
+    close(probe);
+}
+
+// Brings the listening sockets in line with the current generation: sockets
+// that are still wanted stay open (and keep their accept queue), removed ones
+// are closed and new ones are bound. Safe to call again after every reload.
 void Server::initSockets()
 {
-    std::vector<std::pair<std::string, int> > boundSockets;
+    std::vector<ServerConfig>& configs = _generation->configs;
+    std::map<ListenKey, ServerConfig*> wanted;
 
-    for (size_t i = 0; i < _configs.size(); ++i)
+    for (size_t i = 0; i < configs.size(); ++i)
     {
-        const std::vector<int>& ports = _configs[i].getPorts();
-        const std::string& host = _configs[i].getHost();
-
+        const std::vector<int>& ports = configs[i].getPorts();
         for (size_t j = 0; j < ports.size(); ++j)
         {
-            std::pair<std::string, int> socketKey = std::make_pair(host, ports[j]);
+            ListenKey socketKey = std::make_pair(configs[i].getListenHost(j), ports[j]);
+            if (wanted.find(socketKey) == wanted.end())
+                wanted[socketKey] = &configs[i];
+        }
+    }
+
+    for (std::map<ListenKey, int>::iterator it = _listeners.begin(); it != _listeners.end();)
+    {
+        if (wanted.find(it->first) != wanted.end())
+        {
+            ++it;
+            continue;
+        }
+        logMessage("INFO", "Closing listener " + ServerConfig::listenName(it->first.first, it->first.second));
+        closeListener(it->second);
+        if (it->first.second < 0)
+            unlink(it->first.first.c_str() + 5);
+        _listeners.erase(it++);
+    }
 
-            if (std::find(boundSockets.begin(), boundSockets.end(), socketKey) != boundSockets.end()) {
-                logMessage("INFO", "Socket already bound for " + host + ":" + intToString(ports[j]));
-                continue;
+    for (std::map<ListenKey, ServerConfig*>::iterator it = wanted.begin(); it != wanted.end(); ++it)
+    {
+        const std::string& host = it->first.first;
+        int port = it->first.second;
+        std::string name = ServerConfig::listenName(host, port);
+
+        std::map<ListenKey, int>::iterator open = _listeners.find(it->first);
+        if (open != _listeners.end())
+        {
+            // listen() again only resizes the accept queue (backlog reload).
+            listen(open->second, _settings.limits.backlog);
+            _socketToConfig[open->second] = it->second;
+            try {
+                syncTlsContext(open->second, *it->second, port);
+            }
+            catch (const std::exception& e) {
+                logMessage("ERROR", std::string(e.what()) + ", keeping the previous TLS settings of " + name);
             }
+            continue;
+        }
 
-            int server_fd = createSocket();
+        int server_fd = takeInheritedSocket(it->first);
+        if (server_fd >= 0)
+        {
             try {
-                configureSocket(server_fd);
-
-                sockaddr_in address = {};
-                address.sin_family = AF_INET;
-                address.sin_addr.s_addr = inet_addr(host.c_str());
-                address.sin_port = htons(ports[j]);
-
-                if (bind(server_fd, (sockaddr*)&address, sizeof(address)) < 0)
-                {
-                    close(server_fd);
-                    _server_fds.erase(std::remove(_server_fds.begin(), _server_fds.end(), server_fd), _server_fds.end());
-                    throw std::runtime_error("Failed to bind socket for host: " + host + " on port " + intToString(ports[j]));
-                }
-
-                boundSockets.push_back(socketKey);
-                _addresses.push_back(address);
-                listenOnSocket(server_fd);
-                _socketToConfig[server_fd] = &_configs[i];
-                addServerSocketToPoll(server_fd);
-                logMessage("INFO", "Server is listening on " + host + ":" + intToString(ports[j]));
-            } 
-            catch (const std::exception& e)
-            {
+                syncTlsContext(server_fd, *it->second, port);
+            }
+            catch (const std::exception& e) {
                 close(server_fd);
                 logMessage("ERROR", e.what());
                 continue;
             }
+            listen(server_fd, _settings.limits.backlog);
+            _socketToConfig[server_fd] = it->second;
+            _listeners[it->first] = server_fd;
+            addServerSocketToPoll(server_fd);
+            logMessage("INFO", "Adopted inherited listener " + name);
+            continue;
+        }
+
+        sockaddr_storage address;
+        socklen_t addressLength = listenAddress(host, port, address);
+        if (!addressLength)
+        {
+            logMessage("ERROR", "Invalid listen address " + name);
+            continue;
+        }
+        server_fd = createSocket(address.ss_family);
+        try {
+            configureSocket(server_fd, address.ss_family);
+            if (address.ss_family == AF_UNIX)
+                removeStaleSocket(reinterpret_cast<const sockaddr_un&>(address));
+
+            if (bind(server_fd, (sockaddr*)&address, addressLength) < 0)
+                throw std::runtime_error("Failed to bind socket for " + name);
+            syncTlsContext(server_fd, *it->second, port);
+
+            _addresses.push_back(address);
+            listenOnSocket(server_fd);
+            _socketToConfig[server_fd] = it->second;
+            _listeners[it->first] = server_fd;
+            addServerSocketToPoll(server_fd);
+            logMessage("INFO", "Server is listening on " + name + (_tlsContexts.count(server_fd) ? " (ssl)" : ""));
+        }
+        catch (const std::exception& e)
+        {
+            close(server_fd);
+            logMessage("ERROR", e.what());
+            continue;
+        }
+    }
+
+    for (std::map<ListenKey, int>::iterator it = _inherited.begin(); it != _inherited.end(); ++it)
+        close(it->second);
+    _inherited.clear();
+}
+
+void Server::closeListener(int server_fd)
+{
+    _events.forget(server_fd);
+    for (size_t i = 0; i < _poll_fds.size(); ++i)
+    {
+        if (_poll_fds[i].fd == server_fd)
+        {
+            _poll_fds.erase(_poll_fds.begin() + i);
+            break;
         }
     }
+    _server_fds.erase(std::remove(_server_fds.begin(), _server_fds.end(), server_fd), _server_fds.end());
+    _socketToConfig.erase(server_fd);
+    std::map<int, TlsContext*>::iterator tls = _tlsContexts.find(server_fd);
+    if (tls != _tlsContexts.end())
+    {
+        delete tls->second;
+        _tlsContexts.erase(tls);
+    }
+    close(server_fd);
 }
 
+// Gives the listener the TLS context of its default server, or none when
+// the port is not listed as ssl there. Ticket keys carry over from the
+// context being replaced, so clients resume across reloads. Throws, leaving
+// the old context in place, when the certificate cannot be loaded.
+void Server::syncTlsContext(int server_fd, const ServerConfig& config, int port)
+{
+    std::map<int, TlsContext*>::iterator it = _tlsContexts.find(server_fd);
+    if (!config.isSslPort(port))
+    {
+        if (it != _tlsContexts.end())
+        {
+            delete it->second;
+            _tlsContexts.erase(it);
+        }
+        return;
+    }
+    TlsContext* context = new TlsContext(config.getTlsPolicy(), config.http2Enabled());
+    if (it != _tlsContexts.end())
+    {
+        context->inheritTicketKeys(*it->second);
+        delete it->second;
+    }
+    _tlsContexts[server_fd] = context;
+}
 
-void Server::configureSocket(int server_fd)
+// An IPv6 listener takes IPv6 only, so [::]:port and 0.0.0.0:port can be
+// listened on side by side, as separate listeners.
+void Server::configureSocket(int server_fd, int family)
 {
     int opt = 1;
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
@@ -85,11 +250,16 @@ void Server::configureSocket(int server_fd)
         close(server_fd);
         throw std::runtime_error(logMessageError("ERROR", "Failed to configure socket options (SO_REUSEADDR)."));
     }
+    if (family == AF_INET6 && setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt)) < 0)
+    {
+        close(server_fd);
+        throw std::runtime_error(logMessageError("ERROR", "Failed to configure socket options (IPV6_V6ONLY)."));
+    }
 }
 
 void Server::listenOnSocket(int server_fd)
 {
-    if (listen(server_fd, 10) < 0)
+    if (listen(server_fd, _settings.limits.backlog) < 0)
     {
         close(server_fd);
         throw std::runtime_error(logMessageError("ERROR", "Failed to set socket to listen."));
@@ -107,39 +277,50 @@ void Server::addServerSocketToPoll(int server_fd)
 
 ServerConfig* Server::getConfigForRequest(const std::string& hostHeader, int connectedPort)
 {
-    if (hostHeader.empty())
-        return &_configs[0];
-    std::string hostWithoutPort = hostHeader;
-    int portFromHeader = connectedPort;
-    size_t colonPos = hostHeader.find(':');
-    if (colonPos != std::string::npos)
-    {
-        hostWithoutPort = hostHeader.substr(0, colonPos);
-        std::istringstream ss(hostHeader.substr(colonPos + 1));
-        ss >> portFromHeader;
-    }
-    ServerConfig* defaultForPort = NULL;
-    for (size_t i = 0; i < _configs.size(); ++i)
-    {
-        const std::string& configHost = _configs[i].getHost();
-        const std::string& configServerName = _configs[i].getServerName();
-        const std::vector<int>& configPorts = _configs[i].getPorts();
-        if (!configServerName.empty()) {
-            if (hostWithoutPort == configServerName) {
-                if (std::find(configPorts.begin(), configPorts.end(), portFromHeader) != configPorts.end())
-                    return &_configs[i];
-            }
-        }
-        if (hostWithoutPort == configHost) {
-            if (std::find(configPorts.begin(), configPorts.end(), portFromHeader) != configPorts.end())
-                return &_configs[i];
+    return matchConfig(_generation->configs, _generation->index, hostHeader, connectedPort);
+}
+
+// Host header "name[:port]" against the generation's index: a block whose
+// server_name or host matches on that port, else the first block listening
+// on it.
+ServerConfig* Server::matchConfig(std::vector<ServerConfig>& configs, const VirtualHostIndex& index,
+    const std::string& hostHeader, int connectedPort)
+{
+    return matchConfig(configs, index, hostHeader.c_str(), hostHeader.size(), connectedPort);
+}
+
+// hostHeader must be NUL-terminated after length bytes (the port is parsed
+// in place).
+ServerConfig* Server::matchConfig(std::vector<ServerConfig>& configs, const VirtualHostIndex& index,
+    const char* hostHeader, size_t length, int connectedPort)
+{
+    if (configs.empty())
+        return NULL;
+    if (length == 0)
+        return &configs[0];
+
+    // An IPv6 literal is bracketed: "[::1]:8080" names host ::1.
+    if (hostHeader[0] == '[')
+    {
+        const char* bracket = static_cast<const char*>(memchr(hostHeader, ']', length));
+        if (bracket)
+        {
+            size_t rest = length - (bracket + 1 - hostHeader);
+            int port = connectedPort;
+            if (rest > 1 && bracket[1] == ':' && std::isdigit(static_cast<unsigned char>(bracket[2])))
+                port = std::atoi(bracket + 2);
+            int found = index.route(hostHeader + 1, bracket - hostHeader - 1, port);
+            return found >= 0 ? &configs[found] : NULL;
         }
-        if (std::find(configPorts.begin(), configPorts.end(), portFromHeader) != configPorts.end() && !defaultForPort)
-            defaultForPort = &_configs[i];
     }
-    if (defaultForPort)
-        return defaultForPort;
-    return NULL;
+    const char* colon = static_cast<const char*>(memchr(hostHeader, ':', length));
+    size_t hostLen = colon ? colon - hostHeader : length;
+    int port = connectedPort;
+    if (colon && hostLen + 1 < length && std::isdigit(static_cast<unsigned char>(hostHeader[hostLen + 1])))
+        port = std::atoi(hostHeader + hostLen + 1);
+
+    int found = index.route(hostHeader, hostLen, port);
+    return found >= 0 ? &configs[found] : NULL;
 }
 
 
@@ -149,11 +330,13 @@ void Server::cleanupSockets()
     {
         if (_server_fds[i] != -1)
         {
+            _events.forget(_server_fds[i]);
             close(_server_fds[i]);
             _server_fds[i] = -1;
         }
     }
     _poll_fds.clear();
+    _listeners.clear();
 }
 
 void Server::run()
@@ -161,20 +344,93 @@ void Server::run()
     logMessage("INFO", "Server is running...");
     running = true;
 
+    if (_upgradeParent > 0)
+    {
+        logMessage("INFO", "Listeners adopted, asking process " + intToString(_upgradeParent) + " to drain");
+        kill(_upgradeParent, SIGQUIT);
+        _upgradeParent = 0;
+    }
+
+    unsigned long lastWokeUs = Metrics::nowMicros();
     while (running)
     {
-        int poll_count = poll(&_poll_fds[0], _poll_fds.size(), -1);
+        if (_draining && drainFinished())
+        {
+            stop();
+            break;
+        }
+        int timeout = (_draining || _upgradePid > 0) ? 1000 : -1;
+        unsigned long pollStartUs = Metrics::nowMicros();
+        int probeTimeout = _draining ? -1 : healthCheckTimeout(pollStartUs);
+        if (probeTimeout >= 0 && (timeout < 0 || probeTimeout < timeout))
+            timeout = probeTimeout;
+        int fillTimeout = cacheFillTimeout(pollStartUs);
+        if (fillTimeout >= 0 && (timeout < 0 || fillTimeout < timeout))
+            timeout = fillTimeout;
+        int scriptTimeout = cgiTimeout(pollStartUs);
+        if (scriptTimeout >= 0 && (timeout < 0 || scriptTimeout < timeout))
+            timeout = scriptTimeout;
+        int upstreamTimeout = proxyTimeout(pollStartUs);
+        if (upstreamTimeout >= 0 && (timeout < 0 || upstreamTimeout < timeout))
+            timeout = upstreamTimeout;
+        bool tlsPending = tlsBuffered();
+        if (tlsPending)
+            timeout = 0;
+        int poll_count = _events.wait(_poll_fds, _server_fds, timeout);
+        unsigned long wokeUs = Metrics::nowMicros();
+        updateLoopLag(pollStartUs - lastWokeUs, wokeUs - pollStartUs);
+        lastWokeUs = wokeUs;
+        if (tlsPending && poll_count >= 0)
+            markTlsReadable();
 
+        if (signal_received)
+        {
+            stop();
+            break;
+        }
+        if (reload_requested)
+        {
+            reload_requested = 0;
+            reload();
+            continue;
+        }
+        if (upgrade_requested)
+        {
+            upgrade_requested = 0;
+            upgradeBinary();
+        }
+        if (drain_requested)
+        {
+            drain_requested = 0;
+            beginDrain();
+            continue;
+        }
+        if (_upgradePid > 0)
+            checkUpgradeChild();
         if (poll_count < 0)
         {
             if (!running)
                 break;
-            logMessage("ERROR", "Poll failed.");
+            if (errno != EINTR)
+                logMessage("ERROR", "Poll failed.");
             continue;
         }
 
         for (size_t i = 0; i < _poll_fds.size(); ++i)
         {
+            if (_poll_fds[i].revents && !_tlsClients.empty() && handleTlsHandshake(i))
+                continue;
+            if (_poll_fds[i].revents && !_http2Clients.empty() && handleHttp2Event(i))
+                continue;
+            if (_poll_fds[i].revents && (!_proxyClients.empty() || !_idleUpstreams.empty() || !_probes.empty())
+                && handleProxyEvent(i))
+                continue;
+            if (_poll_fds[i].revents && !_uploads.empty() && handleUploadEvent(i))
+                continue;
+            if (_poll_fds[i].revents && (!_cgiClients.empty() || !_cgiStreams.empty()) && handleCgiEvent(i))
+                continue;
+            if (_poll_fds[i].revents && !_cacheFills.empty() && handleCacheFill(i))
+                continue;
             if (_poll_fds[i].revents & POLLIN)
             {
                 if (isServerSocket(_poll_fds[i].fd))
@@ -183,46 +439,76 @@ void Server::run()
                     handleClientRequest(i);
             }
             if (_poll_fds[i].revents & POLLOUT)
-            {
-                int client_fd = _poll_fds[i].fd;
-                if (responseBuffer.find(client_fd) != responseBuffer.end())
-                {
-                    const std::string& response = responseBuffer[client_fd];
-                    ssize_t bytes_sent = send(client_fd, response.c_str(), response.size(), 0);
-                    
-                    if (bytes_sent == -1 || bytes_sent == 0)
-                    {
-                        logMessage("ERROR", "Failed to send data to client " + intToString(client_fd));
-                        removeClient(i);
-                    }
-                    else
-                    {
-                        responseBuffer.erase(client_fd);
-                        _poll_fds[i].events &= ~POLLOUT;
-                    }
-                }
-            }
+                sendPendingResponse(i);
         }
+        if (!_draining)
+            runHealthChecks(Metrics::nowMicros());
+        if (!_cacheFills.empty())
+            expireCacheFills(Metrics::nowMicros());
+        if (!_cgiClients.empty() || !_cgiStreams.empty())
+            expireCgiSessions(Metrics::nowMicros());
+        if (!_proxyClients.empty())
+            expireProxySessions(Metrics::nowMicros());
     }
 }
 
+// Called as poll() returns, before any event is handled, with the time the
+// previous iteration spent handling events and the time poll() waited. Lag
+// follows a slow iteration at once and decays by an eighth per busy
+// iteration after it. If poll() actually had to wait, nothing was queued
+// any more and the estimate restarts from the last iteration.
+void Server::updateLoopLag(unsigned long busyUs, unsigned long idleUs)
+{
+    static const unsigned long IDLE_US = 1000;
+
+    if (busyUs >= _loopLagUs || idleUs >= IDLE_US)
+        _loopLagUs = busyUs;
+    else
+        _loopLagUs -= (_loopLagUs - busyUs) / 8;
+    Metrics::instance().setLoad(_loopLagUs, _bufferedBytes);
+}
+
 
 bool Server::isServerSocket(int fd) const
 {
     return std::find(_server_fds.begin(), _server_fds.end(), fd) != _server_fds.end();
 }
 
+// With io_uring the kernel may have accepted several connections since the
+// last wait; they are all taken in.
 void Server::handleNewConnection(int server_fd)
 {
-    sockaddr_in client_addr;
+    do
+        acceptConnection(server_fd);
+    while (_events.acceptPending(server_fd));
+}
+
+void Server::acceptConnection(int server_fd)
+{
+    sockaddr_storage client_addr;
     socklen_t client_len = sizeof(client_addr);
-    int client_fd = accept(server_fd, (sockaddr*)&client_addr, &client_len);
+    int client_fd = _events.accept(server_fd, client_addr, client_len);
 
     if (client_fd < 0)
     {
-        logMessage("ERROR", "Failed to accept new connection.");
+        if (errno == EMFILE || errno == ENFILE)
+            acceptWithSpareFd(server_fd);
+        else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            logMessage("ERROR", "Failed to accept new connection.");
+        return;
+    }
+
+    std::map<int, TlsContext*>::iterator tls = _tlsContexts.find(server_fd);
+    Metrics::RejectReason reason;
+    if (overloaded(reason))
+    {
+        rejectConnection(client_fd, reason, tls == _tlsContexts.end());
         return;
     }
+    if (tls != _tlsContexts.end())
+        _tlsClients[client_fd] = new TlsConnection(*tls->second, client_fd);
+    else
+        _events.manage(client_fd, true, true);
 
     struct pollfd client_poll_fd = {};
     client_poll_fd.fd = client_fd;
@@ -230,40 +516,240 @@ void Server::handleNewConnection(int server_fd)
 
     _poll_fds.push_back(client_poll_fd);
 
-    ServerConfig* config = _socketToConfig[server_fd];
-    if (config)
-        _socketToConfig[client_fd] = config;
+    InFlight& inflight = _inflight[client_fd];
+    inflight.startUs = 0;
+    inflight.histogram = NULL;
+    inflight.arena = new RequestArena();
+    inflight.active = false;
+    inflight.address = clientAddress(client_addr, _clientAddresses[client_fd]);
+    inflight.limitSlot = -1;
+    inflight.routed = false;
+    inflight.request = NULL;
+    inflight.bodyLength = 0;
 
-    else
+    Metrics::instance().connectionAccepted();
+    updateConnectionGauges();
+
+    if (_socketToConfig.find(server_fd) == _socketToConfig.end())
         logMessage("WARNING", "Could not find server configuration for client.");
 }
 
 
+// The text logged and forwarded for a peer, and the key its limit_req and
+// limit_conn state is kept under: the whole IPv6 address, with IPv4 peers
+// mapped into it as ::ffff:a.b.c.d. Unix socket peers share one key, as
+// they are all the local host.
+ClientKey Server::clientAddress(const sockaddr_storage& address, std::string& text)
+{
+    char buffer[INET6_ADDRSTRLEN];
+    ClientKey key;
+    if (address.ss_family == AF_INET)
+    {
+        const sockaddr_in& peer = reinterpret_cast<const sockaddr_in&>(address);
+        if (inet_ntop(AF_INET, &peer.sin_addr, buffer, sizeof(buffer)))
+            text = buffer;
+        key.bytes[10] = 0xff;
+        key.bytes[11] = 0xff;
+        std::memcpy(key.bytes + 12, &peer.sin_addr, 4);
+        return key;
+    }
+    if (address.ss_family == AF_INET6)
+    {
+        const sockaddr_in6& peer = reinterpret_cast<const sockaddr_in6&>(address);
+        if (inet_ntop(AF_INET6, &peer.sin6_addr, buffer, sizeof(buffer)))
+            text = buffer;
+        std::memcpy(key.bytes, peer.sin6_addr.s6_addr, sizeof(key.bytes));
+        return key;
+    }
+    text = "unix:";
+    return key;
+}
+
+// Checked before a new connection gets any state, so an overloaded server
+// turns clients away quickly instead of letting everyone time out.
+bool Server::overloaded(Metrics::RejectReason& reason) const
+{
+    if (_inflight.size() >= _settings.limits.workerConnections)
+        reason = Metrics::REJECT_CONNECTIONS;
+    else if (_settings.limits.memoryLimit && _bufferedBytes >= _settings.limits.memoryLimit)
+        reason = Metrics::REJECT_MEMORY;
+    else if (_settings.limits.shedLagUs && _loopLagUs >= _settings.limits.shedLagUs)
+        reason = Metrics::REJECT_LAG;
+    else
+        return false;
+    return true;
+}
+
+// Best-effort 503: one non-blocking send, then close whatever happened. A
+// TLS client could not read it, so it is only closed.
+void Server::rejectConnection(int client_fd, Metrics::RejectReason reason, bool plain)
+{
+    if (!plain)
+    {
+        close(client_fd);
+        Metrics::instance().connectionRejected(reason);
+        return;
+    }
+    ResponseBuilder response(503);
+    response.header("Retry-After", _settings.limits.retryAfter);
+    response.header("Connection", "close");
+    response.finish();
+
+    struct iovec iov[ResponseBuilder::MAX_IOV];
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = response.fillIov(iov, ResponseBuilder::MAX_IOV);
+    sendmsg(client_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(client_fd);
+    Metrics::instance().connectionRejected(reason);
+}
+
+// Out of descriptors, the pending connection keeps the listener readable and
+// poll() would spin. The descriptor kept in reserve is given up for just
+// long enough to accept the connection and refuse it.
+void Server::acceptWithSpareFd(int server_fd)
+{
+    if (_spareFd < 0)
+    {
+        logMessage("ERROR", "Out of file descriptors and no spare descriptor left.");
+        return;
+    }
+    close(_spareFd);
+    int client_fd = accept(server_fd, NULL, NULL);
+    if (client_fd >= 0)
+        rejectConnection(client_fd, Metrics::REJECT_DESCRIPTORS, _tlsContexts.find(server_fd) == _tlsContexts.end());
+    _spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+static ResponseBuilder limitedResponse(int statusCode, unsigned long retryAfter)
+{
+    ResponseBuilder response(statusCode);
+    response.header("Retry-After", retryAfter);
+    return response;
+}
+
+// The port the client connected to, which for a unix socket is the one
+// ServerConfig gives its path, or -1.
+static int localPort(int client_fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrLen = sizeof(addr);
+    if (getsockname(client_fd, (struct sockaddr*)&addr, &addrLen) != 0)
+        return -1;
+    if (addr.ss_family == AF_INET)
+        return ntohs(reinterpret_cast<sockaddr_in&>(addr).sin_port);
+    if (addr.ss_family == AF_INET6)
+        return ntohs(reinterpret_cast<sockaddr_in6&>(addr).sin6_port);
+    if (addr.ss_family == AF_UNIX && addrLen > offsetof(sockaddr_un, sun_path))
+    {
+        const char* path = reinterpret_cast<sockaddr_un&>(addr).sun_path;
+        return ServerConfig::unixSocketPort(std::string(path, strnlen(path, addrLen - offsetof(sockaddr_un, sun_path))));
+    }
+    return -1;
+}
+
 void Server::handleClientRequest(int clientIndex)
 {
     int client_fd = _poll_fds[clientIndex].fd;
-    std::string buffer = readClientRequest(client_fd, clientIndex);
-    if (buffer.empty())
+    std::string& buffer = clientBuffers[client_fd];
+    bool bodyPending = false;
+    if (!readClientRequest(client_fd, clientIndex, buffer, bodyPending))
         return;
-    HttpRequest request(buffer);
-    std::string hostHeader = request.getHeaderValue("Host");
-    int connectedPort = -1;
-    struct sockaddr_in addr;
-    socklen_t addrLen = sizeof(addr);
-    if (getsockname(client_fd, (struct sockaddr*)&addr, &addrLen) == 0)
-        connectedPort = ntohs(addr.sin_port);
-    ServerConfig* config = getConfigForRequest(hostHeader, connectedPort);
+    InFlight& inflight = _inflight[client_fd];
+    RequestTrace& trace = inflight.trace;
+    HttpRequest& request = *inflight.request;
+    unsigned long phaseUs = RequestTrace::clock();
+    StringRef hostHeader = request.header("Host");
+    int connectedPort = localPort(client_fd);
+    std::map<int, ConfigGeneration*>::iterator pinned = _clientGeneration.find(client_fd);
+    ServerConfig* config = pinned != _clientGeneration.end() && pinned->second
+        ? matchConfig(pinned->second->configs, pinned->second->index, hostHeader.data, hostHeader.length, connectedPort)
+        : matchConfig(_generation->configs, _generation->index, hostHeader.data, hostHeader.length, connectedPort);
     if (!config)
     {
         logMessage("ERROR", "No configuration found for client " + intToString(client_fd));
         removeClient(clientIndex);
         return;
     }
+    if (trace.active())
+    {
+        const std::string& serverName = config->getServerName();
+        trace.describe(request.getMethodRef(), request.getPathRef(),
+            serverName.empty() ? hostHeader : StringRef(serverName.data(), serverName.size()),
+            request.contentLength());
+    }
+    if (config->http2Enabled() && !tlsFor(client_fd) && startHttp2(clientIndex, buffer, request, *config, bodyPending))
+        return;
+
+    // Proxied requests, uploads into a file and form posts to a script are
+    // streamed; anything else waits for its body.
+    // A malformed Content-Length leaves the body unframed: handleRequest
+    // refuses it before anything is forwarded or written.
+    const ServerLocation* proxied = request.contentLengthValid() ? config->findProxyLocation(request.getPath()) : NULL;
+    UploadTarget upload;
+    int uploadStatus = bodyPending && !proxied ? request.uploadPlan(*config, upload) : -1;
+    if (bodyPending && !proxied && uploadStatus < 0
+        && !request.header("Content-Type").contains("application/x-www-form-urlencoded"))
+        return;
+    const ServerLocation* location = proxied ? proxied : config->findLocation(request.getPath());
+    inflight.histogram = location ? location->getLatencyHistogram() : config->getLatencyHistogram();
+    unsigned long retryAfter = _settings.limits.retryAfter;
+    int limited = admitRequest(inflight, *config, location, retryAfter);
+    trace.span(RequestTrace::ROUTE, phaseUs);
+    if (proxied && !limited)
+        startProxy(client_fd, request, *proxied, buffer);
+    else if (uploadStatus >= 0)
+    {
+        UploadSession* session;
+        if (limited || uploadStatus)
+        {
+            ResponseBuilder response = limited ? limitedResponse(limited, retryAfter)
+                : request.findErrorPage(*config, uploadStatus);
+            session = new UploadSession(client_fd, tlsFor(client_fd), upload.length, response);
+        }
+        else
+            session = new UploadSession(client_fd, tlsFor(client_fd), upload);
+        startUpload(client_fd, request, session, buffer.data() + request.getHeadLength(),
+            buffer.size() - request.getHeadLength());
+    }
+    else if (!proxied)
+        request.streamCgi(client_fd, tlsFor(client_fd), buffer);
+    _bufferedBytes -= buffer.size();
+    if (buffer.capacity() > MAX_RETAINED_BUFFER)
+        std::string().swap(buffer);
+    else
+        buffer.clear();
+    if ((proxied && !limited) || uploadStatus >= 0)
+        return;
     try {
-        std::string response = request.handleRequest(*config);
-         logMessage("INFO", request.getMethod() + " " + request.getPath() + " " + request.getHttpVersion() + + "\" " + intToString(request.extractStatusCode(response)) + " " + intToString(response.size()) + " \"" + request.getHeaderValue("User-Agent") + "\"");
-        responseBuffer[client_fd] = response;
-        _poll_fds[clientIndex].events |= POLLOUT;
+        phaseUs = RequestTrace::clock();
+        ResponseBuilder response = limited ? limitedResponse(limited, retryAfter) : request.handleRequest(*config);
+        trace.span(RequestTrace::HANDLE, phaseUs);
+        if (CgiSession* cgi = request.takeCgiSession())
+        {
+            startCgi(client_fd, 0, request, cgi);
+            return;
+        }
+        if (request.bodyOnSocket())
+        {
+            // Answered without the body, which is read and dropped first.
+            startUpload(client_fd, request,
+                new UploadSession(client_fd, tlsFor(client_fd), request.bodyOnSocket(), response), NULL, 0);
+            return;
+        }
+        if (CacheFill* fill = request.takeCacheFill())
+            startCacheFill(fill);
+        unsigned long lockTimeoutUs;
+        const std::string& cacheWait = request.cacheWait(lockTimeoutUs);
+        if (!cacheWait.empty())
+        {
+            waitForCacheFill(client_fd, 0, request, *config, cacheWait, lockTimeoutUs);
+            return;
+        }
+        response.finish();
+        Metrics::instance().requestCompleted(response.getStatusCode());
+        logAccess(client_fd, request, response);
+        queueResponse(client_fd, response);
     }
     catch (const std::exception& e) {
         logMessage("ERROR", "Failed to handle request for client " + intToString(client_fd));
@@ -271,75 +757,1535 @@ void Server::handleClientRequest(int clientIndex)
     }
 }
 
-std::string Server::readClientRequest(int client_fd, int clientIndex)
+// limit_req and limit_conn of the location take precedence over those of
+// the server block. Runs once the head has been cut in the arena and before
+// the handler touches the filesystem. Returns the status to refuse the
+// request with, or 0.
+int Server::admitRequest(InFlight& inflight, const ServerConfig& config, const ServerLocation* location,
+    unsigned long& retryAfter)
+{
+    const ClientLimit* requests = &config.getClientLimit();
+    const ClientLimit* connections = &config.getClientLimit();
+    if (location && location->getClientLimit().limitsRequests())
+        requests = &location->getClientLimit();
+    if (location && location->getClientLimit().limitsConnections())
+        connections = &location->getClientLimit();
+    if (!requests->limitsRequests() && !connections->limitsConnections())
+        return 0;
+
+    unsigned long nowUs = Metrics::nowMicros();
+    int status = 0;
+    if (requests->limitsRequests() && !_clientLimiter.takeToken(inflight.address, *requests, nowUs, retryAfter))
+    {
+        status = 429;
+        Metrics::instance().requestLimited(Metrics::LIMIT_REQ);
+    }
+    else if (connections->limitsConnections()
+        && !_clientLimiter.acquire(inflight.address, *connections, nowUs, inflight.limitSlot))
+    {
+        status = 503;
+        Metrics::instance().requestLimited(Metrics::LIMIT_CONN);
+    }
+    Metrics::instance().setLimiterState(_clientLimiter.size(), _clientLimiter.evictions());
+    return status;
+}
+
+// Appends what the socket has to buffer. Returns true once buffer holds a
+// complete request; the caller handles it and clears the buffer, which keeps
+// its capacity for the next request on the connection.
+// The head is parsed into inflight.request as soon as it is complete, and
+// only once: after that each read just counts the body bytes against
+// Content-Length. A request with a body still arriving is also handed over
+// once at that point, with bodyPending set: proxied requests stream the
+// rest.
+bool Server::readClientRequest(int client_fd, int clientIndex, std::string& buffer, bool& bodyPending)
 {
     char tempBuffer[1024];
     ssize_t bytes_read;
+    InFlight& inflight = _inflight[client_fd];
+    unsigned long readUs = RequestTrace::clock();
+    size_t before = buffer.size();
 
-    bytes_read = recv(client_fd, tempBuffer, sizeof(tempBuffer) - 1, MSG_DONTWAIT);
+    if (TlsConnection* tls = tlsFor(client_fd))
+    {
+        bytes_read = TlsConnection::read(tls, client_fd, tempBuffer, sizeof(tempBuffer));
+        if (bytes_read > 0)
+            buffer.append(tempBuffer, bytes_read);
+    }
+    else
+        bytes_read = _events.receive(client_fd, buffer, sizeof(tempBuffer));
 
     if (bytes_read > 0)
     {
-        tempBuffer[bytes_read] = '\0';
-        clientBuffers[client_fd] += std::string(tempBuffer, bytes_read);
-
-        if (clientBuffers[client_fd].find("\r\n\r\n") != std::string::npos || clientBuffers[client_fd].find("\n\n") != std::string::npos)
-        {
-            size_t contentLengthPos = clientBuffers[client_fd].find("Content-Length:");
-            
-            if (contentLengthPos != std::string::npos) {
-                size_t start = clientBuffers[client_fd].find(" ", contentLengthPos) + 1;
-                size_t end = clientBuffers[client_fd].find("\r\n", contentLengthPos);
-                int contentLength = std::atoi(clientBuffers[client_fd].substr(start, end - start).c_str());
-                size_t currentBodySize = clientBuffers[client_fd].size() - clientBuffers[client_fd].find("\r\n\r\n") - 4;
-                if (currentBodySize >= static_cast<size_t>(contentLength))
-                {
-                    std::string completeRequest = clientBuffers[client_fd];
-                    clientBuffers.erase(client_fd);
-                    return completeRequest;
-                }
-            }
-            else
+        Metrics::instance().bytesReceived(bytes_read);
+        if (!before)
+        {
+            inflight.startUs = Metrics::nowMicros();
+            inflight.histogram = NULL;
+            inflight.routed = false;
+            if (!inflight.active)
             {
-                std::string completeRequest = clientBuffers[client_fd];
-                clientBuffers.erase(client_fd);
-                return completeRequest;
+                ++_activeRequests;
+                updateConnectionGauges();
             }
+            inflight.active = true;
+            pinGeneration(client_fd);
+            inflight.trace.begin(client_fd, readUs);
+        }
+        inflight.trace.span(RequestTrace::RECV, readUs);
+        _bufferedBytes += bytes_read;
+
+        if (!inflight.request)
+        {
+            // Only the bytes just read can complete the head.
+            size_t from = before > 3 ? before - 3 : 0;
+            if (buffer.find("\r\n\r\n", from) == std::string::npos && buffer.find("\n\n", from) == std::string::npos)
+                return false;
+            unsigned long parseUs = RequestTrace::clock();
+            inflight.request = new HttpRequest(buffer, *inflight.arena);
+            inflight.trace.span(RequestTrace::PARSE, parseUs);
+            inflight.bodyLength = inflight.request->contentLength();
+        }
+        if (buffer.size() - inflight.request->getHeadLength() >= inflight.bodyLength)
+        {
+            inflight.request->takeBody(buffer);
+            return true;
+        }
+        if (!inflight.routed)
+        {
+            inflight.routed = true;
+            bodyPending = true;
+            return true;
         }
     }
     else if (bytes_read == 0)
         removeClient(clientIndex);
-    else if (bytes_read == -1)
+    else if (errno != EAGAIN && errno != EWOULDBLOCK)
     {
         logMessage("ERROR", "Read error on client socket." + intToString(client_fd));
         removeClient(clientIndex);
     }
-    return "";
+    return false;
+}
+
+void Server::queueResponse(int client_fd, ResponseBuilder& response)
+{
+    ResponseBuilder& queued = responseBuffer[client_fd];
+    queued.swap(response);
+    _bufferedBytes += queued.size();
+    if (pollfd* entry = pollFor(client_fd))
+        entry->events |= POLLOUT;
+    if (_events.managesWrites(client_fd) && !_events.sending(client_fd))
+    {
+        // The chain goes out with the next wait, along with the receive
+        // for the next request.
+        struct iovec iov[ResponseBuilder::MAX_IOV];
+        _events.send(client_fd, iov, queued.fillIov(iov, ResponseBuilder::MAX_IOV), -1, 0);
+    }
+}
+
+// A finished response stays in the map as an empty builder so the next
+// request on the connection reuses the node.
+void Server::sendPendingResponse(int clientIndex)
+{
+    int client_fd = _poll_fds[clientIndex].fd;
+    std::map<int, ResponseBuilder>::iterator it = responseBuffer.find(client_fd);
+    if (it == responseBuffer.end() || it->second.remaining() == 0)
+        return;
+
+    struct iovec iov[ResponseBuilder::MAX_IOV];
+    int count = it->second.fillIov(iov, ResponseBuilder::MAX_IOV);
+    unsigned long sendUs = RequestTrace::clock();
+    bool managed = _events.managesWrites(client_fd);
+    ssize_t bytes_sent = managed ? _events.send(client_fd, iov, count, -1, 0)
+        : TlsConnection::write(tlsFor(client_fd), client_fd, iov, count);
+    if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (bytes_sent == -1 || bytes_sent == 0)
+    {
+        logMessage("ERROR", "Failed to send data to client " + intToString(client_fd));
+        removeClient(clientIndex);
+        return;
+    }
+    Metrics::instance().bytesSent(bytes_sent);
+    if (RequestTrace* trace = traceFor(client_fd))
+        trace->span(RequestTrace::SEND, sendUs);
+    it->second.consume(bytes_sent);
+    if (it->second.done())
+    {
+        finishRequest(client_fd);
+        releaseGeneration(client_fd);
+        _bufferedBytes -= it->second.size();
+        ResponseBuilder().swap(it->second);
+        _poll_fds[clientIndex].events &= ~POLLOUT;
+    }
+    else if (managed)
+        _events.send(client_fd, iov, it->second.fillIov(iov, ResponseBuilder::MAX_IOV), -1, 0);
+}
+
+// Records the latency and trace and releases everything the request
+// allocated. A plain HTTP/1.1 connection a session had taken is handed back
+// to the event engine.
+void Server::finishRequest(int client_fd)
+{
+    std::map<int, InFlight>::iterator it = _inflight.find(client_fd);
+    if (it == _inflight.end())
+        return;
+    if (!tlsFor(client_fd) && _http2Clients.find(client_fd) == _http2Clients.end())
+        _events.manage(client_fd, true, true);
+    if (it->second.histogram)
+        it->second.histogram->record(Metrics::nowMicros() - it->second.startUs);
+    it->second.trace.end();
+    it->second.histogram = NULL;
+    delete it->second.request;
+    it->second.request = NULL;
+    it->second.arena->release();
+    _clientLimiter.release(it->second.limitSlot);
+    it->second.limitSlot = -1;
+    if (it->second.active)
+        --_activeRequests;
+    it->second.active = false;
+    updateConnectionGauges();
+}
+
+// Every client connection has an InFlight entry; it is active while a
+// request on it is being served. Kept current on accept, on close and as
+// requests start and finish, so a scrape between requests is not stale.
+void Server::updateConnectionGauges()
+{
+    size_t open = _inflight.size();
+    size_t active = _activeRequests < open ? _activeRequests : open;
+    Metrics::instance().setConnections(active, open - active);
 }
 
 void Server::removeClient(int index)
 {
     int client_fd = _poll_fds[index].fd;
 
-    if (responseBuffer.find(client_fd) != responseBuffer.end())
-        responseBuffer.erase(client_fd);
-    if (_socketToConfig.find(client_fd) != _socketToConfig.end())
-        _socketToConfig.erase(client_fd);
+    std::map<int, ResponseBuilder>::iterator response = responseBuffer.find(client_fd);
+    if (response != responseBuffer.end())
+    {
+        _bufferedBytes -= response->second.size();
+        responseBuffer.erase(response);
+    }
+    std::map<int, std::string>::iterator pending = clientBuffers.find(client_fd);
+    if (pending != clientBuffers.end())
+    {
+        _bufferedBytes -= pending->second.size();
+        clientBuffers.erase(pending);
+    }
+    _clientAddresses.erase(client_fd);
+    _cacheWaiters.erase(client_fd);
+    std::map<int, InFlight>::iterator inflight = _inflight.find(client_fd);
+    if (inflight != _inflight.end())
+    {
+        if (inflight->second.active)
+            --_activeRequests;
+        inflight->second.trace.end();
+        _clientLimiter.release(inflight->second.limitSlot);
+        delete inflight->second.request;
+        delete inflight->second.arena;
+        _inflight.erase(inflight);
+        updateConnectionGauges();
+    }
+    releaseGeneration(client_fd);
+    _clientGeneration.erase(client_fd);
+    std::map<int, TlsConnection*>::iterator tls = _tlsClients.find(client_fd);
+    if (tls != _tlsClients.end())
+    {
+        delete tls->second;
+        _tlsClients.erase(tls);
+    }
+    _events.forget(client_fd);
     if (client_fd != -1)
         close(client_fd);
     _poll_fds.erase(_poll_fds.begin() + index);
+
+    std::map<int, Http2Session*>::iterator http2 = _http2Clients.find(client_fd);
+    if (http2 != _http2Clients.end())
+    {
+        for (std::map<CgiSession*, CgiStream>::iterator it = _cgiStreams.begin(); it != _cgiStreams.end();)
+        {
+            std::map<CgiSession*, CgiStream>::iterator stream = it++;
+            if (stream->second.clientFd != client_fd)
+                continue;
+            dropCgiPipes(stream->first);
+            delete stream->first;
+            _cgiStreams.erase(stream);
+        }
+        Http2Session::Exchange exchange;
+        http2->second->abort();
+        while (http2->second->nextClosed(exchange))
+            _clientLimiter.release(exchange.limitSlot);
+        delete http2->second;
+        _http2Clients.erase(http2);
+    }
+    std::map<int, ProxySession*>::iterator proxied = _proxyClients.find(client_fd);
+    if (proxied != _proxyClients.end())
+    {
+        ProxySession* session = proxied->second;
+        _proxyClients.erase(proxied);
+        _proxyUpstreams.erase(session->upstreamFd());
+        removePollFd(session->upstreamFd());
+        close(session->upstreamFd());
+        delete session;
+    }
+    std::map<int, UploadSession*>::iterator upload = _uploads.find(client_fd);
+    if (upload != _uploads.end())
+    {
+        delete upload->second;
+        _uploads.erase(upload);
+    }
+    std::map<int, CgiSession*>::iterator cgi = _cgiClients.find(client_fd);
+    if (cgi != _cgiClients.end())
+    {
+        CgiSession* session = cgi->second;
+        _cgiClients.erase(cgi);
+        dropCgiPipes(session);
+        delete session;
+    }
 }
 
-void Server::stop()
+/* ------------------------------------------------------------------------ */
+/*                                  HTTP/2                                  */
+/* ------------------------------------------------------------------------ */
+
+// h2c starts with the connection preface, taken as prior knowledge when the
+// default server of the port has http2 on, or with an Upgrade: h2c request
+// to a server that has it; proxied requests stay on HTTP/1.1. From then on
+// the session owns the connection: the HTTP/1.1 request state is released
+// and each stream is admitted and pinned on its own.
+bool Server::startHttp2(int clientIndex, std::string& buffer, HttpRequest& request, const ServerConfig& config,
+    bool bodyPending)
 {
-    logMessage("INFO", "Stopping the server...");
-    running = false;
-    cleanupSockets();
-    logMessage("INFO", "Server stopped successfully.");
+    int client_fd = _poll_fds[clientIndex].fd;
+    bool preface = buffer.compare(0, 14, Http2Session::PREFACE, 14) == 0;
+    StringRef settings = request.header("HTTP2-Settings");
+    if (!preface && (bodyPending || settings.empty() || !request.header("Upgrade").contains("h2c")
+        || config.findProxyLocation(request.getPath())))
+        return false;
+
+    Http2Session* session = new Http2Session(client_fd, NULL);
+    Http2Session::Result result = Http2Session::CONTINUE;
+    if (preface)
+        result = session->receive(buffer.data(), buffer.size());
+    else if (!session->upgrade(settings, buffer))
+    {
+        delete session;
+        return false;
+    }
+    _http2Clients[client_fd] = session;
+    _events.manage(client_fd, false, false);
+    finishRequest(client_fd);
+    releaseGeneration(client_fd);
+    _bufferedBytes -= buffer.size();
+    std::string().swap(buffer);
+    if (result == Http2Session::CLOSE || progressHttp2(session) == Http2Session::CLOSE)
+        removeClient(clientIndex);
+    return true;
 }
 
-void Server::signalHandler(int signal)
+// Returns false once the descriptor is not a TLS connection in its
+// handshake. A connection whose ALPN chose h2 goes on as an HTTP/2 session.
+bool Server::handleTlsHandshake(int index)
 {
-    if (signal == SIGINT)
-        signal_received = 1;
-}
\ No newline at end of file
+    int fd = _poll_fds[index].fd;
+    std::map<int, TlsConnection*>::iterator it = _tlsClients.find(fd);
+    if (it == _tlsClients.end() || it->second->established())
+        return false;
+    TlsConnection* tls = it->second;
+    TlsConnection::State state = tls->handshake();
+    if (state == TlsConnection::FAILED)
+    {
+        Metrics::instance().tlsFailed();
+        removeClient(index);
+        return true;
+    }
+    if (state == TlsConnection::HANDSHAKE)
+    {
+        _poll_fds[index].events = tls->events();
+        return true;
+    }
+    Metrics::instance().tlsHandshake(tls->resumed(), tls->kernelSend());
+    _poll_fds[index].events = POLLIN;
+    if (tls->http2())
+    {
+        Http2Session* session = new Http2Session(fd, tls);
+        _http2Clients[fd] = session;
+        if (progressHttp2(session) == Http2Session::CLOSE)
+            removeClient(index);
+    }
+    return true;
+}
+
+RequestTrace* Server::traceFor(int fd)
+{
+    if (!Tracer::instance().enabled())
+        return NULL;
+    std::map<int, InFlight>::iterator it = _inflight.find(fd);
+    return it != _inflight.end() && it->second.trace.active() ? &it->second.trace : NULL;
+}
+
+TlsConnection* Server::tlsFor(int fd) const
+{
+    std::map<int, TlsConnection*>::const_iterator it = _tlsClients.find(fd);
+    return it == _tlsClients.end() ? NULL : it->second;
+}
+
+// Records OpenSSL has already taken off a socket are invisible to poll().
+bool Server::tlsBuffered() const
+{
+    for (std::map<int, TlsConnection*>::const_iterator it = _tlsClients.begin(); it != _tlsClients.end(); ++it)
+        if (it->second->pending())
+            return true;
+    return false;
+}
+
+void Server::markTlsReadable()
+{
+    for (size_t i = 0; i < _poll_fds.size(); ++i)
+    {
+        if (!(_poll_fds[i].events & POLLIN))
+            continue;
+        TlsConnection* tls = tlsFor(_poll_fds[i].fd);
+        if (tls && tls->pending())
+            _poll_fds[i].revents |= POLLIN;
+    }
+}
+
+// Returns false if the descriptor is not an HTTP/2 connection.
+bool Server::handleHttp2Event(int index)
+{
+    std::map<int, Http2Session*>::iterator it = _http2Clients.find(_poll_fds[index].fd);
+    if (it == _http2Clients.end())
+        return false;
+    Http2Session* session = it->second;
+    Http2Session::Result result = Http2Session::CONTINUE;
+    if (_poll_fds[index].revents & (POLLIN | POLLHUP | POLLERR))
+        result = session->readable();
+    if (result == Http2Session::CLOSE || progressHttp2(session) == Http2Session::CLOSE)
+        removeClient(index);
+    return true;
+}
+
+// Hands every complete request to the handlers, then sends what the session
+// has framed. The connection holds its generation while a stream is open.
+Http2Session::Result Server::progressHttp2(Http2Session* session)
+{
+    uint32_t streamId;
+    while (const std::string* raw = session->nextRequest(streamId))
+        handleHttp2Request(*session, streamId, *raw);
+    Http2Session::Result result = session->writable();
+    endHttp2Streams(session);
+    if (!session->busy())
+        releaseGeneration(session->clientFd());
+    return result;
+}
+
+// A stream goes through the routing, limits and handlers an HTTP/1.1
+// request does. The generation pinned by the first open stream stays until
+// the last one closes, so a reload never swaps it under a waiting stream.
+// Proxied locations are not bridged: HTTP_1_1_REQUIRED makes the client
+// retry them over HTTP/1.1.
+void Server::handleHttp2Request(Http2Session& session, uint32_t streamId, const std::string& raw)
+{
+    int client_fd = session.clientFd();
+    if (!_clientGeneration[client_fd])
+        pinGeneration(client_fd);
+    ConfigGeneration* generation = _clientGeneration[client_fd];
+    HttpRequest request(raw, session.arena(streamId));
+    StringRef hostHeader = request.header("Host");
+    ServerConfig* config = matchConfig(generation->configs, generation->index, hostHeader.data, hostHeader.length,
+        localPort(client_fd));
+    try {
+        ResponseBuilder response;
+        if (!config)
+            response = HttpRequest::generateDefaultErrorPage(421);
+        else if (config->findProxyLocation(request.getPath()))
+        {
+            session.reset(streamId, Http2Session::HTTP_1_1_REQUIRED);
+            return;
+        }
+        else
+        {
+            const ServerLocation* location = config->findLocation(request.getPath());
+            Http2Session::Exchange& exchange = session.exchange(streamId);
+            exchange.histogram = location ? location->getLatencyHistogram() : config->getLatencyHistogram();
+            InFlight admission = _inflight[client_fd];
+            admission.limitSlot = -1;
+            unsigned long retryAfter = _settings.limits.retryAfter;
+            int limited = admitRequest(admission, *config, location, retryAfter);
+            exchange.limitSlot = admission.limitSlot;
+            response = limited ? limitedResponse(limited, retryAfter) : request.handleRequest(*config);
+            if (CgiSession* cgi = request.takeCgiSession())
+            {
+                startCgi(client_fd, streamId, request, cgi);
+                return;
+            }
+            if (CacheFill* fill = request.takeCacheFill())
+                startCacheFill(fill);
+            unsigned long lockTimeoutUs;
+            const std::string& cacheWait = request.cacheWait(lockTimeoutUs);
+            if (!cacheWait.empty())
+            {
+                waitForCacheFill(client_fd, streamId, request, *config, cacheWait, lockTimeoutUs);
+                return;
+            }
+        }
+        response.finish();
+        Metrics::instance().requestCompleted(response.getStatusCode());
+        logAccess(client_fd, request, response);
+        session.respond(streamId, response);
+    }
+    catch (const std::exception& e) {
+        logMessage("ERROR", "Failed to handle stream " + intToString(streamId) + " for client " + intToString(client_fd));
+        if (session.streamOpen(streamId))
+            session.reset(streamId, Http2Session::INTERNAL_ERROR);
+    }
+}
+
+// Records the latency of the streams that closed and frees their limit_conn
+// slots.
+void Server::endHttp2Streams(Http2Session* session)
+{
+    Http2Session::Exchange exchange;
+    while (session->nextClosed(exchange))
+    {
+        if (exchange.histogram)
+            exchange.histogram->record(Metrics::nowMicros() - exchange.startUs);
+        _clientLimiter.release(exchange.limitSlot);
+    }
+    if (pollfd* entry = pollFor(session->clientFd()))
+        entry->events = session->events();
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                 Uploads                                  */
+/* ------------------------------------------------------------------------ */
+
+// body and length are the bytes of the body that were read with the head.
+void Server::startUpload(int client_fd, HttpRequest& request, UploadSession* session, const char* body, size_t length)
+{
+    session->logFields() = LogFields(request);
+    _uploads[client_fd] = session;
+    _events.manage(client_fd, false, false);
+    if (RequestTrace* trace = traceFor(client_fd))
+        trace->mark();
+
+    UploadSession::Result result = session->start(body, length);
+    if (result != UploadSession::CONTINUE)
+        endUpload(session, result);
+}
+
+// Returns false if the descriptor is not a client sending an upload.
+bool Server::handleUploadEvent(int index)
+{
+    std::map<int, UploadSession*>::iterator it = _uploads.find(_poll_fds[index].fd);
+    if (it == _uploads.end())
+        return false;
+    short revents = _poll_fds[index].revents;
+    UploadSession::Result result = UploadSession::CONTINUE;
+    if (revents & POLLIN)
+        result = it->second->readable();
+    else if (revents & (POLLERR | POLLHUP))
+        result = UploadSession::CLIENT_GONE;
+    if (result != UploadSession::CONTINUE)
+        endUpload(it->second, result);
+    return true;
+}
+
+void Server::endUpload(UploadSession* session, UploadSession::Result result)
+{
+    int client_fd = session->clientFd();
+    _uploads.erase(client_fd);
+    if (RequestTrace* trace = traceFor(client_fd))
+        trace->span(RequestTrace::UPLOAD, trace->markedUs());
+    if (result == UploadSession::CLIENT_GONE)
+    {
+        logAccess(client_fd, session->logFields(), 499, 0);
+        delete session;
+        for (size_t i = 0; i < _poll_fds.size(); ++i)
+        {
+            if (_poll_fds[i].fd == client_fd)
+            {
+                removeClient(i);
+                break;
+            }
+        }
+        return;
+    }
+    ResponseBuilder& response = session->response();
+    response.finish();
+    Metrics::instance().requestCompleted(response.getStatusCode());
+    logAccess(client_fd, session->logFields(), response.getStatusCode(), response.size());
+    queueResponse(client_fd, response);
+    delete session;
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                   CGI                                    */
+/* ------------------------------------------------------------------------ */
+
+// stream is the HTTP/2 stream the script answers, or 0. The other streams
+// of the connection carry on meanwhile.
+void Server::startCgi(int client_fd, uint32_t stream, HttpRequest& request, CgiSession* session)
+{
+    session->logFields() = LogFields(request);
+    if (stream)
+    {
+        CgiStream& entry = _cgiStreams[session];
+        entry.clientFd = client_fd;
+        entry.stream = stream;
+    }
+    else
+    {
+        _cgiClients[client_fd] = session;
+        _events.manage(client_fd, false, true);
+        if (_events.managesWrites(client_fd))
+            session->sendThrough(&_events);
+        if (RequestTrace* trace = traceFor(client_fd))
+            trace->mark();
+    }
+    _cgiPipes[session->stdinFd()] = session;
+    _cgiPipes[session->stdoutFd()] = session;
+    addPollFd(session->stdinFd(), 0);
+    addPollFd(session->stdoutFd(), 0);
+    cgiProgress(session, session->start());
+}
+
+// Returns false if the descriptor is neither a client waiting on a script
+// nor one of its pipes.
+bool Server::handleCgiEvent(int index)
+{
+    int fd = _poll_fds[index].fd;
+    short revents = _poll_fds[index].revents;
+    std::map<int, CgiSession*>::iterator it = _cgiClients.find(fd);
+    if (it != _cgiClients.end())
+    {
+        cgiProgress(it->second, it->second->clientReady(revents));
+        return true;
+    }
+    it = _cgiPipes.find(fd);
+    if (it == _cgiPipes.end())
+        return false;
+    CgiSession* session = it->second;
+    cgiProgress(session, fd == session->stdinFd() ? session->stdinReady(revents) : session->stdoutReady(revents));
+    return true;
+}
+
+// A pipe the session is done with leaves the poll set before it is closed.
+void Server::cgiProgress(CgiSession* session, CgiSession::Result result)
+{
+    if (result != CgiSession::CONTINUE)
+    {
+        endCgi(session, result);
+        return;
+    }
+    if (session->stdinDone())
+    {
+        _cgiPipes.erase(session->stdinFd());
+        removePollFd(session->stdinFd());
+        session->closeStdin();
+    }
+    if (session->stdoutDone())
+    {
+        _cgiPipes.erase(session->stdoutFd());
+        removePollFd(session->stdoutFd());
+        session->closeStdout();
+    }
+    else if (session->stdoutHungUp() && _cgiPipes.erase(session->stdoutFd()))
+        removePollFd(session->stdoutFd());
+    if (pollfd* client = pollFor(session->clientFd()))
+        client->events = session->clientEvents();
+    if (session->stdinFd() >= 0)
+        if (pollfd* entry = pollFor(session->stdinFd()))
+            entry->events = session->stdinEvents();
+    if (session->stdoutFd() >= 0)
+        if (pollfd* entry = pollFor(session->stdoutFd()))
+            entry->events = session->stdoutEvents();
+}
+
+// A script that finished within its first output is answered through the
+// usual send path; a streamed response has been sent by the session.
+void Server::endCgi(CgiSession* session, CgiSession::Result result)
+{
+    dropCgiPipes(session);
+    std::map<CgiSession*, CgiStream>::iterator streamed = _cgiStreams.find(session);
+    if (streamed != _cgiStreams.end())
+    {
+        CgiStream stream = streamed->second;
+        _cgiStreams.erase(streamed);
+        answerCgiStream(stream, session);
+        delete session;
+        return;
+    }
+    int client_fd = session->clientFd();
+    _cgiClients.erase(client_fd);
+    if (RequestTrace* trace = traceFor(client_fd))
+    {
+        trace->span(RequestTrace::CGI, trace->markedUs());
+        trace->setCgi(session->pid(), session->waitStatus());
+    }
+
+    const LogFields& log = session->logFields();
+    if (result == CgiSession::RESPOND)
+    {
+        ResponseBuilder& response = session->response();
+        response.finish();
+        Metrics::instance().requestCompleted(response.getStatusCode());
+        logAccess(client_fd, log, response.getStatusCode(), response.size());
+        if (pollfd* entry = pollFor(client_fd))
+            entry->events = POLLIN;
+        queueResponse(client_fd, response);
+        delete session;
+        return;
+    }
+    int status = result == CgiSession::CLIENT_GONE ? 499 : session->status();
+    logAccess(client_fd, log, status, session->bytesToClient());
+    bool keepClient = result == CgiSession::DONE && session->clientReusable();
+    delete session;
+    if (result == CgiSession::DONE)
+        Metrics::instance().requestCompleted(status);
+    if (!keepClient)
+    {
+        for (size_t i = 0; i < _poll_fds.size(); ++i)
+        {
+            if (_poll_fds[i].fd == client_fd)
+            {
+                removeClient(i);
+                break;
+            }
+        }
+        return;
+    }
+    finishRequest(client_fd);
+    releaseGeneration(client_fd);
+    if (pollfd* entry = pollFor(client_fd))
+        entry->events = POLLIN;
+}
+
+// A session without a client always ends with RESPOND. A stream reset
+// while the script ran is dropped: its log fields went with its arena.
+void Server::answerCgiStream(const CgiStream& stream, CgiSession* session)
+{
+    std::map<int, Http2Session*>::iterator it = _http2Clients.find(stream.clientFd);
+    if (it == _http2Clients.end() || !it->second->streamOpen(stream.stream))
+        return;
+    ResponseBuilder& response = session->response();
+    response.finish();
+    Metrics::instance().requestCompleted(response.getStatusCode());
+    logAccess(stream.clientFd, session->logFields(), response.getStatusCode(), response.size());
+    it->second->respond(stream.stream, response);
+    endHttp2Streams(it->second);
+}
+
+// The pipes leave the poll set; the session closes them.
+void Server::dropCgiPipes(CgiSession* session)
+{
+    int pipes[2] = { session->stdinFd(), session->stdoutFd() };
+    for (int i = 0; i < 2; ++i)
+    {
+        if (pipes[i] < 0)
+            continue;
+        _cgiPipes.erase(pipes[i]);
+        removePollFd(pipes[i]);
+    }
+}
+
+void Server::expireCgiSessions(unsigned long nowUs)
+{
+    for (std::map<int, CgiSession*>::iterator it = _cgiClients.begin(); it != _cgiClients.end();)
+    {
+        CgiSession* session = (it++)->second;
+        if (session->deadlineUs() && nowUs >= session->deadlineUs())
+            cgiProgress(session, session->expire(nowUs));
+    }
+    for (std::map<CgiSession*, CgiStream>::iterator it = _cgiStreams.begin(); it != _cgiStreams.end();)
+    {
+        CgiSession* session = (it++)->first;
+        if (session->deadlineUs() && nowUs >= session->deadlineUs())
+            cgiProgress(session, session->expire(nowUs));
+    }
+}
+
+// Milliseconds until the first script deadline, or -1.
+int Server::cgiTimeout(unsigned long nowUs) const
+{
+    unsigned long nextUs = 0;
+    for (std::map<int, CgiSession*>::const_iterator it = _cgiClients.begin(); it != _cgiClients.end(); ++it)
+    {
+        unsigned long deadlineUs = it->second->deadlineUs();
+        if (deadlineUs && (!nextUs || deadlineUs < nextUs))
+            nextUs = deadlineUs;
+    }
+    for (std::map<CgiSession*, CgiStream>::const_iterator it = _cgiStreams.begin(); it != _cgiStreams.end(); ++it)
+    {
+        unsigned long deadlineUs = it->first->deadlineUs();
+        if (deadlineUs && (!nextUs || deadlineUs < nextUs))
+            nextUs = deadlineUs;
+    }
+    if (!nextUs)
+        return -1;
+    return nextUs <= nowUs ? 0 : static_cast<int>((nextUs - nowUs + 999) / 1000);
+}
+
+/* ------------------------------------------------------------------------ */
+/*                              Reverse proxy                               */
+/* ------------------------------------------------------------------------ */
+
+// Hop-by-hop headers are not forwarded; Host names the upstream and the
+// client address is appended to X-Forwarded-For.
+static bool isHopByHop(const StringRef& name)
+{
+    static const char* const names[] = {
+        "Host", "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Upgrade", "Expect", "X-Forwarded-For"
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    {
+        if (name.equalsIgnoreCase(names[i]))
+            return true;
+    }
+    return false;
+}
+
+// Takes over the connection until the response has been relayed. buffer
+// holds the head and whatever part of the body has arrived; the rest is
+// read from the client as the upstream accepts it.
+void Server::startProxy(int client_fd, HttpRequest& request, const ServerLocation& location, const std::string& buffer)
+{
+    if (RequestTrace* trace = traceFor(client_fd))
+        trace->mark();
+    if (!request.header("Transfer-Encoding").empty())
+    {
+        ResponseBuilder response = HttpRequest::generateDefaultErrorPage(411);
+        response.finish();
+        Metrics::instance().requestCompleted(411);
+        logAccess(client_fd, request, response);
+        queueResponse(client_fd, response);
+        return;
+    }
+
+    UpstreamGroup* group = location.getUpstream();
+    unsigned long nowUs = Metrics::nowMicros();
+    Upstream* upstream = group->select(request.getPathRef(), nowUs);
+    if (!upstream)
+    {
+        logMessage("ERROR", "No live upstreams in " + group->name());
+        Metrics::instance().upstreamFailed();
+        ResponseBuilder response = HttpRequest::generateDefaultErrorPage(502);
+        response.finish();
+        Metrics::instance().requestCompleted(502);
+        logAccess(client_fd, request, response);
+        queueResponse(client_fd, response);
+        return;
+    }
+    bool reused = false;
+    int upstream_fd;
+    while ((upstream_fd = upstream->takeIdle()) >= 0)
+    {
+        char next;
+        if (recv(upstream_fd, &next, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            _idleUpstreams.erase(upstream_fd);
+            reused = true;
+            break;
+        }
+        closeIdleUpstream(upstream_fd);
+    }
+    if (upstream_fd < 0)
+    {
+        upstream_fd = upstream->connect();
+        if (upstream_fd < 0)
+        {
+            logMessage("ERROR", "Cannot connect to upstream " + upstream->name());
+            Metrics::instance().upstreamFailed();
+            if (group->failed(upstream, nowUs))
+                logMessage("WARNING", "Upstream " + upstream->name() + " in " + group->name() + " marked down");
+            ResponseBuilder response = HttpRequest::generateDefaultErrorPage(502);
+            response.finish();
+            Metrics::instance().requestCompleted(502);
+            logAccess(client_fd, request, response);
+            queueResponse(client_fd, response);
+            return;
+        }
+        addPollFd(upstream_fd, 0);
+    }
+    Metrics::instance().upstreamConnection(reused);
+
+    ProxySession* session = new ProxySession(client_fd, tlsFor(client_fd), group, upstream, upstream_fd, reused,
+        request.getMethodRef() == "HEAD", location.getProxyConnectTimeoutUs(), location.getProxyReadTimeoutUs());
+    LogFields& log = session->logFields();
+    log = LogFields(request);
+
+    StringRef target = request.getPathRef();
+    const std::string& prefix = location.getPath();
+    std::string& head = session->requestBuffer();
+    head.append(log.method.data, log.method.length);
+    head += ' ';
+    if (location.getProxyUri().empty())
+        head.append(target.data, target.length);
+    else
+    {
+        head += location.getProxyUri();
+        head.append(target.data + prefix.size(), target.length - prefix.size());
+    }
+    head += " HTTP/1.1\r\nHost: ";
+    head += group->name();
+    head += "\r\n";
+    StringRef forwardedFor;
+    for (size_t i = 0; i < request.getHeaderCount(); ++i)
+    {
+        const StringRef& name = request.getHeaderName(i);
+        if (name.equalsIgnoreCase("X-Forwarded-For"))
+            forwardedFor = request.getHeaderValue(i);
+        if (isHopByHop(name))
+            continue;
+        head.append(name.data, name.length);
+        head += ": ";
+        head.append(request.getHeaderValue(i).data, request.getHeaderValue(i).length);
+        head += "\r\n";
+    }
+    head += "X-Forwarded-For: ";
+    if (!forwardedFor.empty())
+    {
+        head.append(forwardedFor.data, forwardedFor.length);
+        head += ", ";
+    }
+    std::map<int, std::string>::const_iterator address = _clientAddresses.find(client_fd);
+    head += address != _clientAddresses.end() ? address->second : "unknown";
+    head += "\r\nConnection: keep-alive\r\n\r\n";
+
+    unsigned long bodyLength = request.contentLength();
+    size_t available = std::min<unsigned long>(buffer.size() - request.getHeadLength(), bodyLength);
+    head.append(buffer, request.getHeadLength(), available);
+    session->expectBody(bodyLength - available);
+
+    _proxyClients[client_fd] = session;
+    _proxyUpstreams[upstream_fd] = session;
+    _events.manage(client_fd, false, false);
+    proxyProgress(session, reused ? session->upstreamReady(POLLOUT) : ProxySession::CONTINUE);
+}
+
+// Client sockets of proxied requests, upstream sockets and idle pooled
+// connections are all handled here. Returns false for anything else.
+bool Server::handleProxyEvent(int index)
+{
+    int fd = _poll_fds[index].fd;
+    short revents = _poll_fds[index].revents;
+
+    std::map<int, ProxySession*>::iterator it = _proxyClients.find(fd);
+    if (it != _proxyClients.end())
+    {
+        ProxySession* session = it->second;
+        ProxySession::Result result = ProxySession::CONTINUE;
+        if ((revents & POLLERR) || ((revents & POLLHUP) && !(revents & POLLIN)))
+            result = ProxySession::CLIENT_GONE;
+        if (result == ProxySession::CONTINUE && (revents & POLLIN))
+            result = session->clientReadable();
+        if (result == ProxySession::CONTINUE && (revents & POLLOUT))
+            result = session->clientWritable();
+        proxyProgress(session, result);
+        return true;
+    }
+    it = _proxyUpstreams.find(fd);
+    if (it != _proxyUpstreams.end())
+    {
+        proxyProgress(it->second, it->second->upstreamReady(revents));
+        return true;
+    }
+    if (_idleUpstreams.find(fd) != _idleUpstreams.end())
+    {
+        // An idle upstream connection only becomes readable when it closes.
+        closeIdleUpstream(fd);
+        return true;
+    }
+    std::map<int, HealthProbe*>::iterator probe = _probes.find(fd);
+    if (probe != _probes.end())
+    {
+        if (probe->second->handle(revents))
+            endProbe(probe->second);
+        else
+            _poll_fds[index].events = probe->second->events();
+        return true;
+    }
+    return false;
+}
+
+void Server::proxyProgress(ProxySession* session, ProxySession::Result result)
+{
+    if (result != ProxySession::CONTINUE)
+    {
+        endProxy(session, result);
+        return;
+    }
+    if (pollfd* client = pollFor(session->clientFd()))
+        client->events = session->clientEvents();
+    if (pollfd* upstream = pollFor(session->upstreamFd()))
+        upstream->events = session->upstreamEvents();
+}
+
+// The upstream connection goes back to the pool when both messages ended on
+// their framing. The client stays open for its next request unless the
+// response was delimited by a close or part of the request body is still
+// unread; an upstream that failed before answering becomes a 502, one that
+// timed out a 504. Both count against the server's max_fails.
+void Server::endProxy(ProxySession* session, ProxySession::Result result)
+{
+    int client_fd = session->clientFd();
+    int upstream_fd = session->upstreamFd();
+    Upstream* upstream = session->upstream();
+    _proxyClients.erase(client_fd);
+    if (RequestTrace* trace = traceFor(client_fd))
+        trace->span(RequestTrace::PROXY, trace->markedUs());
+    _proxyUpstreams.erase(upstream_fd);
+
+    if (result == ProxySession::DONE && session->upstreamReusable() && upstream->keepIdle(upstream_fd))
+    {
+        _idleUpstreams[upstream_fd] = upstream;
+        if (pollfd* entry = pollFor(upstream_fd))
+            entry->events = POLLIN;
+    }
+    else
+    {
+        removePollFd(upstream_fd);
+        close(upstream_fd);
+    }
+
+    bool upstreamError = result == ProxySession::UPSTREAM_FAILED || result == ProxySession::UPSTREAM_TIMED_OUT;
+    bool badGateway = upstreamError && !session->responseStarted();
+    int gatewayStatus = result == ProxySession::UPSTREAM_TIMED_OUT ? 504 : 502;
+    if (upstreamError)
+    {
+        logMessage("ERROR", "Upstream " + upstream->name() + (result == ProxySession::UPSTREAM_TIMED_OUT
+            ? " timed out" : " failed") + " for client " + intToString(client_fd));
+        Metrics::instance().upstreamFailed();
+    }
+    if (badGateway && session->group()->failed(upstream, Metrics::nowMicros()))
+        logMessage("WARNING", "Upstream " + upstream->name() + " in " + session->group()->name() + " marked down");
+    else if (result == ProxySession::DONE)
+        upstream->succeeded();
+    int status = badGateway ? gatewayStatus : result == ProxySession::CLIENT_GONE ? 499 : session->status();
+    logAccess(client_fd, session->logFields(), status, session->bytesToClient());
+    bool keepClient = result == ProxySession::DONE && session->clientReusable();
+    delete session;
+
+    if (badGateway)
+    {
+        ResponseBuilder response = HttpRequest::generateDefaultErrorPage(gatewayStatus);
+        response.finish();
+        Metrics::instance().requestCompleted(gatewayStatus);
+        queueResponse(client_fd, response);
+        if (pollfd* entry = pollFor(client_fd))
+            entry->events = POLLIN | POLLOUT;
+        return;
+    }
+    if (result == ProxySession::DONE)
+        Metrics::instance().requestCompleted(status);
+    if (!keepClient)
+    {
+        for (size_t i = 0; i < _poll_fds.size(); ++i)
+        {
+            if (_poll_fds[i].fd == client_fd)
+            {
+                removeClient(i);
+                break;
+            }
+        }
+        return;
+    }
+    finishRequest(client_fd);
+    releaseGeneration(client_fd);
+    if (pollfd* entry = pollFor(client_fd))
+        entry->events = POLLIN;
+}
+
+void Server::expireProxySessions(unsigned long nowUs)
+{
+    for (std::map<int, ProxySession*>::iterator it = _proxyClients.begin(); it != _proxyClients.end();)
+    {
+        ProxySession* session = (it++)->second;
+        if (session->deadlineUs() && nowUs >= session->deadlineUs())
+            proxyProgress(session, session->expire(nowUs));
+    }
+}
+
+// Milliseconds until the first upstream deadline, or -1.
+int Server::proxyTimeout(unsigned long nowUs) const
+{
+    unsigned long nextUs = 0;
+    for (std::map<int, ProxySession*>::const_iterator it = _proxyClients.begin(); it != _proxyClients.end(); ++it)
+    {
+        unsigned long deadlineUs = it->second->deadlineUs();
+        if (deadlineUs && (!nextUs || deadlineUs < nextUs))
+            nextUs = deadlineUs;
+    }
+    if (!nextUs)
+        return -1;
+    return nextUs <= nowUs ? 0 : static_cast<int>((nextUs - nowUs + 999) / 1000);
+}
+
+// Starts the probes that are due for the current generation's groups and
+// fails the ones past their deadline. One probe per server at a time, every
+// interval.
+void Server::runHealthChecks(unsigned long nowUs)
+{
+    for (std::map<int, HealthProbe*>::iterator it = _probes.begin(); it != _probes.end();)
+    {
+        HealthProbe* probe = (it++)->second;
+        if (nowUs >= probe->deadlineUs())
+            endProbe(probe);
+    }
+
+    const std::vector<UpstreamGroup*>& groups = _generation->upstreams;
+    for (size_t g = 0; g < groups.size(); ++g)
+    {
+        UpstreamGroup* group = groups[g];
+        unsigned long intervalUs = group->healthCheckIntervalUs();
+        if (!intervalUs)
+            continue;
+        for (size_t p = 0; p < group->size(); ++p)
+        {
+            UpstreamGroup::Peer& peer = group->peer(p);
+            if (peer.probing || nowUs < peer.nextProbeUs)
+                continue;
+            peer.nextProbeUs = nowUs + intervalUs;
+            int fd = peer.server->connect();
+            HealthProbe* probe = new HealthProbe(group, p, fd, nowUs + intervalUs);
+            peer.probing = true;
+            if (fd < 0)
+            {
+                endProbe(probe);
+                continue;
+            }
+            _probes[fd] = probe;
+            addPollFd(fd, probe->events());
+        }
+    }
+}
+
+// Milliseconds until runHealthChecks has something to do, or -1.
+int Server::healthCheckTimeout(unsigned long nowUs) const
+{
+    unsigned long nextUs = 0;
+    bool any = false;
+    const std::vector<UpstreamGroup*>& groups = _generation->upstreams;
+    for (size_t g = 0; g < groups.size(); ++g)
+    {
+        if (!groups[g]->healthCheckIntervalUs())
+            continue;
+        for (size_t p = 0; p < groups[g]->size(); ++p)
+        {
+            const UpstreamGroup::Peer& peer = groups[g]->peer(p);
+            if (peer.probing)
+                continue;
+            if (!any || peer.nextProbeUs < nextUs)
+                nextUs = peer.nextProbeUs;
+            any = true;
+        }
+    }
+    for (std::map<int, HealthProbe*>::const_iterator it = _probes.begin(); it != _probes.end(); ++it)
+    {
+        if (!any || it->second->deadlineUs() < nextUs)
+            nextUs = it->second->deadlineUs();
+        any = true;
+    }
+    if (!any)
+        return -1;
+    return nextUs <= nowUs ? 0 : static_cast<int>((nextUs - nowUs + 999) / 1000);
+}
+
+void Server::endProbe(HealthProbe* probe)
+{
+    Upstream* server = probe->server();
+    if (server->probed(probe->healthy()))
+        logMessage(probe->healthy() ? "INFO" : "WARNING", "Health check: upstream " + server->name()
+            + (probe->healthy() ? " is up" : " is down"));
+    probe->peer().probing = false;
+    if (probe->fd() >= 0)
+    {
+        _probes.erase(probe->fd());
+        removePollFd(probe->fd());
+        close(probe->fd());
+    }
+    delete probe;
+}
+
+/* --- cgi_cache fills --- */
+
+void Server::startCacheFill(CacheFill* fill)
+{
+    _cacheFills[fill->fd()] = fill;
+    _fillsByKey[fill->key()] = fill;
+    addPollFd(fill->fd(), POLLIN);
+}
+
+// The response to a cgi_cache miss comes from the run filling its key. The
+// connection is not read from until then; past the lock timeout it is
+// answered with 504 instead.
+void Server::waitForCacheFill(int client_fd, uint32_t stream, HttpRequest& request, const ServerConfig& config,
+    const std::string& key, unsigned long lockTimeoutUs)
+{
+    std::map<std::string, CacheFill*>::iterator fill = _fillsByKey.find(key);
+    CacheWaiters::iterator it = _cacheWaiters.insert(std::make_pair(client_fd, CacheWaiter()));
+    CacheWaiter& waiter = it->second;
+    waiter.stream = stream;
+    waiter.fill = fill == _fillsByKey.end() ? NULL : fill->second;
+    waiter.deadlineUs = Metrics::nowMicros() + lockTimeoutUs;
+    waiter.gzip = request.gzipPolicy(config, waiter.gzipAccepted);
+    waiter.log = LogFields(request);
+    if (!waiter.fill)
+    {
+        answerCacheWaiter(it, HttpRequest::generateDefaultErrorPage(500));
+        return;
+    }
+    // The other streams of an HTTP/2 connection carry on meanwhile.
+    if (pollfd* entry = stream ? NULL : pollFor(client_fd))
+        entry->events = 0;
+}
+
+// An HTTP/2 stream reset while it waited is dropped: its log fields went
+// with its arena.
+void Server::answerCacheWaiter(CacheWaiters::iterator waiter, ResponseBuilder response)
+{
+    int client_fd = waiter->first;
+    uint32_t stream = waiter->second.stream;
+    Http2Session* session = stream ? _http2Clients[client_fd] : NULL;
+    if (session && !session->streamOpen(stream))
+    {
+        _cacheWaiters.erase(waiter);
+        return;
+    }
+    response.finish();
+    Metrics::instance().requestCompleted(response.getStatusCode());
+    logAccess(client_fd, waiter->second.log, response.getStatusCode(), response.size());
+    _cacheWaiters.erase(waiter);
+    if (session)
+    {
+        session->respond(stream, response);
+        endHttp2Streams(session);
+        return;
+    }
+    if (pollfd* entry = pollFor(client_fd))
+        entry->events = POLLIN;
+    queueResponse(client_fd, response);
+}
+
+bool Server::handleCacheFill(int index)
+{
+    int fd = _poll_fds[index].fd;
+    std::map<int, CacheFill*>::iterator it = _cacheFills.find(fd);
+    if (it != _cacheFills.end())
+    {
+        if (it->second->readOutput())
+            endCacheFill(it->second, true);
+        return true;
+    }
+    // A waiting client is polled for nothing, so this is a hangup.
+    if (_cacheWaiters.find(fd) != _cacheWaiters.end())
+    {
+        removeClient(index);
+        return true;
+    }
+    return false;
+}
+
+// Every client waiting on the fill gets a copy of the same response, or of
+// its gzip variant: each variant is built once, however many clients take it.
+void Server::endCacheFill(CacheFill* fill, bool finished)
+{
+    _cacheFills.erase(fill->fd());
+    _fillsByKey.erase(fill->key());
+    removePollFd(fill->fd());
+    ResponseBuilder variants[3];                 // no gzip, gzip not accepted, gzip
+    bool built[3] = { false, false, false };
+    if (!finished)
+    {
+        fill->abandon();
+        Metrics::instance().cgiTimedOut();
+        logMessage("WARNING", "cgi_cache run for " + fill->key() + " timed out");
+        variants[0] = HttpRequest::generateDefaultErrorPage(504);
+    }
+    else if (!fill->finish())
+        logMessage("WARNING", "cgi_cache run for " + fill->key() + " failed, not stored");
+    for (CacheWaiters::iterator it = _cacheWaiters.begin(); it != _cacheWaiters.end();)
+    {
+        CacheWaiters::iterator waiter = it++;
+        if (waiter->second.fill != fill)
+            continue;
+        const GzipPolicy* gzip = waiter->second.gzip;
+        size_t variant = !finished || !gzip ? 0 : waiter->second.gzipAccepted ? 2 : 1;
+        if (finished && !built[variant])
+        {
+            fill->output().build(variants[variant], gzip, waiter->second.gzipAccepted);
+            variants[variant].header("X-Cache-Status", "MISS");
+            built[variant] = true;
+        }
+        answerCacheWaiter(waiter, variants[variant]);
+    }
+    delete fill;
+}
+
+void Server::expireCacheFills(unsigned long nowUs)
+{
+    for (std::map<int, CacheFill*>::iterator it = _cacheFills.begin(); it != _cacheFills.end();)
+    {
+        CacheFill* fill = (it++)->second;
+        if (nowUs >= fill->deadlineUs())
+            endCacheFill(fill, false);
+    }
+    for (CacheWaiters::iterator it = _cacheWaiters.begin(); it != _cacheWaiters.end();)
+    {
+        CacheWaiters::iterator waiter = it++;
+        if (nowUs >= waiter->second.deadlineUs)
+            answerCacheWaiter(waiter, HttpRequest::generateDefaultErrorPage(504));
+    }
+}
+
+// Milliseconds until the first fill or lock deadline, or -1.
+int Server::cacheFillTimeout(unsigned long nowUs) const
+{
+    if (_cacheFills.empty())
+        return -1;
+    unsigned long nextUs = _cacheFills.begin()->second->deadlineUs();
+    for (std::map<int, CacheFill*>::const_iterator it = _cacheFills.begin(); it != _cacheFills.end(); ++it)
+        nextUs = std::min(nextUs, it->second->deadlineUs());
+    for (CacheWaiters::const_iterator it = _cacheWaiters.begin(); it != _cacheWaiters.end(); ++it)
+        nextUs = std::min(nextUs, it->second.deadlineUs);
+    return nextUs <= nowUs ? 0 : static_cast<int>((nextUs - nowUs + 999) / 1000);
+}
+
+void Server::closeIdleUpstream(int upstream_fd)
+{
+    std::map<int, Upstream*>::iterator it = _idleUpstreams.find(upstream_fd);
+    if (it != _idleUpstreams.end())
+    {
+        it->second->forget(upstream_fd);
+        _idleUpstreams.erase(it);
+    }
+    removePollFd(upstream_fd);
+    close(upstream_fd);
+}
+
+pollfd* Server::pollFor(int fd)
+{
+    for (size_t i = 0; i < _poll_fds.size(); ++i)
+    {
+        if (_poll_fds[i].fd == fd)
+            return &_poll_fds[i];
+    }
+    return NULL;
+}
+
+void Server::addPollFd(int fd, short events)
+{
+    struct pollfd entry = {};
+    entry.fd = fd;
+    entry.events = events;
+    _poll_fds.push_back(entry);
+}
+
+void Server::removePollFd(int fd)
+{
+    _events.forget(fd);
+    for (size_t i = 0; i < _poll_fds.size(); ++i)
+    {
+        if (_poll_fds[i].fd == fd)
+        {
+            _poll_fds.erase(_poll_fds.begin() + i);
+            return;
+        }
+    }
+}
+
+void Server::stop()
+{
+    logMessage("INFO", "Stopping the server...");
+    running = false;
+    cleanupSockets();
+    logMessage("INFO", "Server stopped successfully.");
+}
+
+void Server::signalHandler(int signal)
+{
+    if (signal == SIGINT || signal == SIGTERM)
+        signal_received = 1;
+    else if (signal == SIGHUP)
+        reload_requested = 1;
+    else if (signal == SIGUSR2)
+        upgrade_requested = 1;
+    else if (signal == SIGQUIT)
+        drain_requested = 1;
+}
+
+
+// Listening sockets handed over by the process that exec'd us, as
+// "fd=host:port;" entries. The variable is removed so CGI children and a
+// later upgrade never see stale descriptors.
+void Server::adoptInheritedSockets()
+{
+    const char* inherited = std::getenv("WEBSERV_LISTEN_FDS");
+    const char* parent = std::getenv("WEBSERV_UPGRADE_PARENT");
+
+    if (parent && std::atoi(parent) == getppid())
+        _upgradeParent = getppid();
+    if (inherited)
+    {
+        std::istringstream entries(inherited);
+        std::string entry;
+        while (std::getline(entries, entry, ';'))
+        {
+            size_t equal = entry.find('=');
+            size_t colon = entry.rfind(':');
+            if (equal == std::string::npos || colon == std::string::npos || colon < equal)
+                continue;
+            int fd = std::atoi(entry.substr(0, equal).c_str());
+            int accepting = 0;
+            socklen_t len = sizeof(accepting);
+            if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) < 0 || !accepting)
+            {
+                logMessage("WARNING", "Ignoring inherited descriptor " + entry);
+                continue;
+            }
+            ListenKey key = std::make_pair(entry.substr(equal + 1, colon - equal - 1), std::atoi(entry.c_str() + colon + 1));
+            _inherited[key] = fd;
+        }
+    }
+    unsetenv("WEBSERV_LISTEN_FDS");
+    unsetenv("WEBSERV_UPGRADE_PARENT");
+}
+
+int Server::takeInheritedSocket(const ListenKey& key)
+{
+    std::map<ListenKey, int>::iterator it = _inherited.find(key);
+    if (it == _inherited.end())
+        return -1;
+    int fd = it->second;
+    _inherited.erase(it);
+    return fd;
+}
+
+// SIGUSR2: start the binary found at the original program path with the
+// listening sockets inherited across execve(). This process keeps serving
+// until the new one has adopted them and sends SIGQUIT, so a binary that
+// fails to start costs nothing.
+void Server::upgradeBinary()
+{
+    if (_upgradePid > 0)
+    {
+        logMessage("WARNING", "Binary upgrade already in progress (pid " + intToString(_upgradePid) + ")");
+        return;
+    }
+    if (_programPath.empty() || _draining)
+        return;
+
+    std::string listenFds;
+    for (std::map<ListenKey, int>::iterator it = _listeners.begin(); it != _listeners.end(); ++it)
+        listenFds += intToString(it->second) + "=" + it->first.first + ":" + intToString(it->first.second) + ";";
+
+    std::vector<std::string> environment;
+    for (char** env = environ; *env; ++env)
+    {
+        if (std::strncmp(*env, "WEBSERV_LISTEN_FDS=", 19) && std::strncmp(*env, "WEBSERV_UPGRADE_PARENT=", 23))
+            environment.push_back(*env);
+    }
+    environment.push_back("WEBSERV_LISTEN_FDS=" + listenFds);
+    environment.push_back("WEBSERV_UPGRADE_PARENT=" + intToString(getpid()));
+
+    std::vector<char*> envp;
+    for (size_t i = 0; i < environment.size(); ++i)
+        envp.push_back(const_cast<char*>(environment[i].c_str()));
+    envp.push_back(NULL);
+    char* argv[] = { const_cast<char*>(_programPath.c_str()), const_cast<char*>(_configFile.c_str()), NULL };
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        logMessage("ERROR", "Binary upgrade failed: fork() error");
+        return;
+    }
+    if (pid == 0)
+    {
+        for (size_t i = 0; i < _poll_fds.size(); ++i)
+        {
+            if (!isServerSocket(_poll_fds[i].fd))
+                close(_poll_fds[i].fd);
+        }
+        execve(argv[0], argv, &envp[0]);
+        _exit(127);
+    }
+    _upgradePid = pid;
+    logMessage("INFO", "Binary upgrade: started " + _programPath + " as pid " + intToString(pid));
+}
+
+void Server::checkUpgradeChild()
+{
+    int status;
+    if (waitpid(_upgradePid, &status, WNOHANG) != _upgradePid)
+        return;
+    logMessage("ERROR", "Binary upgrade failed: pid " + intToString(_upgradePid) + " exited with status "
+        + intToString(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status)) + ", still serving");
+    _upgradePid = 0;
+}
+
+// SIGQUIT: stop accepting and exit once every open connection is done.
+// Listening sockets are shared with the new process after an upgrade, so
+// closing ours does not refuse anything: pending connections stay queued.
+void Server::beginDrain()
+{
+    if (_draining)
+        return;
+    logMessage("INFO", "Draining " + intToString(_inflight.size()) + " connection(s) before exit");
+    while (!_listeners.empty())
+    {
+        closeListener(_listeners.begin()->second);
+        _listeners.erase(_listeners.begin());
+    }
+    _draining = true;
+    _drainDeadlineUs = Metrics::nowMicros() + DRAIN_TIMEOUT_US;
+}
+
+// Idle keep-alive connections are closed at once; connections with a request
+// or a response in progress are left to finish until the drain deadline.
+bool Server::drainFinished()
+{
+    for (size_t i = _poll_fds.size(); i-- > 0;)
+    {
+        int fd = _poll_fds[i].fd;
+        if (_idleUpstreams.find(fd) != _idleUpstreams.end())
+        {
+            closeIdleUpstream(fd);
+            continue;
+        }
+        if (_proxyUpstreams.find(fd) != _proxyUpstreams.end() || _cacheFills.find(fd) != _cacheFills.end()
+            || _cgiPipes.find(fd) != _cgiPipes.end())
+            continue;
+        if (_probes.find(fd) != _probes.end())
+        {
+            endProbe(_probes[fd]);
+            continue;
+        }
+        std::map<int, Http2Session*>::iterator http2 = _http2Clients.find(fd);
+        if (http2 != _http2Clients.end())
+        {
+            http2->second->goAway();
+            if (progressHttp2(http2->second) == Http2Session::CLOSE)
+                removeClient(i);
+            continue;
+        }
+        std::map<int, InFlight>::iterator inflight = _inflight.find(fd);
+        bool busy = inflight != _inflight.end() && inflight->second.active;
+        char next;
+        if (!busy)
+            busy = recv(fd, &next, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+        if (!busy)
+            removeClient(i);
+    }
+    if (_poll_fds.empty())
+        return true;
+    if (Metrics::nowMicros() >= _drainDeadlineUs)
+    {
+        logMessage("WARNING", "Drain timeout, closing " + intToString(_poll_fds.size()) + " connection(s)");
+        return true;
+    }
+    return false;
+}
@@ -1,16 +1,66 @@
 #include "ServerConfig.hpp"
+#include "Metrics.hpp"
+#include "Bundle.hpp"
+#include "Proxy.hpp"
+#include "UpstreamGroup.hpp"
+#include <cstring>
+#include <set>
+
+// Directive names are matched as prefixes, as find() == 0 did, without
+// searching the rest of the line.
+static bool startsWith(const std::string& line, const char* prefix)
+{
+    return std::strncmp(line.c_str(), prefix, std::strlen(prefix)) == 0;
+}
+
+// Cuts the line [pos, end) of block into line without the characters of
+// trailing at either end, reusing its buffer. False for a blank line.
+static bool trimmedLine(const std::string& block, size_t pos, size_t end, const char* trailing, std::string& line)
+{
+    size_t first = block.find_first_not_of(" \t\r", pos);
+    if (first >= end)
+    {
+        line.clear();
+        return false;
+    }
+    size_t last = block.find_last_not_of(trailing, end - 1);
+    if (last == std::string::npos || last < first)
+    {
+        line.clear();
+        return false;
+    }
+    line.assign(block, first, last + 1 - first);
+    return true;
+}
+
+static std::set<std::string>& readablePaths()
+{
+    static std::set<std::string> paths;
+    return paths;
+}
+
+void ServerConfig::beginConfiguration()
+{
+    readablePaths().clear();
+}
 
-ServerConfig::ServerConfig() : _root("var/www/main"), _index("index.html"), _host("127.0.0.1"), _clientMaxBodySize(100000000)
+// Thousands of blocks share a root and an index page: each path is checked
+// once per parse instead of once per block.
+static bool readable(const std::string& path)
+{
+    if (readablePaths().count(path))
+        return true;
+    if (access(path.c_str(), R_OK) != 0)
+        return false;
+    readablePaths().insert(path);
+    return true;
+}
+
+// Built-in error pages (main/errors/<code>.html) are resolved by getErrorPage
+// instead of being copied into every block: with thousands of server blocks
+// those nine map entries were a large share of startup time.
+ServerConfig::ServerConfig() : _root("var/www/main"), _index("index.html"), _host("127.0.0.1"), _clientMaxBodySize(100000000), _latency(NULL), _http2(false), _uploadTmpfile(false)
 {
-    setErrorPage(404, ("main/errors/404.html"));
-    setErrorPage(500, ("main/errors/500.html"));
-    setErrorPage(504, ("main/errors/504.html"));
-    setErrorPage(411, ("main/errors/411.html"));
-    setErrorPage(400, ("main/errors/400.html"));
-    setErrorPage(403, ("main/errors/403.html"));
-    setErrorPage(405, ("main/errors/405.html"));
-    setErrorPage(413, ("main/errors/413.html"));
-    setErrorPage(415, ("main/errors/415.html"));
 }
 
 void ServerConfig::parseServerBlock(const std::string& serverBlock)
@@ -20,6 +70,7 @@ void ServerConfig::parseServerBlock(const std::string& serverBlock)
 
     bool hasListen = false;
     bool hasRoot = false;
+    std::string line;
 
     while (pos < serverBlock.size())
     {
@@ -27,10 +78,7 @@ void ServerConfig::parseServerBlock(const std::string& serverBlock)
         if (end == std::string::npos)
             end = serverBlock.size();
 
-        std::string line = serverBlock.substr(pos, end - pos);
-
-        line.erase(0, line.find_first_not_of(" \t\r"));
-        line.erase(line.find_last_not_of(" \t\r") + 1);
+        trimmedLine(serverBlock, pos, end, " \t\r", line);
 
         if (line.empty() || line[0] == '#' || line == "server {" || line == "}") 
         {
@@ -38,7 +86,7 @@ void ServerConfig::parseServerBlock(const std::string& serverBlock)
             continue;
         }
 
-        if (line.find("listen") == 0)
+        if (startsWith(line, "listen"))
         {
             std::string value = line.substr(6);
             value.erase(0, value.find_first_not_of(" \t"));
@@ -47,14 +95,49 @@ void ServerConfig::parseServerBlock(const std::string& serverBlock)
             if (value.empty())
                 throw std::runtime_error("Error: Missing value for 'listen'");
 
-            int port = std::atoi(value.c_str());
-            if (port <= 0 || port > 65535)
-                throw std::runtime_error("Error: Invalid port value '" + value + "'");
+            // <port>, <ipv4>:<port>, [<ipv6>]:<port> or unix:<path>
+            size_t split = value.find_first_of(" \t");
+            std::string address = value.substr(0, split);
+            std::string flag;
+            size_t flagStart = value.find_first_not_of(" \t", split);
+            if (split != std::string::npos && flagStart != std::string::npos)
+                flag = value.substr(flagStart, value.find_first_of(" \t", flagStart) - flagStart);
+            std::string listenHost;
+            std::string portText = address;
+            int port;
+            if (address.compare(0, 5, "unix:") == 0)
+            {
+                if (address.size() == 5 || address.size() - 5 >= 108)
+                    throw std::runtime_error("Error: Invalid unix socket path '" + value + "'");
+                listenHost = address;
+                port = unixSocketPort(address.substr(5));
+            }
+            else
+            {
+                size_t colon = address.rfind(':');
+                if (colon != std::string::npos)
+                {
+                    listenHost = address.substr(0, colon);
+                    portText = address.substr(colon + 1);
+                    if (listenHost.size() > 2 && listenHost[0] == '[' && listenHost[listenHost.size() - 1] == ']')
+                        listenHost = listenHost.substr(1, listenHost.size() - 2);
+                    if (!isValidIP(listenHost))
+                        throw std::runtime_error("Error: Invalid listen address '" + value + "'");
+                }
+                port = std::atoi(portText.c_str());
+                if (port <= 0 || port > 65535)
+                    throw std::runtime_error("Error: Invalid port value '" + value + "'");
+            }
+            if (!flag.empty() && flag != "ssl")
+                throw std::runtime_error("Error: Unknown parameter '" + flag + "' for 'listen'");
 
             _ports.push_back(port);
+            _listenHosts.push_back(listenHost);
+            if (flag == "ssl")
+                _sslPorts.push_back(port);
             hasListen = true;
         }
-        else if (line.find("root") == 0)
+        else if (startsWith(line, "root"))
         {
             std::string value = line.substr(4);
             value.erase(0, value.find_first_not_of(" \t"));
@@ -66,7 +149,7 @@ void ServerConfig::parseServerBlock(const std::string& serverBlock)
             _root = value;
             hasRoot = true;
         }
-        else if (line.find("index") == 0)
+        else if (startsWith(line, "index"))
         {
             std::string value = line.substr(5);
             value.erase(0, value.find_first_not_of(" \t"));
@@ -77,7 +160,7 @@ void ServerConfig::parseServerBlock(const std::string& serverBlock)
 
             _index = value;
         }
-        else if (line.find("server_name") == 0)
+        else if (startsWith(line, "server_name"))
         {
             std::string value = line.substr(11);
             value.erase(0, value.find_first_not_of(" \t"));
@@ -88,7 +171,7 @@ void ServerConfig::parseServerBlock(const std::string& serverBlock)
 
             _serverName = value;
         }
-        else if (line.find("host") == 0)
+        else if (startsWith(line, "host"))
         {
             std::string value = line.substr(4);
             value.erase(0, value.find_first_not_of(" \t"));
@@ -99,7 +182,7 @@ void ServerConfig::parseServerBlock(const std::string& serverBlock)
 
             setHost(value);
         }
-        else if (line.find("client_max_body_size") == 0)
+        else if (startsWith(line, "client_max_body_size"))
         {
             std::string value = line.substr(20);
             value.erase(0, value.find_first_not_of(" \t"));
@@ -110,12 +193,75 @@ void ServerConfig::parseServerBlock(const std::string& serverBlock)
 
             _clientMaxBodySize = std::strtoul(value.c_str(), NULL, 10);
         }
-        else if (line.find("location") == 0)
+        else if (startsWith(line, "limit_req"))
+        {
+            std::string value = line.substr(9);
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t;") + 1);
+            _clientLimit.parseRequestLimit(value);
+        }
+        else if (startsWith(line, "limit_conn"))
+        {
+            std::string value = line.substr(10);
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t;") + 1);
+            _clientLimit.parseConnectionLimit(value);
+        }
+        else if (startsWith(line, "cgi_cache_vary"))
+        {
+            std::string value = line.substr(14);
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t;") + 1);
+            _cachePolicy.parseVary(value);
+        }
+        else if (startsWith(line, "cgi_cache_lock_timeout"))
+        {
+            std::string value = line.substr(22);
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t;") + 1);
+            _cachePolicy.parseLockTimeout(value);
+        }
+        else if (startsWith(line, "cgi_cache"))
+        {
+            std::string value = line.substr(9);
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t;") + 1);
+            _cachePolicy.parse(value);
+        }
+        else if (startsWith(line, "gzip"))
+        {
+            if (!_gzip.parse(line))
+                throw std::runtime_error("Error: Unknown directive '" + line + "'");
+        }
+        else if (startsWith(line, "ssl_"))
+        {
+            if (!_tls.parse(line))
+                throw std::runtime_error("Error: Unknown directive '" + line + "'");
+        }
+        else if (startsWith(line, "http2"))
+        {
+            std::string value = line.substr(5);
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t;") + 1);
+            if (value != "on" && value != "off")
+                throw std::runtime_error("Error: http2 expects on or off: '" + line + "'");
+            _http2 = value == "on";
+        }
+        else if (startsWith(line, "upload_tmpfile"))
+        {
+            std::string value = line.substr(14);
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t;") + 1);
+            if (value != "on" && value != "off")
+                throw std::runtime_error("Error: upload_tmpfile expects on or off: '" + line + "'");
+            _uploadTmpfile = value == "on";
+        }
+        else if (startsWith(line, "location"))
         {
             handleLocationDirective(line, serverBlock, pos);
             continue;
         }
-        else if (line.find("error_page") == 0)
+        else if (startsWith(line, "error_page"))
             handleErrorPageDirective(line);
         else
             throw std::runtime_error("Error: Unknown directive '" + line + "'");
@@ -127,6 +273,8 @@ void ServerConfig::parseServerBlock(const std::string& serverBlock)
         throw std::runtime_error("Error: Missing 'listen' directive in server block");
     if (!hasRoot)
         throw std::runtime_error("Error: Missing 'root' directive in server block");
+    if (!_sslPorts.empty() && !_tls.configured())
+        throw std::runtime_error("Error: 'listen ... ssl' needs 'ssl_certificate' and 'ssl_certificate_key'");
 }
 
 void ServerConfig::handleLocationDirective(const std::string& line, const std::string& serverBlock, size_t& pos)
@@ -148,15 +296,15 @@ void ServerConfig::handleLocationDirective(const std::string& line, const std::s
 
     std::string locationBlock = serverBlock.substr(locationStart + 1, locationEnd - locationStart - 1);
 
-    ServerLocation location(path);
-
+    // Parsed in place rather than copied in once complete.
+    _locations.push_back(ServerLocation(path));
     try
     {
-        parseLocationBlock(locationBlock, location);
-        _locations.push_back(location);
+        parseLocationBlock(locationBlock, _locations.back());
     }
     catch (const std::exception& e)
     {
+        _locations.pop_back();
         std::cerr << "Warning: Invalid location block ignored. " << e.what() << std::endl;
     }
 
@@ -190,18 +338,28 @@ void ServerConfig::handleErrorPageDirective(const std::string& line)
     if (errorPath.empty())
         throw std::runtime_error("Error: Missing path for 'error_page'");
     std::string fullPath = _root + errorPath;
-    std::ifstream testFile(fullPath.c_str());
-    if (!testFile.is_open())
+    if (!readable(fullPath))
         throw std::runtime_error("Error page file does not exist: " + fullPath);
-    testFile.close();
 
     _error_pages[errorCode] = errorPath;
 }
 
+// "10", "10s" or "500ms".
+static unsigned long parseDuration(const std::string& value, const std::string& directive)
+{
+    char* end;
+    unsigned long number = std::strtoul(value.c_str(), &end, 10);
+    std::string unit = end;
+    if (end == value.c_str() || (unit != "" && unit != "s" && unit != "ms"))
+        throw std::runtime_error("Error: Invalid time '" + value + "' for '" + directive + "'");
+    return unit == "ms" ? number * 1000 : number * 1000000;
+}
+
 void ServerConfig::parseLocationBlock(const std::string& locationBlock, ServerLocation& location)
 {
     size_t pos = 0;
     size_t end;
+    std::string line;
 
     while (pos < locationBlock.size())
     {
@@ -209,10 +367,7 @@ void ServerConfig::parseLocationBlock(const std::string& locationBlock, ServerLo
         if (end == std::string::npos)
             end = locationBlock.size();
 
-        std::string line = locationBlock.substr(pos, end - pos);
-
-        line.erase(0, line.find_first_not_of(" \t\r"));
-        line.erase(line.find_last_not_of(" \t\r;") + 1);
+        trimmedLine(locationBlock, pos, end, " \t\r;", line);
 
         if (line.empty() || line[0] == '#')
         {
@@ -220,27 +375,95 @@ void ServerConfig::parseLocationBlock(const std::string& locationBlock, ServerLo
             continue;
         }
 
-        if (line.find("root") == 0)
+        if (startsWith(line, "root"))
         {
             std::string value = line.substr(4);
             value.erase(0, value.find_first_not_of(" \t"));
             location.setRoot(value);
 
-            std::ifstream testFile(value.c_str());
-            if (!testFile.is_open())
-            throw std::runtime_error("The specified root directory does not exist: " + value);
+            if (!readable(value))
+                throw std::runtime_error("The specified root directory does not exist: " + value);
         }
-        else if (line.find("index") == 0)
+        else if (startsWith(line, "index"))
         {
             std::string value = line.substr(5);
             value.erase(0, value.find_first_not_of(" \t"));
             location.setIndex(value);
-            std::string fullPath = location.getRoot() + value;
-            std::ifstream testFile(fullPath.c_str());
-            if (!testFile.is_open())
-                throw std::runtime_error("The specified index file does not exist " + fullPath);
         }
-        else if (line.find("methods") == 0)
+        else if (line == "stub_status" || line == "stub_status on")
+            location.enableStubStatus();
+        else if (line == "trace_dump" || line == "trace_dump on")
+            location.enableTraceDump();
+        else if (startsWith(line, "bundle"))
+        {
+            std::string value = line.substr(6);
+            value.erase(0, value.find_first_not_of(" \t"));
+            if (value.empty())
+                throw std::runtime_error("Error: Missing value for 'bundle'");
+            location.setBundle(Bundle::open(value));
+        }
+        else if (startsWith(line, "proxy_connect_timeout"))
+        {
+            std::string value = line.substr(21);
+            value.erase(0, value.find_first_not_of(" \t"));
+            unsigned long timeoutUs = parseDuration(value, "proxy_connect_timeout");
+            if (!timeoutUs)
+                throw std::runtime_error("Error: 'proxy_connect_timeout' must be positive");
+            location.setProxyConnectTimeout(timeoutUs);
+        }
+        else if (startsWith(line, "proxy_read_timeout"))
+        {
+            std::string value = line.substr(18);
+            value.erase(0, value.find_first_not_of(" \t"));
+            unsigned long timeoutUs = parseDuration(value, "proxy_read_timeout");
+            if (!timeoutUs)
+                throw std::runtime_error("Error: 'proxy_read_timeout' must be positive");
+            location.setProxyReadTimeout(timeoutUs);
+        }
+        else if (startsWith(line, "proxy_pass"))
+        {
+            std::string value = line.substr(10);
+            value.erase(0, value.find_first_not_of(" \t"));
+            if (value.empty())
+                throw std::runtime_error("Error: Missing value for 'proxy_pass'");
+            location.setProxyPass(value);
+        }
+        else if (startsWith(line, "limit_req"))
+        {
+            std::string value = line.substr(9);
+            value.erase(0, value.find_first_not_of(" \t"));
+            location.setRequestLimit(value);
+        }
+        else if (startsWith(line, "limit_conn"))
+        {
+            std::string value = line.substr(10);
+            value.erase(0, value.find_first_not_of(" \t"));
+            location.setConnectionLimit(value);
+        }
+        else if (startsWith(line, "cgi_cache_vary"))
+        {
+            std::string value = line.substr(14);
+            value.erase(0, value.find_first_not_of(" \t"));
+            location.setCacheVary(value);
+        }
+        else if (startsWith(line, "cgi_cache_lock_timeout"))
+        {
+            std::string value = line.substr(22);
+            value.erase(0, value.find_first_not_of(" \t"));
+            location.setCacheLockTimeout(value);
+        }
+        else if (startsWith(line, "cgi_cache"))
+        {
+            std::string value = line.substr(9);
+            value.erase(0, value.find_first_not_of(" \t"));
+            location.setCache(value);
+        }
+        else if (startsWith(line, "gzip"))
+        {
+            if (!location.parseGzip(line))
+                throw std::runtime_error("Error: Unknown directive in location block: '" + line + "'");
+        }
+        else if (startsWith(line, "methods"))
         {
             location.disableAllMethods();
             std::string methods = line.substr(7);
@@ -267,11 +490,134 @@ void ServerConfig::parseLocationBlock(const std::string& locationBlock, ServerLo
 
         pos = end + 1;
     }
+
+    // A bundle location looks its index up in the bundle, not on disk.
+    if (!location.getIndex().empty() && !location.getBundle())
+    {
+        std::string fullPath = location.getRoot() + location.getIndex();
+        if (!readable(fullPath))
+            throw std::runtime_error("The specified index file does not exist " + fullPath);
+    }
+}
+
+static unsigned long parseCount(const std::string& value, const std::string& directive)
+{
+    char* end;
+    unsigned long number = std::strtoul(value.c_str(), &end, 10);
+    if (*end || end == value.c_str() || number > 1000)
+        throw std::runtime_error("Error: Invalid value '" + value + "' for '" + directive + "'");
+    return number;
+}
+
+// upstream <name> {
+//     least_conn;                       (or: hash $request_uri consistent;)
+//     server <host>[:port] [weight=N] [max_fails=N] [fail_timeout=T];
+//     health_check [interval=T] [uri=/path];
+// }
+UpstreamGroup* ServerConfig::parseUpstreamBlock(const std::string& upstreamBlock)
+{
+    std::istringstream lines(upstreamBlock);
+    std::string line;
+    std::getline(lines, line);
+    std::istringstream header(line);
+    std::string keyword;
+    std::string name;
+    header >> keyword >> name;
+    if (name.empty() || name == "{")
+        throw std::runtime_error("Error: Missing name for upstream block");
+    if (UpstreamGroup::find(name))
+        throw std::runtime_error("Error: Duplicate upstream '" + name + "'");
+
+    UpstreamGroup* group = new UpstreamGroup(name);
+    try
+    {
+        while (std::getline(lines, line))
+        {
+            line.erase(0, line.find_first_not_of(" \t\r"));
+            line.erase(line.find_last_not_of(" \t\r;") + 1);
+            if (line.empty() || line[0] == '#' || line == "}")
+                continue;
+
+            std::istringstream words(line);
+            std::string directive;
+            std::string word;
+            words >> directive;
+            if (directive == "server")
+            {
+                std::string address;
+                if (!(words >> address))
+                    throw std::runtime_error("Error: Missing address for 'server' in upstream '" + name + "'");
+                size_t colon = address.find(':');
+                std::string host = address.substr(0, colon);
+                int port = colon == std::string::npos ? 80 : std::atoi(address.c_str() + colon + 1);
+                if (host.empty() || port <= 0 || port > 65535)
+                    throw std::runtime_error("Error: Invalid server address '" + address + "' in upstream '" + name + "'");
+
+                unsigned long weight = 1;
+                unsigned long maxFails = 1;
+                unsigned long failTimeoutUs = 10000000;
+                while (words >> word)
+                {
+                    if (word.compare(0, 7, "weight=") == 0)
+                        weight = parseCount(word.substr(7), "weight");
+                    else if (word.compare(0, 10, "max_fails=") == 0)
+                        maxFails = parseCount(word.substr(10), "max_fails");
+                    else if (word.compare(0, 13, "fail_timeout=") == 0)
+                        failTimeoutUs = parseDuration(word.substr(13), "fail_timeout");
+                    else
+                        throw std::runtime_error("Error: Unknown parameter '" + word + "' for 'server'");
+                }
+                if (weight == 0)
+                    throw std::runtime_error("Error: 'weight' must be at least 1");
+                group->addServer(Upstream::get(host, port), weight, maxFails, failTimeoutUs);
+            }
+            else if (directive == "least_conn")
+                group->setPolicy(UpstreamGroup::LEAST_CONN);
+            else if (directive == "hash")
+            {
+                std::string key;
+                std::string mode;
+                words >> key >> mode;
+                if (key != "$request_uri" || mode != "consistent")
+                    throw std::runtime_error("Error: Only 'hash $request_uri consistent' is supported");
+                group->setPolicy(UpstreamGroup::HASH_URI);
+            }
+            else if (directive == "health_check")
+            {
+                unsigned long intervalUs = 5000000;
+                std::string uri = "/";
+                while (words >> word)
+                {
+                    if (word.compare(0, 9, "interval=") == 0)
+                        intervalUs = parseDuration(word.substr(9), "interval");
+                    else if (word.compare(0, 4, "uri=") == 0 && word.size() > 4 && word[4] == '/')
+                        uri = word.substr(4);
+                    else
+                        throw std::runtime_error("Error: Unknown parameter '" + word + "' for 'health_check'");
+                }
+                if (intervalUs < 100000)
+                    throw std::runtime_error("Error: 'health_check' interval must be at least 100ms");
+                group->setHealthCheck(intervalUs, uri);
+            }
+            else
+                throw std::runtime_error("Error: Unknown directive in upstream block: '" + line + "'");
+        }
+        if (group->size() == 0)
+            throw std::runtime_error("Error: Upstream '" + name + "' has no server");
+    }
+    catch (...)
+    {
+        delete group;
+        throw;
+    }
+    return UpstreamGroup::publish(group);
 }
 
 void ServerConfig::clear()
 {
     _ports.clear();
+    _listenHosts.clear();
+    _sslPorts.clear();
     _root.clear();
     _index.clear();
     _error_pages.clear();
@@ -279,6 +625,12 @@ void ServerConfig::clear()
     _serverName.clear();
     _host.clear();
     _clientMaxBodySize = 0;
+    _clientLimit = ClientLimit();
+    _cachePolicy = CachePolicy();
+    _gzip = GzipPolicy();
+    _http2 = false;
+    _uploadTmpfile = false;
+    _tls = TlsPolicy();
 }
 
 void ServerConfig::print() const
@@ -287,11 +639,11 @@ void ServerConfig::print() const
     std::cout << "               Config                   " << std::endl;
     std::cout << "----------------------------------------" << std::endl;
 
-    std::cout << "Ports: ";
+    std::cout << "Listen: ";
     for (size_t i = 0; i < _ports.size(); ++i)
     {
         if (i > 0) std::cout << ", ";
-        std::cout << _ports[i];
+        std::cout << listenName(getListenHost(i), _ports[i]);
     }
     std::cout << std::endl;
 
@@ -300,6 +652,10 @@ void ServerConfig::print() const
     std::cout << "Server Name: " << _serverName << std::endl;
     std::cout << "Host: " << _host << std::endl;
     std::cout << "Client Max Body Size: " << _clientMaxBodySize << std::endl;
+    if (_clientLimit.limitsRequests())
+        std::cout << "Limit Req: " << _clientLimit.rate / 1000.0 << "r/s burst=" << _clientLimit.burst << std::endl;
+    if (_clientLimit.limitsConnections())
+        std::cout << "Limit Conn: " << _clientLimit.connections << std::endl;
 
     std::cout << "Error Pages: " << std::endl;
     for (std::map<int, std::string>::const_iterator it = _error_pages.begin(); it != _error_pages.end(); ++it)
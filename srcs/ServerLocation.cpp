@@ -1,9 +1,13 @@
 #include "ServerLocation.hpp"
+#include "Bundle.hpp"
+#include "Proxy.hpp"
+#include "UpstreamGroup.hpp"
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 #include <algorithm>
 
-ServerLocation::ServerLocation(const std::string& path) : _path(path), _root(""), _index(""), _getAllowed(true), _postAllowed(true), _deleteAllowed(true)
+ServerLocation::ServerLocation(const std::string& path) : _path(path), _root(""), _index(""), _getAllowed(true), _postAllowed(true), _deleteAllowed(true), _stubStatus(false), _traceDump(false), _latency(NULL), _bundle(NULL), _upstream(NULL), _proxyConnectTimeoutUs(60000000), _proxyReadTimeoutUs(60000000)
 {
     if (path.empty())
         throw std::runtime_error("Error: Path cannot be empty in location block");
@@ -97,6 +101,157 @@ void ServerLocation::setAllowedMethods(const std::string& methodsLine)
     }
 }
 
+void ServerLocation::enableStubStatus()
+{
+    _stubStatus = true;
+}
+
+bool ServerLocation::isStubStatus() const
+{
+    return _stubStatus;
+}
+
+void ServerLocation::enableTraceDump()
+{
+    _traceDump = true;
+}
+
+bool ServerLocation::isTraceDump() const
+{
+    return _traceDump;
+}
+
+void ServerLocation::setLatencyHistogram(LatencyHistogram* histogram)
+{
+    _latency = histogram;
+}
+
+LatencyHistogram* ServerLocation::getLatencyHistogram() const
+{
+    return _latency;
+}
+
+void ServerLocation::setBundle(const Bundle* bundle)
+{
+    _bundle = bundle;
+}
+
+const Bundle* ServerLocation::getBundle() const
+{
+    return _bundle;
+}
+
+// Prefix match on whole path segments: /static contains /static and
+// /static/css/site.css, but not /statics.
+bool ServerLocation::contains(const char* requestPath, size_t length) const
+{
+    if (length < _path.size() || _path.compare(0, _path.size(), requestPath, _path.size()) != 0)
+        return false;
+    return length == _path.size() || _path[_path.size() - 1] == '/' || requestPath[_path.size()] == '/'
+        || requestPath[_path.size()] == '?';
+}
+
+void ServerLocation::setRequestLimit(const std::string& value)
+{
+    _clientLimit.parseRequestLimit(value);
+}
+
+void ServerLocation::setConnectionLimit(const std::string& value)
+{
+    _clientLimit.parseConnectionLimit(value);
+}
+
+void ServerLocation::setLimitZone(unsigned long zone)
+{
+    _clientLimit.zone = zone;
+}
+
+const ClientLimit& ServerLocation::getClientLimit() const
+{
+    return _clientLimit;
+}
+
+// proxy_pass http://host[:port][/uri]. With a uri, it replaces the location
+// path at the start of the request target; without one the target is sent
+// unchanged. A host without a port that names an upstream block forwards to
+// that group.
+void ServerLocation::setProxyPass(const std::string& url)
+{
+    if (url.compare(0, 7, "http://") != 0)
+        throw std::runtime_error("Error: proxy_pass expects http://host[:port][/uri], got '" + url + "'");
+    size_t slash = url.find('/', 7);
+    std::string authority = url.substr(7, slash == std::string::npos ? std::string::npos : slash - 7);
+    size_t colon = authority.find(':');
+    std::string host = authority.substr(0, colon);
+    int port = colon == std::string::npos ? 80 : std::atoi(authority.c_str() + colon + 1);
+    if (host.empty() || port <= 0 || port > 65535)
+        throw std::runtime_error("Error: Invalid upstream address in proxy_pass '" + url + "'");
+    _upstream = colon == std::string::npos ? UpstreamGroup::find(host) : NULL;
+    if (!_upstream)
+        _upstream = UpstreamGroup::forServer(Upstream::get(host, port));
+    _proxyUri = slash == std::string::npos ? "" : url.substr(slash);
+}
+
+UpstreamGroup* ServerLocation::getUpstream() const
+{
+    return _upstream;
+}
+
+const std::string& ServerLocation::getProxyUri() const
+{
+    return _proxyUri;
+}
+
+void ServerLocation::setProxyConnectTimeout(unsigned long timeoutUs)
+{
+    _proxyConnectTimeoutUs = timeoutUs;
+}
+
+void ServerLocation::setProxyReadTimeout(unsigned long timeoutUs)
+{
+    _proxyReadTimeoutUs = timeoutUs;
+}
+
+unsigned long ServerLocation::getProxyConnectTimeoutUs() const
+{
+    return _proxyConnectTimeoutUs;
+}
+
+unsigned long ServerLocation::getProxyReadTimeoutUs() const
+{
+    return _proxyReadTimeoutUs;
+}
+
+void ServerLocation::setCache(const std::string& value)
+{
+    _cachePolicy.parse(value);
+}
+
+void ServerLocation::setCacheVary(const std::string& value)
+{
+    _cachePolicy.parseVary(value);
+}
+
+void ServerLocation::setCacheLockTimeout(const std::string& value)
+{
+    _cachePolicy.parseLockTimeout(value);
+}
+
+const CachePolicy& ServerLocation::getCachePolicy() const
+{
+    return _cachePolicy;
+}
+
+bool ServerLocation::parseGzip(const std::string& line)
+{
+    return _gzip.parse(line);
+}
+
+const GzipPolicy& ServerLocation::getGzipPolicy() const
+{
+    return _gzip;
+}
+
 void ServerLocation::display() const
 {
     std::cout << "----------location----------\n";
@@ -106,6 +261,31 @@ void ServerLocation::display() const
 
     std::cout << "index : " << _index << std::endl;
 
+    if (_stubStatus)
+        std::cout << "stub_status : on" << std::endl;
+
+    if (_traceDump)
+        std::cout << "trace_dump : on" << std::endl;
+
+    if (_bundle)
+        std::cout << "bundle : " << _bundle->path() << std::endl;
+
+    if (_upstream)
+    {
+        std::cout << "proxy_pass : http://" << _upstream->name() << _proxyUri << std::endl;
+        std::cout << "proxy timeouts : connect=" << _proxyConnectTimeoutUs / 1000 << "ms read="
+                  << _proxyReadTimeoutUs / 1000 << "ms" << std::endl;
+    }
+
+    if (_clientLimit.limitsRequests())
+        std::cout << "limit_req : " << _clientLimit.rate / 1000.0 << "r/s burst=" << _clientLimit.burst << std::endl;
+    if (_clientLimit.limitsConnections())
+        std::cout << "limit_conn : " << _clientLimit.connections << std::endl;
+    if (_cachePolicy.enabled())
+        std::cout << "cgi_cache : " << _cachePolicy.ttl << "s stale=" << _cachePolicy.stale << "s" << std::endl;
+    if (_gzip.configured)
+        std::cout << "gzip : " << (_gzip.on ? "on" : "off") << " static=" << (_gzip.staticFiles ? "on" : "off") << std::endl;
+
     std::cout << "Allowed Methods:\n";
     std::cout << "  GET: " << (_getAllowed ? "Yes" : "No") << std::endl;
     std::cout << "  POST: " << (_postAllowed ? "Yes" : "No") << std::endl;
@@ -0,0 +1,333 @@
+#include "Tls.hpp"
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/* ------------------------------------------------------------------------ */
+/*                                TlsPolicy                                 */
+/* ------------------------------------------------------------------------ */
+
+TlsPolicy::TlsPolicy()
+    : sessionCache(DEFAULT_SESSION_CACHE), sessionTimeout(DEFAULT_SESSION_TIMEOUT), tickets(true)
+{
+}
+
+static unsigned long parseSeconds(const std::string& value, const std::string& directive)
+{
+    char* end;
+    unsigned long number = std::strtoul(value.c_str(), &end, 10);
+    std::string unit = end;
+    if (end == value.c_str() || value[0] == '-' || (unit != "" && unit != "s" && unit != "m" && unit != "h"))
+        throw std::runtime_error("Error: Invalid time '" + value + "' for '" + directive + "'");
+    return unit == "h" ? number * 3600 : unit == "m" ? number * 60 : number;
+}
+
+bool TlsPolicy::parse(const std::string& line)
+{
+    std::istringstream words(line);
+    std::string directive;
+    words >> directive;
+    if (directive.compare(0, 4, "ssl_") != 0)
+        return false;
+    std::string value;
+    std::getline(words, value);
+    value.erase(0, value.find_first_not_of(" \t"));
+    value.erase(value.find_last_not_of(" \t;") + 1);
+    if (value.empty())
+        throw std::runtime_error("Error: Missing value for '" + directive + "'");
+
+    if (directive == "ssl_certificate")
+        certificate = value;
+    else if (directive == "ssl_certificate_key")
+        key = value;
+    else if (directive == "ssl_session_cache")
+    {
+        char* end;
+        sessionCache = value == "off" ? 0 : std::strtoul(value.c_str(), &end, 10);
+        if (value != "off" && (*end != '\0' || value[0] == '-' || sessionCache == 0))
+            throw std::runtime_error("Error: 'ssl_session_cache' expects a number of sessions or off");
+    }
+    else if (directive == "ssl_session_timeout")
+        sessionTimeout = parseSeconds(value, directive);
+    else if (directive == "ssl_session_tickets")
+    {
+        if (value != "on" && value != "off")
+            throw std::runtime_error("Error: 'ssl_session_tickets' expects on or off, got '" + value + "'");
+        tickets = value == "on";
+    }
+    else
+        return false;
+    return true;
+}
+
+bool TlsPolicy::configured() const
+{
+    return !certificate.empty() && !key.empty();
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                TlsContext                                */
+/* ------------------------------------------------------------------------ */
+
+static std::string sslError()
+{
+    unsigned long code = ERR_get_error();
+    ERR_clear_error();
+    if (!code)
+        return "unknown error";
+    char text[256];
+    ERR_error_string_n(code, text, sizeof(text));
+    return text;
+}
+
+// ALPN protocols in wire format, most preferred first. The callback gets
+// the list rather than the context, which a reload may free while a
+// handshake that started under it is still running.
+struct AlpnOffer
+{
+    const unsigned char* protocols;
+    unsigned int         length;
+};
+
+static const unsigned char H2_AND_HTTP1[] = "\x02h2\x08http/1.1";
+static const unsigned char HTTP1_ONLY[] = "\x08http/1.1";
+static const AlpnOffer OFFER_H2 = { H2_AND_HTTP1, sizeof(H2_AND_HTTP1) - 1 };
+static const AlpnOffer OFFER_HTTP1 = { HTTP1_ONLY, sizeof(HTTP1_ONLY) - 1 };
+
+static int selectProtocol(SSL*, const unsigned char** out, unsigned char* outLength, const unsigned char* in,
+    unsigned int inLength, void* arg)
+{
+    const AlpnOffer* offer = static_cast<const AlpnOffer*>(arg);
+    unsigned char* chosen;
+    if (SSL_select_next_proto(&chosen, outLength, offer->protocols, offer->length, in, inLength)
+        != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    *out = chosen;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+TlsContext::TlsContext(const TlsPolicy& policy, bool http2) : _ctx(SSL_CTX_new(TLS_server_method()))
+{
+    if (!_ctx)
+        throw std::runtime_error("Error: SSL_CTX_new: " + sslError());
+    if (SSL_CTX_use_certificate_chain_file(_ctx, policy.certificate.c_str()) != 1
+        || SSL_CTX_use_PrivateKey_file(_ctx, policy.key.c_str(), SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(_ctx) != 1)
+    {
+        std::string error = sslError();
+        SSL_CTX_free(_ctx);
+        throw std::runtime_error("Error: Cannot use certificate '" + policy.certificate + "' with key '" + policy.key
+            + "': " + error);
+    }
+    SSL_CTX_set_min_proto_version(_ctx, TLS1_2_VERSION);
+    // A peer that drops the connection without close_notify reads as a
+    // plain end of stream, as it does over TCP.
+    SSL_CTX_set_options(_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION
+        | (policy.tickets ? 0 : SSL_OP_NO_TICKET));
+    // Writes return after each record, from a buffer that may have moved
+    // since the attempt that blocked; idle connections give their record
+    // buffers back.
+    SSL_CTX_set_mode(_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+        | SSL_MODE_RELEASE_BUFFERS);
+    static const unsigned char SESSION_CONTEXT[] = "webserv";
+    SSL_CTX_set_session_id_context(_ctx, SESSION_CONTEXT, sizeof(SESSION_CONTEXT) - 1);
+    SSL_CTX_set_session_cache_mode(_ctx, policy.sessionCache ? SSL_SESS_CACHE_SERVER : SSL_SESS_CACHE_OFF);
+    SSL_CTX_sess_set_cache_size(_ctx, policy.sessionCache);
+    SSL_CTX_set_timeout(_ctx, policy.sessionTimeout);
+    SSL_CTX_set_alpn_select_cb(_ctx, selectProtocol, const_cast<AlpnOffer*>(http2 ? &OFFER_H2 : &OFFER_HTTP1));
+}
+
+TlsContext::~TlsContext()
+{
+    SSL_CTX_free(_ctx);
+}
+
+void TlsContext::inheritTicketKeys(const TlsContext& previous)
+{
+    unsigned char keys[80];
+    if (SSL_CTX_get_tlsext_ticket_keys(previous._ctx, keys, sizeof(keys)) == 1)
+        SSL_CTX_set_tlsext_ticket_keys(_ctx, keys, sizeof(keys));
+    std::memset(keys, 0, sizeof(keys));
+}
+
+ssl_ctx_st* TlsContext::get() const
+{
+    return _ctx;
+}
+
+/* ------------------------------------------------------------------------ */
+/*                              TlsConnection                               */
+/* ------------------------------------------------------------------------ */
+
+TlsConnection::TlsConnection(TlsContext& context, int fd)
+    : _ssl(SSL_new(context.get())), _fd(fd), _state(HANDSHAKE), _events(POLLIN), _kernelSend(false)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (!_ssl || SSL_set_fd(_ssl, fd) != 1)
+    {
+        ERR_clear_error();
+        _state = FAILED;
+        return;
+    }
+    SSL_set_accept_state(_ssl);
+}
+
+// No close_notify after a fatal error: OpenSSL forbids it.
+TlsConnection::~TlsConnection()
+{
+    if (_ssl && _state == ESTABLISHED)
+    {
+        SSL_shutdown(_ssl);
+        ERR_clear_error();
+    }
+    SSL_free(_ssl);
+}
+
+TlsConnection::State TlsConnection::handshake()
+{
+    if (_state != HANDSHAKE)
+        return _state;
+    ERR_clear_error();
+    int result = SSL_do_handshake(_ssl);
+    if (result == 1)
+    {
+        _state = ESTABLISHED;
+        _kernelSend = BIO_get_ktls_send(SSL_get_wbio(_ssl));
+        return _state;
+    }
+    int error = SSL_get_error(_ssl, result);
+    if (error == SSL_ERROR_WANT_READ)
+        _events = POLLIN;
+    else if (error == SSL_ERROR_WANT_WRITE)
+        _events = POLLOUT;
+    else
+    {
+        ERR_clear_error();
+        _state = FAILED;
+    }
+    return _state;
+}
+
+short TlsConnection::events() const
+{
+    return _events;
+}
+
+bool TlsConnection::established() const
+{
+    return _state == ESTABLISHED;
+}
+
+bool TlsConnection::resumed() const
+{
+    return SSL_session_reused(_ssl);
+}
+
+bool TlsConnection::http2() const
+{
+    const unsigned char* protocol;
+    unsigned int length;
+    SSL_get0_alpn_selected(_ssl, &protocol, &length);
+    return length == 2 && std::memcmp(protocol, "h2", 2) == 0;
+}
+
+bool TlsConnection::kernelSend() const
+{
+    return _kernelSend;
+}
+
+bool TlsConnection::pending() const
+{
+    return _state == ESTABLISHED && SSL_has_pending(_ssl);
+}
+
+ssize_t TlsConnection::read(TlsConnection* tls, int fd, void* buffer, size_t length)
+{
+    if (!tls)
+        return recv(fd, buffer, length, MSG_DONTWAIT);
+    return tls->receive(buffer, length);
+}
+
+ssize_t TlsConnection::write(TlsConnection* tls, int fd, const struct iovec* iov, int count)
+{
+    if (!tls || tls->_kernelSend)
+    {
+        struct msghdr msg = {};
+        msg.msg_iov = const_cast<struct iovec*>(iov);
+        msg.msg_iovlen = count;
+        return sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    return tls->send(iov, count);
+}
+
+ssize_t TlsConnection::receive(void* buffer, size_t length)
+{
+    if (_state != ESTABLISHED)
+    {
+        errno = _state == HANDSHAKE ? EAGAIN : ECONNRESET;
+        return -1;
+    }
+    ERR_clear_error();
+    int result = SSL_read(_ssl, buffer, length > INT_MAX ? INT_MAX : static_cast<int>(length));
+    if (result > 0)
+        return result;
+    return failed(result);
+}
+
+// Without kTLS every byte is encrypted in user space anyway, so small
+// iovecs (a head before its body) are gathered into one record rather than
+// sent as records of their own.
+ssize_t TlsConnection::send(const struct iovec* iov, int count)
+{
+    if (_state != ESTABLISHED)
+    {
+        errno = _state == HANDSHAKE ? EAGAIN : ECONNRESET;
+        return -1;
+    }
+    char gathered[16384];
+    const void* data = iov[0].iov_base;
+    size_t length = iov[0].iov_len;
+    if (count > 1 && length < sizeof(gathered))
+    {
+        length = 0;
+        for (int i = 0; i < count && length < sizeof(gathered); ++i)
+        {
+            size_t part = std::min(iov[i].iov_len, sizeof(gathered) - length);
+            std::memcpy(gathered + length, iov[i].iov_base, part);
+            length += part;
+        }
+        data = gathered;
+    }
+    ERR_clear_error();
+    int result = SSL_write(_ssl, data, length > INT_MAX ? INT_MAX : static_cast<int>(length));
+    if (result > 0)
+        return result;
+    return failed(result);
+}
+
+// A record still on its way reads as EAGAIN; close_notify as the end of
+// the stream.
+ssize_t TlsConnection::failed(int result)
+{
+    int error = SSL_get_error(_ssl, result);
+    if (error == SSL_ERROR_ZERO_RETURN)
+        return 0;
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    ERR_clear_error();
+    _state = FAILED;
+    errno = ECONNRESET;
+    return -1;
+}
@@ -0,0 +1,321 @@
+#include "Tracer.hpp"
+#include "Metrics.hpp"
+#include "Logger.hpp"
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* ------------------------------------------------------------------------ */
+/*                               RequestTrace                               */
+/* ------------------------------------------------------------------------ */
+
+RequestTrace::RequestTrace()
+    : _active(false), _sampled(false), _fd(-1), _status(0), _bodyBytes(0), _bytesSent(0), _cgiPid(0),
+      _cgiWaitStatus(-1), _startUs(0), _endUs(0), _markUs(0), _spans(0), _dropped(0)
+{
+    _label[0] = '\0';
+    _host[0] = '\0';
+}
+
+unsigned long RequestTrace::clock()
+{
+    return Tracer::instance().enabled() ? Metrics::nowMicros() : 0;
+}
+
+void RequestTrace::begin(int fd, unsigned long startUs)
+{
+    Tracer& tracer = Tracer::instance();
+    _active = tracer.enabled();
+    if (!_active)
+        return;
+    _sampled = tracer.sampleNext();
+    _fd = fd;
+    _status = 0;
+    _bodyBytes = 0;
+    _bytesSent = 0;
+    _cgiPid = 0;
+    _cgiWaitStatus = -1;
+    _startUs = startUs;
+    _endUs = 0;
+    _markUs = startUs;
+    _spans = 0;
+    _dropped = 0;
+    _label[0] = '\0';
+    _host[0] = '\0';
+}
+
+bool RequestTrace::active() const
+{
+    return _active;
+}
+
+void RequestTrace::span(Phase phase, unsigned long startUs)
+{
+    if (!_active)
+        return;
+    unsigned long nowUs = Metrics::nowMicros();
+    if (_spans && _span[_spans - 1].phase == phase)
+    {
+        _span[_spans - 1].endUs = nowUs;
+        ++_span[_spans - 1].events;
+        return;
+    }
+    if (_spans == MAX_SPANS)
+    {
+        ++_dropped;
+        return;
+    }
+    Span& added = _span[_spans++];
+    added.startUs = startUs;
+    added.endUs = nowUs;
+    added.events = 1;
+    added.phase = phase;
+}
+
+void RequestTrace::describe(const StringRef& method, const StringRef& target, const StringRef& host,
+    unsigned long bodyBytes)
+{
+    if (!_active)
+        return;
+    size_t length = method.length < LABEL_SIZE - 2 ? method.length : LABEL_SIZE - 2;
+    std::memcpy(_label, method.data, length);
+    _label[length++] = ' ';
+    size_t rest = target.length < LABEL_SIZE - 1 - length ? target.length : LABEL_SIZE - 1 - length;
+    std::memcpy(_label + length, target.data, rest);
+    _label[length + rest] = '\0';
+    length = host.length < HOST_SIZE - 1 ? host.length : HOST_SIZE - 1;
+    std::memcpy(_host, host.data, length);
+    _host[length] = '\0';
+    _bodyBytes = bodyBytes;
+}
+
+void RequestTrace::setResponse(int status, unsigned long bytesSent)
+{
+    _status = status;
+    _bytesSent = bytesSent;
+}
+
+void RequestTrace::setCgi(int pid, int waitStatus)
+{
+    _cgiPid = pid;
+    _cgiWaitStatus = waitStatus;
+}
+
+void RequestTrace::mark()
+{
+    if (_active)
+        _markUs = Metrics::nowMicros();
+}
+
+unsigned long RequestTrace::markedUs() const
+{
+    return _markUs;
+}
+
+void RequestTrace::end()
+{
+    if (!_active)
+        return;
+    _active = false;
+    _endUs = Metrics::nowMicros();
+    Tracer::instance().record(*this);
+}
+
+const char* RequestTrace::phaseName(Phase phase)
+{
+    static const char* names[PHASES] = { "recv", "parse", "route", "handle", "cgi", "upload", "proxy", "send" };
+    return phase < PHASES ? names[phase] : "unknown";
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                  Tracer                                  */
+/* ------------------------------------------------------------------------ */
+
+Tracer::Tracer() : _enabled(false), _sampleEvery(0), _thresholdUs(0), _slowUs(0), _seen(0), _next(0), _stored(0)
+{
+}
+
+Tracer& Tracer::instance()
+{
+    static Tracer tracer;
+    return tracer;
+}
+
+// The ring is only reallocated, and emptied, when its size changes.
+void Tracer::configure(unsigned long sampleEvery, unsigned long thresholdUs, size_t capacity, unsigned long slowUs)
+{
+    _sampleEvery = sampleEvery;
+    _thresholdUs = thresholdUs;
+    _slowUs = slowUs;
+    if (!sampleEvery && !thresholdUs)
+        capacity = 0;
+    _enabled = capacity || slowUs;
+    if (capacity != _ring.size())
+    {
+        std::vector<RequestTrace>(capacity).swap(_ring);
+        _next = 0;
+        _stored = 0;
+    }
+}
+
+bool Tracer::enabled() const
+{
+    return _enabled;
+}
+
+bool Tracer::sampleNext()
+{
+    return _sampleEvery && ++_seen % _sampleEvery == 0;
+}
+
+void Tracer::record(const RequestTrace& trace)
+{
+    unsigned long elapsedUs = trace._endUs - trace._startUs;
+    if (_slowUs && elapsedUs >= _slowUs)
+        logSlow(trace);
+    if (_ring.empty())
+        return;
+    if (!trace._sampled && !(_thresholdUs && elapsedUs >= _thresholdUs))
+        return;
+    _ring[_next] = trace;
+    _next = (_next + 1) % _ring.size();
+    if (_stored < _ring.size())
+        ++_stored;
+}
+
+static void appendMillis(std::string& out, const char* name, unsigned long micros)
+{
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), " %s=%lu.%03lu", name, micros / 1000, micros % 1000);
+    out += buffer;
+}
+
+// An exit code, sig<n> for a script killed by a signal, or - when it was not
+// waited for before the request ended.
+static std::string waitStatusText(int status)
+{
+    char buffer[16];
+    if (status < 0)
+        return "-";
+    if (WIFSIGNALED(status))
+        snprintf(buffer, sizeof(buffer), "sig%d", WTERMSIG(status));
+    else
+        snprintf(buffer, sizeof(buffer), "%d", WEXITSTATUS(status));
+    return buffer;
+}
+
+// One line per request: total time, request, status and sizes, then the
+// milliseconds spent in each phase and, as other, in none of them.
+void Tracer::logSlow(const RequestTrace& trace)
+{
+    unsigned long phaseUs[RequestTrace::PHASES] = {};
+    bool seen[RequestTrace::PHASES] = {};
+    unsigned long accountedUs = 0;
+    for (int i = 0; i < trace._spans; ++i)
+    {
+        const RequestTrace::Span& span = trace._span[i];
+        unsigned long us = span.endUs > span.startUs ? span.endUs - span.startUs : 0;
+        phaseUs[span.phase] += us;
+        seen[span.phase] = true;
+        accountedUs += us;
+    }
+    unsigned long elapsedUs = trace._endUs - trace._startUs;
+
+    std::string line;
+    char buffer[128];
+    line.reserve(256);
+    line += '[';
+    line += Logger::instance().timestamp();
+    line += ']';
+    appendMillis(line, "time", elapsedUs);
+    line += " \"";
+    line += trace._label[0] ? trace._label : "-";
+    snprintf(buffer, sizeof(buffer), "\" %d host=%s body=%lu sent=%lu", trace._status,
+        trace._host[0] ? trace._host : "-", trace._bodyBytes, trace._bytesSent);
+    line += buffer;
+    if (trace._cgiPid)
+    {
+        snprintf(buffer, sizeof(buffer), " cgi_pid=%d cgi_exit=%s", trace._cgiPid,
+            waitStatusText(trace._cgiWaitStatus).c_str());
+        line += buffer;
+    }
+    for (int phase = 0; phase < RequestTrace::PHASES; ++phase)
+        if (seen[phase])
+            appendMillis(line, RequestTrace::phaseName(static_cast<RequestTrace::Phase>(phase)), phaseUs[phase]);
+    appendMillis(line, "other", elapsedUs > accountedUs ? elapsedUs - accountedUs : 0);
+    line += '\n';
+    Logger::instance().slow(line);
+}
+
+static void appendJsonString(std::string& out, const char* value)
+{
+    out += '"';
+    for (const unsigned char* c = reinterpret_cast<const unsigned char*>(value); *c; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            out += '\\';
+            out += static_cast<char>(*c);
+        }
+        else if (*c < 0x20 || *c >= 0x7f)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+            out += escaped;
+        }
+        else
+            out += static_cast<char>(*c);
+    }
+    out += '"';
+}
+
+static void appendEvent(std::string& out, const char* name, const char* category, int pid, int tid,
+    unsigned long startUs, unsigned long endUs)
+{
+    char buffer[160];
+    out += ",\n{\"name\":";
+    appendJsonString(out, name);
+    snprintf(buffer, sizeof(buffer), ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lu,\"dur\":%lu",
+        category, pid, tid, startUs, endUs > startUs ? endUs - startUs : 0UL);
+    out += buffer;
+}
+
+// Timestamps are the monotonic clock, which the viewers only use relative
+// to each other.
+void Tracer::render(std::string& out) const
+{
+    char buffer[128];
+    int pid = static_cast<int>(getpid());
+    snprintf(buffer, sizeof(buffer), "{\"pid\":%d,\"ph\":\"M\",\"name\":\"process_name\",\"args\":{\"name\":\"webserv\"}}",
+        pid);
+    out += "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    out += buffer;
+    for (size_t i = 0; i < _stored; ++i)
+    {
+        const RequestTrace& trace = _ring[(_next + _ring.size() - _stored + i) % _ring.size()];
+        appendEvent(out, trace._label[0] ? trace._label : "request", "request", pid, trace._fd, trace._startUs,
+            trace._endUs);
+        snprintf(buffer, sizeof(buffer), ",\"args\":{\"status\":%d,\"sampled\":%s,\"dropped_spans\":%u,\"host\":",
+            trace._status, trace._sampled ? "true" : "false", trace._dropped);
+        out += buffer;
+        appendJsonString(out, trace._host);
+        snprintf(buffer, sizeof(buffer), ",\"body\":%lu,\"sent\":%lu", trace._bodyBytes, trace._bytesSent);
+        out += buffer;
+        if (trace._cgiPid)
+        {
+            snprintf(buffer, sizeof(buffer), ",\"cgi_pid\":%d,\"cgi_exit\":\"%s\"", trace._cgiPid,
+                waitStatusText(trace._cgiWaitStatus).c_str());
+            out += buffer;
+        }
+        out += "}}";
+        for (int s = 0; s < trace._spans; ++s)
+        {
+            const RequestTrace::Span& span = trace._span[s];
+            appendEvent(out, RequestTrace::phaseName(span.phase), "phase", pid, trace._fd, span.startUs, span.endUs);
+            snprintf(buffer, sizeof(buffer), ",\"args\":{\"events\":%u}}", span.events);
+            out += buffer;
+        }
+    }
+    out += "\n]}\n";
+}
@@ -0,0 +1,316 @@
+#include "Upload.hpp"
+#include "HttpRequest.hpp"
+#include "Metrics.hpp"
+#include "Tls.hpp"
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+UploadTarget::UploadTarget() : length(0), tmpfile(false)
+{
+}
+
+UploadSession::UploadSession(int clientFd, TlsConnection* tls, const UploadTarget& target)
+    : _clientFd(clientFd), _tls(tls), _target(target), _phase(target.boundary.empty() ? BODY : PART_HEAD),
+      _remaining(target.length), _file(-1), _written(0), _committed(false), _response(201)
+{
+    _pipe[0] = -1;
+    _pipe[1] = -1;
+    _response.header("Content-Type", "text/plain");
+    fcntl(clientFd, F_SETFL, fcntl(clientFd, F_GETFL) | O_NONBLOCK);
+}
+
+UploadSession::UploadSession(int clientFd, TlsConnection* tls, unsigned long length, ResponseBuilder& response)
+    : _clientFd(clientFd), _tls(tls), _phase(DISCARD), _remaining(length), _file(-1), _written(0),
+      _committed(false)
+{
+    _pipe[0] = -1;
+    _pipe[1] = -1;
+    _response.swap(response);
+    fcntl(clientFd, F_SETFL, fcntl(clientFd, F_GETFL) | O_NONBLOCK);
+}
+
+UploadSession::~UploadSession()
+{
+    if (_pipe[0] >= 0)
+    {
+        close(_pipe[0]);
+        close(_pipe[1]);
+    }
+    if (_file >= 0)
+        close(_file);
+    if (!_committed)
+        removePartial();
+}
+
+UploadSession::Result UploadSession::start(const char* data, size_t length)
+{
+    if (length > _remaining)
+        length = _remaining;
+    _remaining -= length;
+    if (_phase == BODY && !openFile(_target.path))
+        return fail(500);
+    Result result = consume(data, length);
+    if (result != CONTINUE)
+        return result;
+    return _remaining ? CONTINUE : complete();
+}
+
+// Moves what the socket has, up to MAX_PER_EVENT so one upload does not
+// hold up the other connections.
+UploadSession::Result UploadSession::readable()
+{
+    size_t moved = 0;
+    while (_remaining && moved < MAX_PER_EVENT)
+    {
+        ssize_t count;
+        if (_phase == PART_HEAD || _tls)
+        {
+            char buffer[65536];
+            count = TlsConnection::read(_tls, _clientFd, buffer,
+                _remaining < sizeof(buffer) ? _remaining : sizeof(buffer));
+            if (count > 0)
+            {
+                _remaining -= count;
+                Result result = consume(buffer, count);
+                if (result != CONTINUE)
+                    return result;
+            }
+        }
+        else
+            count = spliceIn(_remaining < PIPE_SIZE ? _remaining : PIPE_SIZE);
+        if (count == 0)
+            return CLIENT_GONE;
+        if (count < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return CLIENT_GONE;
+        }
+        Metrics::instance().bytesReceived(count);
+        moved += count;
+    }
+    return _remaining ? CONTINUE : complete();
+}
+
+LogFields& UploadSession::logFields()
+{
+    return _log;
+}
+
+ResponseBuilder& UploadSession::response()
+{
+    return _response;
+}
+
+int UploadSession::clientFd() const
+{
+    return _clientFd;
+}
+
+// The rest of the body is discarded and the request answered with status.
+UploadSession::Result UploadSession::fail(int status)
+{
+    if (_file >= 0)
+    {
+        close(_file);
+        _file = -1;
+    }
+    removePartial();
+    _phase = DISCARD;
+    ResponseBuilder response = HttpRequest::generateDefaultErrorPage(status);
+    _response.swap(response);
+    return _remaining ? CONTINUE : DONE;
+}
+
+// Body bytes that passed through user space: the part head is parsed from
+// them, the rest goes to the file.
+UploadSession::Result UploadSession::consume(const char* data, size_t length)
+{
+    if (_phase == BODY && !writeAll(data, length))
+        return fail(500);
+    if (_phase != PART_HEAD)
+        return CONTINUE;
+
+    _partHead.append(data, length);
+    size_t name = _partHead.find("filename=\"");
+    size_t nameEnd = name == std::string::npos ? name : _partHead.find('"', name + 10);
+    size_t headEnd = nameEnd == std::string::npos ? nameEnd : _partHead.find("\r\n\r\n", nameEnd);
+    if (headEnd == std::string::npos)
+        return _partHead.size() > MAX_PART_HEAD ? fail(400) : CONTINUE;
+
+    std::string fileName = _partHead.substr(name + 10, nameEnd - name - 10);
+    if (fileName.empty() || fileName.find('/') != std::string::npos || fileName == "." || fileName == "..")
+        return fail(400);
+    std::string rest = _partHead.substr(headEnd + 4);
+    std::string().swap(_partHead);
+    _phase = BODY;
+    if (!openFile(_target.directory + "/" + fileName))
+        return fail(500);
+    if (!writeAll(rest.data(), rest.size()))
+        return fail(500);
+    return CONTINUE;
+}
+
+// Preallocation is only a hint, except that a full disk fails the upload
+// before its body has been read.
+bool UploadSession::openFile(const std::string& path)
+{
+    _target.path = path;
+    if (_target.tmpfile)
+    {
+        _file = open(_target.directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+        if (_file < 0)
+            _target.tmpfile = false;
+    }
+    if (_file < 0)
+    {
+        static unsigned long uploads = 0;
+        char suffix[64];
+        std::snprintf(suffix, sizeof(suffix), ".upload-%d-%lu", static_cast<int>(getpid()), ++uploads);
+        _partial = path + suffix;
+        _file = open(_partial.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (_file < 0)
+        {
+            _partial.clear();
+            return false;
+        }
+    }
+    if (_target.length && fallocate(_file, FALLOC_FL_KEEP_SIZE, 0, _target.length) < 0 && errno == ENOSPC)
+        return false;
+    return true;
+}
+
+void UploadSession::removePartial()
+{
+    if (_partial.empty())
+        return;
+    unlink(_partial.c_str());
+    _partial.clear();
+}
+
+bool UploadSession::writeAll(const char* data, size_t length)
+{
+    while (length)
+    {
+        ssize_t count = write(_file, data, length);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        data += count;
+        length -= count;
+        _written += count;
+    }
+    return true;
+}
+
+// Socket to pipe to file. The pipe is emptied before the next splice, so
+// it never holds more than one read; a file that stops taking data fails
+// the upload and the rest of the read goes to /dev/null.
+ssize_t UploadSession::spliceIn(size_t length)
+{
+    if (_pipe[0] < 0)
+    {
+        if (pipe2(_pipe, O_CLOEXEC) < 0)
+        {
+            _pipe[0] = -1;
+            _pipe[1] = -1;
+            return -1;
+        }
+        fcntl(_pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+    }
+    if (_file < 0)
+        _file = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (_file < 0)
+        return -1;
+
+    ssize_t count = splice(_clientFd, NULL, _pipe[1], NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (count <= 0)
+        return count;
+    _remaining -= count;
+    for (ssize_t left = count; left > 0;)
+    {
+        ssize_t out = splice(_pipe[0], NULL, _file, NULL, left, SPLICE_F_MOVE);
+        if (out < 0 && errno == EINTR)
+            continue;
+        if (out <= 0)
+        {
+            if (_phase == DISCARD)
+                return -1;
+            fail(500);
+            _file = open("/dev/null", O_WRONLY | O_CLOEXEC);
+            if (_file < 0)
+                return -1;
+            continue;
+        }
+        if (_phase == BODY)
+            _written += out;
+        left -= out;
+    }
+    return count;
+}
+
+UploadSession::Result UploadSession::complete()
+{
+    if (_phase == DISCARD)
+        return DONE;
+    if (_phase == PART_HEAD || (!_target.boundary.empty() && !trimToDelimiter(_file, _target.boundary, _written)))
+        return fail(400);
+    if (!commit())
+        return fail(500);
+    return DONE;
+}
+
+// The file part ends at the first delimiter after it; whatever follows is
+// the other parts and the closing delimiter.
+bool UploadSession::trimToDelimiter(int file, const std::string& boundary, off_t& written)
+{
+    std::string delimiter = "\r\n" + boundary;
+    off_t window = written;
+    if (window > static_cast<off_t>(TRAILER_WINDOW + delimiter.size()))
+        window = TRAILER_WINDOW + delimiter.size();
+    std::string tail(window, '\0');
+    if (window && pread(file, &tail[0], window, written - window) != window)
+        return false;
+    size_t at = tail.find(delimiter);
+    if (at == std::string::npos)
+        return false;
+    written -= window - at;
+    return ftruncate(file, written) == 0;
+}
+
+// An O_TMPFILE has no name until it is linked; linking to a temporary name
+// and renaming over the target replaces an existing file atomically. A
+// named partial file is renamed the same way.
+bool UploadSession::commit()
+{
+    if (ftruncate(_file, _written) != 0)
+        return false;
+    if (!_target.tmpfile)
+    {
+        if (rename(_partial.c_str(), _target.path.c_str()) != 0)
+            return false;
+        _partial.clear();
+        _committed = true;
+        return true;
+    }
+    char procPath[64];
+    std::snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", _file);
+    char suffix[64];
+    std::snprintf(suffix, sizeof(suffix), ".upload-%d-%d", static_cast<int>(getpid()), _file);
+    std::string temporary = _target.path + suffix;
+    unlink(temporary.c_str());
+    if (linkat(AT_FDCWD, procPath, AT_FDCWD, temporary.c_str(), AT_SYMLINK_FOLLOW) != 0)
+        return false;
+    if (rename(temporary.c_str(), _target.path.c_str()) != 0)
+    {
+        unlink(temporary.c_str());
+        return false;
+    }
+    _committed = true;
+    return true;
+}
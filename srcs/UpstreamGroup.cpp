@@ -0,0 +1,350 @@
+#include "UpstreamGroup.hpp"
+#include "Proxy.hpp"
+#include <sstream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/* ------------------------------------------------------------------------ */
+/*                              UpstreamGroup                               */
+/* ------------------------------------------------------------------------ */
+
+// FNV-1a followed by the murmur3 finalizer, which spreads the ring points of
+// similar names ("host:port-1", "host:port-2") over the whole range.
+static uint32_t hashBytes(const char* data, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+UpstreamGroup::UpstreamGroup(const std::string& name)
+    : _name(name), _policy(ROUND_ROBIN), _cursor(0), _probeIntervalUs(0)
+{
+}
+
+std::map<std::string, UpstreamGroup*>& UpstreamGroup::registry()
+{
+    static std::map<std::string, UpstreamGroup*> groups;
+    return groups;
+}
+
+std::map<std::string, UpstreamGroup*>& UpstreamGroup::named()
+{
+    static std::map<std::string, UpstreamGroup*> groups;
+    return groups;
+}
+
+void UpstreamGroup::setPolicy(Policy policy)
+{
+    _policy = policy;
+}
+
+void UpstreamGroup::addServer(Upstream* server, unsigned long weight, unsigned long maxFails, unsigned long failTimeoutUs)
+{
+    Peer peer;
+    peer.server = server;
+    peer.weight = weight;
+    peer.maxFails = maxFails;
+    peer.failTimeoutUs = failTimeoutUs;
+    peer.currentWeight = 0;
+    peer.nextProbeUs = 0;
+    peer.probing = false;
+    _peers.push_back(peer);
+}
+
+void UpstreamGroup::setHealthCheck(unsigned long intervalUs, const std::string& uri)
+{
+    _probeIntervalUs = intervalUs;
+    _probeUri = uri;
+}
+
+std::string UpstreamGroup::signature() const
+{
+    std::ostringstream out;
+    out << _name << '\n' << _policy << ' ' << _probeIntervalUs << ' ' << _probeUri;
+    for (size_t i = 0; i < _peers.size(); ++i)
+    {
+        out << '\n' << _peers[i].server->name() << ' ' << _peers[i].weight << ' ' << _peers[i].maxFails
+            << ' ' << _peers[i].failTimeoutUs;
+    }
+    return out.str();
+}
+
+UpstreamGroup* UpstreamGroup::publish(UpstreamGroup* group)
+{
+    std::string key = group->signature();
+    std::map<std::string, UpstreamGroup*>::iterator it = registry().find(key);
+    if (it != registry().end())
+    {
+        delete group;
+        group = it->second;
+    }
+    else
+    {
+        if (group->_policy == HASH_URI)
+            group->buildRing();
+        registry()[key] = group;
+    }
+    named()[group->_name] = group;
+    return group;
+}
+
+void UpstreamGroup::beginConfiguration()
+{
+    named().clear();
+}
+
+UpstreamGroup* UpstreamGroup::find(const std::string& name)
+{
+    std::map<std::string, UpstreamGroup*>::iterator it = named().find(name);
+    return it == named().end() ? NULL : it->second;
+}
+
+UpstreamGroup* UpstreamGroup::forServer(Upstream* server)
+{
+    static std::map<Upstream*, UpstreamGroup*> groups;
+    std::map<Upstream*, UpstreamGroup*>::iterator it = groups.find(server);
+    if (it != groups.end())
+        return it->second;
+    UpstreamGroup* group = new UpstreamGroup(server->name());
+    group->addServer(server, 1, 0, 0);
+    groups[server] = group;
+    return group;
+}
+
+// RING_POINTS points per unit of weight, so adding or removing a server only
+// moves the keys that hash next to its points.
+void UpstreamGroup::buildRing()
+{
+    _ring.clear();
+    for (size_t i = 0; i < _peers.size(); ++i)
+    {
+        const std::string& name = _peers[i].server->name();
+        for (unsigned long point = 0; point < _peers[i].weight * RING_POINTS; ++point)
+        {
+            std::ostringstream key;
+            key << name << '-' << point;
+            std::string text = key.str();
+            _ring.push_back(std::make_pair(hashBytes(text.data(), text.size()), i));
+        }
+    }
+    std::sort(_ring.begin(), _ring.end());
+}
+
+// A group of one always returns its server: there is nothing to fail over
+// to, so it is worth trying.
+Upstream* UpstreamGroup::select(const StringRef& uri, unsigned long nowUs)
+{
+    if (_peers.size() == 1)
+        return _peers[0].server;
+    if (_policy == LEAST_CONN)
+        return selectLeastConn(nowUs);
+    if (_policy == HASH_URI)
+        return selectHash(uri, nowUs);
+    return selectRoundRobin(nowUs);
+}
+
+// nginx's smooth weighted round robin: weights 5,1,1 give a a b a c a a
+// rather than five a in a row.
+Upstream* UpstreamGroup::selectRoundRobin(unsigned long nowUs)
+{
+    Peer* best = NULL;
+    long total = 0;
+    for (size_t i = 0; i < _peers.size(); ++i)
+    {
+        Peer& peer = _peers[i];
+        if (!peer.server->available(nowUs))
+            continue;
+        peer.currentWeight += peer.weight;
+        total += peer.weight;
+        if (!best || peer.currentWeight > best->currentWeight)
+            best = &peer;
+    }
+    if (!best)
+        return NULL;
+    best->currentWeight -= total;
+    return best->server;
+}
+
+// Fewest requests in flight relative to weight. The scan starts after the
+// previous choice so ties rotate.
+Upstream* UpstreamGroup::selectLeastConn(unsigned long nowUs)
+{
+    size_t count = _peers.size();
+    size_t best = count;
+    for (size_t step = 0; step < count; ++step)
+    {
+        size_t i = (_cursor + step) % count;
+        const Peer& peer = _peers[i];
+        if (!peer.server->available(nowUs))
+            continue;
+        if (best == count
+            || peer.server->active() * _peers[best].weight < _peers[best].server->active() * peer.weight)
+            best = i;
+    }
+    if (best == count)
+        return NULL;
+    _cursor = best + 1;
+    return _peers[best].server;
+}
+
+// The first available server clockwise from the hash of the URI.
+Upstream* UpstreamGroup::selectHash(const StringRef& uri, unsigned long nowUs)
+{
+    if (_ring.empty())
+        return NULL;
+    std::vector<std::pair<uint32_t, size_t> >::const_iterator start
+        = std::lower_bound(_ring.begin(), _ring.end(), std::make_pair(hashBytes(uri.data, uri.length), static_cast<size_t>(0)));
+    size_t position = start - _ring.begin();
+    for (size_t step = 0; step < _ring.size(); ++step)
+    {
+        const Peer& peer = _peers[_ring[(position + step) % _ring.size()].second];
+        if (peer.server->available(nowUs))
+            return peer.server;
+    }
+    return NULL;
+}
+
+bool UpstreamGroup::failed(Upstream* server, unsigned long nowUs)
+{
+    if (_peers.size() == 1)
+        return false;
+    for (size_t i = 0; i < _peers.size(); ++i)
+    {
+        if (_peers[i].server == server)
+            return server->failed(nowUs, _peers[i].maxFails, _peers[i].failTimeoutUs);
+    }
+    return false;
+}
+
+const std::string& UpstreamGroup::name() const
+{
+    return _name;
+}
+
+UpstreamGroup::Policy UpstreamGroup::policy() const
+{
+    return _policy;
+}
+
+size_t UpstreamGroup::size() const
+{
+    return _peers.size();
+}
+
+UpstreamGroup::Peer& UpstreamGroup::peer(size_t index)
+{
+    return _peers[index];
+}
+
+const UpstreamGroup::Peer& UpstreamGroup::peer(size_t index) const
+{
+    return _peers[index];
+}
+
+unsigned long UpstreamGroup::healthCheckIntervalUs() const
+{
+    return _probeIntervalUs;
+}
+
+const std::string& UpstreamGroup::healthCheckUri() const
+{
+    return _probeUri;
+}
+
+/* ------------------------------------------------------------------------ */
+/*                               HealthProbe                                */
+/* ------------------------------------------------------------------------ */
+
+HealthProbe::HealthProbe(UpstreamGroup* group, size_t peer, int fd, unsigned long deadlineUs)
+    : _group(group), _peer(peer), _fd(fd), _deadlineUs(deadlineUs), _connecting(true), _sent(0), _healthy(false)
+{
+    _request = "GET " + group->healthCheckUri() + " HTTP/1.0\r\nHost: " + server()->name()
+        + "\r\nUser-Agent: webserv-health-check\r\nConnection: close\r\n\r\n";
+}
+
+bool HealthProbe::handle(short revents)
+{
+    if (_connecting)
+    {
+        if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+            return false;
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error)
+            return true;
+        _connecting = false;
+        revents |= POLLOUT;
+    }
+    if ((revents & POLLOUT) && _sent < _request.size())
+    {
+        ssize_t sent = send(_fd, _request.data() + _sent, _request.size() - _sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return true;
+        if (sent > 0)
+            _sent += sent;
+    }
+    if (!(revents & (POLLIN | POLLHUP | POLLERR)))
+        return false;
+
+    char buffer[512];
+    ssize_t received = recv(_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (received < 0)
+        return errno != EAGAIN && errno != EWOULDBLOCK;
+    if (received == 0)
+        return true;
+    _response.append(buffer, received);
+    if (_response.find('\n') == std::string::npos)
+        return _response.size() > sizeof(buffer);
+    if (_response.compare(0, 5, "HTTP/") == 0 && _response.size() > 12)
+    {
+        int status = std::atoi(_response.c_str() + 9);
+        _healthy = status >= 200 && status < 400;
+    }
+    return true;
+}
+
+short HealthProbe::events() const
+{
+    if (_connecting)
+        return POLLOUT;
+    return _sent < _request.size() ? POLLIN | POLLOUT : POLLIN;
+}
+
+UpstreamGroup::Peer& HealthProbe::peer() const
+{
+    return _group->peer(_peer);
+}
+
+Upstream* HealthProbe::server() const
+{
+    return _group->peer(_peer).server;
+}
+
+int HealthProbe::fd() const
+{
+    return _fd;
+}
+
+unsigned long HealthProbe::deadlineUs() const
+{
+    return _deadlineUs;
+}
+
+bool HealthProbe::healthy() const
+{
+    return _healthy;
+}
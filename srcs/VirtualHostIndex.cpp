@@ -0,0 +1,165 @@
+#include "VirtualHostIndex.hpp"
+#include "ServerConfig.hpp"
+#include <cstring>
+
+VirtualHostIndex::Slot::Slot() : hash(0), kind(0), port(0), config(-1)
+{
+}
+
+VirtualHostIndex::VirtualHostIndex() : _used(0)
+{
+}
+
+// FNV-1a over every key field; the separators keep ("ab", "c") and
+// ("a", "bc") apart.
+unsigned long VirtualHostIndex::hashKey(int kind, const char* host, size_t hostLen, const char* name, size_t nameLen, int port)
+{
+    unsigned long hash = 1469598103934665603UL;
+
+    hash = (hash ^ static_cast<unsigned char>(kind)) * 1099511628211UL;
+    for (size_t i = 0; i < hostLen; ++i)
+        hash = (hash ^ static_cast<unsigned char>(host[i])) * 1099511628211UL;
+    hash = (hash ^ 0xff) * 1099511628211UL;
+    for (size_t i = 0; i < nameLen; ++i)
+        hash = (hash ^ static_cast<unsigned char>(name[i])) * 1099511628211UL;
+    hash = (hash ^ 0xff) * 1099511628211UL;
+    for (int shift = 0; shift < 32; shift += 8)
+        hash = (hash ^ ((static_cast<unsigned int>(port) >> shift) & 0xff)) * 1099511628211UL;
+    return hash;
+}
+
+// Returns the slot holding the key, or the empty slot where it belongs.
+size_t VirtualHostIndex::probe(unsigned long hash, int kind, const char* host, size_t hostLen, const char* name, size_t nameLen, int port) const
+{
+    size_t mask = _slots.size() - 1;
+    size_t i = hash & mask;
+
+    while (_slots[i].config >= 0)
+    {
+        const Slot& slot = _slots[i];
+        if (slot.hash == hash && slot.kind == kind && slot.port == port
+            && slot.host.size() == hostLen && slot.name.size() == nameLen
+            && std::memcmp(slot.host.data(), host, hostLen) == 0
+            && std::memcmp(slot.name.data(), name, nameLen) == 0)
+            return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+void VirtualHostIndex::rehash(size_t slots)
+{
+    std::vector<Slot> old;
+    old.swap(_slots);
+    _slots.resize(slots);
+
+    size_t mask = _slots.size() - 1;
+    for (size_t i = 0; i < old.size(); ++i)
+    {
+        if (old[i].config < 0)
+            continue;
+        size_t j = old[i].hash & mask;
+        while (_slots[j].config >= 0)
+            j = (j + 1) & mask;
+        Slot& slot = _slots[j];
+        slot.hash = old[i].hash;
+        slot.kind = old[i].kind;
+        slot.port = old[i].port;
+        slot.config = old[i].config;
+        slot.host.swap(old[i].host);
+        slot.name.swap(old[i].name);
+    }
+}
+
+// Inserts the key for config unless an earlier config already owns it.
+// Returns the owner either way.
+int VirtualHostIndex::claim(Kind kind, const std::string& host, const std::string& name, int port, int config)
+{
+    if ((_used + 1) * 4 > _slots.size() * 3)
+        rehash(_slots.empty() ? 64 : _slots.size() * 2);
+
+    unsigned long hash = hashKey(kind, host.data(), host.size(), name.data(), name.size(), port);
+    Slot& slot = _slots[probe(hash, kind, host.data(), host.size(), name.data(), name.size(), port)];
+    if (slot.config >= 0)
+        return slot.config;
+    slot.hash = hash;
+    slot.kind = kind;
+    slot.port = port;
+    slot.config = config;
+    slot.host = host;
+    slot.name = name;
+    ++_used;
+    return config;
+}
+
+int VirtualHostIndex::find(Kind kind, const std::string& host, const std::string& name, int port) const
+{
+    return find(kind, host.data(), host.size(), name.data(), name.size(), port);
+}
+
+int VirtualHostIndex::find(Kind kind, const char* host, size_t hostLen, const char* name, size_t nameLen, int port) const
+{
+    if (_slots.empty())
+        return -1;
+    unsigned long hash = hashKey(kind, host, hostLen, name, nameLen, port);
+    return _slots[probe(hash, kind, host, hostLen, name, nameLen, port)].config;
+}
+
+// Same precedence as the original linear scan: the first block whose
+// server_name or host matches on this port, else the first block listening
+// on the port.
+int VirtualHostIndex::route(const char* host, size_t hostLen, int port) const
+{
+    int byName = find(NAME, "", 0, host, hostLen, port);
+    int byHost = find(HOST, host, hostLen, "", 0, port);
+
+    if (byName >= 0 && (byHost < 0 || byName < byHost))
+        return byName;
+    if (byHost >= 0)
+        return byHost;
+    return find(PORT, "", 0, "", 0, port);
+}
+
+void VirtualHostIndex::build(std::vector<ServerConfig>& configs)
+{
+    static const std::string none;
+
+    clear();
+    reserve(configs.size());
+    for (size_t i = 0; i < configs.size(); ++i)
+    {
+        const std::string& name = configs[i].getServerName();
+        const std::vector<int>& ports = configs[i].getPorts();
+
+        for (size_t p = 0; p < ports.size(); ++p)
+        {
+            if (!name.empty())
+                claim(NAME, none, name, ports[p], i);
+            claim(HOST, configs[i].getListenHost(p), none, ports[p], i);
+            claim(PORT, none, none, ports[p], i);
+        }
+    }
+}
+
+// Sizes the table for keys entries up front, so loading a large
+// configuration rehashes once instead of at every doubling.
+void VirtualHostIndex::reserve(size_t keys)
+{
+    size_t slots = 64;
+
+    while (slots * 3 < keys * 4)
+        slots *= 2;
+    if (slots > _slots.size())
+        rehash(slots);
+}
+
+void VirtualHostIndex::clear()
+{
+    _slots.clear();
+    _used = 0;
+}
+
+size_t VirtualHostIndex::size() const
+{
+    return _used;
+}
@@ -1,13 +1,16 @@
 #include <iostream>
 #include <csignal>
 #include "Server.hpp"
+#include "Logger.hpp"
 
 Server* globalServerPointer = NULL;
 
 void signalHandlerWrapper(int signal)
 {
-    if (signal == SIGINT && globalServerPointer != NULL)
-        globalServerPointer->stop();
+    if (signal == SIGUSR1)
+        Logger::requestReopen();
+    else if (globalServerPointer != NULL)
+        Server::signalHandler(signal);
 }
 
 int main(int argc, char* argv[])
@@ -22,8 +25,15 @@ int main(int argc, char* argv[])
     {
         Server server(configPath);
         globalServerPointer = &server;
+        server.setProgramPath(argv[0]);
 
         std::signal(SIGINT, signalHandlerWrapper);
+        std::signal(SIGTERM, signalHandlerWrapper);
+        std::signal(SIGHUP, signalHandlerWrapper);
+        std::signal(SIGUSR2, signalHandlerWrapper);
+        std::signal(SIGQUIT, signalHandlerWrapper);
+        std::signal(SIGUSR1, signalHandlerWrapper);
+        std::signal(SIGPIPE, SIG_IGN);
 
         server.run();
     }
@@ -1,5 +1,9 @@
 #include "ServerConfig.hpp"
 #include <iostream>
+#include <sstream>
+#include <cstring>
+#include <arpa/inet.h>
+#include "Metrics.hpp"
 
 void ServerConfig::setPort(int serverPort)
 {
@@ -22,6 +26,37 @@ const std::vector<int>& ServerConfig::getPorts() const
     return _ports;
 }
 
+const std::string& ServerConfig::getListenHost(size_t i) const
+{
+    return i < _listenHosts.size() && !_listenHosts[i].empty() ? _listenHosts[i] : _host;
+}
+
+// Unix sockets have no port, but virtual hosts are routed by the port a
+// connection arrived on. Each path gets a negative one of its own, derived
+// from the path so that it is the same in every generation and across a
+// binary upgrade.
+int ServerConfig::unixSocketPort(const std::string& path)
+{
+    unsigned long hash = 2166136261UL;
+    for (size_t i = 0; i < path.size(); ++i)
+        hash = ((hash ^ static_cast<unsigned char>(path[i])) * 16777619UL) & 0xffffffffUL;
+    return -static_cast<int>(hash & 0x3fffffff) - 1;
+}
+
+// "127.0.0.1:8080", "[::1]:8080" or "unix:/run/webserv.sock", for logs and
+// metric labels.
+std::string ServerConfig::listenName(const std::string& host, int port)
+{
+    if (port < 0)
+        return host;
+    std::ostringstream name;
+    if (host.find(':') != std::string::npos)
+        name << '[' << host << "]:" << port;
+    else
+        name << host << ':' << port;
+    return name.str();
+}
+
 void ServerConfig::setRoot(const std::string& rootPath)
 {
     _root = rootPath;
@@ -52,7 +87,19 @@ std::string ServerConfig::getErrorPage(int errorCode) const
     std::map<int, std::string>::const_iterator it = _error_pages.find(errorCode);
     if (it != _error_pages.end())
         return it->second;
-    return "";
+    switch (errorCode)
+    {
+        case 400: return "main/errors/400.html";
+        case 403: return "main/errors/403.html";
+        case 404: return "main/errors/404.html";
+        case 405: return "main/errors/405.html";
+        case 411: return "main/errors/411.html";
+        case 413: return "main/errors/413.html";
+        case 415: return "main/errors/415.html";
+        case 500: return "main/errors/500.html";
+        case 504: return "main/errors/504.html";
+        default: return "";
+    }
 }
 
 void ServerConfig::addLocation(const ServerLocation& location)
@@ -65,6 +112,138 @@ const std::vector<ServerLocation>& ServerConfig::getLocations() const
     return _locations;
 }
 
+const ServerLocation* ServerConfig::findLocation(const std::string& path) const
+{
+    return findLocation(path.c_str());
+}
+
+const ServerLocation* ServerConfig::findLocation(const char* path) const
+{
+    for (std::vector<ServerLocation>::const_iterator it = _locations.begin(); it != _locations.end(); ++it)
+    {
+        if (path == it->getPath())
+            return &*it;
+    }
+    return NULL;
+}
+
+// Proxied locations match by prefix, like bundles: the longest proxy_pass
+// location containing the path wins.
+const ServerLocation* ServerConfig::findProxyLocation(const char* path) const
+{
+    const ServerLocation* found = NULL;
+    size_t length = 0;
+    for (std::vector<ServerLocation>::const_iterator it = _locations.begin(); it != _locations.end(); ++it)
+    {
+        if (!it->getUpstream())
+            continue;
+        if (!length)
+            length = strlen(path);
+        if (it->contains(path, length) && (!found || it->getPath().size() > found->getPath().size()))
+            found = &*it;
+    }
+    return found;
+}
+
+// cgi_cache of the longest location containing the path that sets one,
+// else that of the server block. NULL when responses are not cached.
+const CachePolicy* ServerConfig::findCachePolicy(const char* path) const
+{
+    const ServerLocation* found = NULL;
+    size_t length = strlen(path);
+    for (std::vector<ServerLocation>::const_iterator it = _locations.begin(); it != _locations.end(); ++it)
+    {
+        if (it->getCachePolicy().enabled() && it->contains(path, length)
+            && (!found || it->getPath().size() > found->getPath().size()))
+            found = &*it;
+    }
+    if (found)
+        return &found->getCachePolicy();
+    return _cachePolicy.enabled() ? &_cachePolicy : NULL;
+}
+
+// Same lookup for gzip: a location that sets any gzip directive, else the
+// server block. NULL when neither gzip nor gzip_static is on.
+const GzipPolicy* ServerConfig::findGzipPolicy(const char* path) const
+{
+    const ServerLocation* found = NULL;
+    size_t length = strlen(path);
+    for (std::vector<ServerLocation>::const_iterator it = _locations.begin(); it != _locations.end(); ++it)
+    {
+        if (it->getGzipPolicy().configured && it->contains(path, length)
+            && (!found || it->getPath().size() > found->getPath().size()))
+            found = &*it;
+    }
+    const GzipPolicy& policy = found ? found->getGzipPolicy() : _gzip;
+    return policy.enabled() ? &policy : NULL;
+}
+
+// Limiter zones are named after the same label as the histograms, so the
+// zone of a block survives a reload and clients keep their buckets.
+static unsigned long limitZone(const std::string& label, const std::string& location)
+{
+    unsigned long hash = 1469598103934665603UL;
+    for (size_t i = 0; i < label.size(); ++i)
+        hash = (hash ^ static_cast<unsigned char>(label[i])) * 1099511628211UL;
+    hash = (hash ^ static_cast<unsigned char>('\n')) * 1099511628211UL;
+    for (size_t i = 0; i < location.size(); ++i)
+        hash = (hash ^ static_cast<unsigned char>(location[i])) * 1099511628211UL;
+    return hash;
+}
+
+// Resolves the latency histograms once, labelled by server_name (or
+// host:port) and location path, so requests only follow a pointer.
+void ServerConfig::registerMetrics()
+{
+    static const std::string none = "-";
+
+    _label = _serverName;
+    if (_label.empty())
+        _label = _ports.empty() ? _host : listenName(getListenHost(0), _ports[0]);
+    _latency = Metrics::instance().histogram(_label, none);
+    _clientLimit.zone = limitZone(_label, none);
+    for (size_t i = 0; i < _locations.size(); ++i)
+    {
+        _locations[i].setLatencyHistogram(Metrics::instance().histogram(_label, _locations[i].getPath()));
+        _locations[i].setLimitZone(limitZone(_label, _locations[i].getPath()));
+    }
+}
+
+const ClientLimit& ServerConfig::getClientLimit() const
+{
+    return _clientLimit;
+}
+
+const std::string& ServerConfig::getLabel() const
+{
+    return _label;
+}
+
+bool ServerConfig::http2Enabled() const
+{
+    return _http2;
+}
+
+bool ServerConfig::uploadTmpfile() const
+{
+    return _uploadTmpfile;
+}
+
+bool ServerConfig::isSslPort(int port) const
+{
+    return std::find(_sslPorts.begin(), _sslPorts.end(), port) != _sslPorts.end();
+}
+
+const TlsPolicy& ServerConfig::getTlsPolicy() const
+{
+    return _tls;
+}
+
+LatencyHistogram* ServerConfig::getLatencyHistogram() const
+{
+    return _latency;
+}
+
 void ServerConfig::setHost(const std::string& host)
 {
     if (!isValidIP(host)) {
@@ -91,6 +270,11 @@ void ServerConfig::setClientMaxBodySize(size_t size)
 
 bool ServerConfig::isValidIP(const std::string& ip) const
 {
+    if (ip.find(':') != std::string::npos)
+    {
+        struct in6_addr address;
+        return inet_pton(AF_INET6, ip.c_str(), &address) == 1;
+    }
     int segments = 0;  
     int value = 0;     
     int charCount = 0;
@@ -1,120 +1,176 @@
 #include "HttpRequest.hpp"
+#include "Upload.hpp"
+#include <fcntl.h>
 
-std::string HttpRequest::intToString(int value)
+// Returns the file a GET maps to, as a string owned by the request arena.
+const char* HttpRequest::resolveFilePath(const ServerConfig& config)
 {
-    std::ostringstream oss;
-    oss << value;
-    return oss.str();
-}
-
-std::string HttpRequest::resolveFilePath(const ServerConfig& config)
-{
-    std::string fullPath;
-    bool locationFound = false;
     const std::vector<ServerLocation>& locations = config.getLocations();
     for (std::vector<ServerLocation>::const_iterator it = locations.begin(); it != locations.end(); ++it)
     {
         if (this->_path == it->getPath())
         {
-            fullPath = it->getRoot() + it->getIndex();
-            locationFound = true;
-            break;
+            const std::string& root = it->getRoot();
+            const std::string& index = it->getIndex();
+            return _arena.concat(root.data(), root.size(), index.data(), index.size());
         }
     }
 
-    if (!locationFound)
-    {
-        if (this->_path == "/")
-            fullPath = config.getRoot() + config.getIndex();
-        else
-        {
-            fullPath = _path;
-            fullPath = config.getRoot() + fullPath.substr(1);
-        } 
-    }
-    return fullPath;
+    const std::string& root = config.getRoot();
+    if (this->_path == "/")
+        return _arena.concat(root.data(), root.size(), config.getIndex().data(), config.getIndex().size());
+    if (_path.empty())
+        return _arena.copy(root.data(), root.size());
+    return _arena.concat(root.data(), root.size(), _path.data + 1, _path.length - 1);
 }
 
-bool HttpRequest::isFileAccessible(const std::string& filePath)
+bool HttpRequest::isFileAccessible(const char* filePath)
 {
     struct stat fileStat;
-    if (stat(filePath.c_str(), &fileStat) != 0)
+    if (stat(filePath, &fileStat) != 0)
         return false;
-    if (access(filePath.c_str(), R_OK) != 0)
+    if (access(filePath, R_OK) != 0)
         return false;
     return true;
 }
 
-std::string HttpRequest::readFile(const std::string& filePath)
+// Reads into the caller's (pooled) buffer with plain syscalls: an ifstream
+// allocates its own buffer on every open.
+bool HttpRequest::readFile(const char* filePath, std::string& content)
 {
-    std::ifstream file(filePath.c_str(), std::ios::binary);
-    if (!file.is_open())
-        return "";
-    file.seekg(0, std::ios::end);
-    std::streamsize size = file.tellg();
-    file.seekg(0, std::ios::beg);
+    int fd = open(filePath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0)
+    {
+        close(fd);
+        return false;
+    }
 
-    if (size > 0 && size < std::numeric_limits<std::streamsize>::max())
+    content.clear();
+    size_t size = static_cast<size_t>(fileStat.st_size);
+    if (size == 0)
+    {
+        close(fd);
+        return true;
+    }
+    content.resize(size);
+    size_t total = 0;
+    while (total < size)
     {
-        std::vector<char> buffer(static_cast<size_t>(size));
-        if (file.read(buffer.data(), size))
-            return std::string(buffer.data(), size);
+        ssize_t bytes = read(fd, &content[total], size - total);
+        if (bytes <= 0)
+            break;
+        total += bytes;
     }
-    return "";
+    close(fd);
+    content.resize(total);
+    return total == size;
 }
 
 std::string HttpRequest::getMimeType(const std::string& filePath)
 {
-    std::map<std::string, std::string> mimeTypes;
-    mimeTypes[".php"] = "text/html";
-    mimeTypes[".html"] = "text/html";
-    mimeTypes[".css"] = "text/css";
-    mimeTypes[".js"] = "application/javascript";
-    mimeTypes[".jpg"] = "image/jpeg";
-    mimeTypes[".jpeg"] = "image/jpeg";
-    mimeTypes[".png"] = "image/png";
-    mimeTypes[".gif"] = "image/gif";
-    mimeTypes[".svg"] = "image/svg+xml";
-    mimeTypes[".ico"] = "image/x-icon";
-    mimeTypes[".json"] = "application/json";
-    mimeTypes[".xml"] = "application/xml";
-    mimeTypes[".txt"] = "text/plain";
-    mimeTypes[".py"] = "text/html";
-    mimeTypes[".mp4"] = "video/mp4";
-
-    size_t dotPos = filePath.find_last_of('.');
-    if (dotPos != std::string::npos)
+    return mimeTypeFor(filePath);
+}
+
+// Shared with tools/mkbundle, which stores the result in the bundle.
+const char* HttpRequest::mimeTypeFor(const std::string& filePath)
+{
+    return mimeTypeFor(filePath.c_str());
+}
+
+const char* HttpRequest::mimeTypeFor(const char* filePath)
+{
+    static const char* const mimeTypes[][2] = {
+        { ".php", "text/html" },
+        { ".html", "text/html" },
+        { ".css", "text/css" },
+        { ".js", "application/javascript" },
+        { ".jpg", "image/jpeg" },
+        { ".jpeg", "image/jpeg" },
+        { ".png", "image/png" },
+        { ".gif", "image/gif" },
+        { ".svg", "image/svg+xml" },
+        { ".ico", "image/x-icon" },
+        { ".json", "application/json" },
+        { ".xml", "application/xml" },
+        { ".txt", "text/plain" },
+        { ".py", "text/html" },
+        { ".mp4", "video/mp4" }
+    };
+
+    const char* extension = strrchr(filePath, '.');
+    if (extension)
     {
-        std::string extension = filePath.substr(dotPos);
-        if (mimeTypes.count(extension) > 0)
-            return mimeTypes[extension];
+        for (size_t i = 0; i < sizeof(mimeTypes) / sizeof(mimeTypes[0]); ++i)
+        {
+            if (strcmp(extension, mimeTypes[i][0]) == 0)
+                return mimeTypes[i][1];
+        }
     }
-
     return "application/octet-stream";
 }
 
-std::string HttpRequest::constructCGIResponse(const std::string& output)
+ResponseBuilder HttpRequest::constructCGIResponse(const std::string& output, const GzipPolicy* gzip, bool accepted)
 {
-    std::ostringstream oss;
-    oss << output.size();
+    CgiOutput parsed;
+    parsed.parse(output);
+    ResponseBuilder response;
+    parsed.build(response, gzip, accepted);
+    return response;
+}
 
-    std::string response = "HTTP/1.1 200 OK\r\n";
-    response += "Content-Length: " + oss.str() + "\r\n";
-    response += "Content-Type: text/html\r\n";
-    response += "\r\n";
-    response += output;
+const GzipPolicy* HttpRequest::gzipPolicy(const ServerConfig& config, bool& accepted) const
+{
+    const GzipPolicy* gzip = config.findGzipPolicy(getPath());
+    accepted = gzip && Gzip::accepted(header("Accept-Encoding"));
+    return gzip;
+}
 
-    return response;
+// gzip_static: serves filePath.gz as it is when the client accepts gzip.
+// found tells whether the sibling exists, in which case the response varies
+// on Accept-Encoding whatever the client sent.
+bool HttpRequest::readGzipSibling(const char* filePath, bool accepted, ResponseBuilder& response, bool& found)
+{
+    const char* siblingPath = _arena.concat(filePath, strlen(filePath), ".gz", 3);
+    struct stat siblingStat;
+    found = stat(siblingPath, &siblingStat) == 0 && S_ISREG(siblingStat.st_mode);
+    if (!found)
+        return false;
+    response.header("Vary", "Accept-Encoding");
+    if (!accepted || !readFile(siblingPath, response.bodyBuffer()))
+        return false;
+    response.header("Content-Encoding", "gzip");
+    return true;
+}
+
+// The compressed variant is memoized per file and modification time, so a
+// file is compressed once however often it is served. It is copied into
+// the response: the memo may be replaced before the response is sent.
+void HttpRequest::compressStatic(const GzipPolicy& gzip, const char* filePath, bool accepted, ResponseBuilder& response)
+{
+    if (!gzip.compresses(mimeTypeFor(filePath), response.bodySize()))
+        return;
+    response.header("Vary", "Accept-Encoding");
+    struct stat fileStat;
+    if (!accepted || stat(filePath, &fileStat) != 0)
+        return;
+    const std::string* variant = Gzip::staticVariant(filePath, fileStat, response.bodyBuffer(), gzip.level);
+    if (!variant)
+        return;
+    response.bodyBuffer().assign(*variant);
+    response.header("Content-Encoding", "gzip");
 }
 
 std::vector<char*> HttpRequest::setupCGIEnvironment(const std::string& scriptPath)
 {
     std::vector<std::string> envVars;
 
-    envVars.push_back("REQUEST_METHOD=" + _method);
+    envVars.push_back(std::string("REQUEST_METHOD=") + _method.data);
     envVars.push_back("SCRIPT_FILENAME=" + scriptPath);
-    envVars.push_back("CONTENT_LENGTH=" + intToString(_body.size()));
-    envVars.push_back("CONTENT_TYPE=" + _headers["Content-Type"]);
+    envVars.push_back("CONTENT_LENGTH=" + ResponseBuilder::toString(_body.size() + _bodyOnSocket));
+    envVars.push_back("CONTENT_TYPE=" + getHeaderValue("Content-Type"));
     envVars.push_back("GATEWAY_INTERFACE=CGI/1.1");
     envVars.push_back("SERVER_PROTOCOL=HTTP/1.1");
     envVars.push_back("REDIRECT_STATUS=200");
@@ -164,7 +220,7 @@ bool  HttpRequest::ensureUploadDirectoryExists()
     return true;
 }
 
-std::string HttpRequest::uploadTxt(ServerConfig& config, std::string response)
+ResponseBuilder HttpRequest::uploadTxt(ServerConfig& config)
 {
     std::string fileName = extractJsonValue(this->_body, "fileName");
     std::string fileContent = extractJsonValue(this->_body, "fileContent");
@@ -183,14 +239,57 @@ std::string HttpRequest::uploadTxt(ServerConfig& config, std::string response)
     outFile.write(fileContent.c_str(), fileContent.size());
     outFile.close();
 
-    response = "HTTP/1.1 201 Created\r\n";
-    response += "Content-Length: 0\r\n";
-    response += "Content-Type: text/plain\r\n";
-    response += "\r\n";
+    ResponseBuilder response(201);
+    response.header("Content-Type", "text/plain");
     return response;
 }
 
-std::string HttpRequest::uploadFile(ServerConfig& config, std::string response, std::string contentType)
+// Follows the checks handleRequest and handlePost make before they write.
+int HttpRequest::uploadPlan(ServerConfig& config, UploadTarget& target)
+{
+    if (_method != "POST" || _contentLength == 0)
+        return -1;
+    target.length = _contentLength;
+    if (target.length > static_cast<unsigned long>(config.getClientMaxBodySize()))
+        return 413;
+
+    const std::vector<ServerLocation>& locations = config.getLocations();
+    for (std::vector<ServerLocation>::const_iterator it = locations.begin(); it != locations.end(); ++it)
+    {
+        if (it->getBundle() && it->contains(_path.data, _path.length))
+            return -1;
+        if (_path == it->getPath())
+        {
+            if (!it->isPostAllowed())
+                return 405;
+            if (it->isStubStatus() || it->isTraceDump())
+                return -1;
+        }
+        if ("/post" == it->getPath() && _path != "/cgi-bin/auth.py" && !it->isPostAllowed())
+            return 405;
+    }
+
+    StringRef contentType = header("Content-Type");
+    if (contentType.contains("multipart/form-data"))
+    {
+        std::string type = contentType.str();
+        size_t boundary = type.find("boundary=");
+        if (boundary == std::string::npos)
+            return 400;
+        target.boundary = "--" + type.substr(boundary + 9);
+    }
+    else if (contentType.contains("plain/text"))
+        target.path = std::string(resolveFilePath(config)) + "/plain_text.txt";
+    else
+        return -1;
+    if (!ensureUploadDirectoryExists())
+        return 500;
+    target.directory = target.boundary.empty() ? target.path.substr(0, target.path.rfind('/')) : "var/www/upload";
+    target.tmpfile = config.uploadTmpfile();
+    return 0;
+}
+
+ResponseBuilder HttpRequest::uploadFile(ServerConfig& config, const std::string& contentType)
 {
     std::string boundary = "--" + contentType.substr(contentType.find("boundary=") + 9);
     size_t fileStartPos = _body.find("filename=\"");
@@ -207,13 +306,11 @@ std::string HttpRequest::uploadFile(ServerConfig& config, std::string response,
     std::ofstream outFile(targetPath.c_str(), std::ios::binary);
     if (!outFile.is_open())
         return findErrorPage(config, 500);
-    outFile.write(fileContent.c_str(), fileContent.size() - 46);
+    outFile.write(fileContent.c_str(), fileContent.size());
     outFile.close();
 
-    response = "HTTP/1.1 201 Created\r\n";
-    response += "Content-Length: 0\r\n";
-    response += "Content-Type: text/plain\r\n";
-    response += "\r\n";
+    ResponseBuilder response(201);
+    response.header("Content-Type", "text/plain");
     return response;
 }
 
@@ -230,31 +327,33 @@ int HttpRequest::extractStatusCode(const std::string& response)
     return 0;
 }
 
-std::string HttpRequest::generateDefaultErrorPage(int errorCode)
+ResponseBuilder HttpRequest::generateDefaultErrorPage(int errorCode)
 {
-    std::ostringstream response;
-    response << "<html><body><h1>Error " << errorCode << "</h1></body></html>";
-
-    std::ostringstream httpResponse;
-    httpResponse << "HTTP/1.1 " << errorCode << " Error\r\n";
-    httpResponse << "Content-Type: text/html\r\n";
-    httpResponse << "Content-Length: " << response.str().size() << "\r\n";
-    httpResponse << "\r\n";
-    httpResponse << response.str();
-
-    return httpResponse.str();
+    ResponseBuilder response(errorCode);
+    std::string& page = response.bodyBuffer();
+
+    page = "<html><body><h1>Error ";
+    page += ResponseBuilder::toString(errorCode);
+    page += " ";
+    page += ResponseBuilder::reasonPhrase(errorCode);
+    page += "</h1></body></html>";
+    response.header("Content-Type", "text/html");
+    return response;
 }
 
-std::string HttpRequest::getHeaderValue(const std::string& headerName) const
+// Header names compare case-insensitively. The returned value stays valid
+// until the request arena is released.
+StringRef HttpRequest::header(const char* name) const
 {
-    std::map<std::string, std::string>::const_iterator it = _headers.find(headerName);
-    if (it != _headers.end())
+    for (size_t i = 0; i < _headerCount; ++i)
     {
-        std::string value = it->second;
-        if (!value.empty() && (value[value.size() - 1] == '\n' || value[value.size() - 1] == '\r')) {
-            value.erase(value.size() - 1);
-        }
-        return value;
+        if (_headers[i].name.equalsIgnoreCase(name))
+            return _headers[i].value;
     }
-    return "";
+    return StringRef();
+}
+
+std::string HttpRequest::getHeaderValue(const std::string& headerName) const
+{
+    return header(headerName.c_str()).str();
 }
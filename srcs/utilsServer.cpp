@@ -1,17 +1,34 @@
 #include "Server.hpp"
 #include "HttpRequest.hpp"
 #include "ServerConfig.hpp"
-
-Server::Server(const std::string configFile) : running(false)
+#include "Logger.hpp"
+#include "Bundle.hpp"
+#include <climits>
+#include <fcntl.h>
+
+Server::Server(const std::string configFile)
+    : running(false), _configFile(configFile), _generation(new ConfigGeneration()),
+      _upgradePid(0), _upgradeParent(0), _draining(false), _drainDeadlineUs(0), _activeRequests(0),
+      _spareFd(-1), _loopLagUs(0), _bufferedBytes(0)
 {
     logMessage("INFO", "Initializing the server...");
+    _generation->id = 1;
+    _generation->references = 0;
     try
     {
-        if (!parseConfigFile(configFile))
+        if (!parseConfigFile(configFile, *_generation, _settings))
             throw std::runtime_error("Failed to parse configuration file: " + configFile);
-        validateServerConfigurations();
-        if (_configs.empty())
+        applySettings(_settings);
+        if (_settings.eventEngine == "io_uring" && !_events.useUring())
+            logMessage("WARNING", "io_uring is not available, falling back to poll()");
+        logMessage("INFO", std::string("Event engine: ") + _events.name());
+        validateServerConfigurations(_generation->configs);
+        if (_generation->configs.empty())
             throw std::runtime_error("Failed to parse configuration file: 0 valid config");
+        _generation->index.build(_generation->configs);
+        registerMetrics();
+        _spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        adoptInheritedSockets();
         initSockets();
     }
     catch (const std::exception& e)
@@ -24,143 +41,392 @@ Server::Server(const std::string configFile) : running(false)
 
 Server::~Server()
 {
+    if (_spareFd >= 0)
+        close(_spareFd);
     cleanupSockets();
+    destroyGenerations();
+    for (std::map<int, InFlight>::iterator it = _inflight.begin(); it != _inflight.end(); ++it)
+    {
+        delete it->second.request;
+        delete it->second.arena;
+    }
+    for (std::map<int, ProxySession*>::iterator it = _proxyClients.begin(); it != _proxyClients.end(); ++it)
+    {
+        close(it->second->upstreamFd());
+        delete it->second;
+    }
+    for (std::map<int, Upstream*>::iterator it = _idleUpstreams.begin(); it != _idleUpstreams.end(); ++it)
+        close(it->first);
+    for (std::map<int, UploadSession*>::iterator it = _uploads.begin(); it != _uploads.end(); ++it)
+        delete it->second;
+    for (std::map<int, CgiSession*>::iterator it = _cgiClients.begin(); it != _cgiClients.end(); ++it)
+        delete it->second;
+    for (std::map<CgiSession*, CgiStream>::iterator it = _cgiStreams.begin(); it != _cgiStreams.end(); ++it)
+        delete it->first;
+    for (std::map<int, HealthProbe*>::iterator it = _probes.begin(); it != _probes.end(); ++it)
+    {
+        close(it->first);
+        delete it->second;
+    }
+    for (std::map<int, CacheFill*>::iterator it = _cacheFills.begin(); it != _cacheFills.end(); ++it)
+        delete it->second;
+    for (std::map<int, Http2Session*>::iterator it = _http2Clients.begin(); it != _http2Clients.end(); ++it)
+        delete it->second;
+    for (std::map<int, TlsConnection*>::iterator it = _tlsClients.begin(); it != _tlsClients.end(); ++it)
+        delete it->second;
+    for (std::map<int, TlsContext*>::iterator it = _tlsContexts.begin(); it != _tlsContexts.end(); ++it)
+        delete it->second;
 }
 
 void Server::cleanup()
 {
     logMessage("INFO", "Cleaning up resources...");
-    _configs.clear();
     cleanupSockets();
+    destroyGenerations();
+}
+
+// The upgrade path execs this file again, so resolve it now: a bare name was
+// found through PATH and only /proc knows where.
+void Server::setProgramPath(const std::string& path)
+{
+    char resolved[PATH_MAX];
+    ssize_t len;
+
+    if (path.find('/') != std::string::npos && realpath(path.c_str(), resolved))
+        _programPath = resolved;
+    else if ((len = readlink("/proc/self/exe", resolved, sizeof(resolved) - 1)) > 0)
+        _programPath = std::string(resolved, len);
+    else
+        _programPath = path;
 }
 
-bool Server::parseConfigFile(std::string configFile)
+// Upstream blocks are parsed first so a proxy_pass can name a group defined
+// anywhere in the file.
+bool Server::parseConfigFile(std::string configFile, ConfigGeneration& generation, GlobalSettings& settings)
 {
-    if (parseFileInBlock(configFile) == false)
+    std::vector<ServerConfig>& configs = generation.configs;
+    serverBlocks.clear();
+    upstreamBlocks.clear();
+    if (parseFileInBlock(configFile, settings) == false)
         return false;
 
+    UpstreamGroup::beginConfiguration();
+    ServerConfig::beginConfiguration();
+    for (std::vector<std::string>::iterator it = upstreamBlocks.begin(); it != upstreamBlocks.end(); ++it)
+    {
+        try
+        {
+            generation.upstreams.push_back(ServerConfig::parseUpstreamBlock(*it));
+        }
+        catch (const std::runtime_error& e)
+        {
+            std::cerr << "[ERROR] parsing upstream block failed : " << e.what() << std::endl;
+        }
+    }
+
+    // Sized once and parsed in place: a block that fails resets its slot
+    // for the next one, and the unused tail is cut at the end.
+    size_t kept = 0;
+    configs.resize(serverBlocks.size());
     for (std::vector<std::string>::iterator it = serverBlocks.begin(); it != serverBlocks.end(); ++it)
     {
-        ServerConfig config;
         try
         {
-            config.parseServerBlock(*it);
-            _configs.push_back(config);
+            configs[kept].parseServerBlock(*it);
+            ++kept;
         }
         catch (const std::runtime_error& e)
         {
             std::cerr << "[ERROR] parsing server block failed : " << e.what() << std::endl;
-            config.clear();
+            configs[kept] = ServerConfig();
         }
     }
+    configs.erase(configs.begin() + kept, configs.end());
 
-    return !_configs.empty();
+    for (std::vector<ServerConfig>::iterator config = configs.begin(); config != configs.end(); ++config)
+    {
+        const std::vector<ServerLocation>& locations = config->getLocations();
+        for (std::vector<ServerLocation>::const_iterator it = locations.begin(); it != locations.end(); ++it)
+        {
+            const Bundle* bundle = it->getBundle();
+            if (bundle && std::find(generation.bundles.begin(), generation.bundles.end(), bundle) == generation.bundles.end())
+            {
+                Bundle::acquire(bundle);
+                generation.bundles.push_back(bundle);
+            }
+        }
+    }
+    return !configs.empty();
 }
 
-void Server::validateServerConfigurations()
+Server::ConfigGeneration::~ConfigGeneration()
 {
-    for (size_t i = 0; i < _configs.size(); ++i)
-    {
-        const std::string& host1 = _configs[i].getHost();
-        const std::vector<int>& ports1 = _configs[i].getPorts();
-        const std::string& serverName1 = _configs[i].getServerName();
+    for (size_t i = 0; i < bundles.size(); ++i)
+        Bundle::release(bundles[i]);
+}
 
-        bool shouldEraseI = false;  // Déclaration ici (en dehors de la boucle j)
+// Blocks sharing host and port must differ by server_name. Two unnamed
+// blocks on the same address are both dropped; a repeated server_name drops
+// the later block. One pass over a hash of (host, server_name, port), so
+// tens of thousands of virtual hosts validate in linear time.
+void Server::validateServerConfigurations(std::vector<ServerConfig>& configs)
+{
+    VirtualHostIndex claimed;
+    std::vector<bool> dropped(configs.size(), false);
+    size_t droppedCount = 0;
 
-        for (size_t j = i + 1; j < _configs.size();)
-        {
-            const std::string& host2 = _configs[j].getHost();
-            const std::vector<int>& ports2 = _configs[j].getPorts();
-            const std::string& serverName2 = _configs[j].getServerName();
+    claimed.reserve(configs.size());
 
-            bool shouldEraseJ = false;
+    for (size_t j = 0; j < configs.size(); ++j)
+    {
+        const std::vector<int>& ports = configs[j].getPorts();
+        const std::string& serverName = configs[j].getServerName();
 
-            for (size_t p1 = 0; p1 < ports1.size(); ++p1)
+        for (size_t p = 0; p < ports.size() && !dropped[j]; ++p)
+        {
+            const std::string& host = configs[j].getListenHost(p);
+            int owner = claimed.find(VirtualHostIndex::EXACT, host, serverName, ports[p]);
+            if (owner < 0)
+                continue;
+            if (serverName.empty())
             {
-                for (size_t p2 = 0; p2 < ports2.size(); ++p2)
-                {
-                    if (ports1[p1] == ports2[p2] && host1 == host2)
-                    {
-                        if (serverName1.empty() && serverName2.empty())
-                        {
-                            std::cout << "Multiple servers on the same host ("
-                                      << host1 << ") and port (" << intToString(ports1[p1])
-                                      << ") without server_name." << std::endl;
-                            shouldEraseI = true;
-                            shouldEraseJ = true;
-                        }
-                        else if (!serverName1.empty() && !serverName2.empty() && serverName1 == serverName2)
-                        {
-                            std::cout << "Duplicate server_name (" << serverName1
-                                      << ") on the same host (" << host1
-                                      << ") and port (" << intToString(ports1[p1]) << ")." << std::endl;
-                            shouldEraseJ = true;
-                        }
-                    }
-                }
+                std::cout << "Multiple servers on the same address ("
+                          << ServerConfig::listenName(host, ports[p])
+                          << ") without server_name." << std::endl;
+                droppedCount += !dropped[owner];
+                dropped[owner] = true;
             }
-            if (shouldEraseJ)
+            else
             {
-                _configs.erase(_configs.begin() + j);
-                continue;  // Ne pas incrémenter j, car l'élément suivant prend sa place
+                std::cout << "Duplicate server_name (" << serverName
+                          << ") on the same address ("
+                          << ServerConfig::listenName(host, ports[p]) << ")." << std::endl;
             }
-            ++j;  // Incrément si pas de suppression
+            dropped[j] = true;
+            ++droppedCount;
         }
-        if (shouldEraseI)
-        {
-            _configs.erase(_configs.begin() + i);
-            --i;  // Revenir en arrière car l'élément i a été supprimé
+        if (dropped[j])
+            continue;
+        for (size_t p = 0; p < ports.size(); ++p)
+            claimed.claim(VirtualHostIndex::EXACT, configs[j].getListenHost(p), serverName, ports[p], j);
+    }
+
+    if (droppedCount == 0)
+        return;
+    std::vector<ServerConfig> kept;
+    kept.reserve(configs.size() - droppedCount);
+    for (size_t i = 0; i < configs.size(); ++i)
+    {
+        if (!dropped[i])
+            kept.push_back(configs[i]);
+    }
+    configs.swap(kept);
+}
+
+void Server::registerMetrics()
+{
+    for (size_t i = 0; i < _generation->configs.size(); ++i)
+        _generation->configs[i].registerMetrics();
+    Metrics::instance().setUpstreamGroups(_generation->upstreams);
+}
+
+// SIGHUP: parse the file again into a fresh generation. On any error the
+// running generation is kept untouched. Otherwise new connections and new
+// requests use the new generation, listeners are synced, and the previous
+// generation is freed once its last in-flight request completes.
+void Server::reload()
+{
+    GlobalSettings settings;
+    ConfigGeneration* next = new ConfigGeneration();
+
+    logMessage("INFO", "Reloading configuration from " + _configFile);
+    next->id = _generation->id + 1;
+    next->references = 0;
+    try
+    {
+        if (!parseConfigFile(_configFile, *next, settings))
+            throw std::runtime_error("Failed to parse configuration file: " + _configFile);
+        validateServerConfigurations(next->configs);
+        if (next->configs.empty())
+            throw std::runtime_error("Failed to parse configuration file: 0 valid config");
+        next->index.build(next->configs);
+        applySettings(settings);
+    }
+    catch (const std::exception& e)
+    {
+        delete next;
+        try {
+            applySettings(_settings);
+        }
+        catch (const std::exception&) {
         }
+        logMessage("ERROR", std::string("Reload failed, keeping generation ") + intToString(_generation->id) + ": " + e.what());
+        return;
     }
+
+    if (settings.eventEngine != _settings.eventEngine)
+        logMessage("WARNING", "event_engine is only read at startup, keeping " + std::string(_events.name()));
+    settings.eventEngine = _settings.eventEngine;
+    _settings = settings;
+    ConfigGeneration* previous = _generation;
+    _generation = next;
+    registerMetrics();
+    initSockets();
+    logMessage("INFO", "Configuration generation " + intToString(next->id) + " active with "
+        + intToString(next->configs.size()) + " server block(s)");
+    if (previous->references == 0)
+        delete previous;
+    else
+        logMessage("INFO", "Generation " + intToString(previous->id) + " retires after "
+            + intToString(previous->references) + " in-flight request(s)");
 }
 
+// The map entry lives as long as the connection (removeClient erases it);
+// between requests it holds NULL.
+void Server::pinGeneration(int client_fd)
+{
+    ConfigGeneration*& pinned = _clientGeneration[client_fd];
+    if (pinned == _generation)
+        return;
+    if (pinned)
+        releaseGeneration(client_fd);
+    ++_generation->references;
+    pinned = _generation;
+}
 
+void Server::releaseGeneration(int client_fd)
+{
+    std::map<int, ConfigGeneration*>::iterator it = _clientGeneration.find(client_fd);
+    if (it == _clientGeneration.end() || !it->second)
+        return;
+    ConfigGeneration* generation = it->second;
+    it->second = NULL;
+    if (--generation->references == 0 && generation != _generation)
+    {
+        logMessage("INFO", "Generation " + intToString(generation->id) + " retired");
+        delete generation;
+    }
+}
+
+void Server::destroyGenerations()
+{
+    std::vector<ConfigGeneration*> retired;
+    for (std::map<int, ConfigGeneration*>::iterator it = _clientGeneration.begin(); it != _clientGeneration.end(); ++it)
+    {
+        if (it->second && it->second != _generation && std::find(retired.begin(), retired.end(), it->second) == retired.end())
+            retired.push_back(it->second);
+    }
+    for (size_t i = 0; i < retired.size(); ++i)
+        delete retired[i];
+    _clientGeneration.clear();
+    delete _generation;
+    _generation = NULL;
+}
 
+// Moves block to the end of blocks. Growing the vector would copy every
+// block read so far, so the blocks are swapped into the larger one instead.
+// block is left empty with room for one like it: generated configurations
+// repeat the same block thousands of times.
+static void appendBlock(std::vector<std::string>& blocks, std::string& block)
+{
+    if (blocks.size() == blocks.capacity())
+    {
+        std::vector<std::string> grown;
+        grown.reserve(blocks.empty() ? 16 : blocks.size() * 2);
+        grown.resize(blocks.size());
+        for (size_t i = 0; i < blocks.size(); ++i)
+            grown[i].swap(blocks[i]);
+        blocks.swap(grown);
+    }
+    blocks.push_back(std::string());
+    blocks.back().swap(block);
+    block.reserve(blocks.back().size());
+}
 
-bool Server::parseFileInBlock(std::string configFile)
+// Few lines hold a brace, so memchr skips most of them in one step.
+static int countChar(const char* begin, const char* end, char c)
 {
-    std::ifstream file(configFile.c_str());
+    int count = 0;
+
+    while ((begin = static_cast<const char*>(std::memchr(begin, c, end - begin))) != NULL)
+    {
+        ++count;
+        ++begin;
+    }
+    return count;
+}
+
+// The file is read whole and cut into lines in place: with tens of
+// thousands of server blocks, a string per line was a large share of
+// startup time.
+bool Server::parseFileInBlock(std::string configFile, GlobalSettings& settings)
+{
+    std::ifstream file(configFile.c_str(), std::ios::binary);
     if (!file.is_open())
     {
         std::cerr << "Error: Unable to open config file: " << configFile << std::endl;
         return false;
     }
+    std::string contents;
+    file.seekg(0, std::ios::end);
+    std::streamoff size = file.tellg();
+    file.seekg(0, std::ios::beg);
+    if (size > 0)
+    {
+        contents.resize(static_cast<size_t>(size));
+        file.read(&contents[0], size);
+        contents.resize(static_cast<size_t>(file.gcount()));
+    }
 
-    std::string line;
+    const char* data = contents.data();
+    std::string trimmedLine;
     std::string currentBlock;
-    bool inServerBlock = false;
+    std::vector<std::string>* blocks = NULL;
     int braceCount = 0;
 
-    while (std::getline(file, line))
+    for (size_t pos = 0, end; pos < contents.size(); pos = end + 1)
     {
-        std::string trimmedLine = line;
-        trimmedLine.erase(0, trimmedLine.find_first_not_of(" \t"));
-        trimmedLine.erase(trimmedLine.find_last_not_of(" \t") + 1);
+        const char* newline = static_cast<const char*>(std::memchr(data + pos, '\n', contents.size() - pos));
+        end = newline ? newline - data : contents.size();
+        size_t first = contents.find_first_not_of(" \t\r", pos);
+        if (first >= end || data[first] == '#')
+            continue;
+        size_t last = contents.find_last_not_of(" \t\r", end - 1);
+        bool serverStart = contents.compare(first, 8, "server {") == 0;
+        bool upstreamStart = !blocks && contents.compare(first, 9, "upstream ") == 0
+            && data[last] == '{';
+        if (!blocks && !serverStart && !upstreamStart)
+        {
+            if (!parseGlobalDirective(trimmedLine.assign(contents, first, last + 1 - first), settings))
+                return false;
+            continue;
+        }
 
-        if (trimmedLine.empty() || trimmedLine[0] == '#')
+        if (upstreamStart)
+        {
+            blocks = &upstreamBlocks;
+            braceCount = 1;
+            currentBlock.assign(contents, first, last + 1 - first).push_back('\n');
             continue;
+        }
 
-        if (trimmedLine.find("server {") == 0)
+        if (serverStart)
         {
-            inServerBlock = true;
+            blocks = &serverBlocks;
             braceCount = 1;
             currentBlock = "server {\n";
             continue;
         }
 
-        if (inServerBlock)
+        if (blocks)
         {
-            currentBlock += line + "\n";
-            for (size_t i = 0; i < line.length(); ++i)
-            {
-                if (line[i] == '{') ++braceCount;
-                if (line[i] == '}') --braceCount;
-            }
+            currentBlock.append(contents, pos, end - pos).push_back('\n');
+            braceCount += countChar(data + first, data + last + 1, '{');
+            braceCount -= countChar(data + first, data + last + 1, '}');
             if (braceCount == 0)
             {
-                inServerBlock = false;
-                serverBlocks.push_back(currentBlock);
-                currentBlock.clear();
+                appendBlock(*blocks, currentBlock);
+                blocks = NULL;
             }
             else if (braceCount < 0)
             {
@@ -170,67 +436,213 @@ bool Server::parseFileInBlock(std::string configFile)
         }
     }
 
-    if (inServerBlock)
+    if (blocks)
     {
-        std::cerr << "Error: Unclosed server block at end of file." << std::endl;
+        std::cerr << "Error: Unclosed " << (blocks == &serverBlocks ? "server" : "upstream") << " block at end of file." << std::endl;
         return false;
     }
     return true;
 }
 
-void Server::logMessage(const std::string& level, const std::string& message) const
+Server::Limits::Limits()
+    : workerConnections(1024), backlog(511), memoryLimit(0), shedLagUs(0), retryAfter(5)
 {
-    std::time_t now = std::time(NULL);
-    std::tm* localTime = std::localtime(&now);
-    char timeBuffer[20];
-
-    std::strftime(timeBuffer, sizeof(timeBuffer), "%Y-%m-%d %H:%M:%S", localTime);
-    std::cout << "[" << level << "] " << timeBuffer << " - " << message << std::endl;
 }
 
-std::string Server::logMessageError(const std::string& level, const std::string& message) const
+Server::CacheSettings::CacheSettings()
+    : memoryLimit(ResponseCache::DEFAULT_MEMORY), diskLimit(ResponseCache::DEFAULT_DISK)
 {
-    std::time_t now = std::time(NULL);
-    std::tm* localTime = std::localtime(&now);
+}
 
-    char timeBuffer[20];
-    std::strftime(timeBuffer, sizeof(timeBuffer), "%Y-%m-%d %H:%M:%S", localTime);
+Server::TraceSettings::TraceSettings()
+    : sampleEvery(0), thresholdUs(0), capacity(Tracer::DEFAULT_CAPACITY), slowUs(0)
+{
+}
 
-    std::ostringstream oss;
-    oss << "[" << level << "] " << timeBuffer << " - " << message;
+Server::GlobalSettings::GlobalSettings()
+    : accessLogPath("-"), errorLogPath("-"), slowLogPath(""), logPolicy("drop"), eventEngine("poll")
+{
+}
 
-    return oss.str();
+// Hands the logging, cache and tracing settings to their subsystems. The
+// limits are read where they apply.
+void Server::applySettings(const GlobalSettings& settings)
+{
+    Logger::instance().configure(settings.accessLogPath, settings.errorLogPath, settings.slowLogPath,
+        settings.logPolicy == "block" ? Logger::BLOCK : Logger::DROP);
+    ResponseCache::instance().configure(settings.cache.memoryLimit, settings.cache.path, settings.cache.diskLimit);
+    Tracer::instance().configure(settings.trace.sampleEvery, settings.trace.thresholdUs,
+        settings.trace.capacity, settings.trace.slowUs);
 }
 
-void Server::logResponseDetails(const std::string& response, const std::string& path)
+static bool parseNumber(const std::string& directive, const std::string& value, unsigned long& number)
 {
-    size_t statusLineEnd = response.find("\r\n");
-    if (statusLineEnd == std::string::npos)
+    char* end;
+    number = std::strtoul(value.c_str(), &end, 10);
+    if (value[0] == '-' || *end != '\0')
     {
-        logMessage("ERROR", "Malformed response for path: " + path);
-        return;
+        std::cerr << "Error: '" << directive << "' expects a number" << std::endl;
+        return false;
     }
+    return true;
+}
 
-    std::string statusLine = response.substr(0, statusLineEnd);
-    size_t statusCodeStart = statusLine.find(" ") + 1;
-    size_t statusCodeEnd = statusLine.find(" ", statusCodeStart);
-    std::string statusCode = statusLine.substr(statusCodeStart, statusCodeEnd - statusCodeStart);
-
-    size_t contentTypeStart = response.find("Content-Type: ");
-    std::string contentType = "Unknown";
-    if (contentTypeStart != std::string::npos)
+// Top-level directives outside of any server block.
+bool Server::parseGlobalDirective(const std::string& line, GlobalSettings& settings)
+{
+    std::istringstream iss(line);
+    std::string directive;
+    std::string value;
+
+    iss >> directive >> value;
+    if (!value.empty() && value[value.size() - 1] == ';')
+        value.erase(value.size() - 1);
+    if (value.empty())
     {
-        size_t contentTypeEnd = response.find("\r\n", contentTypeStart);
-        contentType = response.substr(contentTypeStart + 14, contentTypeEnd - (contentTypeStart + 14));
+        std::cerr << "Error: Missing value for '" << directive << "'" << std::endl;
+        return false;
     }
-    logMessage("INFO", "Response sent: " + statusCode + " for " + path + " with Content-Type: " + contentType);
+    if (directive == "access_log")
+        settings.accessLogPath = value;
+    else if (directive == "error_log")
+        settings.errorLogPath = value;
+    else if (directive == "slow_log")
+        settings.slowLogPath = value;
+    else if (directive == "log_full_policy")
+    {
+        if (value != "drop" && value != "block")
+        {
+            std::cerr << "Error: 'log_full_policy' expects drop or block" << std::endl;
+            return false;
+        }
+        settings.logPolicy = value;
+    }
+    else if (directive == "event_engine")
+    {
+        // Read at startup; io_uring falls back to poll() where unsupported.
+        if (value != "poll" && value != "io_uring")
+        {
+            std::cerr << "Error: 'event_engine' expects poll or io_uring" << std::endl;
+            return false;
+        }
+        settings.eventEngine = value;
+    }
+    else if (directive == "worker_connections" || directive == "backlog" || directive == "memory_limit"
+        || directive == "shed_lag_threshold" || directive == "retry_after")
+    {
+        unsigned long number;
+        if (!parseNumber(directive, value, number))
+            return false;
+        if (directive == "worker_connections")
+            settings.limits.workerConnections = number;
+        else if (directive == "backlog")
+            settings.limits.backlog = number > 65535 ? 65535 : number;
+        else if (directive == "memory_limit")
+            settings.limits.memoryLimit = number;
+        else if (directive == "shed_lag_threshold")
+            settings.limits.shedLagUs = number * 1000;
+        else
+            settings.limits.retryAfter = number;
+    }
+    else if (directive == "trace_sample" || directive == "trace_threshold" || directive == "trace_buffer"
+        || directive == "slow_request_threshold")
+    {
+        unsigned long number;
+        if (!parseNumber(directive, value, number))
+            return false;
+        if (directive == "trace_sample")
+            settings.trace.sampleEvery = number;
+        else if (directive == "trace_threshold")
+            settings.trace.thresholdUs = number * 1000;
+        else if (directive == "trace_buffer")
+            settings.trace.capacity = number;
+        else
+            settings.trace.slowUs = number * 1000;
+    }
+    else if (directive == "cgi_cache_memory")
+    {
+        unsigned long number;
+        if (!parseNumber(directive, value, number))
+            return false;
+        settings.cache.memoryLimit = number;
+    }
+    else if (directive == "cgi_cache_path")
+    {
+        // cgi_cache_path <dir> [max_size=<bytes>];
+        std::string option;
+        unsigned long number = ResponseCache::DEFAULT_DISK;
+        if (iss >> option)
+        {
+            if (option[option.size() - 1] == ';')
+                option.erase(option.size() - 1);
+            if (option.compare(0, 9, "max_size=") != 0 || !parseNumber(directive, option.substr(9), number))
+            {
+                std::cerr << "Error: Unknown parameter '" << option << "' for 'cgi_cache_path'" << std::endl;
+                return false;
+            }
+        }
+        if (access(value.c_str(), W_OK | X_OK) != 0)
+        {
+            std::cerr << "Error: 'cgi_cache_path' directory is not writable: " << value << std::endl;
+            return false;
+        }
+        settings.cache.path = value;
+        settings.cache.diskLimit = number;
+    }
+    else
+    {
+        std::cerr << "Error: Unknown global directive '" << line << "'" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void Server::logMessage(const std::string& level, const std::string& message) const
+{
+    Logger::instance().error(level, message);
+}
+
+std::string Server::logMessageError(const std::string& level, const std::string& message) const
+{
+    return "[" + level + "] " + Logger::instance().timestamp() + " - " + message;
+}
+
+// The line is built in a member buffer that keeps its capacity.
+void Server::logAccess(int client_fd, HttpRequest& request, const ResponseBuilder& response)
+{
+    logAccess(client_fd, LogFields(request), response.getStatusCode(), response.size());
 }
 
-std::string Server::intToString(int value)
+void Server::logAccess(int client_fd, const LogFields& log, int statusCode, unsigned long bytes)
 {
-    std::ostringstream oss;
-    oss << value;
-    return oss.str();
+    if (RequestTrace* trace = traceFor(client_fd))
+        trace->setResponse(statusCode, bytes);
+    std::string& line = _accessLine;
+    std::map<int, std::string>::const_iterator addr = _clientAddresses.find(client_fd);
+
+    line.clear();
+    line += addr != _clientAddresses.end() ? addr->second : "-";
+    line += " - - [";
+    line += Logger::instance().timestamp();
+    line += "] \"";
+    line.append(log.method.data, log.method.length);
+    line += ' ';
+    line.append(log.target.data, log.target.length);
+    line += ' ';
+    line.append(log.version.data, log.version.length);
+    line += "\" ";
+    line += intToString(statusCode);
+    line += ' ';
+    line += intToString(bytes);
+    line += " \"";
+    line.append(log.userAgent.data, log.userAgent.length);
+    line += "\"\n";
+    Logger::instance().access(line);
+}
+
+std::string Server::intToString(long value)
+{
+    return ResponseBuilder::toString(value);
 }
 
 void Server::printServerBlocks() const
@@ -246,4 +658,4 @@ void Server::printServerBlocks() const
         std::cout << serverBlocks[i] << std::endl;
         std::cout << "-----------------------------------" << std::endl;
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,970 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*   unittest.cpp - unit tests for the pure-logic parts of webserv            */
+/*                                                                            */
+/*   Self-contained (no network): links the server objects and checks the    */
+/*   parts of the server that are plain logic over memory or a file.         */
+/*   Exits non-zero when any check fails.                                     */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Hpack.hpp"
+#include "ClientLimiter.hpp"
+#include "UpstreamGroup.hpp"
+#include "Proxy.hpp"
+#include "ResponseCache.hpp"
+#include "ResponseBuilder.hpp"
+#include "Bundle.hpp"
+#include "Upload.hpp"
+
+/* ------------------------------------------------------------------------ */
+/*                                Framework                                 */
+/* ------------------------------------------------------------------------ */
+
+typedef void (*TestFunction)();
+
+struct TestEntry
+{
+    const char*  name;
+    TestFunction function;
+};
+
+static std::vector<TestEntry>& registry()
+{
+    static std::vector<TestEntry> entries;
+    return entries;
+}
+
+struct TestRegistrar
+{
+    TestRegistrar(const char* name, TestFunction function)
+    {
+        TestEntry entry = { name, function };
+        registry().push_back(entry);
+    }
+};
+
+#define TEST(name) \
+    static void name(); \
+    static TestRegistrar registrar_##name(#name, &name); \
+    static void name()
+
+static unsigned long g_failures = 0;
+
+static void report(const char* file, int line, const std::string& what)
+{
+    ++g_failures;
+    std::cout << "    " << file << ":" << line << ": " << what << std::endl;
+}
+
+#define CHECK(condition) \
+    do { if (!(condition)) report(__FILE__, __LINE__, "CHECK(" #condition ")"); } while (0)
+
+#define CHECK_EQ(actual, expected) \
+    do { \
+        if (!((actual) == (expected))) \
+        { \
+            std::ostringstream what_; \
+            what_ << "CHECK_EQ(" #actual ", " #expected "): got '" << (actual) << "', expected '" << (expected) << "'"; \
+            report(__FILE__, __LINE__, what_.str()); \
+        } \
+    } while (0)
+
+/* ------------------------------------------------------------------------ */
+/*                                  HPACK                                   */
+/* ------------------------------------------------------------------------ */
+static std::string fromHex(const char* hex)
+{
+    std::string bytes;
+    int high = -1;
+    for (const char* p = hex; *p; ++p)
+    {
+        if (*p == ' ')
+            continue;
+        int digit = *p <= '9' ? *p - '0' : (*p | 0x20) - 'a' + 10;
+        if (high < 0)
+            high = digit;
+        else
+        {
+            bytes += static_cast<char>(high << 4 | digit);
+            high = -1;
+        }
+    }
+    return bytes;
+}
+
+static std::string toHex(const std::string& bytes)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (size_t i = 0; i < bytes.size(); ++i)
+    {
+        hex += digits[static_cast<unsigned char>(bytes[i]) >> 4];
+        hex += digits[static_cast<unsigned char>(bytes[i]) & 0xf];
+    }
+    return hex;
+}
+
+
+static bool decodeBlock(HpackTable& table, const std::string& block, Hpack::Headers& headers)
+{
+    return Hpack::decode(table, reinterpret_cast<const unsigned char*>(block.data()), block.size(),
+        HpackTable::DEFAULT_SIZE, headers);
+}
+
+static std::string entryAt(const HpackTable& table, size_t index)
+{
+    std::string name;
+    std::string value;
+    if (!table.get(index, name, value))
+        return "<none>";
+    return name + ": " + value;
+}
+
+// RFC 7541 C.4: three requests on one connection, Huffman coded.
+TEST(hpack_decodes_rfc_request_sequence)
+{
+    HpackTable table;
+    Hpack::Headers headers;
+
+    CHECK(decodeBlock(table, fromHex("8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff"), headers));
+    CHECK_EQ(headers.size(), 4u);
+    if (headers.size() == 4)
+    {
+        CHECK_EQ(headers[0].first, ":method");
+        CHECK_EQ(headers[0].second, "GET");
+        CHECK_EQ(headers[2].second, "/");
+        CHECK_EQ(headers[3].first, ":authority");
+        CHECK_EQ(headers[3].second, "www.example.com");
+    }
+    CHECK_EQ(entryAt(table, 62), ":authority: www.example.com");
+
+    CHECK(decodeBlock(table, fromHex("8286 84be 5886 a8eb 1064 9cbf"), headers));
+    CHECK_EQ(headers.size(), 5u);
+    if (headers.size() == 5)
+    {
+        CHECK_EQ(headers[3].second, "www.example.com");
+        CHECK_EQ(headers[4].first, "cache-control");
+        CHECK_EQ(headers[4].second, "no-cache");
+    }
+
+    CHECK(decodeBlock(table, fromHex("8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf"), headers));
+    CHECK_EQ(headers.size(), 5u);
+    if (headers.size() == 5)
+    {
+        CHECK_EQ(headers[1].second, "https");
+        CHECK_EQ(headers[2].second, "/index.html");
+        CHECK_EQ(headers[4].first, "custom-key");
+        CHECK_EQ(headers[4].second, "custom-value");
+    }
+    CHECK_EQ(entryAt(table, 62), "custom-key: custom-value");
+    CHECK_EQ(entryAt(table, 63), "cache-control: no-cache");
+    CHECK_EQ(entryAt(table, 64), ":authority: www.example.com");
+    CHECK_EQ(entryAt(table, 65), "<none>");
+}
+
+// RFC 7541 C.5: responses through a 256-byte table, so the second one
+// evicts the oldest entry.
+TEST(hpack_evicts_oldest_entries)
+{
+    HpackTable table;
+    table.resize(256);
+    Hpack::Headers headers;
+
+    CHECK(decodeBlock(table, fromHex("4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420"
+        "3230 3133 2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d"),
+        headers));
+    CHECK_EQ(headers.size(), 4u);
+    CHECK_EQ(entryAt(table, 62), "location: https://www.example.com");
+    CHECK_EQ(entryAt(table, 65), ":status: 302");
+
+    CHECK(decodeBlock(table, fromHex("4803 3330 37c1 c0bf"), headers));
+    CHECK_EQ(headers.size(), 4u);
+    if (headers.size() == 4)
+    {
+        CHECK_EQ(headers[0].second, "307");
+        CHECK_EQ(headers[1].second, "private");
+        CHECK_EQ(headers[3].second, "https://www.example.com");
+    }
+    CHECK_EQ(entryAt(table, 62), ":status: 307");
+    CHECK_EQ(entryAt(table, 65), "cache-control: private");
+    CHECK_EQ(entryAt(table, 66), "<none>");
+}
+
+TEST(hpack_huffman_matches_rfc)
+{
+    std::string coded;
+    Hpack::huffmanEncode("www.example.com", coded);
+    CHECK_EQ(toHex(coded), "f1e3c2e5f23a6ba0ab90f4ff");
+    CHECK_EQ(Hpack::huffmanLength("www.example.com"), 12u);
+
+    coded.clear();
+    Hpack::huffmanEncode("no-cache", coded);
+    CHECK_EQ(toHex(coded), "a8eb10649cbf");
+
+    std::string text;
+    CHECK(Hpack::huffmanDecode(reinterpret_cast<const unsigned char*>(coded.data()), coded.size(), text));
+    CHECK_EQ(text, "no-cache");
+
+    std::string all;
+    for (int c = 0; c < 256; ++c)
+        all += static_cast<char>(c);
+    coded.clear();
+    Hpack::huffmanEncode(all, coded);
+    CHECK(Hpack::huffmanDecode(reinterpret_cast<const unsigned char*>(coded.data()), coded.size(), text));
+    CHECK(text == all);
+}
+
+TEST(hpack_huffman_rejects_bad_padding)
+{
+    std::string text;
+    // '0' is 00000; the three bits after it must be ones.
+    const unsigned char zeroPadding[] = { 0x00 };
+    CHECK(!Hpack::huffmanDecode(zeroPadding, sizeof(zeroPadding), text));
+    // Eight or more bits of padding.
+    const unsigned char longPadding[] = { 0x07, 0xff };
+    CHECK(!Hpack::huffmanDecode(longPadding, sizeof(longPadding), text));
+    // An explicit EOS symbol.
+    const unsigned char eos[] = { 0xff, 0xff, 0xff, 0xff };
+    CHECK(!Hpack::huffmanDecode(eos, sizeof(eos), text));
+}
+
+TEST(hpack_round_trips_through_encoder)
+{
+    HpackTable encoder;
+    HpackTable decoder;
+    Hpack::Headers sent;
+    sent.push_back(std::make_pair(std::string(":status"), std::string("200")));
+    sent.push_back(std::make_pair(std::string("content-type"), std::string("text/html")));
+    sent.push_back(std::make_pair(std::string("x-request-id"), std::string("4f2c1a9be37d")));
+    sent.push_back(std::make_pair(std::string("set-cookie"), std::string("session=1; HttpOnly")));
+
+    std::string first;
+    for (size_t i = 0; i < sent.size(); ++i)
+        Hpack::encode(encoder, sent[i].first, sent[i].second, sent[i].first != "set-cookie", first);
+    Hpack::Headers received;
+    CHECK(decodeBlock(decoder, first, received));
+    CHECK(received == sent);
+
+    // Indexed the first time: each of those is one byte now.
+    std::string second;
+    for (size_t i = 0; i < 3; ++i)
+        Hpack::encode(encoder, sent[i].first, sent[i].second, true, second);
+    CHECK_EQ(second.size(), 3u);
+    CHECK(decodeBlock(decoder, second, received));
+    CHECK_EQ(received.size(), 3u);
+    if (received.size() == 3)
+        CHECK_EQ(received[2].second, "4f2c1a9be37d");
+
+    // Not indexed: set-cookie is spelled out again.
+    size_t nameIndex;
+    CHECK_EQ(encoder.find("set-cookie", "session=1; HttpOnly", nameIndex), 0u);
+    CHECK_EQ(nameIndex, 55u);
+}
+
+TEST(hpack_rejects_malformed_blocks)
+{
+    Hpack::Headers headers;
+    HpackTable table;
+    CHECK(!decodeBlock(table, fromHex("80"), headers));              // index 0
+    CHECK(!decodeBlock(table, fromHex("be"), headers));              // empty dynamic table
+    CHECK(!decodeBlock(table, fromHex("4005 61"), headers));         // name cut short
+    CHECK(!decodeBlock(table, fromHex("7f"), headers));              // integer cut short
+    CHECK(!decodeBlock(table, fromHex("3fff ffff ff0f"), headers));  // integer past 2^28
+
+    std::string resize;
+    Hpack::encodeTableSize(HpackTable::DEFAULT_SIZE * 2, resize);
+    CHECK(!decodeBlock(table, resize, headers));                     // above our limit
+    resize.clear();
+    Hpack::encodeTableSize(0, resize);
+    CHECK(decodeBlock(table, resize, headers));
+    CHECK_EQ(table.maxSize(), 0u);
+    CHECK(!decodeBlock(table, fromHex("82") + resize, headers));     // not at the start
+
+    // An entry larger than the table empties it instead of being added.
+    HpackTable small;
+    small.resize(64);
+    small.add("a", "b");
+    small.add(std::string(40, 'n'), "v");
+    CHECK_EQ(entryAt(small, 62), "<none>");
+}
+
+/* ------------------------------------------------------------------------ */
+/*                              ClientLimiter                               */
+/* ------------------------------------------------------------------------ */
+
+static const unsigned long SECOND_US = 1000000;
+
+static ClientKey clientKey(unsigned long n)
+{
+    ClientKey key;
+    key.bytes[0] = 0x20;
+    key.bytes[1] = 0x01;
+    for (int i = 0; i < 8; ++i)
+        key.bytes[15 - i] = static_cast<unsigned char>(n >> (8 * i));
+    return key;
+}
+
+static ClientLimit requestLimit(const char* value, unsigned long zone)
+{
+    ClientLimit limit;
+    limit.parseRequestLimit(value);
+    limit.zone = zone;
+    return limit;
+}
+
+TEST(limiter_parses_rates)
+{
+    ClientLimit limit;
+    limit.parseRequestLimit("10r/s burst=5");
+    CHECK_EQ(limit.rate, 10000u);
+    CHECK_EQ(limit.burst, 5u);
+    limit.parseRequestLimit("120r/m");
+    CHECK_EQ(limit.rate, 2000u);
+    CHECK_EQ(limit.burst, 0u);
+    limit.parseRequestLimit("1r/m");
+    CHECK_EQ(limit.rate, 17u);
+
+    const char* invalid[] = { "", "0r/s", "5r/h", "5", "r/s", "5r/s burst=", "5r/s burst=x", "5r/s rate=1" };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i)
+    {
+        bool thrown = false;
+        try
+        {
+            limit.parseRequestLimit(invalid[i]);
+        }
+        catch (const std::exception&)
+        {
+            thrown = true;
+        }
+        if (!thrown)
+            report(__FILE__, __LINE__, std::string("accepted limit_req '") + invalid[i] + "'");
+    }
+}
+
+TEST(limiter_token_bucket_allows_burst_then_rate)
+{
+    ClientLimiter limiter;
+    ClientLimit limit = requestLimit("1r/s burst=2", 1);
+    ClientKey client = clientKey(1);
+    unsigned long now = 1000 * SECOND_US;
+    unsigned long retryAfter = 0;
+
+    for (int i = 0; i < 3; ++i)
+        CHECK(limiter.takeToken(client, limit, now, retryAfter));
+    CHECK(!limiter.takeToken(client, limit, now, retryAfter));
+    CHECK_EQ(retryAfter, 1u);
+
+    // Half a second refills half a request: still refused.
+    CHECK(!limiter.takeToken(client, limit, now + SECOND_US / 2, retryAfter));
+    CHECK(limiter.takeToken(client, limit, now + SECOND_US, retryAfter));
+    CHECK(!limiter.takeToken(client, limit, now + SECOND_US, retryAfter));
+
+    // A long pause refills the bucket, but never past burst + 1.
+    now += 60 * SECOND_US;
+    for (int i = 0; i < 3; ++i)
+        CHECK(limiter.takeToken(client, limit, now, retryAfter));
+    CHECK(!limiter.takeToken(client, limit, now, retryAfter));
+}
+
+TEST(limiter_slow_rates_report_retry_after)
+{
+    ClientLimiter limiter;
+    ClientLimit limit = requestLimit("10r/m", 1);
+    ClientKey client = clientKey(1);
+    unsigned long now = 1000 * SECOND_US;
+    unsigned long retryAfter = 0;
+
+    CHECK(limiter.takeToken(client, limit, now, retryAfter));
+    CHECK(!limiter.takeToken(client, limit, now, retryAfter));
+    CHECK_EQ(retryAfter, 6u);
+    CHECK(!limiter.takeToken(client, limit, now + 5 * SECOND_US, retryAfter));
+    CHECK_EQ(retryAfter, 1u);
+    CHECK(limiter.takeToken(client, limit, now + 6 * SECOND_US, retryAfter));
+}
+
+TEST(limiter_keeps_clients_and_zones_apart)
+{
+    ClientLimiter limiter;
+    ClientLimit server = requestLimit("1r/s", 1);
+    ClientLimit location = requestLimit("1r/s", 2);
+    unsigned long now = 1000 * SECOND_US;
+    unsigned long retryAfter;
+
+    CHECK(limiter.takeToken(clientKey(1), server, now, retryAfter));
+    CHECK(!limiter.takeToken(clientKey(1), server, now, retryAfter));
+    CHECK(limiter.takeToken(clientKey(2), server, now, retryAfter));
+    CHECK(limiter.takeToken(clientKey(1), location, now, retryAfter));
+    CHECK_EQ(limiter.size(), 3u);
+
+    // IPv4 peers are kept in their mapped form; a different address
+    // sharing the low bytes is another client.
+    ClientKey mapped;
+    mapped.bytes[10] = 0xff;
+    mapped.bytes[11] = 0xff;
+    mapped.bytes[15] = 1;
+    CHECK(limiter.takeToken(mapped, server, now, retryAfter));
+    CHECK(!(mapped == clientKey(1)));
+}
+
+TEST(limiter_counts_connections_in_flight)
+{
+    ClientLimiter limiter;
+    ClientLimit limit;
+    limit.parseConnectionLimit("2");
+    limit.zone = 1;
+    ClientKey client = clientKey(1);
+    int first, second, third;
+
+    CHECK(limiter.acquire(client, limit, 0, first));
+    CHECK(limiter.acquire(client, limit, 0, second));
+    CHECK(!limiter.acquire(client, limit, 0, third));
+    CHECK_EQ(third, -1);
+    limiter.release(first);
+    CHECK(limiter.acquire(client, limit, 0, third));
+    limiter.release(second);
+    limiter.release(third);
+    limiter.release(-1);
+}
+
+TEST(limiter_evicts_least_recently_seen)
+{
+    ClientLimiter limiter;
+    ClientLimit limit = requestLimit("1r/s", 1);
+    unsigned long now = 1000 * SECOND_US;
+    unsigned long retryAfter;
+
+    // Every client uses up its one request.
+    for (unsigned long i = 0; i < ClientLimiter::CAPACITY; ++i)
+        CHECK(limiter.takeToken(clientKey(i), limit, now, retryAfter));
+    CHECK_EQ(limiter.size(), ClientLimiter::CAPACITY);
+    CHECK_EQ(limiter.evictions(), 0u);
+
+    // Seen again, client 0 is now the most recent; client 1 is the oldest.
+    CHECK(!limiter.takeToken(clientKey(0), limit, now, retryAfter));
+    CHECK(limiter.takeToken(clientKey(ClientLimiter::CAPACITY), limit, now, retryAfter));
+    CHECK_EQ(limiter.evictions(), 1u);
+    CHECK_EQ(limiter.size(), ClientLimiter::CAPACITY);
+
+    CHECK(!limiter.takeToken(clientKey(0), limit, now, retryAfter));
+    // Client 1 was forgotten, so it starts over with a full bucket.
+    CHECK(limiter.takeToken(clientKey(1), limit, now, retryAfter));
+    CHECK_EQ(limiter.evictions(), 2u);
+}
+
+TEST(limiter_never_evicts_requests_in_flight)
+{
+    ClientLimiter limiter;
+    ClientLimit limit;
+    limit.parseConnectionLimit("1");
+    limit.zone = 1;
+    std::vector<int> slots(ClientLimiter::CAPACITY);
+
+    for (unsigned long i = 0; i < ClientLimiter::CAPACITY; ++i)
+        CHECK(limiter.acquire(clientKey(i), limit, 0, slots[i]));
+
+    // No entry can be reused: the new client is let through untracked.
+    int slot;
+    CHECK(limiter.acquire(clientKey(ClientLimiter::CAPACITY), limit, 0, slot));
+    CHECK_EQ(slot, -1);
+    CHECK_EQ(limiter.evictions(), 0u);
+
+    // Once client 5 is done it is the only candidate, oldest or not.
+    limiter.release(slots[5]);
+    CHECK(limiter.acquire(clientKey(ClientLimiter::CAPACITY), limit, 0, slot));
+    CHECK(slot >= 0);
+    CHECK_EQ(limiter.evictions(), 1u);
+    CHECK(!limiter.acquire(clientKey(0), limit, 0, slot));
+}
+
+/* ------------------------------------------------------------------------ */
+/*                              UpstreamGroup                               */
+/* ------------------------------------------------------------------------ */
+
+// Upstreams are process-wide and keep their failure state, so every test
+// takes its own ports.
+static Upstream* upstream(int port)
+{
+    return Upstream::get("127.0.0.1", port);
+}
+
+static std::string pick(UpstreamGroup& group, const char* uri, unsigned long nowUs)
+{
+    Upstream* server = group.select(StringRef(uri, std::strlen(uri)), nowUs);
+    return server ? server->name() : "<none>";
+}
+
+TEST(upstream_round_robin_is_smooth_and_weighted)
+{
+    UpstreamGroup group("unittest-rr");
+    group.addServer(upstream(19001), 5, 0, 0);
+    group.addServer(upstream(19002), 1, 0, 0);
+    group.addServer(upstream(19003), 1, 0, 0);
+
+    std::string order;
+    for (int i = 0; i < 7; ++i)
+        order += pick(group, "/", 0).substr(14);
+    CHECK_EQ(order, "1121311");
+
+    std::map<std::string, int> counts;
+    for (int i = 0; i < 7000; ++i)
+        ++counts[pick(group, "/", 0)];
+    CHECK_EQ(counts["127.0.0.1:19001"], 5000);
+    CHECK_EQ(counts["127.0.0.1:19002"], 1000);
+    CHECK_EQ(counts["127.0.0.1:19003"], 1000);
+}
+
+TEST(upstream_failed_servers_leave_rotation)
+{
+    UpstreamGroup group("unittest-fail");
+    group.addServer(upstream(19011), 1, 2, 10 * SECOND_US);
+    group.addServer(upstream(19012), 1, 2, 10 * SECOND_US);
+    unsigned long now = 1000 * SECOND_US;
+
+    CHECK(!group.failed(upstream(19011), now));
+    CHECK(group.failed(upstream(19011), now + 1));
+    for (int i = 0; i < 4; ++i)
+        CHECK_EQ(pick(group, "/", now + 2), "127.0.0.1:19012");
+    CHECK(group.failed(upstream(19012), now + 3) == false);
+    CHECK(group.failed(upstream(19012), now + 4));
+    CHECK_EQ(pick(group, "/", now + 5), "<none>");
+
+    // Back after fail_timeout.
+    CHECK_EQ(pick(group, "/", now + 1 + 10 * SECOND_US), "127.0.0.1:19011");
+
+    // Failures further apart than fail_timeout do not add up.
+    now += 100 * SECOND_US;
+    CHECK(!group.failed(upstream(19011), now));
+    CHECK(!group.failed(upstream(19011), now + 11 * SECOND_US));
+}
+
+TEST(upstream_single_server_is_never_taken_down)
+{
+    UpstreamGroup group("unittest-single");
+    group.addServer(upstream(19021), 1, 1, 10 * SECOND_US);
+    CHECK(!group.failed(upstream(19021), 0));
+    CHECK(!group.failed(upstream(19021), 1));
+    CHECK_EQ(pick(group, "/", 2), "127.0.0.1:19021");
+}
+
+TEST(upstream_least_conn_prefers_idle_servers)
+{
+    UpstreamGroup group("unittest-lc");
+    group.setPolicy(UpstreamGroup::LEAST_CONN);
+    group.addServer(upstream(19031), 2, 0, 0);
+    group.addServer(upstream(19032), 1, 0, 0);
+
+    // Ties rotate.
+    std::string first = pick(group, "/", 0);
+    CHECK(pick(group, "/", 0) != first);
+
+    upstream(19031)->attach();
+    CHECK_EQ(pick(group, "/", 0), "127.0.0.1:19032");
+    // One each: relative to weight, 19031 is less loaded.
+    upstream(19032)->attach();
+    CHECK_EQ(pick(group, "/", 0), "127.0.0.1:19031");
+    CHECK_EQ(pick(group, "/", 0), "127.0.0.1:19031");
+    upstream(19031)->attach();
+    upstream(19031)->attach();
+    CHECK_EQ(pick(group, "/", 0), "127.0.0.1:19032");
+
+    upstream(19031)->detach();
+    upstream(19031)->detach();
+    upstream(19031)->detach();
+    upstream(19032)->detach();
+}
+
+TEST(upstream_hash_is_consistent)
+{
+    UpstreamGroup* group = new UpstreamGroup("unittest-hash");
+    group->setPolicy(UpstreamGroup::HASH_URI);
+    group->addServer(upstream(19041), 1, 1, 10 * SECOND_US);
+    group->addServer(upstream(19042), 1, 1, 10 * SECOND_US);
+    group->addServer(upstream(19043), 1, 1, 10 * SECOND_US);
+    group = UpstreamGroup::publish(group);
+
+    std::vector<std::string> uris;
+    std::map<std::string, int> counts;
+    for (int i = 0; i < 300; ++i)
+    {
+        std::ostringstream uri;
+        uri << "/item/" << i;
+        uris.push_back(uri.str());
+    }
+    std::vector<std::string> before;
+    for (size_t i = 0; i < uris.size(); ++i)
+    {
+        before.push_back(pick(*group, uris[i].c_str(), 0));
+        ++counts[before.back()];
+        CHECK_EQ(pick(*group, uris[i].c_str(), 0), before.back());
+    }
+    CHECK_EQ(counts.size(), 3u);
+    for (std::map<std::string, int>::iterator it = counts.begin(); it != counts.end(); ++it)
+        CHECK(it->second > 50);
+
+    // Only the keys of the server that went down move.
+    unsigned long now = 1000 * SECOND_US;
+    CHECK(group->failed(upstream(19042), now));
+    for (size_t i = 0; i < uris.size(); ++i)
+    {
+        std::string after = pick(*group, uris[i].c_str(), now);
+        CHECK(after != "127.0.0.1:19042");
+        if (before[i] != "127.0.0.1:19042")
+            CHECK_EQ(after, before[i]);
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/*                              ResponseCache                               */
+/* ------------------------------------------------------------------------ */
+
+static CgiOutput cgiOutput(const char* raw)
+{
+    CgiOutput output;
+    output.parse(raw);
+    return output;
+}
+
+static CachePolicy cachePolicy(const char* value)
+{
+    CachePolicy policy;
+    policy.parse(value);
+    return policy;
+}
+
+static ResponseCache::Result lookup(const std::string& key, bool& refresh, std::string& response)
+{
+    ResponseBuilder builder;
+    ResponseCache::Result result = ResponseCache::instance().lookup(key, builder, refresh, NULL, false);
+    response = builder.finish().str();
+    return result;
+}
+
+static void waitUntil(time_t when)
+{
+    while (time(NULL) < when)
+        usleep(10000);
+}
+
+// Stores key and returns the second it was stored in, retrying when the
+// clock ticked during the call.
+static time_t storeAt(const std::string& key, const CgiOutput& output, const CachePolicy& policy)
+{
+    for (;;)
+    {
+        time_t before = time(NULL);
+        CHECK(ResponseCache::instance().store(key, output, policy));
+        if (time(NULL) == before)
+            return before;
+    }
+}
+
+TEST(cache_parses_policy)
+{
+    CachePolicy policy = cachePolicy("5m stale=30s");
+    CHECK_EQ(policy.ttl, 300u);
+    CHECK_EQ(policy.stale, 30u);
+    CHECK_EQ(cachePolicy("1h").stale, 60u);
+
+    const char* invalid[] = { "", "0", "-5", "5d", "10 stale=x", "10 ttl=5" };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i)
+    {
+        bool thrown = false;
+        try
+        {
+            cachePolicy(invalid[i]);
+        }
+        catch (const std::exception&)
+        {
+            thrown = true;
+        }
+        if (!thrown)
+            report(__FILE__, __LINE__, std::string("accepted cgi_cache '") + invalid[i] + "'");
+    }
+}
+
+TEST(cache_refuses_uncacheable_responses)
+{
+    ResponseCache& cache = ResponseCache::instance();
+    CachePolicy policy = cachePolicy("60");
+    CHECK(!cache.store("unittest:500", cgiOutput("Status: 500 Internal Server Error\r\n\r\nboom"), policy));
+    CHECK(!cache.store("unittest:cookie", cgiOutput("Set-Cookie: a=b\r\n\r\nhi"), policy));
+    CHECK(!cache.store("unittest:nostore", cgiOutput("Cache-Control: no-store\r\n\r\nhi"), policy));
+    CHECK(!cache.store("unittest:private", cgiOutput("Cache-Control: max-age=60, private\r\n\r\nhi"), policy));
+    CHECK(!cache.store("unittest:maxage0", cgiOutput("Cache-Control: max-age=0\r\n\r\nhi"), policy));
+    CHECK(cache.store("unittest:404", cgiOutput("Status: 404 Not Found\r\n\r\ngone"), policy));
+
+    // A response that stops being cacheable drops the stored one.
+    CHECK(cache.store("unittest:flip", cgiOutput("\r\nfirst"), policy));
+    CHECK(!cache.store("unittest:flip", cgiOutput("Cache-Control: no-cache\r\n\r\nsecond"), policy));
+    bool refresh;
+    std::string response;
+    CHECK_EQ(lookup("unittest:flip", refresh, response), ResponseCache::MISS);
+}
+
+TEST(cache_serves_stale_while_revalidating)
+{
+    CachePolicy policy = cachePolicy("1 stale=1");
+    time_t stored = storeAt("unittest:swr", cgiOutput("Content-Type: text/plain\r\n\r\nfresh"), policy);
+    bool refresh = true;
+    std::string response;
+
+    CHECK_EQ(lookup("unittest:swr", refresh, response), ResponseCache::HIT);
+    CHECK(!refresh);
+    CHECK(response.find("X-Cache-Status: HIT") != std::string::npos);
+    CHECK(response.find("\r\n\r\nfresh") != std::string::npos);
+
+    // Expired but within stale: served, and only the first lookup refreshes.
+    waitUntil(stored + 1);
+    CHECK_EQ(lookup("unittest:swr", refresh, response), ResponseCache::STALE);
+    CHECK(refresh);
+    CHECK(response.find("X-Cache-Status: STALE") != std::string::npos);
+    CHECK_EQ(lookup("unittest:swr", refresh, response), ResponseCache::STALE);
+    CHECK(!refresh);
+    ResponseCache::instance().unlock("unittest:swr");
+    CHECK_EQ(lookup("unittest:swr", refresh, response), ResponseCache::STALE);
+    CHECK(refresh);
+    ResponseCache::instance().unlock("unittest:swr");
+
+    waitUntil(stored + 2);
+    CHECK_EQ(lookup("unittest:swr", refresh, response), ResponseCache::MISS);
+}
+
+TEST(cache_script_headers_override_policy)
+{
+    // max-age=1 and no stale window: expired means gone, though the policy
+    // would have kept it for a minute.
+    CachePolicy policy = cachePolicy("60 stale=60");
+    time_t stored = storeAt("unittest:maxage",
+        cgiOutput("Cache-Control: max-age=1, stale-while-revalidate=0\r\n\r\nshort"), policy);
+    bool refresh;
+    std::string response;
+    CHECK_EQ(lookup("unittest:maxage", refresh, response), ResponseCache::HIT);
+    waitUntil(stored + 1);
+    CHECK_EQ(lookup("unittest:maxage", refresh, response), ResponseCache::MISS);
+
+    // s-maxage wins over max-age whatever their order.
+    stored = storeAt("unittest:smaxage", cgiOutput("Cache-Control: s-maxage=60, max-age=0\r\n\r\nshared"),
+        cachePolicy("1 stale=0"));
+    waitUntil(stored + 1);
+    CHECK_EQ(lookup("unittest:smaxage", refresh, response), ResponseCache::HIT);
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                  Bundle                                  */
+/* ------------------------------------------------------------------------ */
+
+TEST(bundle_fits_never_wraps)
+{
+    const uint64_t max = ~static_cast<uint64_t>(0);
+    CHECK(Bundle::fits(0, 0, 0));
+    CHECK(Bundle::fits(0, 100, 100));
+    CHECK(Bundle::fits(100, 0, 100));
+    CHECK(Bundle::fits(40, 60, 100));
+    CHECK(!Bundle::fits(40, 61, 100));
+    CHECK(!Bundle::fits(101, 0, 100));
+    CHECK(!Bundle::fits(0xFFFFFFFFFFFFFF00ULL, 0x200, 100));
+    CHECK(!Bundle::fits(1, max, 100));
+    CHECK(!Bundle::fits(max, 1, max));
+    CHECK(Bundle::fits(max, 0, max));
+}
+
+// One entry, "/a.txt", serving "hello".
+static std::string bundleImage(uint64_t dataOffsetDelta)
+{
+    static const char strings[] = "/a.txt\0text/plain\0\"x\"";
+    BundleHeader header;
+    BundleEntry entry;
+    std::memset(&header, 0, sizeof(header));
+    std::memset(&entry, 0, sizeof(entry));
+    std::memcpy(header.magic, Bundle::MAGIC, sizeof(header.magic));
+    header.version = Bundle::VERSION;
+    header.count = 1;
+    header.entriesOffset = sizeof(header);
+    header.stringsOffset = header.entriesOffset + sizeof(entry);
+    header.dataOffset = header.stringsOffset + sizeof(strings);
+    header.fileSize = header.dataOffset + 5;
+    entry.pathOffset = 0;
+    entry.pathLength = 6;
+    entry.mimeOffset = 7;
+    entry.mimeLength = 10;
+    entry.etagOffset = 18;
+    entry.etagLength = 3;
+    entry.dataOffset = header.dataOffset + dataOffsetDelta;
+    entry.dataLength = 5;
+
+    std::string image(reinterpret_cast<const char*>(&header), sizeof(header));
+    image.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+    image.append(strings, sizeof(strings));
+    image += "hello";
+    return image;
+}
+
+static std::string writeBundle(const std::string& image, const char* name)
+{
+    std::ostringstream path;
+    path << "/tmp/webserv-unittest-" << getpid() << "-" << name << ".bundle";
+    int fd = open(path.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0 && write(fd, image.data(), image.size()) == static_cast<ssize_t>(image.size()));
+    if (fd >= 0)
+        close(fd);
+    return path.str();
+}
+
+TEST(bundle_rejects_entries_outside_the_file)
+{
+    std::string path = writeBundle(bundleImage(0), "valid");
+    const Bundle* bundle = NULL;
+    try
+    {
+        bundle = Bundle::open(path);
+    }
+    catch (const std::exception& e)
+    {
+        report(__FILE__, __LINE__, e.what());
+    }
+    if (bundle)
+    {
+        Bundle::File file;
+        CHECK(bundle->find("/a.txt", 6, file));
+        CHECK(file.length == 5 && std::memcmp(file.data, "hello", 5) == 0);
+        CHECK_EQ(std::string(file.mime), "text/plain");
+        CHECK(!bundle->find("/b.txt", 6, file));
+    }
+    unlink(path.c_str());
+
+    // An offset that wraps past the end of the address space.
+    path = writeBundle(bundleImage(0xFFFFFFFFFFFFFF00ULL), "wrapped");
+    bool thrown = false;
+    try
+    {
+        Bundle::open(path);
+    }
+    catch (const std::exception&)
+    {
+        thrown = true;
+    }
+    CHECK(thrown);
+    unlink(path.c_str());
+
+    path = writeBundle(bundleImage(1), "overrun");
+    thrown = false;
+    try
+    {
+        Bundle::open(path);
+    }
+    catch (const std::exception&)
+    {
+        thrown = true;
+    }
+    CHECK(thrown);
+    unlink(path.c_str());
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                 Uploads                                  */
+/* ------------------------------------------------------------------------ */
+
+// Runs trimToDelimiter over a file holding content; returns what is left,
+// or "<none>" when no delimiter was found.
+static std::string trimmed(const std::string& content, const std::string& boundary)
+{
+    char path[] = "/tmp/webserv-unittest-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return "<mkstemp failed>";
+    unlink(path);
+    std::string result = "<none>";
+    off_t written = content.size();
+    if (write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size())
+        && UploadSession::trimToDelimiter(fd, boundary, written))
+    {
+        result.assign(written, '\0');
+        if (written && pread(fd, &result[0], written, 0) != written)
+            result = "<short read>";
+        if (lseek(fd, 0, SEEK_END) != written)
+            result = "<not truncated>";
+    }
+    close(fd);
+    return result;
+}
+
+TEST(upload_trims_file_part_at_delimiter)
+{
+    const std::string boundary = "--XyZ";
+    const std::string trailer = "\r\n--XyZ\r\nContent-Disposition: form-data; name=\"note\"\r\n\r\nhi\r\n--XyZ--\r\n";
+
+    CHECK_EQ(trimmed("file data" + trailer, boundary), "file data");
+    CHECK_EQ(trimmed(trailer, boundary), "");
+    // A near miss inside the file is kept.
+    CHECK_EQ(trimmed("a\r\n--XyX b\r\n--Xy" + trailer, boundary), "a\r\n--XyX b\r\n--Xy");
+    // Only "\r\n" + boundary delimits, not the boundary alone.
+    CHECK_EQ(trimmed("--XyZ inside" + trailer, boundary), "--XyZ inside");
+    CHECK_EQ(trimmed("no delimiter at all", boundary), "<none>");
+    CHECK_EQ(trimmed("", boundary), "<none>");
+
+    // Large files: only the tail is read.
+    std::string large(3 * UploadSession::TRAILER_WINDOW, 'x');
+    CHECK(trimmed(large + trailer, boundary) == large);
+    // The delimiter has to lie within the trailer window.
+    std::string farTrailer = "\r\n--XyZ\r\n" + std::string(UploadSession::TRAILER_WINDOW + 16, 'f');
+    CHECK_EQ(trimmed("data" + farTrailer, boundary), "<none>");
+}
+
+/* ------------------------------------------------------------------------ */
+/*                                   Main                                   */
+/* ------------------------------------------------------------------------ */
+
+int main(int argc, char** argv)
+{
+    std::string filter;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc)
+            filter = argv[++i];
+        else
+        {
+            std::cerr << "usage: unittest [--filter SUBSTRING]" << std::endl;
+            return 2;
+        }
+    }
+
+    size_t run = 0;
+    size_t failed = 0;
+    const std::vector<TestEntry>& entries = registry();
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        if (!filter.empty() && std::string(entries[i].name).find(filter) == std::string::npos)
+            continue;
+        unsigned long before = g_failures;
+        try
+        {
+            entries[i].function();
+        }
+        catch (const std::exception& e)
+        {
+            report(__FILE__, __LINE__, std::string("uncaught exception: ") + e.what());
+        }
+        ++run;
+        bool passed = g_failures == before;
+        if (!passed)
+            ++failed;
+        std::cout << (passed ? "ok   " : "FAIL ") << entries[i].name << std::endl;
+    }
+    std::cout << run - failed << "/" << run << " tests passed" << std::endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,229 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*   mkbundle.cpp - pack a docroot into a single indexed bundle file          */
+/*                                                                            */
+/*   usage: mkbundle [--gzip] [--gzip-min BYTES] <docroot> <output>           */
+/*                                                                            */
+/*   The layout is described in incl/Bundle.hpp. The output is written to a  */
+/*   temporary file and renamed into place, so a server that has the old     */
+/*   bundle mapped keeps reading consistent data until it reloads.           */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "Bundle.hpp"
+#include "HttpRequest.hpp"
+
+struct PackedFile
+{
+    std::string path;
+    std::string content;
+    std::string gzip;
+    std::string etag;
+    const char* mime;
+};
+
+static bool operator<(const PackedFile& a, const PackedFile& b)
+{
+    return a.path < b.path;
+}
+
+static void collect(const std::string& root, const std::string& relative, std::vector<PackedFile>& files)
+{
+    std::string directory = root + "/" + relative;
+    DIR* dir = opendir(directory.c_str());
+    if (!dir)
+        throw std::runtime_error("Cannot open directory: " + directory);
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..")
+            continue;
+        std::string path = relative.empty() ? name : relative + "/" + name;
+        std::string full = root + "/" + path;
+        struct stat info;
+        if (stat(full.c_str(), &info) != 0)
+            continue;
+        if (S_ISDIR(info.st_mode))
+            collect(root, path, files);
+        else if (S_ISREG(info.st_mode))
+        {
+            std::ifstream in(full.c_str(), std::ios::binary);
+            if (!in.is_open())
+                throw std::runtime_error("Cannot read file: " + full);
+            PackedFile file;
+            file.path = path;
+            file.content.resize(info.st_size);
+            if (info.st_size > 0)
+                in.read(&file.content[0], info.st_size);
+            file.mime = HttpRequest::mimeTypeFor(path);
+            files.push_back(file);
+        }
+    }
+    closedir(dir);
+}
+
+// Strong validator derived from the content only, so rebuilding an unchanged
+// docroot produces the same ETags.
+static std::string computeEtag(const std::string& content)
+{
+    unsigned long hash = 1469598103934665603UL;
+    for (size_t i = 0; i < content.size(); ++i)
+        hash = (hash ^ static_cast<unsigned char>(content[i])) * 1099511628211UL;
+    char buffer[48];
+    snprintf(buffer, sizeof(buffer), "\"%016lx-%lx\"", hash, static_cast<unsigned long>(content.size()));
+    return buffer;
+}
+
+static bool gzipCompress(const std::string& input, std::string& output)
+{
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    output.resize(deflateBound(&stream, input.size()) + 32);
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+    stream.avail_in = input.size();
+    stream.next_out = reinterpret_cast<Bytef*>(&output[0]);
+    stream.avail_out = output.size();
+    int result = deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END;
+}
+
+static uint32_t addString(std::string& strings, const std::string& value)
+{
+    uint32_t offset = strings.size();
+    strings += value;
+    strings += '\0';
+    return offset;
+}
+
+static void writeBundle(const std::string& output, std::vector<PackedFile>& files)
+{
+    BundleHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, Bundle::MAGIC, sizeof(header.magic));
+    header.version = Bundle::VERSION;
+    header.count = files.size();
+    header.entriesOffset = sizeof(BundleHeader);
+
+    std::vector<BundleEntry> entries(files.size());
+    std::string strings;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        entries[i].pathOffset = addString(strings, files[i].path);
+        entries[i].pathLength = files[i].path.size();
+        entries[i].mimeOffset = addString(strings, files[i].mime);
+        entries[i].mimeLength = std::strlen(files[i].mime);
+        entries[i].etagOffset = addString(strings, files[i].etag);
+        entries[i].etagLength = files[i].etag.size();
+    }
+    header.stringsOffset = header.entriesOffset + entries.size() * sizeof(BundleEntry);
+    while (strings.size() % 8)
+        strings += '\0';
+    header.dataOffset = header.stringsOffset + strings.size();
+
+    uint64_t cursor = header.dataOffset;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        entries[i].dataOffset = cursor;
+        entries[i].dataLength = files[i].content.size();
+        cursor += files[i].content.size();
+        entries[i].gzipOffset = files[i].gzip.empty() ? 0 : cursor;
+        entries[i].gzipLength = files[i].gzip.size();
+        cursor += files[i].gzip.size();
+    }
+    header.fileSize = cursor;
+
+    std::string temporary = output + ".tmp";
+    std::ofstream out(temporary.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out.is_open())
+        throw std::runtime_error("Cannot write " + temporary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!entries.empty())
+        out.write(reinterpret_cast<const char*>(&entries[0]), entries.size() * sizeof(BundleEntry));
+    out.write(strings.data(), strings.size());
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        out.write(files[i].content.data(), files[i].content.size());
+        out.write(files[i].gzip.data(), files[i].gzip.size());
+    }
+    out.close();
+    if (!out || std::rename(temporary.c_str(), output.c_str()) != 0)
+    {
+        std::remove(temporary.c_str());
+        throw std::runtime_error("Cannot write " + output);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    bool gzip = false;
+    size_t gzipMin = 256;
+    std::vector<std::string> positional;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--gzip")
+            gzip = true;
+        else if (arg == "--gzip-min" && i + 1 < argc)
+            gzipMin = std::strtoul(argv[++i], NULL, 10);
+        else
+            positional.push_back(arg);
+    }
+    if (positional.size() != 2)
+    {
+        std::cerr << "usage: mkbundle [--gzip] [--gzip-min BYTES] <docroot> <output>" << std::endl;
+        return 2;
+    }
+
+    try
+    {
+        std::string root = positional[0];
+        while (root.size() > 1 && root[root.size() - 1] == '/')
+            root.erase(root.size() - 1);
+
+        std::vector<PackedFile> files;
+        collect(root, "", files);
+        std::sort(files.begin(), files.end());
+
+        size_t rawBytes = 0;
+        size_t gzipCount = 0;
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            PackedFile& file = files[i];
+            file.etag = computeEtag(file.content);
+            rawBytes += file.content.size();
+            // Keep a variant only when it saves at least 10%.
+            if (gzip && file.content.size() >= gzipMin && gzipCompress(file.content, file.gzip)
+                && file.gzip.size() * 10 < file.content.size() * 9)
+                ++gzipCount;
+            else
+                file.gzip.clear();
+        }
+        writeBundle(positional[1], files);
+        std::cout << positional[1] << ": " << files.size() << " files, " << rawBytes << " bytes, "
+                  << gzipCount << " gzip variants" << std::endl;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "mkbundle: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}